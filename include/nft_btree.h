@@ -0,0 +1,261 @@
+/****************************************************************************
+ * (C) Copyright Xenadyne, Inc. 2003-2021  All rights reserved.
+ *
+ * Permission to use, copy, modify and distribute this software for
+ * any purpose and without fee is hereby granted, provided that the
+ * above copyright notice appears in all copies.
+ *
+ * XENADYNE INC DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+ * IN NO EVENT SHALL XENADYNE BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM THE
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ ********************************************************************
+ *
+ * File:  nft_btree.h
+ *
+ * DESCRIPTION
+ *
+ * The btree package is an associative (or map) data structure, which
+ * offers the same API as the rbtree package (see nft_rbtree.h). You can
+ * use it wherever you would use an rbtree, by substituting btree for
+ * rbtree in the function names. Keys and data are pointer-sized, and
+ * you provide a comparison function, exactly as with nft_rbtree_new.
+ * Duplicate keys and duplex keys are supported in the same way.
+ *
+ * The difference is in the implementation. An rbtree node holds a single
+ * key, so a search visits one node for every level in a tree of depth
+ * 2*log2(n), at worst. In large trees, each of those visits is likely to
+ * miss the cache. The btree is a B+tree, whose nodes hold up to
+ * BTREE_ORDER keys in a sorted array. The count and keys of a node fill
+ * two cache lines, so that the search descends log(n)/log(BTREE_ORDER/2)
+ * levels at worst, and each level costs a few adjacent cache lines.
+ * The key-data pairs are stored only in the leaf nodes, which are linked
+ * in key order, so that walking the tree is a sequential scan.
+ *
+ * Unlike an rbtree, the btree's walk_first/walk_next iterator does not
+ * hold pointers into the tree between calls. If you insert or delete
+ * keys during the walk, it resumes after the last key-data pair that
+ * it returned, or if that pair was deleted, at the next greater key.
+ *
+ * Multithreading: Like the rbtree, each btree contains an optional
+ * shared-reader/exclusive-writer lock. The handle-based nft_btree_new()
+ * enables it, while the private btree_new() does not.
+ *
+ */
+#ifndef _NFT_BTREE_H_
+#define _NFT_BTREE_H_
+
+#include "nft_core.h"
+
+typedef struct nft_btree  nft_btree;
+typedef struct nft_btnode nft_btnode;
+
+// Define the Nifty class string, showing nft_btree derives from nft_core.
+#define nft_btree_class nft_core_class ":nft_btree"
+
+// Declare helper functions nft_btree_cast, _handle, _lookup, _discard
+NFT_DECLARE_WRAPPERS(nft_btree,)
+
+// Don't use this to cast - your comparison function must return long.
+typedef long    (* BTREE_COMPARE)( /* void * obj, void * obj2 */ );
+
+/* Ease of use typedefs so the user can easily cast function pointers.
+ */
+typedef void    (* BTREE_APPLY)  ( void * key, void * obj, void * arg);
+typedef void    (* BTREE_APPLYX) (             void * obj, void * arg);
+
+
+//______________________________________________________________________________
+//
+nft_btree_h nft_btree_new( int init_nodes, BTREE_COMPARE comparator);
+/*
+ Creates a new tree. The init_nodes argument is accepted for compatibility
+ with nft_rbtree_new, and must be nonnegative. The btree allocates its nodes
+ as it grows, so there is no initial allocation. The comparator is used
+ exactly as it is by nft_rbtree_new, and for duplex keys, it takes four
+ parameters: key1, key2, data1, and data2.
+*/
+
+//______________________________________________________________________________
+//
+int nft_btree_free ( nft_btree_h );
+/*
+ Releases the tree's handle, and frees associated node storage.
+ Returns zero on success, or EINVAL for handles that have already
+ been release, and for handles that are not nft_btree objects.
+*/
+
+//______________________________________________________________________________
+//
+int nft_btree_insert ( nft_btree_h tree,
+                       void      * key,
+                       void      * data );
+/*
+ Inserts the key-data pair into the tree. Like nft_rbtree_insert, this
+ will insert duplicate keys, after any existing pairs with equal keys.
+ Returns 1 (true) on success, or zero when memory is exhausted.
+*/
+
+//______________________________________________________________________________
+//
+int nft_btree_replace ( nft_btree_h   tree,
+                        void        * key,
+                        void        **data );
+/*
+ Inserts the key-data pair, or replaces the existing pair if an equal key is found.
+ If an existing pair is replaced, the previous data value is stored in *data,
+ and the value 2 is returned. Returns 1 if the key-data was inserted successfully,
+ without replacing a previous pair. Returns zero when the key-data pair could not
+ be inserted due memory exhaustion. This function is not to be used with duplex keys.
+*/
+
+//______________________________________________________________________________
+//
+int nft_btree_search ( nft_btree_h tree,
+                       void      * key,
+                       void      **data );
+/*
+ Searches the tree for key, returning 1 (true) if key is found, or zero
+ if it is not found. If key is found, and *data is non-null, the associated
+ data value is returned via *data. If duplex keys are in use, *data must
+ specify a data value, as with nft_rbtree_search.
+*/
+
+//______________________________________________________________________________
+//
+int nft_btree_delete ( nft_btree_h tree,
+                       void      * key,
+                       void     ** data);
+/*
+ Deletes one node with the given key. Returns true if a node was found and
+ deleted, and also returns the corresponding value if data is non-null.
+ If duplex keys are in use, *data must specify a data value.
+*/
+
+//______________________________________________________________________________
+//
+int nft_btree_apply ( nft_btree_h handle,
+                      BTREE_APPLY apply,
+                      void      * arg);
+/*
+ Call the function 'apply' on every item in the tree, in key order.
+ For each item the function is passed the key, data, and the void * arg.
+ Returns the number of items in the tree. The applied function must not
+ insert or delete items from the tree.
+*/
+
+//______________________________________________________________________________
+//
+int nft_btree_walk_first ( nft_btree_h tree,
+                           void     ** key,
+                           void     ** data );
+
+int nft_btree_walk_next  ( nft_btree_h tree,
+                           void     ** key,
+                           void     ** data );
+/*
+ Initiate a walk of tree in order of ascending keys. _walk_first returns true
+ if there is at least one node in the tree, else false. Key-data pairs are
+ returned via the optional *key and *data pointers.
+
+ This iterator is non-reentrant, as with nft_rbtree_walk_first. You are able
+ to insert and delete items during the walk, as described above.
+*/
+
+//______________________________________________________________________________
+//
+int nft_btree_walk_first_r ( nft_btree_h tree,
+                             void     ** key,
+                             void     ** data,
+                             void     ** walk );
+int nft_btree_walk_next_r  ( nft_btree_h tree,
+                             void     ** key,
+                             void     ** data,
+                             void     ** walk);
+/*
+ This iterator is reentrant, so you can use it to conduct a walk within a function
+ which itself walks the tree, or in a concurrent thread. You may not insert or delete
+ items during a reentrant walk.
+*/
+
+//______________________________________________________________________________
+// Test tree's pointers and key ordering integrity.
+// Returns TRUE (1) if the tree is valid, else 0.
+int nft_btree_validate (nft_btree_h tree);
+
+// Return the number of items in a tree.
+int nft_btree_count( nft_btree_h tree);
+
+// Enable shared-readers/single-writer locking for this btree.
+void nft_btree_locking(nft_btree_h h, unsigned enabled);
+
+
+/*______________________________________________________________________________
+ *
+ * These are the private, direct-access APIs. You can use them when subclassing,
+ * and in situations where you wish to avoid the overhead of the handle-based API.
+ * As with rbtree_new(), btree_new() returns a tree whose lock is disabled.
+ *______________________________________________________________________________
+ */
+
+// The maximum number of keys in a node. With the count, the keys
+// of a node fill two 64-byte cache lines, on 64-bit platforms.
+#define BTREE_ORDER	15
+#define BTREE_LINE	64
+
+struct nft_btnode
+{
+    unsigned        count;              // Number of keys in this node
+    unsigned        leaf;               // True for leaf nodes
+    void          * key [BTREE_ORDER];  // Keys, in ascending order
+    void          * data[BTREE_ORDER];  // Data, or separator data in inner nodes
+    nft_btnode    * link[];             // Leaf: next leaf. Inner: child nodes.
+};
+struct nft_btree
+{
+    nft_core         core;
+
+    nft_btnode     * root;       // The root node, or NULL if empty
+    BTREE_COMPARE    compare;    // key comparison predicate function
+    unsigned int     height;     // Number of levels in the tree
+    unsigned int     count;      // Number of key-data pairs in the tree
+    unsigned int     version;    // Incremented by each insert and delete
+    nft_btnode     * spares[2];  // Reserved inner and leaf nodes
+    unsigned int     num_spares[2];
+    void           * current;    // Maintain walk state for non-reentrant walk
+    void           * walk_key;   // The last pair returned by the walk
+    void           * walk_data;
+    unsigned int     walk_version;
+    unsigned int     locking;    // rwlock is enabled if true.
+    pthread_rwlock_t rwlock;     // Multi-reader/single-writer lock
+};
+
+nft_btree * btree_new         (int min_nodes, BTREE_COMPARE compare);
+int         btree_free        (nft_btree * tree);
+unsigned    btree_count       (nft_btree *);
+void        btree_locking     (nft_btree *, unsigned enabled);
+int         btree_validate    (nft_btree *);
+int         btree_insert      (nft_btree *, void  *key, void  *data);
+int         btree_replace     (nft_btree *, void  *key, void **data);
+int         btree_delete      (nft_btree *, void  *key, void **data);
+int         btree_search      (nft_btree *, void  *key, void **data);
+int         btree_walk_first  (nft_btree *, void **key, void **data);
+int         btree_walk_next   (nft_btree *, void **key, void **data);
+int         btree_walk_first_r(nft_btree *, void **key, void **data, void **walk);
+int         btree_walk_next_r (nft_btree *, void **key, void **data, void **walk);
+int         btree_apply       (nft_btree *, BTREE_APPLY  apply, void * arg);
+int         btree_applyx      (nft_btree *, BTREE_APPLYX apply, void * arg);
+long        btree_compare_pointers(void * h1, void * h2);
+long        btree_compare_strings (char * s1, char * s2);
+
+/* These calls should only be used by subclasses.
+ */
+nft_btree * btree_create      (const char * class, size_t size, int min_nodes, BTREE_COMPARE compare);
+void        btree_destroy     (nft_core   *);
+
+
+#endif // _NFT_BTREE_H_
@@ -0,0 +1,157 @@
+/******************************************************************************
+ * (C) Copyright Xenadyne, Inc. 2002-2013  All rights reserved.
+ *
+ * Permission to use, copy, modify and distribute this software for
+ * any purpose and without fee is hereby granted, provided that the
+ * above copyright notice appears in all copies.
+ *
+ * XENADYNE INC DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+ * IN NO EVENT SHALL XENADYNE BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM THE
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * File:  nft_future.h
+ *
+ * This package lets you submit a function to a thread pool (see nft_pool.h)
+ * and obtain the function's result later. nft_pool_submit returns a handle
+ * to a "future", which you can poll, or wait upon, until the result is ready.
+ *
+ * You can also chain a continuation onto a future, by calling nft_future_then.
+ * The continuation is submitted to the same pool when the future completes,
+ * so that dependent work can be pipelined without parking a thread to wait.
+ *
+ * The API calls are documented in this file, but you should also
+ * review the unit test driver in src/nft_future.c (at #ifdef MAIN)
+ * to see examples of this package in use.
+ *
+ ******************************************************************************
+ */
+#ifndef _NFT_FUTURE_H_
+#define _NFT_FUTURE_H_
+
+#include <nft_pool.h>
+
+typedef struct nft_future_h * nft_future_h;
+
+/* nft_pool_submit: Submit a function to the pool, returning a future.
+ *
+ * The pool will call function(argument), and the value that it returns
+ * becomes the result of the future. The function must not call pthread_exit.
+ * Like nft_pool_add, this call blocks indefinitely while the pool's queue
+ * is at its queue_limit. See nft_pool_submit_wait below for a timeout option.
+ * If the work could not be queued, for example because the pool has been
+ * shut down, the future completes at once, and nft_future_get will return
+ * the error code from nft_pool_add.
+ *
+ * You must call nft_future_free when you no longer need the future.
+ * Returns NULL on a malloc failure.
+ */
+nft_future_h
+nft_pool_submit(nft_pool_h pool, void * (*function)(void *), void * argument);
+
+/* nft_pool_submit_wait: Submit a function to the pool, with a timeout.
+ *
+ * This function works like nft_pool_submit, except that
+ * when the pool's queue has reached its limit:
+ *
+ *	timeout  < 0 :	will wait indefinitely
+ *      timeout == 0 :	will complete the future with ETIMEDOUT immediately
+ *      timeout  > 0 :	will complete the future with ETIMEDOUT after timeout seconds
+ *
+ * The error code from nft_pool_add_wait is returned by nft_future_get.
+ */
+nft_future_h
+nft_pool_submit_wait(nft_pool_h pool, int timeout, void * (*function)(void *), void * argument);
+
+/* nft_future_get: Wait for the future to complete, and get its result.
+ *
+ *	timeout  < 0 :	will wait indefinitely
+ *      timeout == 0 :	will return ETIMEDOUT immediately
+ *      timeout  > 0 :	will return ETIMEDOUT after timeout seconds
+ *
+ * When the future has completed, its result is stored in *result,
+ * if result is not NULL.
+ *
+ * Returns zero on success, otherwise:
+ *	EINVAL    - The future handle is not valid.
+ *	ETIMEDOUT - The future has not completed.
+ *	various   - The work could not be submitted to the pool.
+ */
+int nft_future_get(nft_future_h future, int timeout, void ** result);
+
+/* nft_future_poll: Get the result without waiting.
+ *
+ * Equivalent to nft_future_get(future, 0, result).
+ */
+int nft_future_poll(nft_future_h future, void ** result);
+
+/* nft_future_then: Chain a continuation onto a future.
+ *
+ * When the future completes, function(result, argument) is submitted
+ * to the future's pool, receiving the future's result. The value that
+ * it returns becomes the result of the new future that this call returns.
+ * If the future has already completed, the continuation is submitted now.
+ * If the future completes with an error, the continuation is not called,
+ * and the new future completes with the same error.
+ *
+ * If the pool's queue is at its limit when the continuation is submitted,
+ * the continuation is called in the thread that completed the future,
+ * rather than block that thread. You must call nft_future_free on the
+ * returned future. Returns NULL if the future is invalid, or on a malloc
+ * failure.
+ */
+nft_future_h
+nft_future_then(nft_future_h future, void * (*function)(void * result, void * argument), void * argument);
+
+/* nft_future_free: Release the future.
+ *
+ * You must not use the handle after this call. A pending future will
+ * still execute, and its continuations will still be submitted.
+ *
+ * Returns zero on success, or EINVAL if the handle is not valid.
+ */
+int nft_future_free(nft_future_h future);
+
+
+/******************************************************************************
+ *
+ * The declarations that follow, are _only_ needed to author subclasses,
+ * and they are generally not safe to use, unless you understand the risks.
+ *
+ ******************************************************************************
+ */
+typedef struct nft_future
+{
+    nft_core            core;		// Inherit from nft_core.
+
+    pthread_mutex_t	mutex;		// Protects the fields below.
+    pthread_cond_t	cond;		// Signalled when done is set.
+    int			done;		// True when the future is complete.
+    int			error;		// Nonzero if submission failed.
+    void	      * result;		// The function's result.
+
+    nft_pool_h		pool;		// The pool that runs the function.
+    void	     * (* function)(void *);
+    void	     * (* chained)(void *, void *);
+    void	      * argument;	// Argument to function or chained.
+    void	      * input;		// Predecessor's result, for chained.
+    struct nft_future * next;		// Next in the predecessor's list.
+    struct nft_future * then;		// Continuations awaiting this future.
+} nft_future;
+
+// Define nft_future_class, showing derivation from nft_core.
+#define nft_future_class nft_core_class ":nft_future"
+
+// Define helper functions nft_future_cast, _handle, _lookup, _discard
+NFT_DECLARE_CAST(nft_future)
+NFT_DECLARE_HANDLE(nft_future)
+NFT_DECLARE_LOOKUP(nft_future)
+NFT_DECLARE_DISCARD(nft_future)
+
+nft_future * nft_future_create(const char * class, size_t size, nft_pool_h pool);
+void         nft_future_destroy(nft_core * p);
+
+#endif // _NFT_FUTURE_H_
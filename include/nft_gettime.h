@@ -69,6 +69,7 @@ struct	timespec {
 #define inline __inline
 #else
 #include <sys/time.h>
+#include <time.h>
 #endif
 
 // nft_gettime returns the current time as a struct timespec, converting if necessary.
@@ -93,6 +94,22 @@ nft_gettime(void)
 #endif
 }
 
+// nft_gettime_mono returns a monotonic time, which is suitable for measuring
+// intervals, because it does not jump when the system clock is set.
+// Where no monotonic clock is available, it falls back to nft_gettime.
+//
+static inline struct timespec
+nft_gettime_mono(void)
+{
+#if !defined(_WIN32) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    int rc = clock_gettime(CLOCK_MONOTONIC, &ts); assert(rc == 0);
+    return ts;
+#else
+    return nft_gettime();
+#endif
+}
+
 // Compare two timespecs, returning the difference in nanosec.
 static inline int64_t
 nft_timespec_comp(struct timespec now, struct timespec then)
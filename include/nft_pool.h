@@ -34,6 +34,8 @@
 #ifndef _NFT_POOL_H_
 #define _NFT_POOL_H_
 
+#include "nft_gettime.h" // for struct timespec
+
 typedef struct nft_pool_h * nft_pool_h;
 
 /* nft_pool_new: Initialize a thread pool.
@@ -84,12 +86,189 @@ int nft_pool_add(nft_pool_h pool, void (*function)(void *), void * argument);
 int
 nft_pool_add_wait(nft_pool_h handle, int timeout, void (*function)(void *),  void * argument);
 
+/* nft_pool_add_many: Enqueue a batch of work items.
+ *
+ * Items function[i](argument[i]) are queued with normal priority,
+ * under a single lock of the pool's queue. This call never waits:
+ * if the queue reaches its limit, the remaining items are not queued,
+ * and ETIMEDOUT is returned. The items are queued in order, and the
+ * number that were queued is stored in *added.
+ *
+ * Returns zero if all of the items were queued, otherwise the error
+ * for the first item that was not queued, as for nft_pool_add_wait.
+ */
+int
+nft_pool_add_many(nft_pool_h pool, int count, void (**functions)(void *), void ** arguments, int * added);
+
+/* Priority classes for nft_pool_add_prio. Lower numbers are served first.
+ * Items added with nft_pool_add or nft_pool_add_wait are NFT_POOL_NORMAL.
+ */
+#define NFT_POOL_HIGH		0
+#define NFT_POOL_NORMAL		1
+#define NFT_POOL_LOW		2
+#define NFT_POOL_PRIORITIES	3
+
+/* nft_pool_add_prio: Submit a work item with a priority class and deadline.
+ *
+ * This function works like nft_pool_add_wait, but when threads become
+ * free, they take the next item from the highest nonempty priority class.
+ * Within a class, items are taken in order of their deadlines, earliest
+ * first. If deadline is zero ({0, 0}), the item's deadline is the time
+ * that it was submitted, so items without deadlines are served in FIFO
+ * order, relative to each other.
+ *
+ * A lower class is not starved by a steady supply of higher class items:
+ * after it has been passed over NFT_POOL_AGING times, its next item is
+ * served ahead of the higher classes.
+ *
+ * Returns the same errors as nft_pool_add_wait, and EINVAL if the
+ * priority is not a valid class.
+ */
+int
+nft_pool_add_prio(nft_pool_h pool, int timeout, int priority, struct timespec deadline,
+		  void (*function)(void *), void * argument);
+
+/* nft_pool_class_stats: Return the statistics of a priority class.
+ *
+ * The statistics are accumulated from the pool's creation. The wait
+ * is measured from submission until a thread begins the item. An item
+ * is counted as late if it was begun after its explicit deadline.
+ * For a NUMA pool, the statistics of its sub-pools are combined.
+ *
+ * Returns zero on success, or EINVAL if the pool handle or priority
+ * is not valid.
+ */
+typedef struct nft_pool_class_stats_t
+{
+    unsigned long	submitted;	// Items queued in this class.
+    unsigned long	completed;	// Items whose function has returned.
+    unsigned long	late;		// Items begun after their deadline.
+    double		wait_total;	// Total seconds that items waited.
+    double		wait_max;	// Longest wait, in seconds.
+} nft_pool_class_stats_t;
+
+int
+nft_pool_class_stats(nft_pool_h pool, int priority, nft_pool_class_stats_t * stats);
+
+/* nft_pool_stats: Take a snapshot of the pool's instrumentation.
+ *
+ * Times are measured with nft_gettime_mono, in nanoseconds. The histograms
+ * count work items by the log2 of the time in microseconds: bucket zero
+ * counts times under one microsecond, and bucket i counts times from
+ * 2^(i-1) up to 2^i microseconds. The last bucket also counts longer times.
+ * The wait is measured from submission until a thread begins the item,
+ * and the run time from then until the work function returns.
+ *
+ * Each pool thread updates its own counters without locking, so the
+ * snapshot may be slightly behind the items that are completing.
+ * For a NUMA pool, the statistics of its sub-pools are combined.
+ *
+ * Returns zero on success, or EINVAL if the pool handle is not valid.
+ */
+#define NFT_POOL_BUCKETS	32
+
+typedef struct nft_pool_stats_t
+{
+    uint64_t		completed;	// Work functions that returned.
+    uint64_t		wait_ns;	// Total wait before items began.
+    uint64_t		busy_ns;	// Thread time spent running items.
+    uint64_t		idle_ns;	// Thread time spent waiting for items.
+    uint64_t		spawned;	// Threads created.
+    uint64_t		retired;	// Threads that have exited.
+    int			num_threads;	// Current threads.
+    int			idle_threads;	// Current idle threads.
+    int			queue_depth;	// Current queued items.
+    int			queue_high;	// Most items ever queued.
+    uint64_t		wait_hist[NFT_POOL_BUCKETS];
+    uint64_t		run_hist [NFT_POOL_BUCKETS];
+} nft_pool_stats_t;
+
+int nft_pool_stats(nft_pool_h pool, nft_pool_stats_t * stats);
+
+/* nft_pool_workers: Tune the creation and retirement of pool threads.
+ *
+ * By default, a pool thread is created only when a work item is queued
+ * while no thread is idle, and an idle thread exits after one second.
+ * This call lets you keep a warm core of threads to absorb bursts.
+ *
+ *	min_threads	This many threads are created immediately, and
+ *			they do not exit while idle. It is limited to the
+ *			pool's max_threads.
+ *	idle_timeout	Seconds a thread in excess of min_threads may stay
+ *			idle before it exits. If not positive, one second.
+ *	spawn_depth	If positive, another thread is created whenever more
+ *			than spawn_depth items are queued, even when threads
+ *			are idle. If zero, threads are added only when none
+ *			is idle.
+ *
+ * Returns zero on success, otherwise:
+ *	EINVAL    - The pool handle is not valid.
+ *      ESHUTDOWN - the pool has been shut down.
+ *      various   - pthread_create error codes.
+ */
+int
+nft_pool_workers(nft_pool_h pool, int min_threads, int idle_timeout, int spawn_depth);
+
+
+/* nft_pool_affinity: Bind the pool's threads to a set of CPUs.
+ *
+ * The cpus argument is an array of ncpus CPU numbers. Every pool thread,
+ * including the threads that already exist, will be bound to this set
+ * of CPUs before it processes its next work item. If ncpus is zero,
+ * the threads may again run on any CPU. The threads of a NUMA pool
+ * are bound to their nodes' CPUs, and can't be rebound.
+ *
+ * Returns zero on success, otherwise:
+ *	EINVAL    - The pool handle or a CPU number is not valid,
+ *	            or the pool was created by nft_pool_new_numa.
+ *	ENOMEM    - malloc() failed.
+ *	ENOSYS    - CPU affinity is not supported on this platform.
+ */
+int nft_pool_affinity(nft_pool_h pool, int ncpus, const int * cpus);
+
+/* nft_pool_new_numa: Create a pool with one sub-pool per NUMA node.
+ *
+ * Each sub-pool has its own queue, and up to max_threads threads that
+ * are bound to the CPUs of its NUMA node. Work items that you submit
+ * with nft_pool_add or nft_pool_add_wait are queued to the sub-pool
+ * for the NUMA node where the submitting thread is running.
+ * Use nft_pool_add_node to submit work to a particular node.
+ * The queue_limit and stack_size apply to each sub-pool.
+ *
+ * On systems without NUMA topology, there is a single node. Node numbers
+ * may be sparse, in which case the sub-pools of the missing nodes are
+ * not bound to any CPUs, and receive only the work you submit to them.
+ * Returns NULL on a malloc failure.
+ */
+nft_pool_h
+nft_pool_new_numa(int queue_limit, int max_threads, int stack_size);
+
+/* nft_pool_add_node: Submit a work item to a NUMA node's sub-pool.
+ *
+ * Like nft_pool_add_wait, but the item is queued to the sub-pool for
+ * the given NUMA node. If node is negative, the node where the calling
+ * thread is running is used. Pools that were not created by
+ * nft_pool_new_numa have a single node, zero.
+ *
+ * Returns the same errors as nft_pool_add_wait, and EINVAL if the
+ * node does not exist.
+ */
+int
+nft_pool_add_node(nft_pool_h pool, int node, int timeout, void (*function)(void *), void * argument);
+
+/* nft_pool_numa_nodes: Return the number of NUMA nodes, at least one.
+ * nft_pool_numa_node:  Return the NUMA node of the calling thread's CPU.
+ */
+int nft_pool_numa_nodes(void);
+int nft_pool_numa_node(void);
 
 /* nft_pool_shutdown: Free resources associated with thread pool.
  *
  * After the call to shutdown, no new work items may be enqueued.
  * Pool threads will continue to process enqueued items that remain,
  * and the pool will be destroyed when the last pool thread exits.
+ * The sub-pools of a NUMA pool are shut down one after the other,
+ * and the timeout applies to each of them.
  * Depending on the timeout parameter, the caller can elect to:
  *
  *	timeout  < 0	Wait indefinitely for processing to finish.
@@ -115,6 +294,30 @@ int nft_pool_shutdown(nft_pool_h pool, int timeout);
  */
 #include <nft_queue.h>
 
+// Queued work items of one priority class.
+typedef struct nft_pool_prio
+{
+    struct work_item  ** heap;		// Binary heap, earliest deadline first.
+    int			count;		// Number of items in the heap.
+    int			size;		// Allocated size of the heap.
+    int			reserved;	// Space reserved by pending adds.
+    int			skipped;	// Times passed over while nonempty.
+    nft_pool_class_stats_t stats;
+} nft_pool_prio;
+
+// Counters of one pool thread, which only that thread updates.
+typedef struct nft_pool_worker
+{
+    struct nft_pool_worker * next;	// Next in the pool's list of threads.
+    struct nft_pool        * pool;
+    struct timespec	started;	// When the thread began.
+    uint64_t		completed;
+    uint64_t		wait_ns;
+    uint64_t		busy_ns;
+    uint64_t		wait_hist[NFT_POOL_BUCKETS];
+    uint64_t		run_hist [NFT_POOL_BUCKETS];
+} nft_pool_worker;
+
 typedef struct nft_pool		// Structure describing a thread pool.
 {
     nft_queue           queue;		// Inherit from nft_queue.
@@ -122,6 +325,18 @@ typedef struct nft_pool		// Structure describing a thread pool.
     int			num_threads;
     int			max_threads;
     int			idle_threads;
+    int			min_threads;	// Threads that never retire.
+    int			idle_timeout;	// Seconds before idle threads retire.
+    int			spawn_depth;	// Queue depth that forces a new thread.
+    int			affinity;	// Incremented when cpus[] changes.
+    int			ncpus;		// Number of CPUs in cpus[].
+    int		      * cpus;		// CPUs to which threads are bound.
+    int			num_nodes;	// Number of NUMA sub-pools.
+    nft_pool_h	      * nodes;		// Sub-pool handles, indexed by node.
+    unsigned long	sequence;	// Submission counter, to break ties.
+    nft_pool_prio	prio[NFT_POOL_PRIORITIES];
+    nft_pool_worker   * workers;	// Counters of the current threads.
+    nft_pool_stats_t	totals;		// Counts of pool and exited threads.
     pthread_attr_t	attr;		// Create detached threads.
 } nft_pool;
 
@@ -245,6 +245,7 @@ typedef struct nft_queue
 nft_queue * nft_queue_create(const char * class, size_t size, int limit);
 int         nft_queue_enqueue(nft_queue * q, void * item, int timeout, char which);
 int         nft_queue_dequeue(nft_queue * q, int timeout, void ** item);
+int         nft_queue_length (nft_queue * q);
 void        nft_queue_destroy(nft_core  * p);
 
 // Declare helper functions nft_queue_cast, _handle, _lookup, _discard
@@ -60,7 +60,8 @@
  * Each tree contains a shared-reader/exclusive-writer lock, that allows
  * concurrent searches and traversals, and enforces exclusive insert,
  * replace, and delete operations. But you MUST ENABLE locking via
- * nft_rbtree_locking() - it is not enabled by default.
+ * nft_rbtree_locking() - it is not enabled by default. To scan a large
+ * tree without holding up writers, walk a snapshot (nft_rbtree_snapshot).
  *
  * Algorithm: This package implements the red-black balanced binary tree
  * algorithm as described in Sedgewick, chapter 15, to maintain semi-
@@ -72,6 +73,7 @@
 #define _NFT_RBTREE_H_
 
 #include "nft_core.h"
+#include "nft_pool.h"
 
 typedef struct nft_rbtree nft_rbtree;
 typedef struct nft_rbnode nft_rbnode;
@@ -89,6 +91,7 @@ typedef long    (* RBTREE_COMPARE)( /* void * obj, void * obj2 */ );
  */
 typedef void    (* RBTREE_APPLY)  ( void * key, void * obj, void * arg);
 typedef void    (* RBTREE_APPLYX) (             void * obj, void * arg);
+typedef size_t  (* RBTREE_SAVE)   ( void * item, const void ** bytes);
 
 
 //______________________________________________________________________________
@@ -104,6 +107,26 @@ nft_rbtree_h nft_rbtree_new( int init_nodes, RBTREE_COMPARE comparator);
 
  For duplex keys, the comparator takes four parameters: key1, key2,
  data1, and data2.
+
+ If the comparator is rbtree_compare_pointers or rbtree_compare_integers,
+ the tree compares keys inline, without calling the comparator at each
+ node that it visits. The former sorts keys as unsigned addresses, in
+ descending order, while the latter sorts keys as signed integers
+ (intptr_t), in ascending order.
+*/
+
+//______________________________________________________________________________
+//
+#define RBTREE_ORDER_STATS  1
+
+nft_rbtree_h nft_rbtree_new_ex( int init_nodes, RBTREE_COMPARE comparator, unsigned flags);
+/*
+ Like nft_rbtree_new, but takes flags that enable optional features:
+
+ RBTREE_ORDER_STATS: Keep the size of every subtree, which costs an extra
+ four bytes per node, to support nft_rbtree_rank, _select and _count_range.
+
+ Returns NULL if flags contains an unknown flag.
 */
 
 //______________________________________________________________________________
@@ -115,6 +138,23 @@ int nft_rbtree_free ( nft_rbtree_h );
  been release, and for handles that are not nft_rbtree objects.
 */
 
+//______________________________________________________________________________
+//
+nft_rbtree_h nft_rbtree_snapshot ( nft_rbtree_h tree );
+/*
+ Returns a new tree that holds the same key-data pairs as tree, at the
+ moment of the call. The snapshot shares tree's node storage, so taking
+ it costs little, and you can walk it at leisure, without holding up
+ writers to the original tree. Either tree copies the shared storage
+ the first time that it is changed afterward, so the first insert,
+ replace or delete that follows a snapshot costs O(n), and each tree
+ then goes its own way. The keys and data themselves are not copied,
+ so the objects that they refer to must outlive the snapshot.
+
+ The snapshot has the same comparator, flags and locking as tree.
+ You must free it with nft_rbtree_free. Returns NULL on a malloc failure.
+*/
+
 //______________________________________________________________________________
 //
 int nft_rbtree_insert ( nft_rbtree_h tree,
@@ -130,6 +170,30 @@ int nft_rbtree_insert ( nft_rbtree_h tree,
  Returns 1 (true) on success, or zero when memory is exhausted.
 */
 
+//______________________________________________________________________________
+//
+int nft_rbtree_build_sorted ( nft_rbtree_h tree,
+                              void      ** keys,
+                              void      ** data,
+                              int          n );
+int nft_rbtree_insert_many  ( nft_rbtree_h tree,
+                              void      ** keys,
+                              void      ** data,
+                              int          n );
+/*
+ Bulk loading. _build_sorted loads an empty tree from n key-data pairs that
+ are already in ascending key order, building a balanced tree in O(n) time.
+ It returns zero if the tree is not empty or the keys are out of order.
+
+ _insert_many inserts n pairs in any order. When n is large relative to the
+ tree, it sorts the pairs, merges them with the tree's pairs and rebuilds
+ the tree in O(n log n + count) time, which ends any walk in progress.
+ Otherwise it inserts the pairs individually, after growing the tree once.
+
+ For both calls, data may be NULL, to insert NULL data values.
+ They return 1 (true) on success, or zero when memory is exhausted.
+*/
+
 //______________________________________________________________________________
 //
 int nft_rbtree_replace ( nft_rbtree_h   tree,
@@ -235,6 +299,198 @@ int nft_rbtree_walk_next_r  ( nft_rbtree_h tree,
  more convenient.
 */
 
+//______________________________________________________________________________
+//
+int nft_rbtree_walk_last_r ( nft_rbtree_h tree,
+                             void      ** key,
+                             void      ** data,
+                             void      ** walk );
+int nft_rbtree_walk_prev_r ( nft_rbtree_h tree,
+                             void      ** key,
+                             void      ** data,
+                             void      ** walk);
+/*
+ These are the reverse of _walk_first_r() and _walk_next_r(), and traverse
+ the tree in order of descending keys. The same restrictions apply.
+ The non-reentrant equivalents are rbtree_walk_last() and rbtree_walk_prev(),
+ in the private API below.
+*/
+
+//______________________________________________________________________________
+//
+int nft_rbtree_seek_ge ( nft_rbtree_h tree,
+                         void      ** key,
+                         void      ** data,
+                         void      ** walk );
+int nft_rbtree_seek_gt ( nft_rbtree_h tree,
+                         void      ** key,
+                         void      ** data,
+                         void      ** walk );
+int nft_rbtree_seek_le ( nft_rbtree_h tree,
+                         void      ** key,
+                         void      ** data,
+                         void      ** walk );
+/*
+ Start a walk at a given key, in O(log n) time. On entry, *key holds the key
+ to seek, and if duplex keys are in use, *data must specify a data value.
+ _seek_ge finds the first pair whose key is greater than or equal to *key,
+ _seek_gt the first pair whose key is greater, and _seek_le the last pair
+ whose key is less than or equal. If a pair is found, it is returned via
+ *key and the optional *data, and the function returns true.
+
+ The walk continues in ascending order with _walk_next_r() after _seek_ge
+ and _seek_gt, and in descending order with _walk_prev_r() after _seek_le.
+ Returns false if there is no such pair.
+*/
+
+//______________________________________________________________________________
+//
+int nft_rbtree_range_apply ( nft_rbtree_h handle,
+                             void       * lo,
+                             void       * hi,
+                             RBTREE_APPLY apply,
+                             void       * arg);
+/*
+ Call the function 'apply' on every item whose key k satisfies lo <= k < hi,
+ in ascending order. Returns the number of items in the range. This takes
+ O(log n + k) time for k items, rather than a walk from the first key.
+ The comparator is called with NULL data values, so this is not suitable
+ for trees with duplex keys. The applied function must not insert or delete
+ items from the tree.
+*/
+
+//______________________________________________________________________________
+//
+int nft_rbtree_rank        ( nft_rbtree_h tree, void * key);
+int nft_rbtree_count_range ( nft_rbtree_h tree, void * lo, void * hi);
+int nft_rbtree_select      ( nft_rbtree_h tree,
+                             unsigned     index,
+                             void      ** key,
+                             void      ** data);
+/*
+ Order statistics, which require a tree created with RBTREE_ORDER_STATS.
+ Each of these takes O(log n) time.
+
+ _rank returns the number of keys that are less than key, so that it is
+ the index of key, if key is present. _count_range returns the number of
+ keys k that satisfy lo <= k < hi. These return -1 if the tree does not
+ keep order statistics.
+
+ _select finds the key with the given rank, counting from zero in ascending
+ order, returning it via the optional *key and *data. It returns true if
+ index is less than the number of keys, else false.
+
+ As with nft_rbtree_range_apply, these are not suitable for duplex keys.
+*/
+
+//______________________________________________________________________________
+//
+#define RBTREE_LAYOUT_NONE      0
+#define RBTREE_LAYOUT_INORDER   1
+#define RBTREE_LAYOUT_VEB       2
+
+int nft_rbtree_compact ( nft_rbtree_h tree, unsigned layout );
+/*
+ The tree's nodes are stored in an array, which doubles when it is full,
+ and halves when deletes leave it less than a quarter full. Call this to
+ trim the array to the tree's current size (or the initial allocation,
+ if that is larger) after mass deletes, or when the tree will no longer
+ grow. It also renumbers the nodes to improve locality, per layout:
+
+ RBTREE_LAYOUT_NONE:    Keep the existing node order.
+ RBTREE_LAYOUT_INORDER: Store nodes in key order, so that walks are
+                        sequential scans of the array.
+ RBTREE_LAYOUT_VEB:     Store nodes in the van Emde Boas layout, which
+                        recursively places the top half of each subtree
+                        ahead of its bottom subtrees, so that a search
+                        touches fewer cache lines at every scale.
+
+ Subsequent inserts gradually disturb the layout. Compaction takes O(n)
+ time, and it ends any reentrant walk in progress. In optimistic locking
+ mode, the nodes are renumbered, but the array is not trimmed.
+ Returns 1 on success, or zero if layout is unknown, or memory is exhausted.
+*/
+
+//______________________________________________________________________________
+//
+int nft_rbtree_save ( nft_rbtree_h  tree,
+                      const char  * path,
+                      RBTREE_SAVE   save_key,
+                      RBTREE_SAVE   save_data );
+
+nft_rbtree_h nft_rbtree_map ( const char * path, RBTREE_COMPARE comparator );
+/*
+ _save writes the tree to a file, which _map maps into memory as a read-only
+ tree, without rebuilding it, so that a large lookup table loads much faster
+ than it can be built, and its pages can be shared by the processes that map it.
+
+ The nodes are written as they are. If save_key is NULL, the keys themselves
+ are saved, which is suitable for integer keys. Otherwise, save_key is called
+ for each non-NULL key, and it returns the length of the key's serialized
+ form, and stores a pointer to those bytes in *bytes. The bytes must remain
+ valid until _save returns. The saved bytes are stored in the file, and the
+ mapped tree's keys point to them, aligned for a pointer. Data values are
+ saved in the same way, via save_data. rbtree_save_string is a serializer
+ for string keys and data. Returns zero on success, or an errno value.
+
+ _map takes the comparator, which must be the tree's original comparator,
+ since functions can't be saved. The mapped tree supports searches, walks,
+ seeks and the other read-only calls, but inserts, replaces and deletes
+ fail, and _snapshot and _compact return NULL and zero. The file is unmapped
+ when the tree is freed. _map checks the file's layout, the nodes' links
+ and the locations of serialized keys and data, which takes O(n) time, so
+ that a corrupt file is rejected rather than faulting later. Returns NULL,
+ setting errno, if the file can't be mapped, or EINVAL if it is corrupt,
+ or was saved on a platform with a different word size.
+ Mapping is not supported on Windows.
+*/
+
+//______________________________________________________________________________
+//
+int nft_rbtree_join  ( nft_rbtree_h t1, nft_rbtree_h t2 );
+int nft_rbtree_split ( nft_rbtree_h   tree,
+                       void         * key,
+                       nft_rbtree_h * lo,
+                       nft_rbtree_h * hi );
+/*
+ _join inserts all of t2's pairs into t1, leaving t2 unchanged. Like
+ nft_rbtree_insert_many, it inserts a small t2 pair by pair, and otherwise
+ merges the two trees' pairs and rebuilds t1 in O(n + m) time. Returns 1
+ on success, or zero if memory is exhausted, in which case t1 is unchanged.
+
+ _split returns two new trees, via *lo and *hi, holding the pairs of tree
+ whose keys are less than key, and those whose keys are not, leaving tree
+ unchanged. It takes O(n) time. Returns 1 on success, or zero if memory is
+ exhausted. This is not suitable for duplex keys.
+*/
+
+//______________________________________________________________________________
+//
+nft_rbtree_h nft_rbtree_union        ( nft_rbtree_h t1, nft_rbtree_h t2, nft_pool_h pool );
+nft_rbtree_h nft_rbtree_intersection ( nft_rbtree_h t1, nft_rbtree_h t2, nft_pool_h pool );
+nft_rbtree_h nft_rbtree_difference   ( nft_rbtree_h t1, nft_rbtree_h t2, nft_pool_h pool );
+/*
+ These return a new tree, leaving t1 and t2 unchanged:
+
+ _union:        The pairs of t1, and the pairs of t2 whose keys are not in t1.
+ _intersection: The pairs of t1 whose keys are in t2.
+ _difference:   The pairs of t1 whose keys are not in t2.
+
+ The trees must use the same comparator, and the new tree is like t1.
+ Where t1 has n pairs, t2 has m, and the result has k, a union merges the
+ pairs of both in key order, and builds the new tree directly, in O(n + m)
+ time. So does an intersection or difference of trees of similar size.
+ When t1 is much smaller (n log m < m), each of its keys is searched for
+ in t2 instead, in O(n log m) time. When t2 is much smaller, an
+ intersection seeks to each of t2's keys in t1, in O(m log n + k) time,
+ but a difference, whose result is nearly all of t1, is merged. If pool
+ is not NULL, the merge and the build of large trees are divided among
+ the pool's threads, by ranges of keys, and the caller waits for them,
+ so you must not call these from a function that is running in the same
+ pool. Returns NULL if memory is exhausted, if either handle is invalid,
+ or if the comparators differ.
+*/
+
 //______________________________________________________________________________
 // Test tree's pointers and key ordering integrity.
 // Returns TRUE (1) if the tree is valid, else 0.
@@ -245,6 +501,37 @@ int nft_rbtree_count( nft_rbtree_h tree);
 
 // Enable shared-readers/single-writer locking for this rbtree.
 void nft_rbtree_locking(nft_rbtree_h h, unsigned enabled);
+/*
+ If enabled is RBTREE_LOCK_OPTIMISTIC, nft_rbtree_search does not lock.
+ Instead, it searches the tree optimistically, and uses a sequence number
+ that writers increment to detect whether a writer interfered, in which
+ case it retries. After a few retries it takes the read lock, so that
+ searches cannot be starved by writers. Writers remain serialized by the
+ write lock, and other readers, such as walks, still take the read lock.
+ A search writes only to its thread's own slot, on a separate cache line,
+ so searches scale with cores when writes are rare, but note:
+
+ - A search may call the comparator on a key that is being deleted
+   concurrently, so you must not free a key, once deleted, until
+   nft_rbtree_synchronize has returned. Keys must also be safe to compare
+   at any time, so the comparator must not assume anything about the data.
+ - The nodes array is never shrunk. The arrays that it outgrows, or that
+   are replaced when a snapshot is unshared or the tree is compacted, are
+   freed by the first write to unlock the tree after the searches that
+   began before the array was replaced have finished.
+ - You should enable optimistic mode before the tree is shared.
+*/
+#define RBTREE_LOCK_OPTIMISTIC  2
+
+// Wait until no optimistic search can be using a key deleted before the call.
+void nft_rbtree_synchronize(nft_rbtree_h h);
+/*
+ This is how you reclaim deleted keys in optimistic mode: delete them,
+ call nft_rbtree_synchronize, then free them. It waits only for the
+ searches in progress when it is called, in any optimistic tree, so one
+ call covers a batch of deletes. It must not be called from a comparator.
+ It returns at once if the tree is not in optimistic mode.
+*/
 
 
 /*______________________________________________________________________________
@@ -270,31 +557,66 @@ struct nft_rbtree
 
     nft_rbnode     * nodes;      // Pointer to array of tree nodes
     RBTREE_COMPARE   compare;    // key comparison predicate function
-    unsigned int     current;    // Maintain walk state for non-reentrant walk
+    unsigned int     keys;       // Inline key comparison, see rbtree_create
+    uintptr_t        current;    // Maintain walk state for non-reentrant walk
+    unsigned int     reverse;    // True if the non-reentrant walk is descending
     unsigned int     min_nodes;  // Initial number of nodes to allocate
     unsigned int     num_nodes;  // Current size of the nodes[] array
     unsigned int     next_free;  // Index of the next free node in nodes[]
+    unsigned int     flags;      // Optional features, see rbtree_new_ex
+    unsigned int   * sizes;      // Subtree sizes, if RBTREE_ORDER_STATS
     unsigned int     locking;    // rwlock is enabled if true.
+    unsigned long    seq;        // Odd while a writer holds the lock, if optimistic
+    struct retired_nodes * retired; // Outgrown nodes arrays, if optimistic
+    struct shared_nodes  * shared;  // Nodes shared with snapshots, or NULL
+    void           * map;        // The file mapped by rbtree_map, or NULL
+    size_t           map_size;
     pthread_rwlock_t rwlock;     // Multi-reader/single-writer lock
 };
 
 nft_rbtree * rbtree_new         (int min_nodes, RBTREE_COMPARE compare);
+nft_rbtree * rbtree_new_ex      (int min_nodes, RBTREE_COMPARE compare, unsigned flags);
 nft_rbtree * rbtree_vnew        (int min_nodes, RBTREE_COMPARE compare, void * key, ...);
+nft_rbtree * rbtree_snapshot    (nft_rbtree * tree);
 int          rbtree_free        (nft_rbtree * tree);
 unsigned     rbtree_count       (nft_rbtree *);
 void         rbtree_locking     (nft_rbtree *, unsigned enabled);
+void         rbtree_synchronize (nft_rbtree *);
 int          rbtree_validate    (nft_rbtree *);
 int          rbtree_insert      (nft_rbtree *, void  *key, void  *data);
 int          rbtree_replace     (nft_rbtree *, void  *key, void **data);
+int          rbtree_build_sorted(nft_rbtree *, void **keys, void **data, int n);
+int          rbtree_insert_many (nft_rbtree *, void **keys, void **data, int n);
 int          rbtree_delete      (nft_rbtree *, void  *key, void **data);
 int          rbtree_search      (nft_rbtree *, void  *key, void **data);
 int          rbtree_walk_first  (nft_rbtree *, void **key, void **data);
 int          rbtree_walk_next   (nft_rbtree *, void **key, void **data);
 int          rbtree_walk_first_r(nft_rbtree *, void **key, void **data, void **walk);
 int          rbtree_walk_next_r (nft_rbtree *, void **key, void **data, void **walk);
+int          rbtree_walk_last   (nft_rbtree *, void **key, void **data);
+int          rbtree_walk_prev   (nft_rbtree *, void **key, void **data);
+int          rbtree_walk_last_r (nft_rbtree *, void **key, void **data, void **walk);
+int          rbtree_walk_prev_r (nft_rbtree *, void **key, void **data, void **walk);
+int          rbtree_seek_ge     (nft_rbtree *, void **key, void **data, void **walk);
+int          rbtree_seek_gt     (nft_rbtree *, void **key, void **data, void **walk);
+int          rbtree_seek_le     (nft_rbtree *, void **key, void **data, void **walk);
+int          rbtree_range_apply (nft_rbtree *, void  *lo,  void  *hi, RBTREE_APPLY apply, void * arg);
+int          rbtree_rank        (nft_rbtree *, void  *key);
+int          rbtree_count_range (nft_rbtree *, void  *lo,  void  *hi);
+int          rbtree_select      (nft_rbtree *, unsigned index, void **key, void **data);
+int          rbtree_compact     (nft_rbtree *, unsigned layout);
+int          rbtree_save        (nft_rbtree *, const char * path, RBTREE_SAVE save_key, RBTREE_SAVE save_data);
+nft_rbtree * rbtree_map         (const char * path, RBTREE_COMPARE compare);
+size_t       rbtree_save_string (void * item, const void ** bytes);
+int          rbtree_join        (nft_rbtree * t1, nft_rbtree * t2);
+int          rbtree_split       (nft_rbtree *, void * key, nft_rbtree ** lo, nft_rbtree ** hi);
+nft_rbtree * rbtree_union       (nft_rbtree * t1, nft_rbtree * t2, nft_pool_h pool);
+nft_rbtree * rbtree_intersection(nft_rbtree * t1, nft_rbtree * t2, nft_pool_h pool);
+nft_rbtree * rbtree_difference  (nft_rbtree * t1, nft_rbtree * t2, nft_pool_h pool);
 int          rbtree_apply       (nft_rbtree *, RBTREE_APPLY  apply, void * arg);
 int          rbtree_applyx      (nft_rbtree *, RBTREE_APPLYX apply, void * arg);
 long         rbtree_compare_pointers(void * h1, void * h2);
+long         rbtree_compare_integers(void * i1, void * i2);
 long         rbtree_compare_strings (char * s1, char * s2);
 
 /* These calls should only be used by subclasses.
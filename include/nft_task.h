@@ -27,10 +27,11 @@
  * Task code must therefore synchronize access to shared data structures.
  * The task must not block for any length of time, as that will disrupt the
  * timely execution of other scheduled tasks. If the task will perform any
- * blocking operations, such as gethostbyname_r(), the task should submit the
- * work to a thread pool (see nft_pool.h), so that the task scheduler thread
- * doesn't block. There is an example in nft_task.c unit-test section, which
- * demonstrates a subclass of nft_task that does this.
+ * blocking operations, such as gethostbyname_r(), the task should be scheduled
+ * with nft_task_schedule_on, so that it runs in a thread pool (see nft_pool.h),
+ * and the task scheduler thread doesn't block. There is also an example in
+ * the nft_task.c unit-test section, which demonstrates a subclass of nft_task
+ * that submits its work to a pool.
  *
  ******************************************************************************
  */
@@ -38,6 +39,7 @@
 #define _NFT_TASK_H_
 
 #include "nft_gettime.h" // for struct timespec
+#include "nft_pool.h"	 // for nft_pool_h
 
 /* All of the client APIs refer the task object by its handle.
  * The handle is just an integer, but we define it as a pointer
@@ -66,6 +68,42 @@ nft_task_h  nft_task_schedule(struct timespec abstime,
 			      void	   (* function)(void *),
 			      void          * argument);
 
+/*
+ * nft_task_schedule_on - Schedule a task to be run by a thread pool.
+ *
+ * As nft_task_schedule, but when the task comes due, the scheduler thread
+ * submits function(argument) to the pool, and does not call it. All of the
+ * tasks that come due at once are submitted with one nft_pool_add_many call
+ * per pool, so that the scheduler never runs user code for these tasks, and
+ * remains punctual however long they take.
+ *
+ * The scheduler never blocks on the pool. If the pool's queue is full, or
+ * memory for the batch is exhausted, a one-shot task is retried one tick
+ * later, and the run of a periodic task is skipped and counted (see
+ * nft_task_info). If the pool is shut down, the runs are dropped. Since the function runs in a pool thread,
+ * nft_task_this returns NULL there. Returns NULL if pool is NULL.
+ */
+nft_task_h  nft_task_schedule_on(nft_pool_h      pool,
+				 struct timespec abstime,
+				 struct timespec interval,
+				 void	      (* function)(void *),
+				 void	       * argument);
+
+/*
+ * nft_task_schedule_slack - Schedule a task that may run a little late.
+ *
+ * As nft_task_schedule, but the task may run at any time from abstime
+ * to abstime plus slack. The scheduler uses this freedom to run tasks
+ * whose windows overlap together in one wakeup, which reduces wakeups
+ * when there are many timers with nearby deadlines. Each run of a
+ * periodic task has the same slack. Returns NULL if slack is invalid.
+ */
+nft_task_h  nft_task_schedule_slack(struct timespec abstime,
+				    struct timespec interval,
+				    struct timespec slack,
+				    void	 (* function)(void *),
+				    void	  * argument);
+
 /*
  * nft_task_cancel - Cancel a scheduler task.
  *
@@ -76,15 +114,244 @@ nft_task_h  nft_task_schedule(struct timespec abstime,
 void *	    nft_task_cancel(nft_task_h taskh);
 
 
+/*
+ * nft_task_reschedule - Move a pending task to a new abstime.
+ *
+ * The task keeps its handle, and is moved within the queue in place,
+ * which is much cheaper than canceling it and scheduling a new task.
+ * If abstime is null, the task is moved to one interval from now.
+ * A periodic task continues at its interval from the new abstime.
+ *
+ * Returns zero on success, EINVAL if the handle or abstime is invalid,
+ * or ENOENT if the task is not pending, as with a one-shot that has
+ * already executed.
+ */
+int	    nft_task_reschedule(nft_task_h taskh, struct timespec abstime);
+
+/*
+ * nft_task_extend - Defer a pending task to a later abstime, lazily.
+ *
+ * As nft_task_reschedule, but when the new abstime is later, it is only
+ * recorded, and the task is requeued when its old abstime comes due.
+ * This makes it very cheap to push out a timeout on every bit of activity,
+ * as with an idle timer. If the new abstime is earlier, the task is moved
+ * as by nft_task_reschedule. The return values are as for that call.
+ */
+int	    nft_task_extend(nft_task_h taskh, struct timespec abstime);
+
+/*
+ * nft_task_schedule_many - Schedule a batch of tasks.
+ *
+ * Each spec gives the arguments of nft_task_schedule_slack, and the handle
+ * of each new task is stored in handles, or NULL if its spec is invalid.
+ * This is cheaper than scheduling the tasks one by one, since each queue
+ * is locked only once, and each scheduler thread is signalled at most once.
+ * Returns the number of tasks scheduled.
+ */
+typedef struct nft_task_spec
+{
+    struct timespec abstime;
+    struct timespec interval;
+    struct timespec slack;
+    void	 (* function)(void *);
+    void	  * argument;
+} nft_task_spec_t;
+
+int	    nft_task_schedule_many(const nft_task_spec_t * specs, int count, nft_task_h * handles);
+
+/*
+ * nft_task_cancel_many - Cancel a batch of tasks.
+ *
+ * For each handle whose task is canceled, its argument is stored in
+ * arguments, if arguments is not NULL, or else NULL is stored there.
+ * Returns the number of tasks canceled.
+ */
+int	    nft_task_cancel_many(const nft_task_h * handles, int count, void ** arguments);
+
+/*
+ * nft_task_catchup - Set the catch-up policy of a periodic task.
+ *
+ * When a periodic task falls behind, as when a task ahead of it runs long,
+ * the next run is still computed from the previous abstime, so the period
+ * never drifts. The policy decides what happens to the runs that were missed:
+ *
+ * NFT_TASK_RUN_ALL	Run each missed run, back to back. This is the default.
+ * NFT_TASK_SKIP	Skip the missed runs, and resume at the next abstime
+ *			after the current time. The skipped runs are counted.
+ *
+ * Returns zero on success, or EINVAL if the handle or policy is invalid.
+ */
+#define NFT_TASK_RUN_ALL	0
+#define NFT_TASK_SKIP		1
+
+int	    nft_task_catchup(nft_task_h taskh, int policy);
+
+/*
+ * nft_task_info - Get a task's run count and lateness.
+ *
+ * Lateness is the time from a run's abstime until the scheduler ran it,
+ * in seconds. Returns zero on success, or EINVAL if the task is not found,
+ * as with a one-shot that has already executed.
+ */
+typedef struct nft_task_info
+{
+    long	runs;		// number of times the task has run
+    long	skipped;	// number of periodic runs skipped
+    double	late_last;	// lateness of the last run
+    double	late_max;	// maximum lateness
+    double	late_mean;	// mean lateness
+} nft_task_info_t;
+
+int	    nft_task_info(nft_task_h taskh, nft_task_info_t * info);
+
+/*
+ * nft_task_stats - Take a snapshot of the scheduler's instrumentation.
+ *
+ * The statistics are summed over all of the scheduler shards. Lateness is
+ * the time from a run's abstime until the scheduler ran it, and run time
+ * is the time that the task's action took. Tasks scheduled on a pool are
+ * counted as fired when they are dispatched, but their run time is counted
+ * by the pool (see nft_pool_stats).
+ *
+ * The lateness and run time histograms count runs by the log2 of the time
+ * in microseconds, as with nft_pool_stats: bucket zero counts times under
+ * one microsecond, and bucket i counts times from 2^(i-1) up to 2^i
+ * microseconds. The fired histogram counts wakeups by the log2 of the
+ * number of tasks that each fired: bucket i counts from 2^(i-1) up to 2^i.
+ * The last bucket of each also counts larger values.
+ *
+ * Returns zero on success, or EINVAL if stats is NULL.
+ */
+#define NFT_TASK_BUCKETS	32
+
+typedef struct nft_task_stats
+{
+    uint64_t	wakeups;	// Wakeups that fired at least one task.
+    uint64_t	fired;		// Task runs.
+    uint64_t	overruns;	// Actions that exceeded the budget.
+    uint64_t	late_ns;	// Total lateness.
+    uint64_t	run_ns;		// Total run time of actions.
+    long	queue_size;	// Current pending tasks.
+    long	queue_high;	// Most tasks ever pending, summed over the shards.
+    uint64_t	late_hist [NFT_TASK_BUCKETS];
+    uint64_t	run_hist  [NFT_TASK_BUCKETS];
+    uint64_t	fired_hist[NFT_TASK_BUCKETS];
+} nft_task_stats_t;
+
+int	    nft_task_stats(nft_task_stats_t * stats);
+
+/*
+ * nft_task_budget - Set the run-time budget for task actions.
+ *
+ * Task actions run in the scheduler thread, so an action that blocks delays
+ * every other task on its shard. When an action runs for longer than the
+ * budget, it is counted in nft_task_stats, and if overrun is not NULL, it is
+ * called in the scheduler thread, with the task's handle and run time.
+ * The handle may no longer be valid, if the task has finished or been
+ * canceled. A zero budget, the default, disables the check. This may be
+ * called at any time. Returns zero on success, or EINVAL if budget is invalid.
+ */
+int	    nft_task_budget(struct timespec budget, void (* overrun)(nft_task_h task, double seconds));
+
 /*
  * nft_task_this - Return the handle of the current task.
  *
  * This convenience function allows your task function to get its own
  * task handle, making it easy for repeating tasks to cancel themselves.
- * It should only be called within the task code.
+ * It should only be called within the task code, and returns NULL
+ * elsewhere. It does not lock, so it is cheap to call on every run.
  */
 nft_task_h  nft_task_this(void);
 
+/*
+ * nft_task_this_info - Describe the current task, and the run in progress.
+ *
+ * Like nft_task_this, this is only meaningful within the task code, and
+ * it does not lock. The deadline is the abstime of the current run, on
+ * the clock of nft_gettime, and runs counts the runs so far, including
+ * the current one. Returns zero on success, EINVAL if info is NULL,
+ * or ENOENT if the caller is not running a task.
+ */
+typedef struct nft_task_this_info
+{
+    nft_task_h	    task;	// The current task's handle.
+    struct timespec deadline;	// The abstime of the current run.
+    struct timespec interval;	// The task's interval, or zero.
+    long	    runs;	// The runs so far, including this one.
+} nft_task_this_info_t;
+
+int	    nft_task_this_info(nft_task_this_info_t * info);
+
+
+/*
+ * nft_task_backend - Select how the scheduler queues pending tasks.
+ *
+ * NFT_TASK_HEAP	A binary heap, which is the default. Schedule and
+ *			cancel are O(log n), and tasks run at their abstime.
+ * NFT_TASK_WHEEL	A hierarchical timing wheel. Schedule and cancel are
+ *			O(1), but tasks run on the first tick at or after
+ *			their abstime, so the tick sets the resolution.
+ *			If tick is zero, it is one millisecond.
+ *
+ * This must be called before any task is scheduled, and applies to
+ * the whole process. Returns zero on success, EINVAL if an argument
+ * is invalid, or EBUSY if the scheduler has already started.
+ */
+#define NFT_TASK_HEAP	0
+#define NFT_TASK_WHEEL	1
+
+int	    nft_task_backend(int backend, struct timespec tick);
+
+
+/*
+ * nft_task_clock - Select the clock that the scheduler waits on.
+ *
+ * NFT_TASK_REALTIME	The system clock, which is the default. If the clock
+ *			is stepped, as by NTP, tasks will run early or late.
+ * NFT_TASK_MONOTONIC	The monotonic clock, which is not affected when the
+ *			system clock is set. Each abstime is still given as
+ *			by nft_gettime, and is converted to the monotonic
+ *			clock when the task is scheduled.
+ *
+ * This must be called before any task is scheduled, and applies to
+ * the whole process. Returns zero on success, EINVAL if clock is invalid,
+ * ENOTSUP if the platform cannot wait on the monotonic clock, or EBUSY
+ * if the scheduler has already started.
+ */
+#define NFT_TASK_REALTIME	0
+#define NFT_TASK_MONOTONIC	1
+
+int	    nft_task_clock(int clock);
+
+/*
+ * nft_task_shards - Set the number of scheduler threads.
+ *
+ * By default, a single scheduler thread runs every task. With more than
+ * one shard, each shard has its own queue, lock and scheduler thread, and
+ * each task is assigned to a shard by a hash of its handle. This spreads
+ * schedule and cancel contention across the shards, and a task that blocks
+ * only delays the other tasks on its own shard.
+ *
+ * This must be called before any task is scheduled, and applies to
+ * the whole process. Returns zero on success, EINVAL if count is less
+ * than one, or EBUSY if the scheduler has already started.
+ */
+int	    nft_task_shards(int count);
+
+/*
+ * nft_task_schedule_shard - Schedule a task on a particular shard.
+ *
+ * As nft_task_schedule, but the task runs on the scheduler thread of the
+ * given shard, numbered from zero, so that related tasks execute in order
+ * on one thread. If shard is negative, the task is assigned by hash.
+ * Returns NULL if the shard is out of range.
+ */
+nft_task_h  nft_task_schedule_shard(int             shard,
+				    struct timespec abstime,
+				    struct timespec interval,
+				    void	 (* function)(void *),
+				    void	  * argument);
+
 
 
 /******************************************************************************
@@ -105,7 +372,20 @@ nft_task_h  nft_task_this(void);
 typedef struct nft_task
 {
     nft_core        core;
-    long            index;		// position in heap
+    long            index;		// position in heap, or wheel slot
+    struct nft_task * next;		// links within a wheel slot
+    struct nft_task * prev;
+    uint64_t	    tick;		// wheel tick when the task is due
+    int		    shard;		// scheduler shard, or -1 if unassigned
+    nft_pool_h	    pool;		// pool to run the function, or NULL
+    struct timespec slack;		// how late the task may run
+    struct timespec extend;		// lazily deferred abstime, or zero
+    int		    catchup;		// NFT_TASK_RUN_ALL or NFT_TASK_SKIP
+    long	    runs;		// number of times the task has run
+    long	    skipped;		// number of periodic runs skipped
+    int64_t	    late_last;		// lateness of the last run, in nsec
+    int64_t	    late_max;		// maximum lateness, in nsec
+    int64_t	    late_total;		// total lateness, in nsec
 
     struct timespec abstime;		// absolute time to perform task
     struct timespec interval;		// period to repeat task
@@ -0,0 +1,1600 @@
+/***********************************************************************
+ * (C) Copyright Xenadyne, Inc. 2003-2021  All rights reserved.
+ *
+ * Permission to use, copy, modify and distribute this software for
+ * any purpose and without fee is hereby granted, provided that the
+ * above copyright notice appears in all copies.
+ *
+ * XENADYNE INC DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+ * IN NO EVENT SHALL XENADYNE BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM THE
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ ************************************************************************
+ *
+ * File: nft_btree.c
+ *
+ * DESCRIPTION
+ *
+ * This package implements a B+tree, with the same API as nft_rbtree.
+ * For a full description of this package, please refer to the header
+ * file nft_btree.h. Usage is illustrated by the unit test below (see
+ * #ifdef MAIN), which also compares its performance with nft_rbtree.
+ *
+ * ALGORITHM
+ *
+ * Every node holds between BTREE_ORDER/2 and BTREE_ORDER keys, except
+ * the root, which may hold fewer. All leaves are at the same depth, and
+ * hold the key-data pairs. The inner nodes hold separators: the keys of
+ * child[i] are no greater than separator i, and the keys of child[i+1]
+ * are no less. Duplicate keys may therefore straddle a separator, so
+ * that a search descends to the leftmost child that could hold the key,
+ * and may need to step once along the leaf chain.
+ *
+ * Separators are copies of leaf keys, and so they carry the data value
+ * too, so that duplex comparators see all four of their arguments.
+ *
+ * Nodes are allocated on cache-line boundaries, which leaves the low
+ * bits of a leaf pointer clear, so that a reentrant walk can encode the
+ * leaf and the index within it in a single void pointer.
+ *
+ * The nodes that an insert may need are reserved before the tree is
+ * modified, so that an insert never fails halfway through a split.
+ *
+ *******************************************************************
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#include <nft_btree.h>
+
+// Define the wrapper functions nft_btree_cast, _lookup, _discard, etc.
+//
+NFT_DEFINE_WRAPPERS(nft_btree,)
+
+
+// The minimum number of keys in a node other than the root.
+#define MIN_KEYS        (BTREE_ORDER / 2)
+
+// Macros to reference the links of leaf and inner nodes.
+#define NEXT(n)         (n)->link[0]
+#define CHILD(n,i)      (n)->link[i]
+
+// A walk cursor is a leaf pointer, with the index in its low bits.
+#define CURSOR(n,i)     ((void *)((uintptr_t)(n) | (i)))
+#define CURSOR_NODE(c)  ((nft_btnode *)((uintptr_t)(c) & ~(uintptr_t)(BTREE_LINE - 1)))
+#define CURSOR_INDEX(c) ((unsigned)((uintptr_t)(c) & (BTREE_LINE - 1)))
+
+/* Returns the size of a leaf or inner node.
+ */
+static inline size_t
+node_size(int leaf)
+{
+    return sizeof(nft_btnode) + (leaf ? 1 : BTREE_ORDER + 1) * sizeof(nft_btnode *);
+}
+
+/* Allocate a node on a cache-line boundary.
+ */
+static nft_btnode *
+node_alloc(int leaf)
+{
+#ifdef _WIN32
+    return _aligned_malloc(node_size(leaf), BTREE_LINE);
+#else
+    void * node = NULL;
+    return posix_memalign(&node, BTREE_LINE, node_size(leaf)) ? NULL : node;
+#endif
+}
+
+static void
+node_release(nft_btnode * node)
+{
+#ifdef _WIN32
+    _aligned_free(node);
+#else
+    free(node);
+#endif
+}
+
+/* Ensure that the tree holds enough spare nodes to complete an insert:
+ * one leaf, and an inner node for every level that might split.
+ * Returns 1 on success, zero on failure.
+ */
+static int
+reserve_nodes(nft_btree * tree)
+{
+    for (int leaf = 0; leaf < 2; leaf++)
+    {
+	unsigned need = leaf ? 1 : tree->height;
+	while (tree->num_spares[leaf] < need)
+	{
+	    nft_btnode * node = node_alloc(leaf);
+	    if (!node) return 0;
+	    NEXT(node) = tree->spares[leaf];
+	    tree->spares[leaf] = node;
+	    tree->num_spares[leaf]++;
+	}
+    }
+    return 1;
+}
+
+/* Take a node from the spares reserved by reserve_nodes().
+ */
+static nft_btnode *
+node_new(nft_btree * tree, int leaf)
+{
+    nft_btnode * node = tree->spares[leaf];
+    assert(node);
+    tree->spares[leaf] = NEXT(node);
+    tree->num_spares[leaf]--;
+
+    node->count = 0;
+    node->leaf  = leaf;
+    NEXT(node)  = NULL;
+    return node;
+}
+
+/* Return a node to the spares, or free it if there are enough already.
+ */
+static void
+node_free(nft_btree * tree, nft_btnode * node)
+{
+    int leaf = node->leaf;
+    if (tree->num_spares[leaf] <= tree->height) {
+	NEXT(node) = tree->spares[leaf];
+	tree->spares[leaf] = node;
+	tree->num_spares[leaf]++;
+    }
+    else
+	node_release(node);
+}
+
+/* Free a subtree.
+ */
+static void
+free_nodes(nft_btnode * node)
+{
+    if (!node->leaf)
+	for (unsigned i = 0; i <= node->count; i++)
+	    free_nodes(CHILD(node, i));
+    node_release(node);
+}
+
+/* Return the index of the first key in node that is not less than key.
+ */
+static inline unsigned
+node_lower(BTREE_COMPARE compare, nft_btnode * node, void * key, void * token)
+{
+    unsigned lo = 0, hi = node->count;
+    while (lo < hi) {
+	unsigned mid = (lo + hi) / 2;
+	if (compare(key, node->key[mid], token, node->data[mid]) > 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+/* Return the index of the first key in node that is greater than key.
+ */
+static inline unsigned
+node_upper(BTREE_COMPARE compare, nft_btnode * node, void * key, void * token)
+{
+    unsigned lo = 0, hi = node->count;
+    while (lo < hi) {
+	unsigned mid = (lo + hi) / 2;
+	if (compare(key, node->key[mid], token, node->data[mid]) >= 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+/* Make a cursor for the given leaf position, stepping to the next leaf
+ * if index is past the end of this one. Returns NULL at the end of the tree.
+ */
+static void *
+cursor_make(nft_btnode * leaf, unsigned index)
+{
+    if (leaf && index >= leaf->count) {
+	leaf  = NEXT(leaf);
+	index = 0;
+    }
+    return leaf ? CURSOR(leaf, index) : NULL;
+}
+
+/* Return a cursor for the first pair that is not less than key, or NULL.
+ */
+static void *
+seek_lower(nft_btree * tree, void * key, void * token)
+{
+    nft_btnode * node = tree->root;
+    if (!node) return NULL;
+
+    while (!node->leaf)
+	node = CHILD(node, node_lower(tree->compare, node, key, token));
+
+    return cursor_make(node, node_lower(tree->compare, node, key, token));
+}
+
+/* Return a cursor for the first pair in the tree, or NULL.
+ */
+static void *
+seek_first(nft_btree * tree)
+{
+    nft_btnode * node = tree->root;
+    if (!node) return NULL;
+
+    while (!node->leaf)
+	node = CHILD(node, 0);
+    return CURSOR(node, 0);
+}
+
+/******************************************************************************/
+/*******                                                                *******/
+/*******        Core algorithm: Insertion, deletion and balancing       *******/
+/*******                                                                *******/
+/******************************************************************************/
+
+/* Insert key, data and link at index i of node, which must not be full.
+ * For inner nodes, link becomes child i+1.
+ */
+static void
+node_insert_at(nft_btnode * node, unsigned i, void * key, void * data, nft_btnode * link)
+{
+    unsigned n = node->count;
+    assert(n < BTREE_ORDER && i <= n);
+
+    memmove(&node->key [i + 1], &node->key [i], (n - i) * sizeof(void *));
+    memmove(&node->data[i + 1], &node->data[i], (n - i) * sizeof(void *));
+    node->key [i] = key;
+    node->data[i] = data;
+    if (!node->leaf) {
+	memmove(&CHILD(node, i + 2), &CHILD(node, i + 1), (n - i) * sizeof(nft_btnode *));
+	CHILD(node, i + 1) = link;
+    }
+    node->count++;
+}
+
+/* Remove the key and data at index i of node.
+ * For inner nodes, also remove child i+1.
+ */
+static void
+node_remove_at(nft_btnode * node, unsigned i)
+{
+    unsigned n = node->count;
+    assert(i < n);
+
+    memmove(&node->key [i], &node->key [i + 1], (n - i - 1) * sizeof(void *));
+    memmove(&node->data[i], &node->data[i + 1], (n - i - 1) * sizeof(void *));
+    if (!node->leaf)
+	memmove(&CHILD(node, i + 1), &CHILD(node, i + 2), (n - i - 1) * sizeof(nft_btnode *));
+    node->count--;
+}
+
+/* Insert key, data and link at index i of a full node, splitting it.
+ * Returns the new right-hand node, and its separator via *sepkey, *sepdata.
+ */
+static nft_btnode *
+node_split(nft_btree * tree, nft_btnode * node, unsigned i,
+	   void * key, void * data, nft_btnode * link,
+	   void ** sepkey, void ** sepdata)
+{
+    void       * keys [BTREE_ORDER + 1];
+    void       * datas[BTREE_ORDER + 1];
+    nft_btnode * links[BTREE_ORDER + 2];
+    int          leaf  = node->leaf;
+    unsigned     n     = BTREE_ORDER + 1;
+    assert(node->count == BTREE_ORDER);
+
+    // Merge the new entry into temporary arrays.
+    memcpy(keys,  node->key,  i * sizeof(void *));
+    memcpy(datas, node->data, i * sizeof(void *));
+    keys [i] = key;
+    datas[i] = data;
+    memcpy(&keys [i + 1], &node->key [i], (BTREE_ORDER - i) * sizeof(void *));
+    memcpy(&datas[i + 1], &node->data[i], (BTREE_ORDER - i) * sizeof(void *));
+    if (!leaf) {
+	memcpy(links, node->link, (i + 1) * sizeof(nft_btnode *));
+	links[i + 1] = link;
+	memcpy(&links[i + 2], &CHILD(node, i + 1), (BTREE_ORDER - i) * sizeof(nft_btnode *));
+    }
+
+    nft_btnode * right = node_new(tree, leaf);
+    unsigned     half  = n / 2;
+
+    if (leaf) {
+	// Leaves keep every pair, and the separator is a copy of the right's first.
+	node->count  = half;
+	right->count = n - half;
+	memcpy(node->key,   keys,          half * sizeof(void *));
+	memcpy(node->data,  datas,         half * sizeof(void *));
+	memcpy(right->key,  &keys [half], (n - half) * sizeof(void *));
+	memcpy(right->data, &datas[half], (n - half) * sizeof(void *));
+	NEXT(right) = NEXT(node);
+	NEXT(node)  = right;
+	*sepkey  = right->key [0];
+	*sepdata = right->data[0];
+    }
+    else {
+	// The middle key of an inner node moves up to the parent.
+	node->count  = half;
+	right->count = n - half - 1;
+	memcpy(node->key,   keys,              half * sizeof(void *));
+	memcpy(node->data,  datas,             half * sizeof(void *));
+	memcpy(node->link,  links,      (half + 1) * sizeof(nft_btnode *));
+	memcpy(right->key,  &keys [half + 1], (n - half - 1) * sizeof(void *));
+	memcpy(right->data, &datas[half + 1], (n - half - 1) * sizeof(void *));
+	memcpy(right->link, &links[half + 1], (n - half) * sizeof(nft_btnode *));
+	*sepkey  = keys [half];
+	*sepdata = datas[half];
+    }
+    return right;
+}
+
+/* Insert key and data into the subtree at node, after any equal keys.
+ * If the node splits, returns the new right-hand node and its separator.
+ */
+static nft_btnode *
+insert_node(nft_btree * tree, nft_btnode * node, void * key, void * data,
+	    void ** sepkey, void ** sepdata)
+{
+    unsigned     i    = node_upper(tree->compare, node, key, data);
+    nft_btnode * link = NULL;
+
+    if (!node->leaf)
+    {
+	link = insert_node(tree, CHILD(node, i), key, data, &key, &data);
+	if (!link) return NULL;
+    }
+    if (node->count < BTREE_ORDER) {
+	node_insert_at(node, i, key, data, link);
+	return NULL;
+    }
+    return node_split(tree, node, i, key, data, link, sepkey, sepdata);
+}
+
+/* Child i of node has too few keys. Borrow a key from a sibling,
+ * or if neither sibling can spare one, merge with a sibling.
+ */
+static void
+rebalance(nft_btree * tree, nft_btnode * node, unsigned i)
+{
+    nft_btnode * child = CHILD(node, i);
+    nft_btnode * left  = (i > 0)           ? CHILD(node, i - 1) : NULL;
+    nft_btnode * right = (i < node->count) ? CHILD(node, i + 1) : NULL;
+
+    if (left && left->count > MIN_KEYS)
+    {
+	unsigned last = left->count - 1;
+	if (child->leaf) {
+	    node_insert_at(child, 0, left->key[last], left->data[last], NULL);
+	    node->key [i - 1] = child->key [0];
+	    node->data[i - 1] = child->data[0];
+	}
+	else {
+	    // Rotate the separator down into child, and left's last key up.
+	    memmove(&CHILD(child, 1), &CHILD(child, 0), (child->count + 1) * sizeof(nft_btnode *));
+	    memmove(&child->key [1], &child->key [0], child->count * sizeof(void *));
+	    memmove(&child->data[1], &child->data[0], child->count * sizeof(void *));
+	    child->key [0]  = node->key [i - 1];
+	    child->data[0]  = node->data[i - 1];
+	    CHILD(child, 0) = CHILD(left, last + 1);
+	    child->count++;
+	    node->key [i - 1] = left->key [last];
+	    node->data[i - 1] = left->data[last];
+	}
+	left->count--;
+    }
+    else if (right && right->count > MIN_KEYS)
+    {
+	if (child->leaf) {
+	    node_insert_at(child, child->count, right->key[0], right->data[0], NULL);
+	    node_remove_at(right, 0);
+	    node->key [i] = right->key [0];
+	    node->data[i] = right->data[0];
+	}
+	else {
+	    // Rotate the separator down into child, and right's first key up.
+	    child->key [child->count] = node->key [i];
+	    child->data[child->count] = node->data[i];
+	    CHILD(child, child->count + 1) = CHILD(right, 0);
+	    child->count++;
+	    node->key [i] = right->key [0];
+	    node->data[i] = right->data[0];
+	    memmove(&CHILD(right, 0), &CHILD(right, 1), right->count * sizeof(nft_btnode *));
+	    memmove(&right->key [0], &right->key [1], (right->count - 1) * sizeof(void *));
+	    memmove(&right->data[0], &right->data[1], (right->count - 1) * sizeof(void *));
+	    right->count--;
+	}
+    }
+    else
+    {
+	// Merge the child with a sibling, removing separator s.
+	unsigned s = left ? i - 1 : i;
+	if (left) right = child;
+	else      left  = child;
+	assert(left && right);
+
+	unsigned n = left->count;
+	if (left->leaf) {
+	    NEXT(left) = NEXT(right);
+	}
+	else {
+	    left->key [n] = node->key [s];
+	    left->data[n] = node->data[s];
+	    n++;
+	    memcpy(&CHILD(left, n), &CHILD(right, 0), (right->count + 1) * sizeof(nft_btnode *));
+	}
+	memcpy(&left->key [n], right->key,  right->count * sizeof(void *));
+	memcpy(&left->data[n], right->data, right->count * sizeof(void *));
+	left->count = n + right->count;
+	assert(left->count <= BTREE_ORDER);
+
+	node_remove_at(node, s);
+	node_free(tree, right);
+    }
+}
+
+/* Delete one pair that matches key from the subtree at node.
+ * Returns 1 if it was found, and the data via *data.
+ */
+static int
+delete_node(nft_btree * tree, nft_btnode * node, void * key, void * token, void ** data)
+{
+    BTREE_COMPARE compare = tree->compare;
+    unsigned      i       = node_lower(compare, node, key, token);
+
+    if (node->leaf)
+    {
+	if (i == node->count || compare(key, node->key[i], token, node->data[i]))
+	    return 0;
+	*data = node->data[i];
+	node_remove_at(node, i);
+	return 1;
+    }
+
+    // Equal keys may straddle a separator, so try the next child if need be.
+    int found;
+    while (!(found = delete_node(tree, CHILD(node, i), key, token, data)) &&
+	   (i < node->count) &&
+	   (compare(key, node->key[i], token, node->data[i]) == 0))
+	i++;
+
+    if (found && CHILD(node, i)->count < MIN_KEYS)
+	rebalance(tree, node, i);
+    return found;
+}
+
+/******************************************************************************/
+/*******                                                                *******/
+/*******                BTREE PRIVATE APIS                              *******/
+/*******                                                                *******/
+/******************************************************************************/
+
+/*-----------------------------------------------------------------------------
+ *
+ * btree_new		Create a new btree
+ *
+ *-----------------------------------------------------------------------------
+ */
+nft_btree *
+btree_new(int min_nodes, BTREE_COMPARE compare)
+{
+    return btree_create(nft_btree_class, sizeof(nft_btree), min_nodes, compare);
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ * btree_free		Free a btree created by btree_new().
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+btree_free(nft_btree * tree)
+{
+    return tree ? nft_btree_discard(tree) : EINVAL ;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ * btree_locking	Enable or disable the btree's rwlock.
+ *
+ *-----------------------------------------------------------------------------
+ */
+void
+btree_locking(nft_btree * tree, unsigned enabled)
+{
+    if (tree) tree->locking = enabled;
+}
+
+static void
+btree_rdlock(nft_btree * tree)
+{
+    int r = pthread_rwlock_rdlock(&tree->rwlock); assert(r == 0);
+}
+
+static void
+btree_wrlock(nft_btree * tree)
+{
+    int r = pthread_rwlock_wrlock(&tree->rwlock); assert(r == 0);
+}
+
+static void
+btree_unlock(nft_btree * tree)
+{
+    int r = pthread_rwlock_unlock(&tree->rwlock); assert(r == 0);
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ * btree_create
+ *
+ * This constructor takes additional parameters class and size,
+ * so that you can use it to implement a subclass of nft_btree.
+ *
+ *-----------------------------------------------------------------------------
+ */
+nft_btree *
+btree_create(const char * class, size_t size, int min_nodes, BTREE_COMPARE compare)
+{
+    // The initial size must be nonnegative, and the compare arg is mandatory.
+    if (min_nodes < 0) return NULL;
+    if (!compare) return NULL;
+
+    nft_btree * tree = nft_btree_cast(nft_core_create(class, size));
+    if (!tree) return NULL;
+
+    // Initialize the tree
+    tree->core.destroy = btree_destroy;
+    tree->root      = NULL;
+    tree->compare   = compare;
+    tree->height    = 0;
+    tree->count     = 0;
+    tree->version   = 0;
+    tree->spares[0] = tree->spares[1] = NULL;
+    tree->num_spares[0] = tree->num_spares[1] = 0;
+    tree->current   = NULL;
+    tree->walk_key  = NULL;
+    tree->walk_data = NULL;
+    tree->walk_version = 0;
+    tree->locking   = 0;
+    pthread_rwlock_init(&tree->rwlock, NULL);
+
+    return tree;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ * btree_destroy	Destroy a freed btree.
+ *
+ * Do not call this directly or you will leak handles. Use btree_free instead.
+ *
+ *-----------------------------------------------------------------------------
+ */
+void
+btree_destroy(nft_core * core)
+{
+    // The _cast function will return NULL if core is not a nft_btree.
+    nft_btree * tree = nft_btree_cast(core);
+    if (tree) {
+	if (tree->root) free_nodes(tree->root);
+	for (int leaf = 0; leaf < 2; leaf++)
+	    while (tree->spares[leaf]) {
+		nft_btnode * node = tree->spares[leaf];
+		tree->spares[leaf] = NEXT(node);
+		node_release(node);
+	    }
+	pthread_rwlock_destroy(&tree->rwlock);
+    }
+    // Remember to invoke the base-class destroyer last of all.
+    nft_core_destroy(core);
+}
+
+/* Insert a pair, with the tree locked. Returns 1 on success, zero on failure.
+ */
+static int
+insert_pair(nft_btree * tree, void * key, void * data)
+{
+    if (!reserve_nodes(tree)) return 0;
+
+    if (!tree->root) {
+	tree->root   = node_new(tree, 1);
+	tree->height = 1;
+    }
+
+    void       * sepkey, * sepdata;
+    nft_btnode * right = insert_node(tree, tree->root, key, data, &sepkey, &sepdata);
+
+    // If the root split, grow a new root above it.
+    if (right) {
+	nft_btnode * root = node_new(tree, 0);
+	root->count    = 1;
+	root->key [0]  = sepkey;
+	root->data[0]  = sepdata;
+	CHILD(root, 0) = tree->root;
+	CHILD(root, 1) = right;
+	tree->root     = root;
+	tree->height++;
+    }
+    tree->count++;
+    tree->version++;
+    return 1;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ * btree_insert		Insert a new key/data pair into the tree.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+btree_insert(nft_btree * tree, void * key, void * data)
+{
+    if (!tree) return 0;
+    if (tree->locking) btree_wrlock(tree);
+
+    int result = insert_pair(tree, key, data);
+
+    if (tree->locking) btree_unlock(tree);
+    return result;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ * btree_replace	Insert the key, or update an existing entry.
+ *
+ * Returns:	2	An existing key-data pair was replaced.
+ *			The *data was overwritten with the previous data.
+ *		1	A new node was inserted successfully.
+ *		0	The key-data pair could not be inserted.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+btree_replace(nft_btree * tree, void * key, void ** data)
+{
+    int result = 0;
+
+    if (!tree) return 0;
+    if (tree->locking) btree_wrlock(tree);
+
+    void * cursor = seek_lower(tree, key, *data);
+    nft_btnode * leaf = CURSOR_NODE(cursor);
+    unsigned     i    = CURSOR_INDEX(cursor);
+
+    // If key found, replace key and data, else insert a new pair.
+    if (cursor && !tree->compare(key, leaf->key[i], *data, leaf->data[i])) {
+	void * save   = leaf->data[i];
+	leaf->key [i] = key;
+	leaf->data[i] = *data;
+	*data         = save;
+	result        = 2;
+    }
+    else
+	result = insert_pair(tree, key, *data);
+
+    if (tree->locking) btree_unlock(tree);
+    return result;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ * btree_delete		Remove a key,data pair from the tree.
+ * 			If duplex keys are in use, *data must be specified.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+btree_delete(nft_btree * tree, void * key, void ** data)
+{
+    if (!tree) return 0;
+    if (tree->locking) btree_wrlock(tree);
+
+    void * token = data ? *data : NULL;
+    void * found = NULL;
+    int result   = tree->root && delete_node(tree, tree->root, key, token, &found);
+
+    if (result)
+    {
+	if (data) *data = found;
+	tree->count--;
+	tree->version++;
+
+	// Shrink the tree when the root runs out of keys.
+	nft_btnode * root = tree->root;
+	if (root->count == 0) {
+	    tree->root = root->leaf ? NULL : CHILD(root, 0);
+	    tree->height--;
+	    node_free(tree, root);
+	}
+    }
+    if (tree->locking) btree_unlock(tree);
+    return result;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ * btree_search		Look up a key in a tree
+ *			If duplex keys are in use, *data must be specified.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+btree_search(nft_btree * tree, void * key, void ** data)
+{
+    if (!tree) return 0;
+    if (tree->locking) btree_rdlock(tree);
+
+    void * token  = data ? *data : NULL;
+    void * cursor = seek_lower(tree, key, token);
+    int    result = 0;
+
+    if (cursor) {
+	nft_btnode * leaf = CURSOR_NODE(cursor);
+	unsigned     i    = CURSOR_INDEX(cursor);
+
+	if (!tree->compare(key, leaf->key[i], token, leaf->data[i])) {
+	    if (data) *data = leaf->data[i];
+	    result = 1;
+	}
+    }
+    if (tree->locking) btree_unlock(tree);
+    return result;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ *	btree_count() - Return number of entries in the btree.
+ *
+ *-----------------------------------------------------------------------------
+ */
+unsigned
+btree_count(nft_btree * tree)
+{
+    return tree ? tree->count : 0;
+}
+
+/* Return the pair at cursor, and advance the cursor.
+ */
+static int
+cursor_next(void ** cursor, void ** key, void ** data)
+{
+    if (!*cursor) return 0;
+
+    nft_btnode * leaf = CURSOR_NODE(*cursor);
+    unsigned     i    = CURSOR_INDEX(*cursor);
+    assert(leaf->leaf && i < leaf->count);
+
+    if (key)  *key  = leaf->key [i];
+    if (data) *data = leaf->data[i];
+    *cursor = cursor_make(leaf, i + 1);
+    return 1;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ *	btree_walk_first_r    Initiate a walk of tree in order of ascending keys.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+btree_walk_first_r(nft_btree * tree, void ** key, void ** data, void ** walk)
+{
+    if (!tree) return 0;
+    if (tree->locking) btree_rdlock(tree);
+
+    *walk = seek_first(tree);
+    int result = cursor_next(walk, key, data);
+
+    if (tree->locking) btree_unlock(tree);
+    return result;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ *	btree_walk_next_r	Returns the next key and data in ascending order.
+ *
+ *	You must call btree_walk_first_r() to start the walk.
+ *      You may not insert or delete keys during the walk.
+ *	Returns TRUE until the last node has been returned,
+ *	then returns FALSE for all subsequent calls.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+btree_walk_next_r(nft_btree * tree, void ** key, void ** data, void ** walk)
+{
+    if (!tree) return 0;
+    if (tree->locking) btree_rdlock(tree);
+
+    int result = cursor_next(walk, key, data);
+
+    if (tree->locking) btree_unlock(tree);
+    return result;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ *	btree_walk_first	Single-threaded walk-first call.
+ *
+ *	Only one thread may walk a shared tree at a time.
+ *	The caller must enforce this constraint.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+btree_walk_first(nft_btree * tree, void ** key, void ** data)
+{
+    if (!tree) return 0;
+    if (tree->locking) btree_rdlock(tree);
+
+    tree->current = seek_first(tree);
+    int result = cursor_next(&tree->current, &tree->walk_key, &tree->walk_data);
+    if (result) {
+	if (key)  *key  = tree->walk_key;
+	if (data) *data = tree->walk_data;
+    }
+    tree->walk_version = tree->version;
+
+    if (tree->locking) btree_unlock(tree);
+    return result;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ *	btree_walk_next		Single threaded walk_next call.
+ *
+ *	If the tree has been modified since the last call, the cursor
+ *	may be stale, so we find the last pair returned, and resume after it.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+btree_walk_next(nft_btree * tree, void ** key, void ** data)
+{
+    if (!tree) return 0;
+    if (tree->locking) btree_rdlock(tree);
+
+    if (tree->walk_version != tree->version && tree->current)
+    {
+	void * walk_key  = tree->walk_key;
+	void * walk_data = tree->walk_data;
+	void * cursor    = seek_lower(tree, walk_key, walk_data);
+	void * k, * d;
+
+	// Skip past the equal keys up to and including the last pair returned.
+	tree->current = cursor;
+	while (cursor_next(&cursor, &k, &d) && !tree->compare(walk_key, k, walk_data, d)) {
+	    tree->current = cursor;
+	    if (k == walk_key && d == walk_data) break;
+	}
+    }
+    int result = cursor_next(&tree->current, &tree->walk_key, &tree->walk_data);
+    if (result) {
+	if (key)  *key  = tree->walk_key;
+	if (data) *data = tree->walk_data;
+    }
+    tree->walk_version = tree->version;
+
+    if (tree->locking) btree_unlock(tree);
+    return result;
+}
+
+/*-----------------------------------------------------------------------------
+ *	btree_apply() - Call a function on every entry in the btree.
+ *	Return the number of entries in the tree.
+ *
+ *	Function takes args of (key, data, extra_arg).
+ *
+ *	WARNING - Your function must _NOT_ modify or delete the key,
+ *	otherwise the tree will not function correctly.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+btree_apply(nft_btree * tree, BTREE_APPLY apply, void * arg)
+{
+    if (!tree) return 0;
+    if (tree->locking) btree_rdlock(tree);
+
+    void * cursor = seek_first(tree);
+    int    num    = 0;
+    void * key, * data;
+
+    while (cursor_next(&cursor, &key, &data)) {
+	num++;
+	(*apply)(key, data, arg);
+    }
+    if (tree->locking) btree_unlock(tree);
+    return num;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ *	Like _apply(), but function takes args of (data, extra_arg).
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+btree_applyx(nft_btree * tree, BTREE_APPLYX apply, void * arg)
+{
+    if (!tree) return 0;
+    if (tree->locking) btree_rdlock(tree);
+
+    void * cursor = seek_first(tree);
+    int    num    = 0;
+    void * data;
+
+    while (cursor_next(&cursor, NULL, &data)) {
+	num++;
+	(*apply)(data, arg);
+    }
+    if (tree->locking) btree_unlock(tree);
+    return num;
+}
+
+/********************* tree validation functions ************************/
+
+/*
+ *  Verify that each node is aligned and holds a valid number of keys,
+ *  that the keys are ordered and lie within the separators above them,
+ *  and that all leaves are at the same depth. Returns the number of
+ *  pairs in the subtree, or -1 if it is invalid.
+ */
+static long
+check_node(nft_btree * tree, nft_btnode * node, unsigned depth,
+	   void ** lo, void ** hi)
+{
+    BTREE_COMPARE compare = tree->compare;
+
+    if ((uintptr_t) node & (BTREE_LINE - 1)) {
+	assert(!"btree_validate: Misaligned node!\n");
+	return -1;
+    }
+    if (node->count > BTREE_ORDER ||
+	(node != tree->root && node->count < MIN_KEYS) ||
+	(node->leaf != (depth == tree->height)))
+    {
+	assert(!"btree_validate: Bad node count or depth!\n");
+	return -1;
+    }
+    for (unsigned i = 0; i < node->count; i++)
+    {
+	if ((i > 0 && compare(node->key[i], node->key[i-1], node->data[i], node->data[i-1]) < 0) ||
+	    (lo    && compare(node->key[i], lo[0], node->data[i], lo[1]) < 0) ||
+	    (hi    && compare(node->key[i], hi[0], node->data[i], hi[1]) > 0))
+	{
+	    assert(!"btree_validate: Key order violation!\n");
+	    return -1;
+	}
+    }
+    if (node->leaf)
+	return node->count;
+
+    long total = 0;
+    for (unsigned i = 0; i <= node->count; i++)
+    {
+	void * clo[2] = { i > 0           ? node->key[i-1] : NULL, i > 0           ? node->data[i-1] : NULL };
+	void * chi[2] = { i < node->count ? node->key[i]   : NULL, i < node->count ? node->data[i]   : NULL };
+	long   n      = check_node(tree, CHILD(node, i), depth + 1,
+				   i > 0 ? clo : lo, i < node->count ? chi : hi);
+	if (n < 0) return -1;
+	total += n;
+    }
+    return total;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ * btree_validate	Test tree's pointers and key ordering integrity.
+ * 			Returns TRUE (1) if the tree is valid, else 0.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+btree_validate(nft_btree * tree)
+{
+    if (!tree->root)
+	return (tree->count == 0 && tree->height == 0);
+
+    long count = check_node(tree, tree->root, 1, NULL, NULL);
+    if (count != tree->count) {
+	assert(!"btree_validate: Bad count!\n");
+	return 0;
+    }
+
+    // The leaf chain must visit every pair, in order.
+    void * cursor = seek_first(tree);
+    void * key, * data, * prevkey = NULL, * prevdata = NULL;
+    for (count = 0; cursor_next(&cursor, &key, &data); count++)
+    {
+	if (count > 0 && tree->compare(key, prevkey, data, prevdata) < 0) {
+	    assert(!"btree_validate: Leaf chain order violation!\n");
+	    return 0;
+	}
+	prevkey  = key;
+	prevdata = data;
+    }
+    if (count != tree->count) {
+	assert(!"btree_validate: Bad leaf chain!\n");
+	return 0;
+    }
+    return 1;
+}
+
+/* These two comparators should cover most needs.
+ */
+long btree_compare_pointers(void * h1, void * h2) { return h2 > h1 ? 1 : h2 < h1 ? -1 : 0; }
+long btree_compare_strings (char * s1, char * s2) { return (long) strcmp(s1, s2); }
+
+
+/******************************************************************************/
+/*******                                                                *******/
+/*******                BTREE PUBLIC APIS                               *******/
+/*******                                                                *******/
+/*******  These APIs are Nifty wrappers around the private APIs.        *******/
+/*******                                                                *******/
+/******************************************************************************/
+
+nft_btree_h
+nft_btree_new(int min_nodes, BTREE_COMPARE compare)
+{
+    nft_btree * btree = btree_new(min_nodes, compare);
+    if (btree) {
+
+        // Enable locking, to make the handles safe for sharing.
+        btree_locking(btree, 1);
+
+        return nft_btree_handle(btree);
+    }
+    return NULL;
+}
+int
+nft_btree_free(nft_btree_h h)
+{
+    int result = EINVAL;
+    nft_btree * btree = nft_btree_lookup(h);
+    if (btree)
+    {
+        // Double-discard, to release the reference returned from btree_create().
+        if ((result = nft_btree_discard(btree)) == 0)
+             result = nft_btree_discard(btree);
+
+        // This assert should never fail.
+        assert(result == 0);
+    }
+    return result;
+}
+int
+nft_btree_count(nft_btree_h h)
+{
+    int         result = 0;
+    nft_btree * btree  = nft_btree_lookup(h);
+    if (btree) {
+        result = btree_count(btree);
+        nft_btree_discard(btree);
+    }
+    return result;
+}
+void
+nft_btree_locking(nft_btree_h h, unsigned enabled)
+{
+    nft_btree * btree = nft_btree_lookup(h);
+    if (btree) {
+        btree_locking(btree, enabled);
+        nft_btree_discard(btree);
+    }
+}
+int
+nft_btree_insert(nft_btree_h h, void  *key, void  *data)
+{
+    int         result = 0;
+    nft_btree * btree  = nft_btree_lookup(h);
+    if (btree) {
+        result = btree_insert(btree, key, data);
+        nft_btree_discard(btree);
+    }
+    return result;
+}
+int
+nft_btree_replace(nft_btree_h h, void  *key, void  **data)
+{
+    int         result = 0;
+    nft_btree * btree  = nft_btree_lookup(h);
+    if (btree) {
+        result = btree_replace(btree, key, data);
+        nft_btree_discard(btree);
+    }
+    return result;
+}
+int
+nft_btree_delete(nft_btree_h h, void  *key, void **data)
+{
+    int         result = 0;
+    nft_btree * btree  = nft_btree_lookup(h);
+    if (btree) {
+        result = btree_delete(btree, key, data);
+        nft_btree_discard(btree);
+    }
+    return result;
+}
+int
+nft_btree_search(nft_btree_h h, void  *key, void **data)
+{
+    int         result = 0;
+    nft_btree * btree  = nft_btree_lookup(h);
+    if (btree) {
+        result = btree_search(btree, key, data);
+        nft_btree_discard(btree);
+    }
+    return result;
+}
+int
+nft_btree_walk_first(nft_btree_h h, void **key, void **data)
+{
+    int         result = 0;
+    nft_btree * btree  = nft_btree_lookup(h);
+    if (btree) {
+        result = btree_walk_first(btree, key, data);
+        nft_btree_discard(btree);
+    }
+    return result;
+}
+int
+nft_btree_walk_next(nft_btree_h h, void **key, void **data)
+{
+    int         result = 0;
+    nft_btree * btree  = nft_btree_lookup(h);
+    if (btree) {
+        result = btree_walk_next(btree, key, data);
+        nft_btree_discard(btree);
+    }
+    return result;
+}
+int
+nft_btree_walk_first_r(nft_btree_h h, void **key, void **data, void **walk)
+{
+    int         result = 0;
+    nft_btree * btree  = nft_btree_lookup(h);
+    if (btree) {
+        result = btree_walk_first_r(btree, key, data, walk);
+        nft_btree_discard(btree);
+    }
+    return result;
+}
+int
+nft_btree_walk_next_r(nft_btree_h h, void **key, void **data, void **walk)
+{
+    int         result = 0;
+    nft_btree * btree  = nft_btree_lookup(h);
+    if (btree) {
+        result = btree_walk_next_r(btree, key, data, walk);
+        nft_btree_discard(btree);
+    }
+    return result;
+}
+int
+nft_btree_apply(nft_btree_h h, BTREE_APPLY apply, void * arg)
+{
+    int         result = 0;
+    nft_btree * btree  = nft_btree_lookup(h);
+    if (btree) {
+        result = btree_apply(btree, apply, arg);
+        nft_btree_discard(btree);
+    }
+    return result;
+}
+int
+nft_btree_validate(nft_btree_h h)
+{
+    int         result = 0;
+    nft_btree * btree  = nft_btree_lookup(h);
+    if (btree) {
+        result = btree_validate(btree);
+        nft_btree_discard(btree);
+    }
+    return result;
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/*******                                                                *******/
+/*******                BTREE PACKAGE UNIT TEST                         *******/
+/*******                                                                *******/
+/******************************************************************************/
+/******************************************************************************/
+#ifdef MAIN
+#ifdef NDEBUG
+#undef NDEBUG  // Assertions must be active in test code.
+#endif
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nft_gettime.h>
+#include <nft_rbtree.h>
+#include <nft_sack.h>
+
+static void
+test_basic(void)
+{
+    printf("\nbtree: testing basic operations: ");
+
+    int    testn    = 20;
+    char * test[20] = { "a", "b", "c", "d", "e", "f", "g", "h", "i", "j",
+                        "k", "l", "m", "n", "o", "p", "q", "r", "s", "t" };
+    void * key, * data;
+    nft_btree * t = btree_new(0, btree_compare_strings);
+
+    btree_locking(t, 1);    // Enable locking for thread-safety
+
+    for (int i = 0; i < 10; i++)
+        btree_insert(t, test[i], test[i]);
+    assert(btree_validate(t));
+
+    for (int i = 0; i < 10; i++) {
+        assert(btree_search(t, test[i], &data));
+        assert(data == test[i]);
+    }
+
+    for (int i = 10; i < testn; i++) {
+        // First, insert a copy
+        void * copy = strdup(test[i]);
+        assert(1 == btree_replace(t, copy, &copy));
+
+        // Next, replace the copy with the original.
+        void * data = test[i];
+        assert(2 == btree_replace(t, data, &data));
+        assert(data == copy);
+        free(copy);
+    }
+    assert(btree_validate(t));
+
+    for (int i = 0, result = btree_walk_first(t, &key, &data);
+         result;
+         i++,       result = btree_walk_next (t, &key, &data))
+    {
+        assert(key  == test[i]);
+        assert(data == test[i]);
+    }
+
+    int num = btree_count(t);
+    for (int i = 0; i < num; i++) {
+        assert(btree_delete(t, test[i], (void**) &data));
+        assert(data == test[i]);
+        assert(btree_validate(t));
+    }
+    assert(btree_count(t) == 0);
+
+    {   /* This loop randomly inserts and deletes keys, while running the validator.
+         */
+        void * lastkey = NULL;
+        int limit = 100000;
+        int j     = 0;
+
+        srand48(time(0));       /* seed the random number generator */
+
+        btree_walk_first(t, &lastkey, NULL);
+
+        for (int i = 0; i < limit; i++)
+        {
+            assert(btree_count(t) == j);
+
+            int slot = lrand48() % testn;
+
+            if (btree_search(t, test[slot], &data)) {
+                btree_delete(t, test[slot], 0);
+                assert( data  == test[slot] );
+                j--;
+            }
+            else {
+                btree_insert(t, test[slot], test[slot]);
+                j++;
+            }
+            assert(btree_validate(t));
+
+            /* To increase stress, do a walk while everything else is going on.
+             */
+            if (btree_walk_next(t, &key, NULL) == 0)
+                btree_walk_first(t, &lastkey, NULL);
+            else {
+                assert(strcmp((char *) lastkey, (char *) key) < 0);
+                lastkey = key;
+            }
+        }
+    }
+    int result = nft_btree_discard(t);
+    assert(0 == result);
+
+    printf("Passed!\n");
+}
+
+/* test_duplicates
+ *
+ * Insert many duplicates of a few keys, so that they straddle separators,
+ * and verify that search, walk and delete find all of them.
+ */
+static void
+test_duplicates(void)
+{
+    printf("btree: testing duplicate keys: ");
+
+    nft_btree * t = btree_new(0, btree_compare_pointers);
+    intptr_t    n = 1000;
+
+    for (intptr_t i = 0; i < n; i++)
+        assert(btree_insert(t, (void *)(i % 3), (void *) i));
+    assert(btree_validate(t));
+    assert(btree_count(t) == n);
+
+    // Duplicates are walked in the order they were inserted.
+    void   * key, * data, * walk, * prevkey = NULL;
+    intptr_t prev = -1, i = 0;
+    for (int r = btree_walk_first_r(t, &key, &data, &walk); r; r = btree_walk_next_r(t, &key, &data, &walk), i++) {
+        if (key != prevkey) prev = -1;
+        assert((intptr_t) data > prev);
+        prev    = (intptr_t) data;
+        prevkey = key;
+    }
+    assert(i == n);
+
+    // Delete the duplicates in the order they were inserted.
+    for (intptr_t i = 0; i < n; i++) {
+        assert(btree_search(t, (void *)(i % 3), NULL));
+        assert(btree_delete(t, (void *)(i % 3), &data));
+        assert((intptr_t) data == i);
+        if (i % 97 == 0) assert(btree_validate(t));
+    }
+    assert(btree_count(t) == 0);
+    assert(!btree_search(t, (void *) 0, NULL));
+    assert(btree_validate(t));
+    assert(0 == btree_free(t));
+
+    printf("Passed!\n");
+}
+
+static long
+strcmp_duplex(char *key1, char *key2, char *tok1, char *tok2)
+{
+    int res = strcmp(key1, key2);
+    if (res == 0)
+        res = strcmp(tok1, tok2);
+    return res;
+}
+
+static void
+test_duplex_keys(void)
+{
+    printf("btree: testing duplex comparator: ");
+
+    nft_btree * u = btree_create(nft_btree_class, sizeof(nft_btree), 10, strcmp_duplex);
+
+    char * test[10] = { "one", "two", "three", "four", "five", "six", "seven", "eight", "nine", "ten" };
+    for (int i = 0; i < 10; i++)
+        btree_insert(u, "bob", test[i]);
+    assert(btree_validate(u));
+
+    for (int i = 0; i < 10; i++) {
+        void * data = test[i];
+        assert(btree_search(u, "bob", &data));
+        assert(data == test[i]);
+    }
+    for (int i = 0; i < 10; i += 2) {
+        void * data = test[i];
+        assert(btree_delete(u, "bob", &data));
+        assert(data == test[i]);
+        data = test[i];
+        assert(!btree_search(u, "bob", &data));
+    }
+    assert(btree_validate(u));
+    assert(btree_count(u) == 5);
+
+    int result = nft_btree_discard(u);
+    assert(0 == result);
+
+    printf("Passed!\n");
+}
+
+/* test_handle_api
+ *
+ * Exercise the handle-based wrappers.
+ */
+static void
+test_handle_api(void)
+{
+    printf("btree: testing the handle-based API: ");
+
+    nft_btree_h h = nft_btree_new(0, btree_compare_pointers);
+    assert(h);
+    for (intptr_t i = 1000; i > 0; i--)
+        assert(nft_btree_insert(h, (void *) i, (void *) -i));
+    assert(nft_btree_count(h) == 1000);
+    assert(nft_btree_validate(h));
+
+    // Note that btree_compare_pointers sorts in descending order.
+    void   * key, * data, * walk;
+    intptr_t i = 1000;
+    for (int r = nft_btree_walk_first(h, &key, &data); r; r = nft_btree_walk_next(h, &key, &data), i--)
+        assert((intptr_t) key == i && (intptr_t) data == -i);
+    assert(i == 0);
+    i = 1000;
+    for (int r = nft_btree_walk_first_r(h, &key, &data, &walk); r; r = nft_btree_walk_next_r(h, &key, &data, &walk), i--)
+        assert((intptr_t) key == i);
+    assert(i == 0);
+
+    data = (void *) 7;
+    assert(2 == nft_btree_replace(h, (void *) 500, &data));
+    assert(data == (void *) -500);
+    assert(nft_btree_search(h, (void *) 500, &data) && data == (void *) 7);
+    assert(nft_btree_delete(h, (void *) 500, &data) && data == (void *) 7);
+    assert(!nft_btree_search(h, (void *) 500, NULL));
+    assert(nft_btree_count(h) == 999);
+
+    assert(0 == nft_btree_free(h));
+    assert(EINVAL == nft_btree_free(h));
+    assert(!nft_btree_insert(h, NULL, NULL));
+
+    printf("Passed!\n");
+}
+
+/*
+ * Store a set of strings that we will use to test this package.
+ */
+#define MAXKEYS 500000
+static char  * keys[MAXKEYS];
+static int     nkeys = 0;
+
+// Read strings from stdin and store them in keys[].
+int read_words(sack_t sack, int limit) {
+    int i = 0;
+    for (i = 0; i < limit && i < MAXKEYS; i++) {
+        char * line = sack_stralloc(sack, 255);
+
+        if (fgets(line, 256, stdin)) {
+            int len = strlen(line);
+            // Trim any trailing linefeed.
+            if (line[len-1] == '\n') {
+                line[len-1]  = '\0';
+                len -= 1;
+            }
+            keys[i] = sack_realloc(sack, line, len + 1);
+        }
+        else {
+            sack_realloc(sack, line, 0);
+            break;
+        }
+    }
+    return i;
+}
+
+/* Timing stuff.
+ */
+struct timespec mark, done;
+#define MARK    mark = nft_gettime()
+#define TIME    done = nft_gettime()
+#define ELAPSED 0.000000001 * nft_timespec_comp(done, mark)
+
+/* The benchmark runs the same operations on an rbtree and a btree,
+ * through these function pointers.
+ */
+typedef struct bench_ops
+{
+    const char * name;
+    void *    (* new)   (int, void *);
+    int       (* insert)(void *, void *, void *);
+    int       (* search)(void *, void *, void **);
+    int       (* delete)(void *, void *, void **);
+    int       (* first) (void *, void **, void **, void **);
+    int       (* next)  (void *, void **, void **, void **);
+    int       (* free)  (void *);
+} bench_ops;
+
+static const bench_ops Rbtree = {
+    "rbtree", (void *) rbtree_new, (void *) rbtree_insert, (void *) rbtree_search, (void *) rbtree_delete,
+    (void *) rbtree_walk_first_r, (void *) rbtree_walk_next_r, (void *) rbtree_free
+};
+static const bench_ops Btree = {
+    "btree",  (void *) btree_new,  (void *) btree_insert,  (void *) btree_search,  (void *) btree_delete,
+    (void *) btree_walk_first_r,  (void *) btree_walk_next_r,  (void *) btree_free
+};
+
+static void
+bench_tree(const bench_ops * ops, void * compare, void ** items, int n)
+{
+    void * t = ops->new(0, compare);
+    void * key, * data, * walk;
+    double insert, walk_time, search, delete;
+    int    i;
+
+    MARK;
+    for (i = 0; i < n; i++)
+        ops->insert(t, items[i], items[i]);
+    TIME; insert = ELAPSED;
+
+    // The walk continues only if first() found a pair.
+    MARK;
+    for (i = 0; i < n && (i ? ops->next : ops->first)(t, &key, &data, &walk); i++);
+    TIME; walk_time = ELAPSED;
+    assert(i == n && !(n && ops->next(t, &key, &data, &walk)));
+
+    MARK;
+    for (i = 0; i < n; i++)
+        if (!ops->search(t, items[i], &data)) assert(!"search: key not found");
+    TIME; search = ELAPSED;
+
+    MARK;
+    for (i = 0; i < n; i++)
+        if (!ops->delete(t, items[i], &data)) assert(!"delete: key not found");
+    TIME; delete = ELAPSED;
+
+    printf("%-8s insert %.3f  walk %.3f  search %.3f  delete %.3f\n",
+           ops->name, insert, walk_time, search, delete);
+    assert(0 == ops->free(t));
+}
+
+/* bench_compare
+ *
+ * Compare the btree with the rbtree, using the words from stdin as string
+ * keys, and then a larger set of random integer keys.
+ */
+static void
+bench_compare(int nints)
+{
+    // Skip the string keys if stdin was empty.
+    if (nkeys > 0) {
+        printf("\nbtree: comparing with rbtree, %d string keys\n", nkeys);
+        bench_tree(&Rbtree, rbtree_compare_strings, (void **) keys, nkeys);
+        bench_tree(&Btree,  btree_compare_strings,  (void **) keys, nkeys);
+    }
+
+    void ** ints = malloc(nints * sizeof(void *));
+    for (int i = 0; i < nints; i++)
+        ints[i] = (void *)(intptr_t)(lrand48() + 1);
+
+    printf("\nbtree: comparing with rbtree, %d integer keys\n", nints);
+    bench_tree(&Rbtree, rbtree_compare_pointers, ints, nints);
+    bench_tree(&Btree,  btree_compare_pointers,  ints, nints);
+    free(ints);
+}
+
+int
+main(int argc, char * argv[])
+{
+    /* Set limit on keys.
+     */
+    int limit;
+    limit  = ((argc > 1) ? atoi(argv[1]) : MAXKEYS);
+    limit  = ((limit > MAXKEYS) ? MAXKEYS : limit);
+
+    /* Run some basic smoke tests.
+     */
+    test_basic();
+    test_duplicates();
+    test_duplex_keys();
+    test_handle_api();
+
+    /* Insert strings into key table, and compare with the rbtree.
+     */
+    sack_t sack = sack_create(16344);
+    nkeys       = read_words(sack, limit);
+    bench_compare(1000000);
+    sack_destroy(sack);
+
+    fprintf(stderr, "nft_btree: All tests passed.\n");
+    exit(0);
+}
+
+#endif
@@ -0,0 +1,503 @@
+/*******************************************************************************
+ * (C) Xenadyne Inc. 2002-2013.  All rights reserved.
+ *
+ * Permission to use, copy, modify and distribute this software for
+ * any purpose and without fee is hereby granted, provided that the
+ * above copyright notice appears in all copies.
+ *
+ * XENADYNE INC DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+ * IN NO EVENT SHALL XENADYNE BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM THE
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * File: nft_future.c
+ *
+ * Description:	Futures for work submitted to a thread pool.
+ *
+ * The APIs are documented in nft_future.h. The unit test at the bottom
+ * of this file (see #ifdef MAIN) demonstrates how to use this package.
+ *
+ * Each future is an nft_core object. The caller holds one reference,
+ * returned from nft_pool_submit or nft_future_then, and the pending work
+ * item holds another, so that the future survives until the work is done,
+ * even if the caller frees it first. A continuation that is waiting for
+ * its predecessor is held on the predecessor's "then" list, and the list
+ * holds the continuation's work-item reference until it is submitted.
+ *
+ *******************************************************************************
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <nft_future.h>
+
+NFT_DEFINE_WRAPPERS(nft_future,)
+
+static void future_dispatch(nft_future * future, void * input, int error);
+
+/*----------------------------------------------------------------------
+ *
+ * nft_future_create()
+ *
+ *----------------------------------------------------------------------
+ */
+nft_future *
+nft_future_create(const char * class, size_t size, nft_pool_h pool)
+{
+    nft_future * future = nft_future_cast(nft_core_create(class, size));
+    if (!future) return NULL;
+    future->core.destroy = nft_future_destroy;
+
+    int rc = pthread_mutex_init(&future->mutex, NULL); assert(rc == 0);
+    rc     = pthread_cond_init (&future->cond,  NULL); assert(rc == 0);
+
+    future->done     = 0;
+    future->error    = 0;
+    future->result   = NULL;
+    future->pool     = pool;
+    future->function = NULL;
+    future->chained  = NULL;
+    future->argument = NULL;
+    future->input    = NULL;
+    future->next     = NULL;
+    future->then     = NULL;
+
+    return future;
+}
+
+/*----------------------------------------------------------------------
+ *
+ * nft_future_destroy()
+ *
+ *----------------------------------------------------------------------
+ */
+void
+nft_future_destroy(nft_core * p)
+{
+    nft_future * future = nft_future_cast(p);
+    if (!future) return;
+
+    // The pending work item holds a reference until the future completes,
+    // and completion empties the then list, so it must be empty here.
+    assert(future->then == NULL);
+
+    int rc = pthread_mutex_destroy(&future->mutex); assert(rc == 0);
+    rc     = pthread_cond_destroy (&future->cond);  assert(rc == 0);
+
+    nft_core_destroy(p);
+}
+
+/*----------------------------------------------------------------------
+ *
+ * future_finish()
+ *
+ * Record the result, waken waiting threads, and dispatch continuations.
+ *----------------------------------------------------------------------
+ */
+static void
+future_finish(nft_future * future, void * result, int error)
+{
+    int rc = pthread_mutex_lock(&future->mutex); assert(rc == 0);
+    future->result = result;
+    future->error  = error;
+    future->done   = 1;
+    nft_future * then = future->then;
+    future->then   = NULL;
+    rc = pthread_cond_broadcast(&future->cond);   assert(rc == 0);
+    rc = pthread_mutex_unlock(&future->mutex);    assert(rc == 0);
+
+    // Dispatch outside the mutex, since a continuation may run inline.
+    while (then) {
+	nft_future * next = then->next;
+	then->next = NULL;
+	future_dispatch(then, result, error);
+	then = next;
+    }
+}
+
+/*----------------------------------------------------------------------
+ *
+ * future_run()	- The pool work function.
+ *
+ * Invokes the user's function, completes the future, and releases
+ * the reference that was held by the work item.
+ *----------------------------------------------------------------------
+ */
+static void
+future_run(void * arg)
+{
+    nft_future * future = arg;
+    void       * result;
+
+    if (future->chained)
+	result = future->chained(future->input, future->argument);
+    else
+	result = future->function(future->argument);
+
+    future_finish(future, result, 0);
+    nft_future_discard(future);
+}
+
+/*----------------------------------------------------------------------
+ *
+ * future_dispatch()
+ *
+ * Submit a continuation whose predecessor has completed. The caller
+ * passes the continuation's work-item reference, which is released
+ * by future_run, or here if the continuation is not submitted.
+ *----------------------------------------------------------------------
+ */
+static void
+future_dispatch(nft_future * future, void * input, int error)
+{
+    // Propagate the predecessor's error without running the continuation.
+    if (error) {
+	future_finish(future, NULL, error);
+	nft_future_discard(future);
+	return;
+    }
+    future->input = input;
+
+    // Don't block the completing thread when the pool's queue is full,
+    // since that thread may be one of the pool's own workers.
+    int rc = nft_pool_add_wait(future->pool, 0, future_run, future);
+    if (rc == ETIMEDOUT)
+	future_run(future);
+    else if (rc != 0) {
+	future_finish(future, NULL, rc);
+	nft_future_discard(future);
+    }
+}
+
+/*----------------------------------------------------------------------
+ *
+ * nft_pool_submit()
+ * nft_pool_submit_wait()
+ *
+ *----------------------------------------------------------------------
+ */
+nft_future_h
+nft_pool_submit(nft_pool_h pool, void * (*function)(void *), void * argument)
+{
+    return nft_pool_submit_wait(pool, -1, function, argument);
+}
+
+nft_future_h
+nft_pool_submit_wait(nft_pool_h pool, int timeout, void * (*function)(void *), void * argument)
+{
+    nft_future * future = nft_future_create(nft_future_class, sizeof(nft_future), pool);
+    if (!future) return NULL;
+    future->function = function;
+    future->argument = argument;
+
+    // Take a second reference for the work item.
+    nft_future_h handle = nft_future_handle(future);
+    nft_future * ref    = nft_future_lookup(handle); assert(ref == future);
+
+    int rc = nft_pool_add_wait(pool, timeout, future_run, ref);
+    if (rc != 0) {
+	future_finish(ref, NULL, rc);
+	nft_future_discard(ref);
+    }
+    return handle;
+}
+
+/*----------------------------------------------------------------------
+ *
+ * nft_future_then()
+ *
+ *----------------------------------------------------------------------
+ */
+nft_future_h
+nft_future_then(nft_future_h handle, void * (*function)(void *, void *), void * argument)
+{
+    nft_future * future = nft_future_lookup(handle);
+    if (!future) return NULL;
+
+    nft_future * then = nft_future_create(nft_future_class, sizeof(nft_future), future->pool);
+    if (!then) {
+	nft_future_discard(future);
+	return NULL;
+    }
+    then->chained  = function;
+    then->argument = argument;
+
+    // Take a second reference for the then list and the work item.
+    nft_future_h result = nft_future_handle(then);
+    nft_future * ref    = nft_future_lookup(result); assert(ref == then);
+
+    // If the future is still pending, the continuation waits on its list.
+    int rc = pthread_mutex_lock(&future->mutex); assert(rc == 0);
+    int done = future->done;
+    if (!done) {
+	ref->next    = future->then;
+	future->then = ref;
+    }
+    rc = pthread_mutex_unlock(&future->mutex); assert(rc == 0);
+
+    // The result and error are immutable once the future is done.
+    if (done) future_dispatch(ref, future->result, future->error);
+
+    nft_future_discard(future);
+    return result;
+}
+
+/*----------------------------------------------------------------------
+ *
+ * future_cleanup() 	- cancellation cleanup handler.
+ *
+ * This handler is called when a thread is cancelled
+ * while blocked in nft_future_get().
+ *----------------------------------------------------------------------
+ */
+static void
+future_cleanup(void * arg)
+{
+    nft_future * future = arg;
+    pthread_mutex_unlock(&future->mutex);
+    nft_future_discard(future);
+}
+
+/*----------------------------------------------------------------------
+ *
+ * nft_future_get()
+ *
+ *----------------------------------------------------------------------
+ */
+int
+nft_future_get(nft_future_h handle, int timeout, void ** result)
+{
+    nft_future * future = nft_future_lookup(handle);
+    if (!future) return EINVAL;
+
+    int rc = pthread_mutex_lock(&future->mutex); assert(rc == 0);
+    int error = 0;
+
+    // Push a cancellation cleanup handler in case we get cancelled.
+    pthread_cleanup_push(future_cleanup, future);
+
+    // If timeout is positive, do a timed wait, else wait indefinitely.
+    if (timeout > 0) {
+	struct timespec abstime = nft_gettime();
+	abstime.tv_sec += timeout;
+
+	// pthread_cond_timed_wait returns ETIMEDOUT on timeout.
+	while (!future->done)
+	    if ((error = pthread_cond_timedwait(&future->cond, &future->mutex, &abstime)) != 0)
+		break;
+	assert(error == 0 || error == ETIMEDOUT);
+    }
+    else if (timeout < 0) {
+	while (!future->done)
+	    if ((error = pthread_cond_wait(&future->cond, &future->mutex)) != 0)
+		break;
+	assert(error == 0);
+    }
+    pthread_cleanup_pop(0); // Pop cleanup without executing it.
+
+    if (future->done) {
+	if (result) *result = future->result;
+	error = future->error;
+    }
+    else error = ETIMEDOUT;
+
+    rc = pthread_mutex_unlock(&future->mutex); assert(rc == 0);
+    nft_future_discard(future);
+    return error;
+}
+
+/*----------------------------------------------------------------------
+ *
+ * nft_future_poll()
+ *
+ *----------------------------------------------------------------------
+ */
+int
+nft_future_poll(nft_future_h handle, void ** result)
+{
+    return nft_future_get(handle, 0, result);
+}
+
+/*----------------------------------------------------------------------
+ *
+ * nft_future_free()
+ *
+ *----------------------------------------------------------------------
+ */
+int
+nft_future_free(nft_future_h handle)
+{
+    int result = EINVAL;
+    nft_future * future = nft_future_lookup(handle);
+    if (future)
+    {
+        // Double-discard, to release the reference returned from nft_future_create().
+        if ((result = nft_future_discard(future)) == 0)
+             result = nft_future_discard(future);
+
+        // This assert should never fail.
+        assert(result == 0);
+    }
+    return result;
+}
+
+
+/******************************************************************************/
+/******************************************************************************/
+/*******								*******/
+/*******		FUTURE PACKAGE TEST DRIVER			*******/
+/*******								*******/
+/******************************************************************************/
+/******************************************************************************/
+#ifdef MAIN
+#ifdef NDEBUG
+#undef NDEBUG  // Enable asserts for test code.
+#endif
+#include <assert.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+static void *
+square(void * arg)
+{
+    long n = (long) arg;
+    return (void *) (n * n);
+}
+
+static void *
+nap(void * arg)
+{
+    sleep((long) arg);
+    return arg;
+}
+
+static void *
+add(void * result, void * arg)
+{
+    return (void *) ((long) result + (long) arg);
+}
+
+static void *
+times(void * result, void * arg)
+{
+    return (void *) ((long) result * (long) arg);
+}
+
+// Returns the number of live future objects.
+static int
+count_futures(void)
+{
+    int            n = 0;
+    nft_handle * list = nft_core_gather(nft_future_class);
+    if (list) {
+	while (list[n]) n++;
+	free(list);
+    }
+    return n;
+}
+
+int
+main(int argc, char *argv[])
+{
+    void * result;
+    int    rc;
+
+    nft_pool_h pool = nft_pool_new(0, 4, 0);
+    assert(pool);
+
+    // Test 1: Submit a function and wait for its result.
+    nft_future_h f = nft_pool_submit(pool, square, (void *) 7L);
+    assert(f);
+    rc = nft_future_get(f, -1, &result);
+    assert(rc == 0 && (long) result == 49);
+    rc = nft_future_free(f);	  assert(rc == 0);
+    rc = nft_future_free(NULL);	  assert(rc == EINVAL);
+    fprintf(stderr, "Test 1: submit/get passed.\n");
+
+    // Test 2: poll and get with a timeout on a slow function.
+    f = nft_pool_submit(pool, nap, (void *) 2L);
+    rc = nft_future_poll(f, &result);	assert(rc == ETIMEDOUT);
+    rc = nft_future_get(f, 1, &result);	assert(rc == ETIMEDOUT);
+    rc = nft_future_get(f, 5, &result);	assert(rc == 0 && (long) result == 2);
+    rc = nft_future_poll(f, NULL);	assert(rc == 0);
+    rc = nft_future_free(f);		assert(rc == 0);
+    fprintf(stderr, "Test 2: poll/timeout passed.\n");
+
+    // Test 3: Chain continuations onto a pending future: (1 + 1) * 2 + 1
+    f = nft_pool_submit(pool, nap, (void *) 1L);
+    nft_future_h g = nft_future_then(f, add,   (void *) 1L);
+    nft_future_h h = nft_future_then(g, times, (void *) 2L);
+    nft_future_h i = nft_future_then(h, add,   (void *) 1L);
+    assert(g && h && i);
+    rc = nft_future_free(g); assert(rc == 0);	// Free before completion.
+    rc = nft_future_get(i, -1, &result);
+    assert(rc == 0 && (long) result == 5);
+
+    // Chain onto a future that has already completed.
+    nft_future_h j = nft_future_then(h, times, (void *) 10L);
+    rc = nft_future_get(j, -1, &result);
+    assert(rc == 0 && (long) result == 40);
+    rc = nft_future_free(f); assert(rc == 0);
+    rc = nft_future_free(h); assert(rc == 0);
+    rc = nft_future_free(i); assert(rc == 0);
+    rc = nft_future_free(j); assert(rc == 0);
+    assert(nft_future_then(NULL, add, NULL) == NULL);
+    fprintf(stderr, "Test 3: continuations passed.\n");
+
+    // Test 4: Many futures in flight at once.
+    nft_future_h submitted[1000], many[1000];
+    for (long k = 0; k < 1000; k++) {
+	submitted[k] = nft_pool_submit(pool, square, (void *) k);
+	many[k]      = nft_future_then(submitted[k], add, (void *) k);
+	assert(submitted[k] && many[k]);
+    }
+    for (long k = 0; k < 1000; k++) {
+	rc = nft_future_get(many[k], -1, &result);
+	assert(rc == 0 && (long) result == k * k + k);
+	rc = nft_future_get(submitted[k], -1, &result);
+	assert(rc == 0 && (long) result == k * k);
+	rc = nft_future_free(submitted[k]); assert(rc == 0);
+	rc = nft_future_free(many[k]);      assert(rc == 0);
+    }
+    // The pool threads may hold references until the pool is shut down,
+    // so Test 6 checks that no futures leak, after the shutdown.
+    fprintf(stderr, "Test 4: 1000 futures passed.\n");
+
+    // Test 5: Submission with a timeout, while the pool's queue is full.
+    nft_pool_h full = nft_pool_new(1, 1, 0);
+    f = nft_pool_submit(full, nap, (void *) 1L);
+    usleep(100000);					// Let the thread take f.
+    g = nft_pool_submit(full, square, (void *) 2L);	// Fill the queue.
+    h = nft_pool_submit_wait(full, 0, square, (void *) 3L);
+    assert(f && g && h);
+    rc = nft_future_get(h, -1, &result); assert(rc == ETIMEDOUT);
+    rc = nft_future_get(g, -1, &result); assert(rc == 0 && (long) result == 4);
+    rc = nft_future_free(f); assert(rc == 0);
+    rc = nft_future_free(g); assert(rc == 0);
+    rc = nft_future_free(h); assert(rc == 0);
+    rc = nft_pool_shutdown(full, -1); assert(rc == 0);
+    fprintf(stderr, "Test 5: submit with a timeout passed.\n");
+
+    // Test 6: Submission to a pool that has been shut down.
+    rc = nft_pool_shutdown(pool, -1); assert(rc == 0);
+    f = nft_pool_submit(pool, square, (void *) 3L);
+    rc = nft_future_get(f, -1, &result);
+    assert(rc == EINVAL || rc == ESHUTDOWN);
+    g = nft_future_then(f, add, (void *) 1L);
+    rc = nft_future_get(g, -1, &result);
+    assert(rc == EINVAL || rc == ESHUTDOWN);
+    rc = nft_future_free(f); assert(rc == 0);
+    rc = nft_future_free(g); assert(rc == 0);
+    assert(count_futures() == 0);
+    fprintf(stderr, "Test 6: shutdown passed.\n");
+
+    fprintf(stderr, "nft_future: All tests passed.\n");
+    exit(0);
+}
+#endif // MAIN
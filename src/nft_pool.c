@@ -27,9 +27,15 @@
  *
  *******************************************************************************
  */
+#ifdef __linux__
+#define _GNU_SOURCE	// for sched_getcpu and pthread_setaffinity_np
+#include <sched.h>
+#endif
 #include <assert.h>
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <nft_pool.h>
 
@@ -40,15 +46,289 @@ typedef struct work_item	// Work items are queued by the pool
 {
     void (*function)(void *);
     void  *argument;
+    int    priority;		// Priority class.
+    int    deadline_set;	// True if the caller gave a deadline.
+    unsigned long   sequence;	// Submission order, to break deadline ties.
+    struct timespec deadline;	// Begin the item by this time.
+    struct timespec queued;	// Monotonic time the item was submitted.
 } work_item;
 
 // The nft_pool_create stack_size parameter is forced to this minimum.
 #define  NFT_POOL_MIN_STACK_SIZE 16*1024
 
+// Idle pool threads in excess of min_threads exit after this many seconds.
+#ifndef  NFT_POOL_IDLE_TIMEOUT
+#define  NFT_POOL_IDLE_TIMEOUT 1
+#endif
+
+// A lower priority class that is passed over this many times is served next.
+#ifndef  NFT_POOL_AGING
+#define  NFT_POOL_AGING 8
+#endif
+
+// Pool threads update their own counters, while nft_pool_stats reads them.
+#ifdef __GNUC__
+#define STAT_ADD(x, n)	__atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+#define STAT_GET(x)	__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#else
+#define STAT_ADD(x, n)	((x) += (n))
+#define STAT_GET(x)	(x)
+#endif
+
 // When the queue has been shutdown, the shutdown flag is true.
 #define SHUTDOWN(q) (0 != pool->queue.shutdown)
 
 
+/*------------------------------------------------------------------------------
+ * Priority classes
+ *
+ * The nft_queue provides the queue limit, blocking and shutdown behavior,
+ * but it holds only a NULL placeholder for each work item. The items are
+ * held in the heap of their priority class, and when a pool thread dequeues
+ * a placeholder, it runs the most urgent item from the heaps. Space in the
+ * heap is reserved before the placeholder is enqueued, so that adding the
+ * item to the heap cannot fail once the placeholder is in the queue.
+ *------------------------------------------------------------------------------
+ */
+static int
+item_before(work_item * a, work_item * b)
+{
+    if (a->deadline.tv_sec  != b->deadline.tv_sec)  return a->deadline.tv_sec  < b->deadline.tv_sec;
+    if (a->deadline.tv_nsec != b->deadline.tv_nsec) return a->deadline.tv_nsec < b->deadline.tv_nsec;
+    return a->sequence < b->sequence;
+}
+
+// Reserve heap space for one more item. Returns zero, or ENOMEM.
+static int
+prio_reserve(nft_pool_prio * prio)
+{
+    if (prio->count + prio->reserved == prio->size) {
+	int          size = prio->size ? prio->size * 2 : 16;
+	work_item ** heap = realloc(prio->heap, size * sizeof(work_item *));
+	if (!heap) return ENOMEM;
+	prio->heap = heap;
+	prio->size = size;
+    }
+    prio->reserved++;
+    return 0;
+}
+
+// Add the item to the class heap, using space that was reserved.
+static void
+prio_push(nft_pool_prio * prio, work_item * item)
+{
+    assert(prio->reserved > 0 && prio->count < prio->size);
+    prio->reserved--;
+    int i = prio->count++;
+    while (i > 0 && item_before(item, prio->heap[(i - 1) / 2])) {
+	prio->heap[i] = prio->heap[(i - 1) / 2];
+	i = (i - 1) / 2;
+    }
+    prio->heap[i] = item;
+}
+
+// Remove and return the earliest item in the class heap, which must be nonempty.
+static work_item *
+prio_pop(nft_pool_prio * prio)
+{
+    assert(prio->count > 0);
+    work_item * top  = prio->heap[0];
+    work_item * last = prio->heap[--prio->count];
+    int i = 0, child;
+    while ((child = 2 * i + 1) < prio->count) {
+	if (child + 1 < prio->count && item_before(prio->heap[child + 1], prio->heap[child]))
+	    child++;
+	if (!item_before(prio->heap[child], last)) break;
+	prio->heap[i] = prio->heap[child];
+	i = child;
+    }
+    prio->heap[i] = last;
+    return top;
+}
+
+/*------------------------------------------------------------------------------
+ * pool_next	- Select the next work item to run. The caller must hold the mutex.
+ *
+ * Take the highest nonempty class, unless a lower class has aged,
+ * and count a skip against each nonempty class that was passed over.
+ *------------------------------------------------------------------------------
+ */
+static work_item *
+pool_next(nft_pool * pool)
+{
+    int p, chosen = -1;
+    for (p = NFT_POOL_PRIORITIES - 1; p > 0; p--)
+	if (pool->prio[p].count > 0 && pool->prio[p].skipped >= NFT_POOL_AGING)
+	    chosen = p;
+    if (chosen < 0)
+	for (p = 0; p < NFT_POOL_PRIORITIES; p++)
+	    if (pool->prio[p].count > 0) { chosen = p; break; }
+    assert(chosen >= 0);
+
+    for (p = 0; p < NFT_POOL_PRIORITIES; p++)
+	if (p != chosen && pool->prio[p].count > 0) pool->prio[p].skipped++;
+    pool->prio[chosen].skipped = 0;
+
+    return prio_pop(&pool->prio[chosen]);
+}
+
+
+
+/*------------------------------------------------------------------------------
+ * NUMA topology
+ *
+ * On Linux, we read the CPU list of each NUMA node from /sys, and build
+ * a table that maps each CPU to its node. Elsewhere, there is one node.
+ *------------------------------------------------------------------------------
+ */
+#define NUMA_NODE_PATH   "/sys/devices/system/node/node%d/cpulist"
+#define NUMA_ONLINE_PATH "/sys/devices/system/node/online"
+
+static pthread_once_t NumaOnce  = PTHREAD_ONCE_INIT;
+static int            NumaNodes = 1;	// Number of NUMA nodes.
+#ifdef __linux__
+static int            NumaCpus[CPU_SETSIZE]; // Maps CPU number to node.
+
+// Read a list such as "0-3,8-11" from path into list[], returning the count.
+static int
+numa_list(const char * path, int * list, int max)
+{
+    FILE * file = fopen(path, "r");
+    if (!file) return -1;
+
+    int count = 0, lo, hi;
+    while (fscanf(file, "%d", &lo) == 1) {
+	hi = lo;
+	int c = fgetc(file);
+	if (c == '-') {
+	    if (fscanf(file, "%d", &hi) != 1) break;
+	    c = fgetc(file);
+	}
+	for (int n = lo; n <= hi && count < max; n++)
+	    list[count++] = n;
+	if (c != ',') break;
+    }
+    fclose(file);
+    return count;
+}
+
+// Read the cpulist of a NUMA node into cpus[], returning the count.
+static int
+numa_cpulist(int node, int * cpus, int max)
+{
+    char  path[64];
+    snprintf(path, sizeof(path), NUMA_NODE_PATH, node);
+    return numa_list(path, cpus, max);
+}
+#endif
+
+/* Node numbers may be sparse, so we read the list of online nodes,
+ * and there are as many nodes as the highest node number plus one.
+ * Nodes that are missing from the list have no CPUs.
+ */
+static void
+numa_init(void)
+{
+#ifdef __linux__
+    int cpus[CPU_SETSIZE];
+    int online[CPU_SETSIZE];
+    int num_online = numa_list(NUMA_ONLINE_PATH, online, CPU_SETSIZE);
+
+    // Without the online list, count nodes until one is missing.
+    if (num_online < 0)
+	for (num_online = 0; num_online < CPU_SETSIZE && numa_cpulist(num_online, cpus, 0) >= 0; num_online++)
+	    online[num_online] = num_online;
+
+    for (int i = 0; i < num_online; i++) {
+	int node  = online[i];
+	int count = numa_cpulist(node, cpus, CPU_SETSIZE);
+	for (int j = 0; j < count; j++)
+	    if (cpus[j] < CPU_SETSIZE) NumaCpus[cpus[j]] = node;
+	if (node >= NumaNodes) NumaNodes = node + 1;
+    }
+#endif
+}
+
+int
+nft_pool_numa_nodes(void)
+{
+    int rc = pthread_once(&NumaOnce, numa_init); assert(rc == 0);
+    return NumaNodes;
+}
+
+int
+nft_pool_numa_node(void)
+{
+    int rc = pthread_once(&NumaOnce, numa_init); assert(rc == 0);
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    if (cpu >= 0 && cpu < CPU_SETSIZE) return NumaCpus[cpu];
+#endif
+    return 0;
+}
+
+/*------------------------------------------------------------------------------
+ * pool_thread_affinity	- Bind the calling pool thread to the pool's CPUs.
+ *
+ * The caller must hold the pool mutex. Errors are ignored, because they
+ * merely mean that the thread continues to run where it was running.
+ *------------------------------------------------------------------------------
+ */
+static void
+pool_thread_affinity(nft_pool * pool)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (pool->ncpus > 0)
+	for (int i = 0; i < pool->ncpus; i++) CPU_SET(pool->cpus[i], &set);
+    else
+	for (int i = 0; i < CPU_SETSIZE; i++) CPU_SET(i, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+/*------------------------------------------------------------------------------
+ * pool_bucket	- Return the histogram bucket for a time in nanoseconds.
+ *------------------------------------------------------------------------------
+ */
+static int
+pool_bucket(int64_t ns)
+{
+    int64_t usec   = ns / 1000;
+    int     bucket = 0;
+    while (usec > 0 && bucket < NFT_POOL_BUCKETS - 1) {
+	usec >>= 1;
+	bucket++;
+    }
+    return bucket;
+}
+
+/*------------------------------------------------------------------------------
+ * pool_retire	- Fold an exiting thread's counters into the pool totals.
+ *
+ * The caller must hold the pool mutex.
+ *------------------------------------------------------------------------------
+ */
+static void
+pool_retire(nft_pool * pool, nft_pool_worker * worker)
+{
+    nft_pool_worker ** link = &pool->workers;
+    while (*link != worker) link = &(*link)->next;
+    *link = worker->next;
+
+    int64_t life = nft_timespec_comp(nft_gettime_mono(), worker->started);
+    pool->totals.completed += worker->completed;
+    pool->totals.wait_ns   += worker->wait_ns;
+    pool->totals.busy_ns   += worker->busy_ns;
+    pool->totals.idle_ns   += (life > (int64_t) worker->busy_ns) ? life - worker->busy_ns : 0;
+    for (int i = 0; i < NFT_POOL_BUCKETS; i++) {
+	pool->totals.wait_hist[i] += worker->wait_hist[i];
+	pool->totals.run_hist[i]  += worker->run_hist[i];
+    }
+    pool->totals.retired++;
+}
+
 /*------------------------------------------------------------------------------
  * pool_thread_cleanup	- Function for use with pthread_cleanup_push/pop.
  *
@@ -59,9 +339,11 @@ typedef struct work_item	// Work items are queued by the pool
 static void
 pool_thread_cleanup(void * arg)
 {
-    nft_pool * pool = nft_pool_cast(arg); assert(pool);
+    nft_pool_worker * worker = arg;
+    nft_pool        * pool   = worker->pool;
 
     int rc = pthread_mutex_lock(&pool->queue.mutex); assert(rc == 0);
+    pool_retire(pool, worker);
 
     // If the pool is shutting down and we are the last pool thread
     // to finish, signal the thread that is waiting in nft_pool_shutdown.
@@ -88,17 +370,56 @@ nft_pool_thread(void * arg)
     nft_pool * pool = nft_pool_cast(arg);
     int rc          = pthread_mutex_lock(&pool->queue.mutex); assert(rc == 0);
 
+    // Link this thread's counters into the pool, for nft_pool_stats.
+    nft_pool_worker worker;
+    memset(&worker, 0, sizeof(worker));
+    worker.pool    = pool;
+    worker.started = nft_gettime_mono();
+    worker.next    = pool->workers;
+    pool->workers  = &worker;
+
     // Increment pool->idle_threads before we block in nft_queue_dequeue.
     // nft_pool_add has already incremented num_threads, after spawning this thread.
     pool->idle_threads++;
 
+    // Bind this thread to the pool's CPUs, and rebind whenever they change.
+    int affinity = pool->affinity;
+    if (pool->ncpus) pool_thread_affinity(pool);
+
     // nft_queue_dequeue will not block when the queue is shutting down.
     // It will continue to dequeue items, and return ESHUTDOWN when the queue is empty.
     work_item * item;
-    while ((0 == nft_queue_dequeue(&pool->queue, 1, (void**) &item)))
+    int         result;
+    while ((result = nft_queue_dequeue(&pool->queue, pool->idle_timeout, (void**) &item)) != ESHUTDOWN)
     {
+	// When the dequeue times out, retire this thread, unless it
+	// belongs to the warm core of min_threads.
+	if (result != 0) {
+	    if (pool->num_threads > pool->min_threads) break;
+	    continue;
+	}
 	pool->idle_threads--;
 
+	// The queue holds placeholders, so take the most urgent item from the heaps.
+	item = pool_next(pool);
+
+	struct timespec begin = nft_gettime_mono();
+	int64_t         wait  = nft_timespec_comp(begin, item->queued);
+	STAT_ADD(worker.wait_ns, wait);
+	STAT_ADD(worker.wait_hist[pool_bucket(wait)], 1);
+
+	nft_pool_prio * prio = &pool->prio[item->priority];
+	prio->stats.wait_total += wait / (double) NANOSEC;
+	if (wait / (double) NANOSEC > prio->stats.wait_max)
+	    prio->stats.wait_max = wait / (double) NANOSEC;
+	if (item->deadline_set && nft_timespec_comp(nft_gettime(), item->deadline) > 0)
+	    prio->stats.late++;
+
+	if (affinity != pool->affinity) {
+	    affinity  = pool->affinity;
+	    pool_thread_affinity(pool);
+	}
+
 	// We must release the mutex while the work function executes.
 	rc = pthread_mutex_unlock(&pool->queue.mutex); assert(0 == rc);
 
@@ -106,7 +427,7 @@ nft_pool_thread(void * arg)
 	 * but the work function could call pthread_exit(), so we need a cleanup
 	 * function to decrement pool->num_threads and discard the reference.
 	 */
-	pthread_cleanup_push(pool_thread_cleanup, pool);
+	pthread_cleanup_push(pool_thread_cleanup, &worker);
 
 	void (* function)(void *) = item->function;
 	void  * argument          = item->argument;
@@ -116,12 +437,21 @@ nft_pool_thread(void * arg)
 	function(argument);
 
 	pthread_cleanup_pop(0); // do not execute pool_thread_cleanup
+
+	// These counters are ours alone, so we update them without the mutex.
+	int64_t run = nft_timespec_comp(nft_gettime_mono(), begin);
+	STAT_ADD(worker.busy_ns, run);
+	STAT_ADD(worker.run_hist[pool_bucket(run)], 1);
+	STAT_ADD(worker.completed, 1);
+
 	rc = pthread_mutex_lock(&pool->queue.mutex); assert(0 == rc);
 
+	prio->stats.completed++;
 	pool->idle_threads++;
     }
     pool->idle_threads--;
     pool->num_threads--;
+    pool_retire(pool, &worker);
 
     // If the pool is shutting down and we are the last pool thread
     // to finish, signal the thread that is waiting in nft_pool_shutdown.
@@ -133,6 +463,29 @@ nft_pool_thread(void * arg)
     return NULL;
 }
 
+/*------------------------------------------------------------------------------
+ * pool_spawn	- Create a pool thread. The caller must hold the pool mutex.
+ *
+ * Returns zero on success, or a pthread_create error code.
+ *------------------------------------------------------------------------------
+ */
+static int
+pool_spawn(nft_pool * pool)
+{
+    // Create a fresh reference to the pool, which we will pass to the thread.
+    // Discard the clone reference if pthread_create fails.
+    nft_pool * clone = nft_pool_lookup(nft_pool_handle(pool)); assert(clone);
+    pthread_t  id;
+    int result = pthread_create(&id, &pool->attr, nft_pool_thread, clone);
+    if (result == 0) {
+	pool->num_threads++;
+	pool->totals.spawned++;
+    }
+    else
+	nft_pool_discard(clone);
+    return result;
+}
+
 /*------------------------------------------------------------------------------
  * nft_pool_destroy
  *
@@ -146,6 +499,10 @@ nft_pool_destroy(nft_core * p)
     nft_pool * pool = nft_pool_cast(p); assert(pool);
     if (!pool) return;
     int rc = pthread_attr_destroy(&pool->attr); assert(0 == rc);
+    free(pool->cpus);
+    free(pool->nodes);
+    for (int i = 0; i < NFT_POOL_PRIORITIES; i++)
+	free(pool->prio[i].heap);
     nft_queue_destroy(p);
 }
 
@@ -186,6 +543,18 @@ nft_pool_create(const char * class, size_t size,
     pool->max_threads  = (max_threads > 0) ? max_threads : 4 ;
     pool->num_threads  = 0;
     pool->idle_threads = 0;
+    pool->min_threads  = 0;
+    pool->idle_timeout = NFT_POOL_IDLE_TIMEOUT;
+    pool->spawn_depth  = 0;
+    pool->affinity     = 0;
+    pool->ncpus        = 0;
+    pool->cpus         = NULL;
+    pool->num_nodes    = 0;
+    pool->nodes        = NULL;
+    pool->sequence     = 0;
+    pool->workers      = NULL;
+    memset(pool->prio,    0, sizeof(pool->prio));
+    memset(&pool->totals, 0, sizeof(pool->totals));
 
     return pool;
 }
@@ -204,9 +573,136 @@ nft_pool_new(int queue_limit, int max_threads, int stack_size)
 					   queue_limit, max_threads, stack_size));
 }
 
+/*----------------------------------------------------------------------
+ * nft_pool_new_numa()
+ *
+ * Create a pool that serves as a front for one sub-pool per NUMA node.
+ * The front pool has no threads of its own - nft_pool_add_wait routes
+ * work items to the sub-pools.
+ *----------------------------------------------------------------------
+ */
+nft_pool_h
+nft_pool_new_numa(int queue_limit, int max_threads, int stack_size)
+{
+    int        num_nodes = nft_pool_numa_nodes();
+    nft_pool * pool      = nft_pool_create(nft_pool_class, sizeof(nft_pool),
+					   queue_limit, max_threads, stack_size);
+    if (!pool) return NULL;
+
+    nft_pool_h handle = nft_pool_handle(pool);
+    if (!(pool->nodes = calloc(num_nodes, sizeof(nft_pool_h)))) {
+	nft_pool_shutdown(handle, 0);
+	return NULL;
+    }
+    for (int node = 0; node < num_nodes; node++)
+    {
+	nft_pool_h sub = nft_pool_new(queue_limit, max_threads, stack_size);
+	if (!sub) break;
+	pool->nodes[pool->num_nodes++] = sub;
+#ifdef __linux__
+	int cpus[CPU_SETSIZE];
+	int ncpus = numa_cpulist(node, cpus, CPU_SETSIZE);
+	if (ncpus > 0) nft_pool_affinity(sub, ncpus, cpus);
+#endif
+    }
+    if (pool->num_nodes < num_nodes) {
+	nft_pool_shutdown(handle, 0);
+	return NULL;
+    }
+    return handle;
+}
+
+/*------------------------------------------------------------------------------
+ * nft_pool_affinity	- Bind the pool's threads to a set of CPUs.
+ *
+ * Each pool thread compares pool->affinity with the value it last saw,
+ * and rebinds itself before processing its next work item.
+ *
+ * Returns: 0		Success
+ *	    EINVAL	Invalid handle or CPU number, or a NUMA pool
+ *          ENOMEM      malloc failed
+ *          ENOSYS      CPU affinity is not supported
+ *------------------------------------------------------------------------------
+ */
+int
+nft_pool_affinity(nft_pool_h handle, int ncpus, const int * cpus)
+{
+#ifdef __linux__
+    if (ncpus < 0 || (ncpus > 0 && !cpus)) return EINVAL;
+    for (int i = 0; i < ncpus; i++)
+	if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE) return EINVAL;
+
+    nft_pool * pool = nft_pool_lookup(handle);
+    if (!pool) return EINVAL;
+
+    // The sub-pools of a NUMA pool are bound to their own nodes' CPUs.
+    if (pool->nodes) {
+	nft_pool_discard(pool);
+	return EINVAL;
+    }
+    int * copy = NULL;
+    if (ncpus > 0 && !(copy = malloc(ncpus * sizeof(int)))) {
+	nft_pool_discard(pool);
+	return ENOMEM;
+    }
+    if (copy) memcpy(copy, cpus, ncpus * sizeof(int));
+
+    int rc = pthread_mutex_lock(&pool->queue.mutex); assert(0 == rc);
+    free(pool->cpus);
+    pool->cpus  = copy;
+    pool->ncpus = ncpus;
+    pool->affinity++;
+    rc = pthread_mutex_unlock(&pool->queue.mutex); assert(0 == rc);
+
+    nft_pool_discard(pool);
+    return 0;
+#else
+    return ENOSYS;
+#endif
+}
+
+/*------------------------------------------------------------------------------
+ * pool_node	- Return a NUMA pool's sub-pool handle for the node.
+ *
+ * A negative node selects the node of the calling thread's CPU.
+ * Returns NULL if the pool has no sub-pools, or the node is invalid.
+ * The nodes array is immutable once the pool has been created.
+ *------------------------------------------------------------------------------
+ */
+static nft_pool_h
+pool_node(nft_pool * pool, int node)
+{
+    if (!pool->nodes) return NULL;
+    if (node < 0) node = nft_pool_numa_node();
+    return (node < pool->num_nodes) ? pool->nodes[node] : NULL;
+}
 
 /*------------------------------------------------------------------------------
- * nft_pool_add_wait	- Add a work item to the pool's queue.
+ * nft_pool_add_node	- Add a work item to a NUMA node's sub-pool.
+ *------------------------------------------------------------------------------
+ */
+int
+nft_pool_add_node(nft_pool_h handle, int node, int timeout, void (*function)(void *), void * argument)
+{
+    nft_pool * pool = nft_pool_lookup(handle);
+    if (!pool) return EINVAL;
+
+    int result;
+    if (pool->nodes) {
+	nft_pool_h sub = pool_node(pool, node);
+	result = sub ? nft_pool_add_wait(sub, timeout, function, argument) : EINVAL;
+    }
+    else if (node <= 0)
+	result = nft_pool_add_wait(handle, timeout, function, argument);
+    else
+	result = EINVAL;
+
+    nft_pool_discard(pool);
+    return result;
+}
+
+/*------------------------------------------------------------------------------
+ * nft_pool_add_prio	- Add a work item to the pool's queue, in a priority class.
  *
  * The wait parameter is defined as in nft_queue_timed_wait.
  * If the queue is at its limit:
@@ -215,24 +711,40 @@ nft_pool_new(int queue_limit, int max_threads, int stack_size)
  *      timeout == 0	will return ETIMEDOUT immediately
  *      timeout  > 0	will return ETIMEDOUT after timeout seconds
  *
+ * A zero deadline means the item is due when it is submitted.
+ *
  * Returns: 0		Success
  *          ENOMEM      malloc failed, memory exhausted.
- *	    EINVAL	Invalid handle
+ *	    EINVAL	Invalid handle or priority
  *          ESHUTDOWN   Pool has been shutdown.
  *          various     pthread_create error codes
  *
  *------------------------------------------------------------------------------
  */
 int
-nft_pool_add_wait(nft_pool_h handle, int timeout, void (*function)(void *),  void * argument)
+nft_pool_add_prio(nft_pool_h handle, int timeout, int priority, struct timespec deadline,
+		  void (*function)(void *), void * argument)
 {
+    if (priority < 0 || priority >= NFT_POOL_PRIORITIES) return EINVAL;
+
     nft_pool * pool = nft_pool_lookup(handle);
     if (!pool) return EINVAL;
 
+    // A NUMA pool routes the item to the sub-pool for the caller's node.
+    if (pool->nodes) {
+	nft_pool_h sub = pool_node(pool, -1);
+	nft_pool_discard(pool);
+	return sub ? nft_pool_add_prio(sub, timeout, priority, deadline, function, argument) : EINVAL;
+    }
+
     work_item * item = malloc(sizeof(work_item));
     if (item) {
-	item->function = function;
-	item->argument = argument;
+	item->function     = function;
+	item->argument     = argument;
+	item->priority     = priority;
+	item->queued       = nft_gettime_mono();
+	item->deadline_set = (deadline.tv_sec != 0 || deadline.tv_nsec != 0);
+	item->deadline     = item->deadline_set ? deadline : nft_gettime();
     }
     else {
 	// Be sure not to return without discarding this reference.
@@ -242,37 +754,52 @@ nft_pool_add_wait(nft_pool_h handle, int timeout, void (*function)(void *),  voi
     // We must hold the mutex when calling nft_queue_enqueue.
     int rc = pthread_mutex_lock(&pool->queue.mutex); assert(0 == rc);
 
-    if (SHUTDOWN(pool)) {
+    nft_pool_prio * prio = &pool->prio[priority];
+    int result = SHUTDOWN(pool) ? ESHUTDOWN : prio_reserve(prio);
+    if (result != 0) {
 	rc = pthread_mutex_unlock(&pool->queue.mutex); assert(0 == rc);
 	nft_pool_discard(pool);
 	free(item);
-	return ESHUTDOWN;
+	return result;
     }
-    // Enqueue the work item. This may block if the queue is at its limit
-    int result = nft_queue_enqueue(&pool->queue, item, timeout, 'L');
+    // Enqueue a placeholder. This may block if the queue is at its limit
+    result = nft_queue_enqueue(&pool->queue, NULL, timeout, 'L');
     if (result == 0)
     {
+	item->sequence = pool->sequence++;
+	prio_push(prio, item);
+	prio->stats.submitted++;
+
+	int depth = nft_queue_length(&pool->queue);
+	if (depth > pool->totals.queue_high) pool->totals.queue_high = depth;
+
 	// The item was queued successfully, so make sure there is a thread to process it.
-	if ((pool->idle_threads == 0) &&
-	    (pool->num_threads  <  pool->max_threads))
-	{
-	    // Create a fresh reference to the pool, which we will pass to the thread.
-	    // Discard the clone reference if pthread_create fails.
-	    nft_pool * clone = nft_pool_lookup(nft_pool_handle(pool)); assert(clone);
-	    pthread_t  id;
-	    if (!(result = pthread_create(&id, &pool->attr, nft_pool_thread, clone)))
-		pool->num_threads++;
-	    else
-		nft_pool_discard(clone);
-	}
+	// When spawn_depth is set, also add a thread if the queue has grown too deep.
+	if ((pool->num_threads < pool->max_threads) &&
+	    ((pool->idle_threads == 0) ||
+	     (pool->spawn_depth > 0 && nft_queue_length(&pool->queue) > pool->spawn_depth)))
+	    result = pool_spawn(pool);
+    }
+    else {
+	prio->reserved--;
+	free(item); // The item was not queued.
     }
-    else free(item); // The item was not queued.
-
     rc = pthread_mutex_unlock(&pool->queue.mutex); assert(0 == rc);
     nft_pool_discard(pool);
     return result;
 }
 
+/*------------------------------------------------------------------------------
+ * nft_pool_add_wait	- Add a work item to the pool's queue, with normal priority.
+ *------------------------------------------------------------------------------
+ */
+int
+nft_pool_add_wait(nft_pool_h handle, int timeout, void (*function)(void *),  void * argument)
+{
+    struct timespec none = { 0, 0 };
+    return nft_pool_add_prio(handle, timeout, NFT_POOL_NORMAL, none, function, argument);
+}
+
 /*------------------------------------------------------------------------------
  * nft_pool_add		- Add a work item to the pool's queue, with no timeout.
  *------------------------------------------------------------------------------
@@ -284,6 +811,232 @@ nft_pool_add(nft_pool_h handle, void (*function)(void *),  void * argument)
 }
 
 
+/*------------------------------------------------------------------------------
+ * nft_pool_add_many	- Add a batch of work items, with normal priority.
+ *
+ * The items are queued under one acquisition of the queue mutex, and idle
+ * threads are woken once. This call does not wait: it stops at the first
+ * item that cannot be queued, and returns the error for that item.
+ * The number of items queued is stored in *added.
+ *------------------------------------------------------------------------------
+ */
+int
+nft_pool_add_many(nft_pool_h handle, int count, void (**functions)(void *), void ** arguments, int * added)
+{
+    *added = 0;
+    nft_pool * pool = nft_pool_lookup(handle);
+    if (!pool) return EINVAL;
+
+    // A NUMA pool routes the items to the sub-pool for the caller's node.
+    if (pool->nodes) {
+	nft_pool_h sub = pool_node(pool, -1);
+	nft_pool_discard(pool);
+	return sub ? nft_pool_add_many(sub, count, functions, arguments, added) : EINVAL;
+    }
+
+    // We must hold the mutex when calling nft_queue_enqueue.
+    int rc = pthread_mutex_lock(&pool->queue.mutex); assert(0 == rc);
+
+    nft_pool_prio * prio   = &pool->prio[NFT_POOL_NORMAL];
+    struct timespec queued = nft_gettime_mono();
+    struct timespec now    = nft_gettime();
+    int             result = 0;
+    int		    i;
+
+    for (i = 0; i < count; i++)
+    {
+	if (SHUTDOWN(pool)) { result = ESHUTDOWN; break; }
+
+	work_item * item = malloc(sizeof(work_item));
+	if (!item) { result = ENOMEM; break; }
+	if ((result = prio_reserve(prio)) != 0) {
+	    free(item);
+	    break;
+	}
+	// Enqueue a placeholder, without waiting if the queue is at its limit.
+	if ((result = nft_queue_enqueue(&pool->queue, NULL, 0, 'L')) != 0) {
+	    prio->reserved--;
+	    free(item);
+	    break;
+	}
+	item->function     = functions[i];
+	item->argument     = arguments[i];
+	item->priority     = NFT_POOL_NORMAL;
+	item->queued       = queued;
+	item->deadline_set = 0;
+	item->deadline     = now;
+	item->sequence     = pool->sequence++;
+	prio_push(prio, item);
+	prio->stats.submitted++;
+    }
+    *added = i;
+
+    int depth = nft_queue_length(&pool->queue);
+    if (depth > pool->totals.queue_high) pool->totals.queue_high = depth;
+
+    // Spawn enough threads for the new items, beyond those that are idle.
+    for (int spawned = 0; spawned < i - pool->idle_threads; spawned++) {
+	if (pool->num_threads >= pool->max_threads) break;
+	if ((rc = pool_spawn(pool)) != 0) {
+	    if (result == 0) result = rc;
+	    break;
+	}
+    }
+    rc = pthread_mutex_unlock(&pool->queue.mutex); assert(0 == rc);
+    nft_pool_discard(pool);
+    return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * nft_pool_workers	- Tune the creation and retirement of pool threads.
+ *
+ * The min_threads are spawned immediately, and do not retire when idle.
+ * Threads in excess of min_threads retire after idle_timeout seconds.
+ * If spawn_depth is positive, nft_pool_add_wait creates a thread whenever
+ * more than spawn_depth items are queued, rather than waiting for the
+ * existing threads to become busy.
+ *
+ * Returns: 0		Success
+ *	    EINVAL	Invalid handle
+ *          ESHUTDOWN   Pool has been shutdown.
+ *          various     pthread_create error codes
+ *------------------------------------------------------------------------------
+ */
+int
+nft_pool_workers(nft_pool_h handle, int min_threads, int idle_timeout, int spawn_depth)
+{
+    nft_pool * pool = nft_pool_lookup(handle);
+    if (!pool) return EINVAL;
+
+    // The settings of a NUMA pool apply to each of its sub-pools.
+    int result = 0;
+    for (int node = 0; node < pool->num_nodes && !result; node++)
+	result = nft_pool_workers(pool->nodes[node], min_threads, idle_timeout, spawn_depth);
+    if (pool->nodes) {
+	nft_pool_discard(pool);
+	return result;
+    }
+    int rc = pthread_mutex_lock(&pool->queue.mutex); assert(0 == rc);
+
+    if (!SHUTDOWN(pool)) {
+	if (min_threads > pool->max_threads) min_threads = pool->max_threads;
+	pool->min_threads  = (min_threads  > 0) ? min_threads  : 0 ;
+	pool->idle_timeout = (idle_timeout > 0) ? idle_timeout : NFT_POOL_IDLE_TIMEOUT ;
+	pool->spawn_depth  = (spawn_depth  > 0) ? spawn_depth  : 0 ;
+
+	// Pre-spawn the warm core of threads.
+	while (pool->num_threads < pool->min_threads)
+	    if ((result = pool_spawn(pool)) != 0)
+		break;
+    }
+    else result = ESHUTDOWN;
+
+    rc = pthread_mutex_unlock(&pool->queue.mutex); assert(0 == rc);
+    nft_pool_discard(pool);
+    return result;
+}
+
+/*------------------------------------------------------------------------------
+ * nft_pool_class_stats	- Return the statistics of a priority class.
+ *
+ * Returns: 0		Success
+ *	    EINVAL	Invalid handle or priority
+ *------------------------------------------------------------------------------
+ */
+int
+nft_pool_class_stats(nft_pool_h handle, int priority, nft_pool_class_stats_t * stats)
+{
+    if (priority < 0 || priority >= NFT_POOL_PRIORITIES || !stats) return EINVAL;
+
+    nft_pool * pool = nft_pool_lookup(handle);
+    if (!pool) return EINVAL;
+
+    int rc = pthread_mutex_lock(&pool->queue.mutex); assert(0 == rc);
+    *stats = pool->prio[priority].stats;
+    rc = pthread_mutex_unlock(&pool->queue.mutex); assert(0 == rc);
+
+    // Combine the statistics of a NUMA pool's sub-pools.
+    for (int node = 0; node < pool->num_nodes; node++) {
+	nft_pool_class_stats_t sub;
+	if (nft_pool_class_stats(pool->nodes[node], priority, &sub) != 0) continue;
+	stats->submitted  += sub.submitted;
+	stats->completed  += sub.completed;
+	stats->late       += sub.late;
+	stats->wait_total += sub.wait_total;
+	if (sub.wait_max > stats->wait_max) stats->wait_max = sub.wait_max;
+    }
+    nft_pool_discard(pool);
+    return 0;
+}
+
+/*------------------------------------------------------------------------------
+ * nft_pool_stats	- Take a snapshot of the pool's instrumentation.
+ *
+ * The totals hold the counts of exited threads, to which we add the
+ * counters of the current threads. Those may be updated as we read them.
+ *
+ * Returns: 0		Success
+ *	    EINVAL	Invalid handle
+ *------------------------------------------------------------------------------
+ */
+static void
+stats_add(nft_pool_stats_t * to, const nft_pool_stats_t * from)
+{
+    to->completed    += from->completed;
+    to->wait_ns      += from->wait_ns;
+    to->busy_ns      += from->busy_ns;
+    to->idle_ns      += from->idle_ns;
+    to->spawned      += from->spawned;
+    to->retired      += from->retired;
+    to->num_threads  += from->num_threads;
+    to->idle_threads += from->idle_threads;
+    to->queue_depth  += from->queue_depth;
+    if (from->queue_high > to->queue_high) to->queue_high = from->queue_high;
+    for (int i = 0; i < NFT_POOL_BUCKETS; i++) {
+	to->wait_hist[i] += from->wait_hist[i];
+	to->run_hist[i]  += from->run_hist[i];
+    }
+}
+
+int
+nft_pool_stats(nft_pool_h handle, nft_pool_stats_t * stats)
+{
+    if (!stats) return EINVAL;
+
+    nft_pool * pool = nft_pool_lookup(handle);
+    if (!pool) return EINVAL;
+
+    int rc = pthread_mutex_lock(&pool->queue.mutex); assert(0 == rc);
+    *stats = pool->totals;
+    stats->num_threads  = pool->num_threads;
+    stats->idle_threads = pool->idle_threads;
+    stats->queue_depth  = nft_queue_length(&pool->queue);
+
+    struct timespec now = nft_gettime_mono();
+    for (nft_pool_worker * w = pool->workers; w; w = w->next) {
+	int64_t  life = nft_timespec_comp(now, w->started);
+	uint64_t busy = STAT_GET(w->busy_ns);
+	stats->completed += STAT_GET(w->completed);
+	stats->wait_ns   += STAT_GET(w->wait_ns);
+	stats->busy_ns   += busy;
+	stats->idle_ns   += (life > (int64_t) busy) ? life - busy : 0;
+	for (int i = 0; i < NFT_POOL_BUCKETS; i++) {
+	    stats->wait_hist[i] += STAT_GET(w->wait_hist[i]);
+	    stats->run_hist[i]  += STAT_GET(w->run_hist[i]);
+	}
+    }
+    rc = pthread_mutex_unlock(&pool->queue.mutex); assert(0 == rc);
+
+    // Combine the statistics of a NUMA pool's sub-pools.
+    for (int node = 0; node < pool->num_nodes; node++) {
+	nft_pool_stats_t sub;
+	if (nft_pool_stats(pool->nodes[node], &sub) == 0) stats_add(stats, &sub);
+    }
+    nft_pool_discard(pool);
+    return 0;
+}
+
 /*------------------------------------------------------------------------------
  * pool_shutdown_cleanup - Function for use with pthread_cleanup_push/pop.
  *
@@ -314,6 +1067,15 @@ nft_pool_shutdown(nft_pool_h handle, int timeout)
     nft_pool * pool = nft_pool_lookup(handle);
     if (!pool) return EINVAL;
 
+    // Shut down the sub-pools of a NUMA pool, before the pool itself.
+    for (int node = 0; node < pool->num_nodes; node++) {
+	int result = nft_pool_shutdown(pool->nodes[node], timeout);
+	if (result != 0 && result != EINVAL) {
+	    nft_pool_discard(pool);
+	    return result;
+	}
+    }
+
     // nft_queue_shutdown will wake any idle threads that are waiting,
     // either to enqueue or dequeue, and wait for them to detach,
     // but busy pool threads will continue to dequeue and process items.
@@ -500,6 +1262,235 @@ basic_tests(void)
     fputs("passed.\n", stderr);
 }
 
+void
+worker_tests(void)
+{
+    int rc;
+    fputs("Test 6: warm core of pool threads ", stderr);
+
+    nft_pool_h pool = nft_pool_new(0, 4, 0); assert(pool != NULL);
+    nft_pool * pref = nft_pool_lookup(pool); assert(pref != NULL);
+
+    // The core threads are spawned immediately, and survive the idle timeout.
+    rc = nft_pool_workers(pool, 2, 1, 1); assert(rc == 0);
+    assert(pref->num_threads == 2);
+    sleep(3);
+    assert(pref->num_threads  == 2);
+    assert(pref->idle_threads == 2);
+
+    // A deep queue causes threads to be added, even while the core threads are idle.
+    for (int i = 0; i < 4; i++) flags[i] = 1;
+    for (long i = 0; i < 4; i++) {
+	rc = nft_pool_add(pool, sleeper, (void*) 1); assert(rc == 0);
+    }
+    assert(pref->num_threads > 2 && pref->num_threads <= 4);
+
+    // The extra threads retire after the idle timeout, but the core remains.
+    sleep(4);
+    assert(pref->num_threads  == 2);
+    assert(pref->idle_threads == 2);
+    assert(flags[1] == 0);
+
+    nft_pool_discard(pref);
+    rc = nft_pool_shutdown(pool, -1); assert(rc == 0);
+    rc = nft_pool_workers(pool, 1, 1, 0); assert(rc == ESHUTDOWN || rc == EINVAL);
+    fputs("passed.\n", stderr);
+}
+
+#ifdef __linux__
+// Record the CPU set of the pool thread that runs this function.
+volatile int affinity_cpus = -1;
+void record_affinity(void * arg) {
+    cpu_set_t set;
+    int rc = pthread_getaffinity_np(pthread_self(), sizeof(set), &set); assert(rc == 0);
+    affinity_cpus = CPU_ISSET((long) arg, &set) ? CPU_COUNT(&set) : 0;
+}
+#endif
+
+void
+numa_tests(void)
+{
+    int rc;
+    fputs("Test 7: CPU affinity and NUMA pools ", stderr);
+
+    int nodes = nft_pool_numa_nodes();
+    int node  = nft_pool_numa_node();
+    assert(nodes >= 1);
+    assert(node  >= 0 && node < nodes);
+
+#ifdef __linux__
+    // Bind the pool threads to the CPU we are running on now.
+    int cpu = sched_getcpu();
+    nft_pool_h pool = nft_pool_new(0, 2, 0); assert(pool != NULL);
+    rc = nft_pool_affinity(pool, 1, &cpu);  assert(rc == 0);
+    rc = nft_pool_add(pool, record_affinity, (void*)(long) cpu); assert(rc == 0);
+    rc = nft_pool_shutdown(pool, -1); assert(rc == 0);
+    assert(affinity_cpus == 1);
+
+    int bad = -1;
+    pool = nft_pool_new(0, 2, 0); assert(pool != NULL);
+    assert(EINVAL == nft_pool_affinity(pool, 1, &bad));
+    rc = nft_pool_shutdown(pool, -1); assert(rc == 0);
+#endif
+
+    // Submit work to the caller's node, and to each node explicitly.
+    nft_pool_h numa = nft_pool_new_numa(0, 2, 0); assert(numa != NULL);
+    rc = nft_pool_workers(numa, 1, 1, 0); assert(rc == 0);
+    for (int i = 0; i < 10; i++) flags[i] = 1;
+    rc = nft_pool_add(numa, clear_flag, (void*) 0); assert(rc == 0);
+    rc = nft_pool_add_node(numa, -1, -1, clear_flag, (void*) 1); assert(rc == 0);
+    for (long n = 0; n < nodes && n < 8; n++) {
+	rc = nft_pool_add_node(numa, n, -1, clear_flag, (void*)(n + 2)); assert(rc == 0);
+    }
+    assert(EINVAL == nft_pool_add_node(numa, nodes, -1, clear_flag, (void*) 0));
+#ifdef __linux__
+    assert(EINVAL == nft_pool_affinity(numa, 1, &cpu));
+#endif
+    rc = nft_pool_shutdown(numa, -1); assert(rc == 0);
+    for (int i = 0; i < nodes + 2 && i < 10; i++) assert(flags[i] == 0);
+
+    fputs("passed.\n", stderr);
+}
+
+// Record the order in which work items run.
+static pthread_mutex_t order_mutex = PTHREAD_MUTEX_INITIALIZER;
+static long            order[64];
+static int             order_count;
+void record_order(void * arg) {
+    pthread_mutex_lock(&order_mutex);
+    if (order_count < 64) order[order_count++] = (long) arg;
+    pthread_mutex_unlock(&order_mutex);
+}
+
+void
+prio_tests(void)
+{
+    int rc;
+    fputs("Test 8: priority classes and deadlines ", stderr);
+
+    // With the thread asleep, queue items in each class, then check their order.
+    struct timespec none = { 0, 0 }, soon = nft_gettime();
+    nft_pool_h pool = nft_pool_new(0, 1, 0); assert(pool != NULL);
+    order_count = 0;
+    rc = nft_pool_add_prio(pool, -1, NFT_POOL_HIGH, none, (void(*)(void*)) sleep, (void*) 1); assert(rc == 0);
+    rc = nft_pool_add_prio(pool, -1, NFT_POOL_LOW,    none, record_order, (void*) 5); assert(rc == 0);
+    rc = nft_pool_add_prio(pool, -1, NFT_POOL_NORMAL, none, record_order, (void*) 3); assert(rc == 0);
+    rc = nft_pool_add     (pool,                            record_order, (void*) 4); assert(rc == 0);
+    rc = nft_pool_add_prio(pool, -1, NFT_POOL_HIGH,   none, record_order, (void*) 1); assert(rc == 0);
+    rc = nft_pool_add_prio(pool, -1, NFT_POOL_NORMAL, soon, record_order, (void*) 2); assert(rc == 0);
+    assert(EINVAL == nft_pool_add_prio(pool, -1, NFT_POOL_PRIORITIES, none, record_order, NULL));
+
+    nft_pool_class_stats_t stats;
+    rc = nft_pool_shutdown(pool, -1); assert(rc == 0);
+    assert(order_count == 5);
+    for (int i = 0; i < 5; i++) assert(order[i] == i + 1);
+
+    // The low class is served after it has been passed over NFT_POOL_AGING times.
+    pool = nft_pool_new(0, 1, 0); assert(pool != NULL);
+    order_count = 0;
+    rc = nft_pool_add_prio(pool, -1, NFT_POOL_HIGH, none, (void(*)(void*)) sleep, (void*) 1); assert(rc == 0);
+    rc = nft_pool_add_prio(pool, -1, NFT_POOL_LOW, none, record_order, (void*) 0); assert(rc == 0);
+    for (long i = 1; i <= 2 * NFT_POOL_AGING; i++) {
+	rc = nft_pool_add_prio(pool, -1, NFT_POOL_HIGH, none, record_order, (void*) i); assert(rc == 0);
+    }
+    sleep(2);
+    rc = nft_pool_class_stats(pool, NFT_POOL_HIGH, &stats); assert(rc == 0);
+    assert(stats.submitted == 2 * NFT_POOL_AGING + 1 && stats.completed == 2 * NFT_POOL_AGING + 1);
+    assert(stats.late == 0 && stats.wait_max > 0.5);
+    rc = nft_pool_class_stats(pool, NFT_POOL_LOW, &stats); assert(rc == 0);
+    assert(stats.submitted == 1 && stats.completed == 1);
+    assert(EINVAL == nft_pool_class_stats(pool, -1, &stats));
+    rc = nft_pool_shutdown(pool, -1); assert(rc == 0);
+    assert(order_count == 2 * NFT_POOL_AGING + 1);
+    int low = 0;
+    while (order[low] != 0) low++;
+    assert(low <= NFT_POOL_AGING);
+
+    fputs("passed.\n", stderr);
+}
+
+void
+stats_tests(void)
+{
+    int rc;
+    fputs("Test 9: pool statistics ", stderr);
+
+    nft_pool_h pool = nft_pool_new(0, 2, 0); assert(pool != NULL);
+    nft_pool_stats_t stats;
+    rc = nft_pool_stats(pool, &stats); assert(rc == 0);
+    assert(stats.spawned == 0 && stats.completed == 0 && stats.queue_high == 0);
+    assert(EINVAL == nft_pool_stats(pool, NULL));
+
+    // Two sleepers keep both threads busy, while ten items wait behind them.
+    for (int i = 0; i < 10; i++) flags[i] = 1;
+    rc = nft_pool_add(pool, (void(*)(void*)) sleep, (void*) 1); assert(rc == 0);
+    rc = nft_pool_add(pool, (void(*)(void*)) sleep, (void*) 1); assert(rc == 0);
+    for (long i = 0; i < 10; i++) {
+	rc = nft_pool_add(pool, clear_flag, (void*) i); assert(rc == 0);
+    }
+    rc = nft_pool_stats(pool, &stats); assert(rc == 0);
+    assert(stats.spawned == 2 && stats.num_threads == 2);
+    assert(stats.queue_high >= 10 && stats.queue_depth <= stats.queue_high);
+
+    // Wait for the idle threads to retire.
+    sleep(3);
+    rc = nft_pool_stats(pool, &stats); assert(rc == 0);
+    assert(stats.completed == 12 && stats.retired == 2 && stats.num_threads == 0);
+    assert(stats.busy_ns >= 2 * (uint64_t) NANOSEC && stats.idle_ns > 0);
+    assert(stats.wait_ns >= 10 * (uint64_t) NANOSEC / 2);
+
+    // The sleepers ran for about 2^20 microseconds, and the others waited as long.
+    uint64_t runs = 0, waits = 0;
+    for (int i = 0; i < NFT_POOL_BUCKETS; i++) {
+	runs  += stats.run_hist[i];
+	waits += stats.wait_hist[i];
+    }
+    assert(runs == 12 && waits == 12);
+    assert(stats.run_hist[20] + stats.run_hist[21] == 2);
+    assert(stats.wait_hist[20] + stats.wait_hist[21] >= 8);
+
+    rc = nft_pool_shutdown(pool, -1); assert(rc == 0);
+    for (int i = 0; i < 10; i++) assert(flags[i] == 0);
+    fputs("passed.\n", stderr);
+}
+
+/* Test 10: Verify that nft_pool_add_many queues a batch up to the queue limit.
+ */
+static void
+many_tests(void)
+{
+    int rc, added;
+    fputs("Test 10: batch submission ", stderr);
+
+    void (* functions[10])(void *);
+    void  * arguments[10];
+    for (long i = 0; i < 10; i++) {
+	flags[i]     = 1;
+	functions[i] = clear_flag;
+	arguments[i] = (void*) i;
+    }
+    // Keep the only thread busy, so that the batch fills the queue.
+    nft_pool_h pool = nft_pool_new(4, 1, 0); assert(pool != NULL);
+    rc = nft_pool_add(pool, (void(*)(void*)) sleep, (void*) 1); assert(rc == 0);
+    usleep(100000);
+
+    rc = nft_pool_add_many(pool, 10, functions, arguments, &added);
+    assert(rc == ETIMEDOUT && added == 4);
+    rc = nft_pool_shutdown(pool, -1); assert(rc == 0);
+    for (int i = 0; i < 10; i++) assert(flags[i] == (i >= 4));
+
+    // Submit a whole batch, which spawns threads to run it.
+    for (int i = 0; i < 10; i++) flags[i] = 1;
+    pool = nft_pool_new(0, 4, 0); assert(pool != NULL);
+    rc = nft_pool_add_many(pool, 10, functions, arguments, &added);
+    assert(rc == 0 && added == 10);
+    rc = nft_pool_shutdown(pool, -1); assert(rc == 0);
+    for (int i = 0; i < 10; i++) assert(flags[i] == 0);
+
+    assert(EINVAL == nft_pool_add_many(pool, 10, functions, arguments, &added));
+    assert(added == 0);
+    fputs("passed.\n", stderr);
+}
 
 /*****************************************************************************************
  * nft_action_pool	- Demonstrate a subclass based on nft_pool
@@ -620,6 +1611,13 @@ main(int argc, char *argv[])
 {
     basic_tests();
 
+    worker_tests();
+
+    numa_tests();
+    prio_tests();
+    stats_tests();
+    many_tests();
+
     test_nft_action_pool();
 
     printf("nft_pool: All tests passed.\n");
@@ -381,6 +381,19 @@ nft_queue_dequeue(nft_queue * q, int timeout, void ** itemp)
 	return ETIMEDOUT;
 }
 
+/*----------------------------------------------------------------------
+ *  nft_queue_length()	- Return the number of queued items.
+ *
+ *  Like nft_queue_count, but for use by subclasses such as nft_pool,
+ *  which must already hold the queue mutex while calling _length.
+ *----------------------------------------------------------------------
+ */
+int
+nft_queue_length(nft_queue * q)
+{
+    return COUNT(q);
+}
+
 /*----------------------------------------------------------------------
  *  nft_queue_destroy()
  *
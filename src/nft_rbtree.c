@@ -41,11 +41,22 @@
  */
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <sched.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <nft_future.h>
 #include <nft_rbtree.h>
 
 // Define the wrapper functions nft_rbtree_cast, _lookup, _discard, etc.
@@ -142,6 +153,46 @@ node_successor(nft_rbtree * tree, unsigned node)
     }
 }
 
+/* Returns the index of the last node in tree, or NIL if empty.
+ */
+static unsigned
+node_last( nft_rbtree * tree)
+{
+    unsigned     node  = NIL;
+    nft_rbnode * nodes = tree->nodes;
+    if (nodes) {
+        // Go to the rightmost node in the tree.
+        for (node = ROOT; !IS_NIL(node) && !IS_NIL(RIGHT(node)); node = RIGHT(node));
+    }
+    return node;
+}
+
+/* Find the predecessor in key order to the given node.
+ * This is the mirror image of node_successor().
+ */
+static unsigned
+node_predecessor(nft_rbtree * tree, unsigned node)
+{
+    assert(node != NIL);
+    assert(node  < tree->next_free);
+
+    nft_rbnode * nodes = tree->nodes;
+
+    if (!IS_NIL(LEFT(node)))
+    {
+        for (node  = LEFT(node);
+             !IS_NIL(RIGHT(node));
+             node  = RIGHT(node));
+        return node;
+    }
+    else {
+        unsigned parent;
+        while ((!IS_NIL(parent = PARENT(node))) && (node == LEFT(parent)))
+            node = parent;
+        return parent;
+    }
+}
+
 /******************************************************************************/
 /*******                                                                *******/
 /*******        Core algorithm: Insertion, deletion and balancing       *******/
@@ -163,7 +214,18 @@ attach_leaf(nft_rbtree * tree, unsigned parent, void *key, void *data, int which
 
     nodes[node] = (nft_rbnode) {  key, data, { NIL, NIL }, parent, 0 };
 
+    // Optimistic readers must not find the node before it is initialized.
+    if (tree->locking == RBTREE_LOCK_OPTIMISTIC)
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
     CHILD(parent,which) = node;
+
+    // Count the new leaf in the subtree sizes of its ancestors.
+    if (tree->sizes) {
+        tree->sizes[node] = 1;
+        for (unsigned p = parent; !IS_NIL(p); p = PARENT(p))
+            tree->sizes[p]++;
+    }
     return node;
 }
 
@@ -171,8 +233,9 @@ attach_leaf(nft_rbtree * tree, unsigned parent, void *key, void *data, int which
  * If gs is a left child, this will do a right rotate, otherwise a left-rotate.
  */
 static void
-rotate(nft_rbnode * nodes, unsigned node, unsigned s, unsigned gs)
+rotate(nft_rbtree * tree, unsigned node, unsigned s, unsigned gs)
 {
+    nft_rbnode * nodes = tree->nodes;
     int left  = (gs == LEFT(s)) ? 0 : 1;
     int right = left ^ 1;
 
@@ -186,6 +249,13 @@ rotate(nft_rbnode * nodes, unsigned node, unsigned s, unsigned gs)
     if (s == LEFT(node)) LEFT(node) = gs;
     else                RIGHT(node) = gs;
     PARENT(gs) = node;
+
+    // gs now roots the subtree that s did, and s has lost gs's subtree.
+    if (tree->sizes) {
+        unsigned * sizes = tree->sizes;
+        sizes[gs] = sizes[s];
+        sizes[s]  = sizes[LEFT(s)] + sizes[RIGHT(s)] + 1;
+    }
     return;
 }
 
@@ -221,14 +291,14 @@ insert_fixup(nft_rbtree * tree, unsigned x)
         else {
             if (x == CHILD(p, right))
             {
-                rotate(nodes, gp, p, x);
+                rotate(tree, gp, p, x);
                 x  = CHILD(x, left);
                 p  = PARENT(x);
                 gp = PARENT(p);
             }
             RESET_RED(p);
             SET_RED(gp);
-            rotate(nodes, PARENT(gp), gp, p);
+            rotate(tree, PARENT(gp), gp, p);
         }
     }
     RESET_RED(ROOT);
@@ -236,37 +306,204 @@ insert_fixup(nft_rbtree * tree, unsigned x)
 }
 
 
+/* Trees whose comparator is rbtree_compare_pointers or rbtree_compare_integers
+ * compare keys inline. Each of these macros compares key k1 to node key k2,
+ * as the comparator would, given the data values d1 and d2.
+ */
+#define KEYS_GENERIC    0
+#define KEYS_POINTERS   1
+#define KEYS_INTEGERS   2
+
+#define COMPARE_GENERIC(k1,k2,d1,d2)  compare(k1, k2, d1, d2)
+#define COMPARE_POINTERS(k1,k2,d1,d2) (long) (((uintptr_t) (k2) > (uintptr_t) (k1)) - ((uintptr_t) (k2) < (uintptr_t) (k1)))
+#define COMPARE_INTEGERS(k1,k2,d1,d2) (long) (((intptr_t)  (k1) > (intptr_t)  (k2)) - ((intptr_t)  (k1) < (intptr_t)  (k2)))
+
+/* Define these descents for each kind of key:
+ *
+ * seek_ge_<keys> returns the first node whose key (and data, for duplex keys)
+ * is greater than key, or if equal is true, not less than key, or NIL.
+ * seek_le_<keys> returns the last node whose key is not greater, or NIL.
+ * rank_<keys> returns the number of keys less than key, using the sizes.
+ * probe_<keys> is seek_ge for optimistic searches, which checks each index
+ * against num, and gives up after OPTIMISTIC_STEPS. It returns true if it
+ * reached the bottom of the tree, and the node it found via *found.
+ * find_leaf_<keys> returns the node under which to attach a new leaf,
+ * after any equal keys, and the side on which to attach it. It never gets
+ * called on an empty tree.
+ *
+ * The descents never stop early on an equal key. Each step selects the child
+ * and the candidate by indexing and conditional moves, rather than branching,
+ * so that the only branch is the loop test, which is well predicted.
+ */
+#define OPTIMISTIC_STEPS    128
+
+#define DEFINE_FINDERS(keys, COMPARE)                                           \
+static unsigned                                                                 \
+seek_ge_##keys(nft_rbtree * tree, void * key, void * data, int equal)           \
+{                                                                               \
+    RBTREE_COMPARE compare = tree->compare; (void) compare;                     \
+    nft_rbnode   * nodes   = tree->nodes;                                       \
+    unsigned       found   = NIL;                                               \
+                                                                                \
+    for (unsigned node = nodes ? ROOT : NIL; !IS_NIL(node); ) {                 \
+        unsigned side = COMPARE(key, KEY(node), data, DATA(node)) >= equal;     \
+        found = side ? found : node;                                            \
+        node  = CHILD(node, side);                                              \
+    }                                                                           \
+    return found;                                                               \
+}                                                                               \
+static unsigned                                                                 \
+seek_le_##keys(nft_rbtree * tree, void * key, void * data)                      \
+{                                                                               \
+    RBTREE_COMPARE compare = tree->compare; (void) compare;                     \
+    nft_rbnode   * nodes   = tree->nodes;                                       \
+    unsigned       found   = NIL;                                               \
+                                                                                \
+    for (unsigned node = nodes ? ROOT : NIL; !IS_NIL(node); ) {                 \
+        unsigned side = COMPARE(key, KEY(node), data, DATA(node)) >= 0;         \
+        found = side ? node : found;                                            \
+        node  = CHILD(node, side);                                              \
+    }                                                                           \
+    return found;                                                               \
+}                                                                               \
+static int                                                                      \
+rank_##keys(nft_rbtree * tree, void * key)                                      \
+{                                                                               \
+    RBTREE_COMPARE compare = tree->compare; (void) compare;                     \
+    nft_rbnode   * nodes   = tree->nodes;                                       \
+    unsigned     * sizes   = tree->sizes;                                       \
+    int            rank    = 0;                                                 \
+                                                                                \
+    for (unsigned node = ROOT; !IS_NIL(node); ) {                               \
+        unsigned side = COMPARE(key, KEY(node), NULL, NULL) > 0;                \
+        rank += side ? sizes[LEFT(node)] + 1 : 0;                               \
+        node  = CHILD(node, side);                                              \
+    }                                                                           \
+    return rank;                                                                \
+}                                                                               \
+static int                                                                      \
+probe_##keys(nft_rbtree * tree, nft_rbnode * nodes, unsigned num,               \
+             void * key, void * data, unsigned * found)                         \
+{                                                                               \
+    RBTREE_COMPARE compare = tree->compare; (void) compare;                     \
+    unsigned       node    = nodes ? ROOT : NIL;                                \
+    int            steps   = 0;                                                 \
+                                                                                \
+    *found = NIL;                                                               \
+    for ( ; !IS_NIL(node) && node < num && steps < OPTIMISTIC_STEPS; steps++) { \
+        unsigned side = COMPARE(key, KEY(node), data, DATA(node)) > 0;          \
+        *found = side ? *found : node;                                          \
+        node   = CHILD(node, side);                                             \
+    }                                                                           \
+    return IS_NIL(node);                                                        \
+}                                                                               \
+static unsigned                                                                 \
+find_leaf_##keys(nft_rbtree * tree, void * key, void * data, unsigned * which)  \
+{                                                                               \
+    RBTREE_COMPARE compare = tree->compare; (void) compare;                     \
+    nft_rbnode   * nodes   = tree->nodes;                                       \
+    unsigned       x       = ROOT;                                              \
+    unsigned       node, side;                                                  \
+                                                                                \
+    do {                                                                        \
+        node = x;                                                               \
+        side = COMPARE(key, KEY(node), data, DATA(node)) >= 0;                  \
+        x    = CHILD(node, side);                                               \
+    } while (!IS_NIL(x));                                                       \
+                                                                                \
+    *which = side;                                                              \
+    return node;                                                                \
+}
+
+DEFINE_FINDERS(generic,  COMPARE_GENERIC)
+DEFINE_FINDERS(pointers, COMPARE_POINTERS)
+DEFINE_FINDERS(integers, COMPARE_INTEGERS)
+
+/* Compare key k1 to k2, as the tree's comparator would.
+ */
+static inline long
+node_compare(nft_rbtree * tree, void * k1, void * k2, void * d1, void * d2)
+{
+    RBTREE_COMPARE compare = tree->compare;
+
+    switch (tree->keys) {
+    case KEYS_POINTERS: return COMPARE_POINTERS(k1, k2, d1, d2);
+    case KEYS_INTEGERS: return COMPARE_INTEGERS(k1, k2, d1, d2);
+    default:            return COMPARE_GENERIC (k1, k2, d1, d2);
+    }
+}
+
+/* Find the first node whose key is greater than key, or if equal is true,
+ * not less than key. Returns NIL if there is no such node.
+ */
+static unsigned
+node_seek_ge(nft_rbtree * tree, void * key, void * token, int equal)
+{
+    switch (tree->keys) {
+    case KEYS_POINTERS: return seek_ge_pointers(tree, key, token, equal);
+    case KEYS_INTEGERS: return seek_ge_integers(tree, key, token, equal);
+    default:            return seek_ge_generic (tree, key, token, equal);
+    }
+}
+
+/* Find the last node whose key is not greater than key, or NIL.
+ */
+static unsigned
+node_seek_le(nft_rbtree * tree, void * key, void * token)
+{
+    switch (tree->keys) {
+    case KEYS_POINTERS: return seek_le_pointers(tree, key, token);
+    case KEYS_INTEGERS: return seek_le_integers(tree, key, token);
+    default:            return seek_le_generic (tree, key, token);
+    }
+}
+
+/* Return the number of keys less than key, using the subtree sizes.
+ */
+static int
+node_rank(nft_rbtree * tree, void * key)
+{
+    switch (tree->keys) {
+    case KEYS_POINTERS: return rank_pointers(tree, key);
+    case KEYS_INTEGERS: return rank_integers(tree, key);
+    default:            return rank_generic (tree, key);
+    }
+}
+
+/* Find the node with the given key (and data, for duplex keys), or NIL.
+ * If there are several, this finds the first of them.
+ */
+static unsigned
+find_node(nft_rbtree * tree, void * key, void * data)
+{
+    unsigned node = node_seek_ge(tree, key, data, 1);
+    if (IS_NIL(node)) return NIL;
+
+    nft_rbnode * nodes = tree->nodes;
+    return node_compare(tree, key, KEY(node), data, DATA(node)) ? NIL : node;
+}
+
 /*  Insert a node into a non-empty tree.
  *  attach_leaf() is used on empty trees.
  */
 static void
 insert_node(nft_rbtree *tree, void *key, void *data)
 {
-    RBTREE_COMPARE compare = tree->compare;
     nft_rbnode   * nodes   = tree->nodes;
-    long           comp    = -1;
+    unsigned       which, node;
 
     // This never gets called on an empty tree.
     assert(!IS_NIL(ROOT));
 
-    unsigned x = ROOT;
-    unsigned node;
-
     // Find the node to which to attach the new leaf.
-    do {
-        node = x;
-
-        /* Provide four parameters to comparison function to support duplex keys.
-         * A simple comparison function can ignore the last two parameters.
-         */
-        comp = compare(key, KEY(node), data, DATA(node));
-
-        x = (comp < 0) ? LEFT(node) : RIGHT(node) ;
-
-    } while (!IS_NIL(x));
+    switch (tree->keys) {
+    case KEYS_POINTERS: node = find_leaf_pointers(tree, key, data, &which); break;
+    case KEYS_INTEGERS: node = find_leaf_integers(tree, key, data, &which); break;
+    default:            node = find_leaf_generic (tree, key, data, &which); break;
+    }
 
     // Attach a new leaf under node, and rebalance the tree.
-    unsigned leaf = attach_leaf(tree, node, key, data, comp >= 0 );
+    unsigned leaf = attach_leaf(tree, node, key, data, which);
     SET_RED(leaf);
     insert_fixup(tree, leaf);
     return;
@@ -298,7 +535,7 @@ delete_fixup(nft_rbtree * tree, unsigned x)
         {
             RESET_RED(w);
             SET_RED(p);
-            rotate(nodes, PARENT(p), p, w);
+            rotate(tree, PARENT(p), p, w);
             w = CHILD(p, right);                assert(!IS_NIL(w));
         }
         // w is now black. If both children are also black...
@@ -314,7 +551,7 @@ delete_fixup(nft_rbtree * tree, unsigned x)
 
                 RESET_RED(CHILD(w, left));
                 SET_RED(w);
-                rotate(nodes, p, w, CHILD(w, left));
+                rotate(tree, p, w, CHILD(w, left));
                 w = CHILD(p, right);            assert(!IS_NIL(w));
             }
             // Now the right child is red, and the left black
@@ -324,7 +561,7 @@ delete_fixup(nft_rbtree * tree, unsigned x)
                 RESET_RED(w);
             RESET_RED(p);
             RESET_RED(CHILD(w, right));
-            rotate(nodes, PARENT(p), p, w);
+            rotate(tree, PARENT(p), p, w);
             x = ROOT;
             break;
         }
@@ -368,11 +605,15 @@ delete_node(nft_rbtree * tree, unsigned z)
         // y has at least one Nil child, so we can splice y out by promoting the other child.
         y = z;
 
-        // If z was to be the next walk node, increment the walk to z's successor.
+        // If z was to be the next walk node, advance the walk past z.
         if (tree->current == y)
-            tree->current = node_successor(tree, y);
+            tree->current = tree->reverse ? node_predecessor(tree, y) : node_successor(tree, y);
     }
     else {
+        // If z was to be the next node in a reverse walk, z's predecessor is next.
+        if (tree->current == z && tree->reverse)
+            tree->current = node_predecessor(tree, z);
+
         // Both of z's subtree's are full, so copy the key/data of z's successor to z, and remove the successor.
         y = node_successor(tree, z);
         KEY(z)  = KEY(y);
@@ -387,6 +628,11 @@ delete_node(nft_rbtree * tree, unsigned z)
     // x is the child of y that we will promote into y's place.  x could be the Nil node.
     x = (!IS_NIL(LEFT(y))) ? LEFT(y) : RIGHT(y) ;
 
+    // Discount y from the subtree sizes of its ancestors.
+    if (tree->sizes)
+        for (p = PARENT(y); !IS_NIL(p); p = PARENT(p))
+            tree->sizes[p]--;
+
     // To promote x, set its parent pointer to y's parent.
     p = PARENT(y);
     SET_PARENT(x, p);
@@ -408,6 +654,7 @@ delete_node(nft_rbtree * tree, unsigned z)
     if (y != z)
     {
         nodes[y] = nodes[z];
+        if (tree->sizes) tree->sizes[y] = tree->sizes[z];
 
         // Switch parent pointers in z's children to point to y.
         SET_PARENT( LEFT(z), y);
@@ -427,6 +674,286 @@ delete_node(nft_rbtree * tree, unsigned z)
     return;
 }
 
+/* Resize the sizes array, if the tree keeps order statistics.
+ * The sizes array must be at least as large as the nodes array,
+ * so a failure to shrink it is harmless, but a failure to grow it is not.
+ */
+static int
+resize_sizes(nft_rbtree * tree, int new_size)
+{
+    if (tree->flags & RBTREE_ORDER_STATS)
+    {
+        unsigned * new_sizes = realloc(tree->sizes, new_size * sizeof(unsigned));
+        if (new_sizes) {
+            if (tree->sizes == NULL)
+                new_sizes[0] = 0;
+            tree->sizes = new_sizes;
+        }
+        else if (new_size > tree->num_nodes)
+            return 0;
+    }
+    return 1;
+}
+
+/* The nodes and sizes arrays, when they are shared by a tree and its
+ * snapshots. The last tree to release them frees them.
+ */
+typedef struct shared_nodes
+{
+    unsigned               refs;
+    nft_rbnode           * nodes;
+    unsigned             * sizes;
+} shared_nodes;
+
+/* A nodes array that was replaced while optimistic readers may be using it.
+ */
+typedef struct retired_nodes
+{
+    struct retired_nodes * next;
+    nft_rbnode           * nodes;
+    shared_nodes         * shared;
+    unsigned long          epoch;   // The epoch in which it was replaced
+} retired_nodes;
+
+/* Optimistic searches use epoch-based reclamation. Each thread that searches
+ * has a slot of its own, on a separate cache line, in which it records the
+ * epoch in which its current search began, or zero between searches, so that
+ * a search writes to no memory that other threads use. A writer that replaces
+ * a nodes array tags it with the epoch, and advances the epoch. The array is
+ * freed once no slot holds an epoch as old as its tag, since searches that
+ * began in later epochs can only have seen its replacement.
+ */
+#define READER_LINE     64
+
+#if defined(_WIN32) && !defined(__GNUC__)
+#define thread_local __declspec(thread)
+#else
+#define thread_local _Thread_local
+#endif
+
+typedef struct reader_slot
+{
+    _Alignas(READER_LINE)
+    unsigned long          epoch;   // Epoch of the search in progress, or zero
+    unsigned               depth;   // Nested searches, as from a comparator
+    int                    in_use;  // True while a thread owns the slot
+    struct reader_slot   * next;    // The list of all slots
+} reader_slot;
+
+// The epoch is only written when an array is retired, so it has its own line.
+static _Alignas(READER_LINE) unsigned long Epoch = 1;
+
+// Slots are recycled when their threads exit, via ReaderKey, but never freed.
+static reader_slot        * Readers = NULL;
+static thread_local reader_slot * Reader;
+static pthread_key_t        ReaderKey;
+static int                  ReaderKeyStatus = -1;
+static pthread_once_t       ReaderOnce = PTHREAD_ONCE_INIT;
+
+static void
+reader_release(void * arg)
+{
+    reader_slot * slot = arg;
+    slot->depth = 0;
+    __atomic_store_n(&slot->epoch,  0, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void
+reader_init(void)
+{
+    ReaderKeyStatus = pthread_key_create(&ReaderKey, reader_release);
+}
+
+/* Give the calling thread a slot, reusing one whose thread has exited.
+ * Returns NULL on failure.
+ */
+static reader_slot *
+reader_register(void)
+{
+    int r = pthread_once(&ReaderOnce, reader_init); assert(r == 0);
+    if (ReaderKeyStatus != 0) return NULL;
+
+    reader_slot * slot;
+    for (slot = __atomic_load_n(&Readers, __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+        int idle = 0;
+        if (__atomic_compare_exchange_n(&slot->in_use, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (!slot) {
+#ifdef _WIN32
+        slot = _aligned_malloc(sizeof(reader_slot), READER_LINE);
+#else
+        void * mem = NULL;
+        slot = posix_memalign(&mem, READER_LINE, sizeof(reader_slot)) ? NULL : mem;
+#endif
+        if (!slot) return NULL;
+        *slot = (reader_slot) { .in_use = 1 };
+        slot->next = __atomic_load_n(&Readers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&Readers, &slot->next, slot, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    if (pthread_setspecific(ReaderKey, slot)) {
+        reader_release(slot);
+        return NULL;
+    }
+    return Reader = slot;
+}
+
+/* Record the epoch in the thread's slot before a search loads the nodes array.
+ * The fence orders the store before those loads, and pairs with the fence in
+ * rbtree_unlock, so that a writer either sees the slot's epoch, or the search
+ * sees the new array. Returns NULL if the thread has no slot.
+ */
+static reader_slot *
+reader_enter(void)
+{
+    reader_slot * slot = Reader;
+    if (!slot && !(slot = reader_register())) return NULL;
+
+    if (slot->depth++ == 0) {
+        __atomic_store_n(&slot->epoch, __atomic_load_n(&Epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+    return slot;
+}
+
+static void
+reader_exit(reader_slot * slot)
+{
+    if (--slot->depth == 0)
+        __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Returns the epoch of the oldest search in progress, or ULONG_MAX if none.
+ */
+static unsigned long
+reader_oldest(void)
+{
+    unsigned long oldest = ULONG_MAX;
+    for (reader_slot * slot = __atomic_load_n(&Readers, __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+        unsigned long epoch = __atomic_load_n(&slot->epoch, __ATOMIC_ACQUIRE);
+        if (epoch && epoch < oldest) oldest = epoch;
+    }
+    return oldest;
+}
+
+static void
+release_shared(shared_nodes * shared)
+{
+    if (__atomic_sub_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(shared->nodes);
+        free(shared->sizes);
+        free(shared);
+    }
+}
+
+/* Free a list of retired nodes arrays.
+ */
+static void
+free_retired(retired_nodes * retired)
+{
+    while (retired) {
+        retired_nodes * next = retired->next;
+        if (retired->shared) release_shared(retired->shared);
+        free(retired->nodes);
+        free(retired);
+        retired = next;
+    }
+}
+
+/* Put a nodes array, or a reference to shared nodes, on the retired list.
+ * This must follow the store of the new nodes array, so that searches that
+ * begin in the next epoch see the new array.
+ */
+static void
+retire(nft_rbtree * tree, retired_nodes * retired, nft_rbnode * nodes, shared_nodes * shared)
+{
+    retired->nodes  = nodes;
+    retired->shared = shared;
+    retired->epoch  = __atomic_fetch_add(&Epoch, 1, __ATOMIC_SEQ_CST);
+    retired->next   = tree->retired;
+    tree->retired   = retired;
+}
+
+/* Grow the nodes array for a tree with optimistic readers. The old array
+ * is kept on the tree's retired list until no search can be using it (see
+ * rbtree_unlock), and the array is never shrunk, so that a reader who sees
+ * the new num_nodes also sees the new array, and a reader who sees the old
+ * num_nodes stays within either array. Returns 1 on success, zero on failure.
+ */
+static int
+retire_nodes(nft_rbtree * tree, unsigned new_size)
+{
+    if (new_size <= tree->num_nodes) return 1;
+
+    retired_nodes * retired   = malloc(sizeof(retired_nodes));
+    nft_rbnode    * new_nodes = malloc(new_size * sizeof(nft_rbnode));
+    if (!retired || !new_nodes || !resize_sizes(tree, new_size)) {
+        free(retired);
+        free(new_nodes);
+        return 0;
+    }
+    if (tree->nodes)
+        memcpy(new_nodes, tree->nodes, tree->next_free * sizeof(nft_rbnode));
+    else
+        new_nodes[0] = (nft_rbnode) { 0 };
+
+    nft_rbnode * old_nodes = tree->nodes;
+    __atomic_store_n(&tree->nodes,     new_nodes, __ATOMIC_RELEASE);
+    __atomic_store_n(&tree->num_nodes, new_size,  __ATOMIC_RELEASE);
+    retire(tree, retired, old_nodes, NULL);
+
+    assert(rbtree_validate(tree));
+    return 1;
+}
+
+/* Give the tree its own copy of the nodes and sizes arrays, if they are
+ * shared with a snapshot. This must precede any change to the tree.
+ * Returns 1 on success, zero on failure.
+ */
+static int
+own_nodes(nft_rbtree * tree)
+{
+    shared_nodes * shared = tree->shared;
+
+    // A tree mapped by rbtree_map is read-only.
+    if (tree->map) return 0;
+    if (!shared)   return 1;
+
+    // If the snapshots have all been freed, the arrays are ours again.
+    if (__atomic_load_n(&shared->refs, __ATOMIC_ACQUIRE) == 1) {
+        free(shared);
+        tree->shared = NULL;
+        return 1;
+    }
+    nft_rbnode    * nodes   = malloc(tree->num_nodes * sizeof(nft_rbnode));
+    unsigned      * sizes   = tree->sizes ? malloc(tree->num_nodes * sizeof(unsigned)) : NULL;
+    retired_nodes * retired = (tree->locking == RBTREE_LOCK_OPTIMISTIC) ? malloc(sizeof(retired_nodes)) : NULL;
+    if (!nodes || (tree->sizes && !sizes) || (tree->locking == RBTREE_LOCK_OPTIMISTIC && !retired)) {
+        free(nodes);
+        free(sizes);
+        free(retired);
+        return 0;
+    }
+    memcpy(nodes, tree->nodes, tree->next_free * sizeof(nft_rbnode));
+    if (sizes) memcpy(sizes, tree->sizes, tree->next_free * sizeof(unsigned));
+
+    tree->sizes  = sizes;
+    tree->shared = NULL;
+
+    // Optimistic readers may still be reading the shared array, so the
+    // reference is dropped once none are, see rbtree_unlock().
+    if (retired) {
+        __atomic_store_n(&tree->nodes, nodes, __ATOMIC_RELEASE);
+        retire(tree, retired, NULL, shared);
+    }
+    else {
+        tree->nodes = nodes;
+        release_shared(shared);
+    }
+    return 1;
+}
+
 /* This function expands or shrinks the tree by reallocing the nodes array.
  * Returns 1 on success, zero on failure.
  */
@@ -437,6 +964,11 @@ resize_nodes(nft_rbtree *tree, int new_size)
     if (new_size < 2)
         new_size = 2;
     assert(new_size > tree->next_free);
+    assert(!tree->shared);
+
+    // Optimistic readers may still be reading the old nodes array.
+    if (tree->locking == RBTREE_LOCK_OPTIMISTIC)
+        return retire_nodes(tree, new_size);
 
     // Attempt to realloc the nodes array to the new size.
     nft_rbnode * new_nodes = realloc(tree->nodes, new_size * sizeof(nft_rbnode));
@@ -450,7 +982,8 @@ resize_nodes(nft_rbtree *tree, int new_size)
     if (tree->nodes == NULL)
         new_nodes[0] = (nft_rbnode) { 0 };
 
-    tree->nodes     = new_nodes;
+    tree->nodes = new_nodes;
+    if (!resize_sizes(tree, new_size)) return 0;
     tree->num_nodes = new_size;
 
     assert(rbtree_validate(tree));
@@ -476,6 +1009,30 @@ rbtree_new(int min_nodes, RBTREE_COMPARE compare )
     return rbtree_create(nft_rbtree_class, sizeof(nft_rbtree), min_nodes, compare);
 }
 
+/*-----------------------------------------------------------------------------
+ *
+ * rbtree_new_ex	Create a new rbtree with optional features.
+ *
+ *-----------------------------------------------------------------------------
+ */
+nft_rbtree *
+rbtree_new_ex(int min_nodes, RBTREE_COMPARE compare, unsigned flags)
+{
+    if (flags & ~RBTREE_ORDER_STATS) return NULL;
+
+    // Set the flags before the nodes are allocated.
+    nft_rbtree * tree = rbtree_create(nft_rbtree_class, sizeof(nft_rbtree), 0, compare);
+    if (tree) {
+        tree->flags     = flags;
+        tree->min_nodes = min_nodes;
+        if (min_nodes > 0 && !resize_nodes(tree, min_nodes)) {
+            nft_rbtree_discard(tree);
+            return NULL;
+        }
+    }
+    return tree;
+}
+
 /*-----------------------------------------------------------------------------
  *
  * rbtree_vnew		Create a new rbtree variadic
@@ -544,6 +1101,12 @@ int
 rbtree_wrlock(nft_rbtree * tree)
 {
     int r = pthread_rwlock_wrlock(&tree->rwlock); assert(r == 0);
+
+    // An odd sequence number tells optimistic readers that a write is in progress.
+    if (tree->locking == RBTREE_LOCK_OPTIMISTIC) {
+        __atomic_store_n(&tree->seq, tree->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
     return r;
 }
 
@@ -556,10 +1119,105 @@ rbtree_wrlock(nft_rbtree * tree)
 int
 rbtree_unlock(nft_rbtree * tree)
 {
+    // Only a writer can hold the lock while the sequence number is odd.
+    if (tree->seq & 1)
+    {
+        /* Free the retired arrays that no optimistic search can be using:
+         * those retired before the epoch of the oldest search in progress.
+         * The list is in order of retirement, newest first.
+         */
+        if (tree->retired) {
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            unsigned long    oldest = reader_oldest();
+            retired_nodes ** tail   = &tree->retired;
+            while (*tail && (*tail)->epoch >= oldest)
+                tail = &(*tail)->next;
+            free_retired(*tail);
+            *tail = NULL;
+        }
+        __atomic_store_n(&tree->seq, tree->seq + 1, __ATOMIC_RELEASE);
+    }
+
     int r = pthread_rwlock_unlock(&tree->rwlock); assert(r == 0);
     return r;
 }
 
+/*-----------------------------------------------------------------------------
+ *
+ * rbtree_synchronize	Wait until no search can be using a deleted key.
+ *
+ * Advances the epoch, so that the searches that begin afterward see the
+ * tree as it is now, and waits until every slot is idle or holds a newer
+ * epoch. Once it returns, the keys deleted before the call may be freed.
+ * It must not be called during a search, as from a comparator.
+ *
+ *-----------------------------------------------------------------------------
+ */
+void
+rbtree_synchronize(nft_rbtree * tree)
+{
+    if (!tree || tree->locking != RBTREE_LOCK_OPTIMISTIC) return;
+    assert(!Reader || Reader->depth == 0);
+
+    // The fetch_add is a full barrier, which pairs with the fence in
+    // reader_enter, as the fence in rbtree_unlock does.
+    unsigned long epoch = __atomic_fetch_add(&Epoch, 1, __ATOMIC_SEQ_CST);
+    for (reader_slot * slot = __atomic_load_n(&Readers, __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+        for (;;) {
+            unsigned long e = __atomic_load_n(&slot->epoch, __ATOMIC_ACQUIRE);
+            if (e == 0 || e > epoch) break;
+            sched_yield();
+        }
+    }
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ * rbtree_snapshot	Create a tree that shares the nodes of another tree.
+ *
+ * The nodes are shared until either tree is changed, see own_nodes().
+ *
+ *-----------------------------------------------------------------------------
+ */
+nft_rbtree *
+rbtree_snapshot(nft_rbtree * tree)
+{
+    if (!tree || tree->map) return NULL;
+
+    nft_rbtree * snap = rbtree_create(nft_rbtree_class, sizeof(nft_rbtree), 0, tree->compare);
+    if (!snap) return NULL;
+
+    // The write lock keeps other snapshots from sharing the nodes concurrently.
+    if (tree->locking) rbtree_wrlock(tree);
+
+    if (tree->nodes && !tree->shared) {
+        if ((tree->shared = malloc(sizeof(shared_nodes))))
+            *tree->shared = (shared_nodes) { 1, tree->nodes, tree->sizes };
+    }
+    if (tree->nodes && tree->shared) {
+        __atomic_add_fetch(&tree->shared->refs, 1, __ATOMIC_RELAXED);
+        snap->shared    = tree->shared;
+        snap->nodes     = tree->nodes;
+        snap->sizes     = tree->sizes;
+        snap->num_nodes = tree->num_nodes;
+        snap->next_free = tree->next_free;
+    }
+    snap->flags     = tree->flags;
+    snap->min_nodes = tree->min_nodes;
+    snap->locking   = tree->locking;
+
+    // If the nodes couldn't be shared, the snapshot fails.
+    int failed = tree->nodes && !tree->shared;
+
+    if (tree->locking) rbtree_unlock(tree);
+
+    if (failed) {
+        nft_rbtree_discard(snap);
+        return NULL;
+    }
+    return snap;
+}
+
 /*-----------------------------------------------------------------------------
  *
  * rbtree_create
@@ -588,10 +1246,22 @@ rbtree_create (const char * class, size_t size, int min_nodes, RBTREE_COMPARE co
     tree->core.destroy = rbtree_destroy;
     tree->compare   = compare;
     tree->min_nodes = min_nodes;
+
+    // The common comparators are replaced by inline comparisons.
+    tree->keys      = (compare == (RBTREE_COMPARE) rbtree_compare_pointers) ? KEYS_POINTERS :
+                      (compare == (RBTREE_COMPARE) rbtree_compare_integers) ? KEYS_INTEGERS : KEYS_GENERIC;
     tree->num_nodes = 0;
     tree->nodes     = NULL;
+    tree->sizes     = NULL;
+    tree->retired   = NULL;
+    tree->shared    = NULL;
+    tree->map       = NULL;
+    tree->map_size  = 0;
+    tree->seq       = 0;
+    tree->flags     = 0;
     tree->next_free = 1; // remember that the zeroth node is our sentinel
     tree->current   = 0;
+    tree->reverse   = 0;
     tree->locking   = 0;
     pthread_rwlock_init(&tree->rwlock, NULL);
 
@@ -618,7 +1288,17 @@ void rbtree_destroy(nft_core * core)
     // The _cast function will return NULL if core is not a nft_rbtree.
     nft_rbtree * rbtree = nft_rbtree_cast(core);
     if (rbtree) {
-	if (rbtree->nodes) free(rbtree->nodes);
+	if (rbtree->shared)
+	    release_shared(rbtree->shared);
+#ifndef _WIN32
+	else if (rbtree->map)
+	    munmap(rbtree->map, rbtree->map_size);
+#endif
+	else {
+	    if (rbtree->nodes) free(rbtree->nodes);
+	    if (rbtree->sizes) free(rbtree->sizes);
+	}
+	free_retired(rbtree->retired);
 	pthread_rwlock_destroy(&rbtree->rwlock);
     }
     // Remember to invoke the base-class destroyer last of all.
@@ -643,10 +1323,11 @@ rbtree_insert(nft_rbtree *tree,  void * key,  void * data)
     assert(tree->next_free <= tree->num_nodes || tree->num_nodes == 0);
 
     // Ensure that there is room to insert a key.
-    if (tree->next_free >= tree->num_nodes)
+    int owned = own_nodes(tree);
+    if (owned && tree->next_free >= tree->num_nodes)
         resize_nodes(tree, 2 * tree->num_nodes);
 
-    if (tree->next_free < tree->num_nodes) {
+    if (owned && tree->next_free < tree->num_nodes) {
         // The first node in an empty tree is made the left child of NIL.
         if (tree->next_free == 1)
             attach_leaf(tree, NIL, key, data, 0);
@@ -658,37 +1339,605 @@ rbtree_insert(nft_rbtree *tree,  void * key,  void * data)
     return result;
 }
 
-/*-----------------------------------------------------------------------------
- *
- * rbtree_replace	Insert the key, or update an existing entry.
- *
- * Returns:	2	An existing key-data pair was replaced.
- *			The *data was overwritten with the previous data.
- *		1	A new node was inserted successfully.
- *		0	The key-data pair could not be inserted.
- *
- *-----------------------------------------------------------------------------
+/* When a pool is given, build_tree builds the subtrees at BUILD_SPLIT_DEPTH
+ * in parallel. Since the node numbers follow key order, the subtrees occupy
+ * disjoint ranges of the nodes array, and each subtree's root is known
+ * before it is built.
  */
-int
-rbtree_replace(nft_rbtree *tree, void *key, void **data)
+#define BUILD_SPLIT_DEPTH   3
+#define BUILD_SPLIT_MIN     65536   // The least number of pairs worth splitting
+
+typedef struct build_task
 {
-    int result = 0;
+    nft_rbtree   * tree;
+    void        ** keys, ** data;
+    int            lo, hi, depth, deepest;
+    unsigned       parent;
+} build_task;
+
+typedef struct build_tasks
+{
+    nft_pool_h     pool;
+    int            count;
+    build_task     task  [1 << BUILD_SPLIT_DEPTH];
+    nft_future_h   future[1 << BUILD_SPLIT_DEPTH];
+} build_tasks;
+
+static void * build_subtree(void * arg);
+
+/* Build a balanced subtree from the sorted pairs lo..hi, storing pair i
+ * in node i+1, so that the node numbers follow key order. Nodes at the
+ * deepest level are red, and all others are black, so that every path
+ * to a leaf holds the same number of black nodes. Returns the root.
+ */
+static unsigned
+build_nodes(nft_rbtree * tree, void ** keys, void ** data, int lo, int hi,
+            unsigned parent, int depth, int deepest, build_tasks * tasks)
+{
+    if (lo > hi) return NIL;
+
+    nft_rbnode * nodes = tree->nodes;
+    int          mid   = lo + (hi - lo) / 2;
+    unsigned     node  = mid + 1;
+
+    if (tasks && depth == BUILD_SPLIT_DEPTH) {
+        build_task * task = &tasks->task[tasks->count];
+        *task = (build_task) { tree, keys, data, lo, hi, depth, deepest, parent };
+        tasks->future[tasks->count++] = nft_pool_submit_wait(tasks->pool, 0, build_subtree, task);
+        return node;
+    }
+    nodes[node] = (nft_rbnode) { keys[mid], data ? data[mid] : NULL, { NIL, NIL }, parent, depth == deepest };
+    LEFT(node)  = build_nodes(tree, keys, data, lo, mid - 1, node, depth + 1, deepest, tasks);
+    RIGHT(node) = build_nodes(tree, keys, data, mid + 1, hi, node, depth + 1, deepest, tasks);
+
+    if (tree->sizes) tree->sizes[node] = hi - lo + 1;
+
+    // Optimistic readers must not find the node before it is initialized.
+    if (tree->locking == RBTREE_LOCK_OPTIMISTIC)
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    return node;
+}
+
+static void *
+build_subtree(void * arg)
+{
+    build_task * t = arg;
+    build_nodes(t->tree, t->keys, t->data, t->lo, t->hi, t->parent, t->depth, t->deepest, NULL);
+    return NULL;
+}
+
+/* Replace the contents of the tree with n sorted pairs, in O(n) time.
+ * If pool is not NULL, large trees are built in parallel.
+ * Returns 1 on success, or zero if the nodes array could not be grown.
+ */
+static int
+build_tree(nft_rbtree * tree, void ** keys, void ** data, int n, nft_pool_h pool)
+{
+    if (tree->num_nodes < n + 1 &&
+        !resize_nodes(tree, (n + 1 > tree->min_nodes) ? n + 1 : tree->min_nodes))
+        return 0;
+
+    // The tree's height is floor(log2(n)).
+    int deepest = 0;
+    while ((2 << deepest) <= n) deepest++;
+
+    nft_rbnode * nodes = tree->nodes;
+    tree->next_free = n + 1;
+    tree->current   = NIL;
+    build_tasks * tasks = (pool && n >= BUILD_SPLIT_MIN) ? malloc(sizeof(build_tasks)) : NULL;
+    if (tasks) {
+        tasks->pool  = pool;
+        tasks->count = 0;
+    }
+    ROOT = build_nodes(tree, keys, data, 0, n - 1, NIL, 0, deepest, tasks);
+
+    // Build the subtrees that could not be submitted to the pool ourselves.
+    if (tasks) {
+        for (int i = 0; i < tasks->count; i++)
+            if (!tasks->future[i] || nft_future_get(tasks->future[i], -1, NULL) != 0)
+                build_subtree(&tasks->task[i]);
+        for (int i = 0; i < tasks->count; i++)
+            if (tasks->future[i]) nft_future_free(tasks->future[i]);
+        free(tasks);
+    }
+    RESET_RED(ROOT);
+
+    assert(rbtree_validate(tree));
+    return 1;
+}
+
+/* Sort n pairs by key with a stable merge sort, using temp for scratch space.
+ */
+static void
+sort_pairs(RBTREE_COMPARE compare, void ** keys, void ** data, void ** tkeys, void ** tdata, int n)
+{
+    if (n < 2) return;
+
+    int half = n / 2;
+    sort_pairs(compare, keys, data, tkeys, tdata, half);
+    sort_pairs(compare, keys + half, data + half, tkeys, tdata, n - half);
+
+    // Merge the two halves via temp, preferring the left on equal keys.
+    int i = 0, j = half, k = 0;
+    while (i < half && j < n) {
+        if (compare(keys[j], keys[i], data[j], data[i]) < 0)
+            tkeys[k] = keys[j], tdata[k++] = data[j++];
+        else
+            tkeys[k] = keys[i], tdata[k++] = data[i++];
+    }
+    while (i < half) tkeys[k] = keys[i], tdata[k++] = data[i++];
+    while (j < n)    tkeys[k] = keys[j], tdata[k++] = data[j++];
+
+    memcpy(keys, tkeys, n * sizeof(void *));
+    memcpy(data, tdata, n * sizeof(void *));
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ * rbtree_build_sorted	Load an empty tree from arrays of sorted pairs.
+ *
+ * This builds a balanced tree directly into the nodes array, in O(n) time.
+ * The data array may be NULL, in which case all data values are NULL.
+ * Returns 1 on success, or zero if the tree is not empty, the keys are not
+ * sorted, or memory is exhausted.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+rbtree_build_sorted(nft_rbtree * tree, void ** keys, void ** data, int n)
+{
+    if (!tree || n < 0 || (n > 0 && !keys)) return 0;
+    if (tree->locking) rbtree_wrlock(tree);
+
+    int result = (rbtree_count(tree) == 0) && own_nodes(tree);
+
+    for (int i = 1; result && i < n; i++)
+        if (tree->compare(keys[i], keys[i-1], data ? data[i] : NULL, data ? data[i-1] : NULL) < 0)
+            result = 0;
+
+    if (result && n > 0)
+        result = build_tree(tree, keys, data, n, NULL);
+
+    if (tree->locking) rbtree_unlock(tree);
+    return result;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ * rbtree_insert_many	Insert n key-data pairs.
+ *
+ * When the batch is large relative to the tree, the batch is sorted
+ * and merged with the tree's pairs, and the tree is rebuilt in O(n + m)
+ * time. A rebuild ends any walk in progress. Smaller batches are inserted
+ * individually, after growing the nodes array once. As with rbtree_insert,
+ * equal keys are placed after existing keys. The data array may be NULL.
+ * Returns 1 on success, or zero if memory is exhausted, in which case
+ * the tree is unchanged.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+rbtree_insert_many(nft_rbtree * tree, void ** keys, void ** data, int n)
+{
+    if (!tree || n < 0 || (n > 0 && !keys)) return 0;
+    if (n == 0) return 1;
+    if (tree->locking) rbtree_wrlock(tree);
+
+    unsigned count  = rbtree_count(tree);
+    int      result = 0;
+
+    if (!own_nodes(tree))
+        ;
+    else if (n < count / 16)
+    {
+        if (tree->num_nodes >= count + n + 1 || resize_nodes(tree, count + n + 1)) {
+            for (int i = 0; i < n; i++) {
+                if (tree->next_free == 1)
+                    attach_leaf(tree, NIL, keys[i], data ? data[i] : NULL, 0);
+                else
+                    insert_node(tree, keys[i], data ? data[i] : NULL);
+            }
+            result = 1;
+        }
+    }
+    else if (count + n + 1 <= tree->num_nodes || resize_nodes(tree, count + n + 1))
+    {
+        // Lay out the tree's pairs, the batch, and scratch space for the sort and merge.
+        void ** pairs = malloc(4 * (count + n) * sizeof(void *));
+        if (pairs) {
+            void       ** tkeys = pairs, ** tdata = pairs + (count + n);
+            void       ** mkeys = pairs + 2 * (count + n), ** mdata = pairs + 3 * (count + n);
+            void       ** bkeys = tkeys + count, ** bdata = tdata + count;
+            nft_rbnode  * nodes = tree->nodes;
+            RBTREE_COMPARE compare = tree->compare;
+
+            memcpy(bkeys, keys, n * sizeof(void *));
+            if (data) memcpy(bdata, data, n * sizeof(void *));
+            else      memset(bdata, 0,    n * sizeof(void *));
+            sort_pairs(compare, bkeys, bdata, mkeys, mdata, n);
+
+            // Merge the tree's pairs with the batch, existing pairs first on equal keys.
+            unsigned node = node_first(tree);
+            int      j = 0, k = 0;
+            while (!IS_NIL(node) || j < n) {
+                if (IS_NIL(node) || (j < n && compare(bkeys[j], KEY(node), bdata[j], DATA(node)) < 0))
+                    mkeys[k] = bkeys[j], mdata[k++] = bdata[j++];
+                else {
+                    mkeys[k] = KEY(node), mdata[k++] = DATA(node);
+                    node = node_successor(tree, node);
+                }
+            }
+            result = build_tree(tree, mkeys, mdata, k, NULL);
+            free(pairs);
+        }
+    }
+    if (tree->locking) rbtree_unlock(tree);
+    return result;
+}
+
+/* The key-data pairs of a tree, in key order.
+ */
+typedef struct pairs
+{
+    void    ** keys;
+    void    ** data;
+    unsigned   count;
+} pairs;
+
+/* Copy the tree's pairs into p, in key order. Returns 1 on success,
+ * or zero on a malloc failure. The caller must free p->keys.
+ */
+static int
+flatten(nft_rbtree * tree, pairs * p)
+{
+    if (tree->locking) rbtree_rdlock(tree);
+
+    nft_rbnode * nodes = tree->nodes;
+    unsigned     count = rbtree_count(tree);
+
+    p->count = 0;
+    p->keys  = malloc(2 * (count + 1) * sizeof(void *));
+    p->data  = p->keys + count + 1;
+    if (p->keys)
+        for (unsigned node = node_first(tree); !IS_NIL(node); node = node_successor(tree, node)) {
+            p->keys[p->count]   = KEY(node);
+            p->data[p->count++] = DATA(node);
+        }
+    if (tree->locking) rbtree_unlock(tree);
+    return p->keys != NULL;
+}
+
+/* Return the index of the first pair in p that is not less than key.
+ */
+static unsigned
+lower_bound(RBTREE_COMPARE compare, pairs * p, unsigned lo, unsigned hi, void * key, void * data)
+{
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (compare(p->keys[mid], key, p->data[mid], data) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Build a new tree like tree, from n sorted pairs, using the pool if given.
+ * Returns NULL on failure.
+ */
+static nft_rbtree *
+new_tree_from(nft_rbtree * tree, void ** keys, void ** data, unsigned n, nft_pool_h pool)
+{
+    nft_rbtree * result = rbtree_new_ex(0, tree->compare, tree->flags);
+    if (result && n > 0 && !build_tree(result, keys, data, n, pool)) {
+        rbtree_free(result);
+        return NULL;
+    }
+    if (result) result->locking = tree->locking;
+    return result;
+}
+
+/* The set operations merge the pairs of two trees, divided into chunks
+ * that can be merged in parallel. Each chunk holds a range of t1's pairs,
+ * and the range of t2's pairs that fall between the same keys.
+ */
+enum { SET_UNION, SET_INTERSECTION, SET_DIFFERENCE };
+
+#define SET_CHUNKS      8       // The number of chunks, when a pool is given
+#define SET_CHUNK_MIN   4096    // The least number of pairs worth a chunk
+
+typedef struct set_chunk
+{
+    RBTREE_COMPARE compare;
+    int            op;
+    pairs          in1, in2;    // The chunk's pairs from t1 and t2
+    pairs          out;         // The chunk's result
+} set_chunk;
+
+static void *
+merge_chunk(void * arg)
+{
+    set_chunk    * c       = arg;
+    RBTREE_COMPARE compare = c->compare;
+    pairs        * a = &c->in1, * b = &c->in2, * out = &c->out;
+    unsigned       i = 0, j = 0;
+
+#define EMIT(p, n)  (out->keys[out->count] = (p)->keys[n], out->data[out->count++] = (p)->data[n])
+
+    while (i < a->count) {
+        long comp = (j < b->count) ? compare(a->keys[i], b->keys[j], a->data[i], b->data[j]) : -1;
+        if (comp > 0) {
+            if (c->op == SET_UNION) EMIT(b, j);
+            j++;
+            continue;
+        }
+        // The pair from t1 is in t2 if the keys are equal. Skip t2's equal keys
+        // after the last of t1's duplicates of the key.
+        int in_t2 = (comp == 0);
+        if (c->op == SET_UNION || (c->op == SET_INTERSECTION) == in_t2)
+            EMIT(a, i);
+        i++;
+        if (in_t2 && (i == a->count || compare(a->keys[i], a->keys[i - 1], a->data[i], a->data[i - 1]) != 0))
+            while (j < b->count && compare(a->keys[i - 1], b->keys[j], a->data[i - 1], b->data[j]) == 0)
+                j++;
+    }
+    for (; c->op == SET_UNION && j < b->count; j++)
+        EMIT(b, j);
+#undef EMIT
+
+    return NULL;
+}
+
+/* Returns true if it is cheaper to search a tree of large pairs for each
+ * of small keys, in O(small * log(large)) time, than to merge the pairs.
+ */
+static int
+set_probe(unsigned small, unsigned large)
+{
+    unsigned depth = 1;
+    while (large >> depth) depth++;
+    return (uint64_t) small * depth < large;
+}
+
+/* Intersection or difference of a small t1 with a large t2. The pairs of t1
+ * are kept or dropped according to whether t2 holds their keys.
+ */
+static nft_rbtree *
+set_probe_t2(nft_rbtree * t1, nft_rbtree * t2, int op, nft_pool_h pool)
+{
+    pairs p1;
+    if (!flatten(t1, &p1)) return NULL;
+
+    unsigned count = 0;
+    if (t2->locking) rbtree_rdlock(t2);
+    for (unsigned i = 0; i < p1.count; i++) {
+        int in_t2 = !IS_NIL(find_node(t2, p1.keys[i], p1.data[i]));
+        if ((op == SET_INTERSECTION) == in_t2)
+            p1.keys[count] = p1.keys[i], p1.data[count++] = p1.data[i];
+    }
+    if (t2->locking) rbtree_unlock(t2);
+
+    nft_rbtree * result = new_tree_from(t1, p1.keys, p1.data, count, pool);
+    free(p1.keys);
+    return result;
+}
+
+/* Intersection of a large t1 with a small t2. The pairs of t1 whose keys
+ * are in t2 are found by seeking to each of t2's distinct keys.
+ */
+static nft_rbtree *
+set_probe_t1(nft_rbtree * t1, nft_rbtree * t2, nft_pool_h pool)
+{
+    pairs p2, out = { 0 };
+    if (!flatten(t2, &p2)) return NULL;
+
+    nft_rbtree * result = NULL;
+    if (t1->locking) rbtree_rdlock(t1);
+
+    // The intersection holds every duplicate in t1 of a key in t2,
+    // so count them before allocating it.
+    for (int pass = 0; pass < 2; pass++) {
+        nft_rbnode * nodes = t1->nodes;
+        unsigned     count = 0;
+        for (unsigned j = 0; j < p2.count; j++) {
+            if (j > 0 && t1->compare(p2.keys[j], p2.keys[j - 1], p2.data[j], p2.data[j - 1]) == 0)
+                continue;
+            for (unsigned node = node_seek_ge(t1, p2.keys[j], p2.data[j], 1);
+                 !IS_NIL(node) && !node_compare(t1, p2.keys[j], KEY(node), p2.data[j], DATA(node));
+                 node = node_successor(t1, node), count++)
+                if (pass) out.keys[count] = KEY(node), out.data[count] = DATA(node);
+        }
+        if (pass) out.count = count;
+        else if ((out.keys = malloc(2 * (count + 1) * sizeof(void *))))
+            out.data = out.keys + count + 1;
+        else break;
+    }
+    if (t1->locking) rbtree_unlock(t1);
+
+    if (out.keys) result = new_tree_from(t1, out.keys, out.data, out.count, pool);
+    free(p2.keys);
+    free(out.keys);
+    return result;
+}
+
+/* Compute union, intersection, or difference of t1 and t2, as a new tree.
+ */
+static nft_rbtree *
+set_operation(nft_rbtree * t1, nft_rbtree * t2, int op, nft_pool_h pool)
+{
+    // The merge relies on both trees being in the same order.
+    if (!t1 || !t2 || t1->compare != t2->compare) return NULL;
+
+    // When one tree is much smaller, search the other for its keys, rather
+    // than flatten both. A union holds every pair of both, so it is merged.
+    unsigned n1 = rbtree_count(t1), n2 = rbtree_count(t2);
+    if (op != SET_UNION && set_probe(n1, n2))
+        return set_probe_t2(t1, t2, op, pool);
+    if (op == SET_INTERSECTION && set_probe(n2, n1))
+        return set_probe_t1(t1, t2, pool);
+
+    nft_rbtree * result = NULL;
+    pairs        p1, p2, out = { 0 };
+    if (!flatten(t1, &p1)) return NULL;
+    if (!flatten(t2, &p2)) { free(p1.keys); return NULL; }
+
+    unsigned  size   = (op == SET_UNION) ? p1.count + p2.count : p1.count;
+    int       chunks = (pool && p1.count >= 2 * SET_CHUNK_MIN) ? SET_CHUNKS : 1;
+    if (chunks > p1.count / SET_CHUNK_MIN && chunks > 1)
+        chunks = p1.count / SET_CHUNK_MIN;
+
+    out.keys = malloc(2 * (size + 1) * sizeof(void *));
+    out.data = out.keys + size + 1;
+    set_chunk    * chunk  = malloc(chunks * sizeof(set_chunk));
+    nft_future_h * future = calloc(chunks, sizeof(nft_future_h));
+
+    if (out.keys && chunk && future)
+    {
+        // Divide t1's pairs evenly, without dividing equal keys between chunks.
+        unsigned a = 0, b = 0;
+        for (int i = 0; i < chunks; i++) {
+            unsigned next_a = (i + 1 == chunks) ? p1.count : (unsigned) ((uint64_t) p1.count * (i + 1) / chunks);
+            if (next_a < a) next_a = a;
+            while (next_a > a && next_a < p1.count &&
+                   t1->compare(p1.keys[next_a], p1.keys[next_a - 1], p1.data[next_a], p1.data[next_a - 1]) == 0)
+                next_a++;
+            unsigned next_b = (next_a == p1.count) ? p2.count :
+                              lower_bound(t1->compare, &p2, b, p2.count, p1.keys[next_a], p1.data[next_a]);
+            unsigned offset = (op == SET_UNION) ? a + b : a;
+
+            chunk[i] = (set_chunk) { t1->compare, op,
+                                     { p1.keys + a, p1.data + a, next_a - a },
+                                     { p2.keys + b, p2.data + b, next_b - b },
+                                     { out.keys + offset, out.data + offset, 0 } };
+            a = next_a, b = next_b;
+        }
+
+        // Merge the first chunk in this thread, while the pool merges the rest.
+        // Never wait for room in the pool's queue, since the chunks that it
+        // cannot take are merged here.
+        for (int i = 1; i < chunks; i++)
+            future[i] = nft_pool_submit_wait(pool, 0, merge_chunk, &chunk[i]);
+        merge_chunk(&chunk[0]);
+        for (int i = 1; i < chunks; i++)
+            if (!future[i] || nft_future_get(future[i], -1, NULL) != 0)
+                merge_chunk(&chunk[i]);
+        for (int i = 1; i < chunks; i++)
+            if (future[i]) nft_future_free(future[i]);
+
+        // Close the gaps between the chunks' results.
+        for (int i = 0; i < chunks; i++) {
+            memmove(out.keys + out.count, chunk[i].out.keys, chunk[i].out.count * sizeof(void *));
+            memmove(out.data + out.count, chunk[i].out.data, chunk[i].out.count * sizeof(void *));
+            out.count += chunk[i].out.count;
+        }
+        result = new_tree_from(t1, out.keys, out.data, out.count, pool);
+    }
+    free(p1.keys);
+    free(p2.keys);
+    free(out.keys);
+    free(chunk);
+    free(future);
+    return result;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ * rbtree_union		Return a new tree with the pairs of t1,
+ *			and the pairs of t2 whose keys are not in t1.
+ * rbtree_intersection	Return a new tree with the pairs of t1 whose keys are in t2.
+ * rbtree_difference	Return a new tree with the pairs of t1 whose keys are not in t2.
+ *
+ *-----------------------------------------------------------------------------
+ */
+nft_rbtree *
+rbtree_union(nft_rbtree * t1, nft_rbtree * t2, nft_pool_h pool)
+{
+    return set_operation(t1, t2, SET_UNION, pool);
+}
+nft_rbtree *
+rbtree_intersection(nft_rbtree * t1, nft_rbtree * t2, nft_pool_h pool)
+{
+    return set_operation(t1, t2, SET_INTERSECTION, pool);
+}
+nft_rbtree *
+rbtree_difference(nft_rbtree * t1, nft_rbtree * t2, nft_pool_h pool)
+{
+    return set_operation(t1, t2, SET_DIFFERENCE, pool);
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ * rbtree_join		Insert all of t2's pairs into t1.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+rbtree_join(nft_rbtree * t1, nft_rbtree * t2)
+{
+    pairs p;
+    if (!t1 || !t2 || !flatten(t2, &p)) return 0;
+
+    int result = rbtree_insert_many(t1, p.keys, p.data, p.count);
+    free(p.keys);
+    return result;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ * rbtree_split		Return new trees with the pairs whose keys are
+ *			less than key, and those that are not.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+rbtree_split(nft_rbtree * tree, void * key, nft_rbtree ** lo, nft_rbtree ** hi)
+{
+    pairs p;
+    if (!tree || !lo || !hi || !flatten(tree, &p)) return 0;
+
+    unsigned split = lower_bound(tree->compare, &p, 0, p.count, key, NULL);
+
+    *lo = new_tree_from(tree, p.keys, p.data, split, NULL);
+    *hi = new_tree_from(tree, p.keys + split, p.data + split, p.count - split, NULL);
+    free(p.keys);
+
+    if (!*lo || !*hi) {
+        if (*lo) rbtree_free(*lo);
+        if (*hi) rbtree_free(*hi);
+        *lo = *hi = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ * rbtree_replace	Insert the key, or update an existing entry.
+ *
+ * Returns:	2	An existing key-data pair was replaced.
+ *			The *data was overwritten with the previous data.
+ *		1	A new node was inserted successfully.
+ *		0	The key-data pair could not be inserted.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+rbtree_replace(nft_rbtree *tree, void *key, void **data)
+{
+    int result = 0;
 
     if (!tree) return 0;
     if (tree->locking) rbtree_wrlock(tree);
+    if (!own_nodes(tree)) {
+        if (tree->locking) rbtree_unlock(tree);
+        return 0;
+    }
 
-    RBTREE_COMPARE compare = tree->compare;
     nft_rbnode   * nodes   = tree->nodes;
-    long           comp    = -1;
-    unsigned       node;
-
-    // Find the given key.
-    for (node = ROOT;
-	 node != NIL && (comp = compare(key, KEY(node), *data, DATA(node)));
-	 node = (comp < 0) ? LEFT(node) : RIGHT(node));
+    unsigned       node    = find_node(tree, key, *data);
 
     // If key found, replace key and data, else insert a new node.
-    if (comp == 0) {
+    if (node != NIL) {
         void * save = DATA(node);
         KEY(node)   = key;
 	DATA(node)  = *data;
@@ -730,21 +1979,17 @@ rbtree_delete(nft_rbtree * tree,  void *key,  void **data)
 
     if (tree->locking) rbtree_wrlock(tree);
 
-    RBTREE_COMPARE compare = tree->compare;
-    nft_rbnode   * nodes   = tree->nodes;
-    void         * token   = data ? *data : NULL;
-    long           comp    = -1;
-    unsigned       node;
-
     // Find the given key.
-    for (node = ROOT;
-	 node != NIL && (comp = compare(key, KEY(node), token, DATA(node)));
-	 node = (comp < 0) ? LEFT(node) : RIGHT(node) );
+    unsigned node = find_node(tree, key, data ? *data : NULL);
+
+    // The tree can't be changed if it can't be unshared from its snapshots.
+    if (node != NIL && !own_nodes(tree))
+        node = NIL;
 
     // If the key is found, store the data and delete node.
-    if (comp == 0)
+    if (node != NIL)
     {
-	assert(!IS_NIL(node));
+	nft_rbnode * nodes = tree->nodes;
 
 	if (data) *data = DATA(node);
 
@@ -752,6 +1997,7 @@ rbtree_delete(nft_rbtree * tree,  void *key,  void **data)
 
 	/* If only a quarter of the nodes are in use, halve the tree size.
 	 * Don't shrink below the initial allocation, though.
+	 * (With optimistic readers, the nodes array never shrinks.)
 	 */
 	if ((tree->next_free <  tree->num_nodes/4) &&
 	    (tree->min_nodes <= tree->num_nodes/2)  )
@@ -759,7 +2005,210 @@ rbtree_delete(nft_rbtree * tree,  void *key,  void **data)
     }
 
     if (tree->locking) rbtree_unlock(tree);
-    return (comp == 0);
+    return (node != NIL);
+}
+
+/* Return the number of levels in the subtree rooted at node.
+ */
+static int
+subtree_height(nft_rbnode * nodes, unsigned node)
+{
+    if (IS_NIL(node)) return 0;
+
+    int left  = subtree_height(nodes, LEFT(node));
+    int right = subtree_height(nodes, RIGHT(node));
+    return 1 + (left > right ? left : right);
+}
+
+static void layout_veb(nft_rbnode * nodes, unsigned node, int height, unsigned * map, unsigned * next);
+
+/* Lay out the subtrees whose roots are depth levels below node.
+ */
+static void
+layout_bottoms(nft_rbnode * nodes, unsigned node, int depth, int height, unsigned * map, unsigned * next)
+{
+    if (IS_NIL(node)) return;
+
+    if (depth == 0)
+        layout_veb(nodes, node, height, map, next);
+    else {
+        layout_bottoms(nodes, LEFT(node),  depth - 1, height, map, next);
+        layout_bottoms(nodes, RIGHT(node), depth - 1, height, map, next);
+    }
+}
+
+/* Assign new numbers to the top height levels of the subtree rooted at node,
+ * in van Emde Boas order: the top half of the levels, then each subtree below.
+ */
+static void
+layout_veb(nft_rbnode * nodes, unsigned node, int height, unsigned * map, unsigned * next)
+{
+    if (IS_NIL(node) || height <= 0) return;
+
+    if (height == 1)
+        map[node] = (*next)++;
+    else {
+        int top = height / 2;
+        layout_veb(nodes, node, top, map, next);
+        layout_bottoms(nodes, node, top, height - top, map, next);
+    }
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ * rbtree_compact	Trim the nodes array, and renumber the nodes.
+ *
+ * We compute a map from old to new node numbers, and copy the nodes into
+ * a new array in their new positions. Deletes keep the nodes dense, by
+ * moving the last node into the hole, so the tree occupies nodes 1..count.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+rbtree_compact(nft_rbtree * tree, unsigned layout)
+{
+    if (!tree || tree->map || layout > RBTREE_LAYOUT_VEB) return 0;
+    if (tree->locking) rbtree_wrlock(tree);
+
+    int          optimistic = (tree->locking == RBTREE_LOCK_OPTIMISTIC);
+    unsigned     used       = tree->next_free;
+    unsigned     new_size   = used > tree->min_nodes ? used : tree->min_nodes;
+    nft_rbnode * nodes      = tree->nodes;
+    int          result     = 0;
+
+    if (new_size < 2)  new_size = 2;
+    if (optimistic)    new_size = tree->num_nodes;
+
+    // An empty tree that has never allocated nodes is already compact.
+    if (!nodes) {
+        if (tree->locking) rbtree_unlock(tree);
+        return 1;
+    }
+    unsigned      * map       = malloc(used * sizeof(unsigned));
+    nft_rbnode    * new_nodes = malloc(new_size * sizeof(nft_rbnode));
+    unsigned      * new_sizes = tree->sizes ? malloc(new_size * sizeof(unsigned)) : NULL;
+    retired_nodes * retired   = optimistic ? malloc(sizeof(retired_nodes)) : NULL;
+
+    if (map && new_nodes && (new_sizes || !tree->sizes) && (retired || !optimistic))
+    {
+        unsigned next = 1;
+        map[NIL] = NIL;
+        switch (layout) {
+        case RBTREE_LAYOUT_NONE:
+            for (unsigned node = 1; node < used; node++)
+                map[node] = node;
+            break;
+        case RBTREE_LAYOUT_INORDER:
+            for (unsigned node = node_first(tree); !IS_NIL(node); node = node_successor(tree, node))
+                map[node] = next++;
+            break;
+        case RBTREE_LAYOUT_VEB:
+            layout_veb(nodes, ROOT, subtree_height(nodes, ROOT), map, &next);
+            break;
+        }
+        assert(layout == RBTREE_LAYOUT_NONE || next == used);
+
+        // Copy each node to its new position, renumbering its links.
+        new_nodes[NIL] = (nft_rbnode) { 0 };
+        new_nodes[NIL].child[0] = map[ROOT];
+        for (unsigned node = 1; node < used; node++) {
+            nft_rbnode * new_node = &new_nodes[map[node]];
+            *new_node = nodes[node];
+            new_node->child[0] = map[LEFT(node)];
+            new_node->child[1] = map[RIGHT(node)];
+            new_node->parent   = map[PARENT(node)];
+            if (new_sizes) new_sizes[map[node]] = tree->sizes[node];
+        }
+        if (new_sizes) new_sizes[NIL] = 0;
+
+        // The non-reentrant walk continues from the same node.
+        if (tree->current && tree->current < used)
+            tree->current = map[tree->current];
+
+        // Release the old arrays, which may be shared with snapshots,
+        // or still in use by optimistic readers.
+        if (optimistic) {
+            if (!tree->shared) free(tree->sizes);
+            __atomic_store_n(&tree->nodes, new_nodes, __ATOMIC_RELEASE);
+            retire(tree, retired, tree->shared ? NULL : nodes, tree->shared);
+        }
+        else {
+            if (tree->shared)
+                release_shared(tree->shared);
+            else {
+                free(nodes);
+                free(tree->sizes);
+            }
+            tree->nodes     = new_nodes;
+            tree->num_nodes = new_size;
+        }
+        tree->shared = NULL;
+        tree->sizes  = new_sizes;
+        new_nodes    = NULL;
+        new_sizes    = NULL;
+        retired      = NULL;
+        result       = 1;
+
+        assert(rbtree_validate(tree));
+    }
+    free(map);
+    free(new_nodes);
+    free(new_sizes);
+    free(retired);
+
+    if (tree->locking) rbtree_unlock(tree);
+    return result;
+}
+
+/* Search without locking, validating the result with the sequence number.
+ * Writers may be changing the tree as we descend, so the probe bounds the
+ * number of steps, in case we are led around a cycle, and checks node indexes
+ * against the size of the nodes array. Returns -1 if a writer interfered
+ * with every attempt, in which case the caller must take the read lock.
+ */
+#define OPTIMISTIC_TRIES    4
+
+static int
+search_optimistic(nft_rbtree * tree, void * key, void ** data)
+{
+    void         * token   = data ? *data : NULL;
+    int            result  = -1;
+
+    // Publish our epoch before loading any nodes array, so that a writer
+    // will not free an array that we may still be walking.
+    reader_slot  * slot    = reader_enter();
+    if (!slot) return -1;
+
+    for (int tries = 0; tries < OPTIMISTIC_TRIES; tries++)
+    {
+        unsigned long seq = __atomic_load_n(&tree->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) continue;
+
+        // Load num_nodes before nodes, see retire_nodes().
+        unsigned     num   = __atomic_load_n(&tree->num_nodes, __ATOMIC_ACQUIRE);
+        nft_rbnode * nodes = __atomic_load_n(&tree->nodes,     __ATOMIC_ACQUIRE);
+        unsigned     node;
+        int          done;
+
+        switch (tree->keys) {
+        case KEYS_POINTERS: done = probe_pointers(tree, nodes, num, key, token, &node); break;
+        case KEYS_INTEGERS: done = probe_integers(tree, nodes, num, key, token, &node); break;
+        default:            done = probe_generic (tree, nodes, num, key, token, &node); break;
+        }
+        int    found = done && !IS_NIL(node) && !node_compare(tree, key, KEY(node), token, DATA(node));
+        void * value = found ? DATA(node) : NULL;
+
+        // If no writer has intervened, the result is valid.
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (done && __atomic_load_n(&tree->seq, __ATOMIC_RELAXED) == seq)
+        {
+            if (found && data) *data = value;
+            result = found;
+            break;
+        }
+    }
+    reader_exit(slot);
+    return result;
 }
 
 /*-----------------------------------------------------------------------------
@@ -774,25 +2223,22 @@ rbtree_search(nft_rbtree *tree, void *key, void  **data)
 {
     if (!tree) return 0;
 
+    if (tree->locking == RBTREE_LOCK_OPTIMISTIC)
+    {
+        int result = search_optimistic(tree, key, data);
+        if (result >= 0) return result;
+    }
     if (tree->locking) rbtree_rdlock(tree);
 
-    RBTREE_COMPARE compare = tree->compare;
     nft_rbnode   * nodes   = tree->nodes;
-    void         * token   = data ? *data : NULL;
-    long           comp    = -1;
-    unsigned       node;
-
-    // Find the given key.
-    for (node = ROOT;
-	 node != NIL && (comp = compare(key, KEY(node), token, DATA(node)));
-	 node = (comp < 0) ? LEFT(node) : RIGHT(node) );
+    unsigned       node    = find_node(tree, key, data ? *data : NULL);
 
     // Return data if key found.
-    if ((comp == 0) && data)
+    if (node != NIL && data)
 	*data = DATA(node);
 
     if (tree->locking) rbtree_unlock(tree);
-    return (comp == 0);
+    return (node != NIL);
 }
 
 /*-----------------------------------------------------------------------------
@@ -887,6 +2333,7 @@ rbtree_walk_next_r(nft_rbtree *tree, void **key, void **data, void **walk)
 int
 rbtree_walk_first(nft_rbtree *tree, void  **key, void  **data)
 {
+    if (tree) tree->reverse = 0;
     return rbtree_walk_first_r(tree, key, data, (void**) &tree->current);
 }
 
@@ -906,6 +2353,279 @@ rbtree_walk_next(nft_rbtree *tree, void **key, void **data)
     return rbtree_walk_next_r(tree, key, data, (void**) &tree->current);
 }
 
+/*-----------------------------------------------------------------------------
+ *
+ *	rbtree_walk_last_r	Initiate a walk of tree in order of descending keys.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+rbtree_walk_last_r(nft_rbtree *tree, void  **key, void  **data, void **walk)
+{
+    if (!tree) return 0;
+
+    if (tree->locking) rbtree_rdlock(tree);
+
+    nft_rbnode * nodes = tree->nodes;
+    int          result = 0;
+    unsigned     node;
+
+    // If tree is not empty, set *walk to node's predecessor.
+    if ((node = node_last(tree)))
+    {
+	if (key)  *key  = KEY(node);
+	if (data) *data = DATA(node);
+	*walk  = (void*)(uintptr_t)node_predecessor(tree, node);
+	result = 1;
+    }
+    if (tree->locking) rbtree_unlock(tree);
+    return result;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ *	rbtree_walk_prev_r	Returns the next key and data in descending order.
+ *
+ *	You must call rbtree_walk_last_r() or rbtree_seek_le() to start the walk.
+ *      You may not insert or delete keys during the walk.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+rbtree_walk_prev_r(nft_rbtree *tree, void **key, void **data, void **walk)
+{
+    if (!tree) return 0;
+
+    if (tree->locking) rbtree_rdlock(tree);
+
+    nft_rbnode * nodes  = tree->nodes;
+    unsigned     node   = (uintptr_t) *walk;
+    int          result = 0;
+
+    // Have nodes have been deleted, or is *walk uninitialized?
+    assert(node < tree->next_free);
+
+    if (!IS_NIL(node) && node < tree->next_free)
+    {
+        if (key)  *key  = KEY(node);
+        if (data) *data = DATA(node);
+        *walk  = (void*)(uintptr_t)node_predecessor(tree, node);
+        result = 1;
+    }
+    if (tree->locking) rbtree_unlock(tree);
+    return result;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ *	rbtree_walk_last	Single-threaded reverse walk calls.
+ *	rbtree_walk_prev
+ *
+ *	As with rbtree_walk_first(), you may insert and delete keys
+ *	during the walk, but only one thread may walk the tree at a time.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+rbtree_walk_last(nft_rbtree *tree, void  **key, void  **data)
+{
+    if (tree) tree->reverse = 1;
+    return rbtree_walk_last_r(tree, key, data, (void**) &tree->current);
+}
+
+int
+rbtree_walk_prev(nft_rbtree *tree, void **key, void **data)
+{
+    return rbtree_walk_prev_r(tree, key, data, (void**) &tree->current);
+}
+
+/* Common code for the seek functions. Returns the pair at node via *key
+ * and *data, and sets *walk to the next node in the given direction.
+ */
+static int
+seek_result(nft_rbtree * tree, unsigned node, int reverse, void **key, void **data, void **walk)
+{
+    nft_rbnode * nodes = tree->nodes;
+
+    if (IS_NIL(node)) {
+        *walk = (void*)(uintptr_t) NIL;
+        return 0;
+    }
+    *key  = KEY(node);
+    if (data) *data = DATA(node);
+    *walk = (void*)(uintptr_t)(reverse ? node_predecessor(tree, node) : node_successor(tree, node));
+    return 1;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ *	rbtree_seek_ge		Start a walk at the first key >= *key.
+ *	rbtree_seek_gt		Start a walk at the first key >  *key.
+ *	rbtree_seek_le		Start a reverse walk at the last key <= *key.
+ *
+ *	On entry, *key holds the key to seek, and for duplex trees, *data
+ *	holds its data. If a pair is found, it is returned in *key and *data,
+ *	and *walk is set so that rbtree_walk_next_r(), or rbtree_walk_prev_r()
+ *	after rbtree_seek_le(), continues the walk. Returns false if none is found.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+rbtree_seek_ge(nft_rbtree *tree, void **key, void **data, void **walk)
+{
+    if (!tree) return 0;
+    if (tree->locking) rbtree_rdlock(tree);
+
+    unsigned node   = node_seek_ge(tree, *key, data ? *data : NULL, 1);
+    int      result = seek_result(tree, node, 0, key, data, walk);
+
+    if (tree->locking) rbtree_unlock(tree);
+    return result;
+}
+
+int
+rbtree_seek_gt(nft_rbtree *tree, void **key, void **data, void **walk)
+{
+    if (!tree) return 0;
+    if (tree->locking) rbtree_rdlock(tree);
+
+    unsigned node   = node_seek_ge(tree, *key, data ? *data : NULL, 0);
+    int      result = seek_result(tree, node, 0, key, data, walk);
+
+    if (tree->locking) rbtree_unlock(tree);
+    return result;
+}
+
+int
+rbtree_seek_le(nft_rbtree *tree, void **key, void **data, void **walk)
+{
+    if (!tree) return 0;
+    if (tree->locking) rbtree_rdlock(tree);
+
+    unsigned node   = node_seek_le(tree, *key, data ? *data : NULL);
+    int      result = seek_result(tree, node, 1, key, data, walk);
+
+    if (tree->locking) rbtree_unlock(tree);
+    return result;
+}
+
+/*-----------------------------------------------------------------------------
+ *	rbtree_range_apply() - Call a function on each entry with lo <= key < hi.
+ *	Return the number of entries in the range.
+ *
+ *	This visits the range in O(log n + k) time, for k entries.
+ *	The comparator is passed NULL for the data arguments,
+ *	so this is not suitable for trees with duplex keys.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+rbtree_range_apply( nft_rbtree * tree,
+                    void       * lo,
+                    void       * hi,
+                    void (* apply)( void * key, void * obj, void * arg),
+                    void       * arg)
+{
+    if (!tree) return 0;
+
+    if (tree->locking) rbtree_rdlock(tree);
+
+    nft_rbnode   * nodes   = tree->nodes;
+    unsigned       node    = NIL;
+    unsigned       end     = NIL;
+    int            num     = 0;
+
+    // The range ends at the first key that is not less than hi.
+    if (node_compare(tree, lo, hi, NULL, NULL) < 0) {
+        node = node_seek_ge(tree, lo, NULL, 1);
+        end  = node_seek_ge(tree, hi, NULL, 1);
+    }
+    for ( ; node != end; node = node_successor(tree, node))
+    {
+        num++;
+        (*apply)( KEY(node), DATA(node), arg);
+    }
+    if (tree->locking) rbtree_unlock(tree);
+    return num;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ *	rbtree_rank		Return the number of keys less than key.
+ *	rbtree_count_range	Return the number of keys k, lo <= k < hi.
+ *
+ *	These take O(log n) time. The tree must have been created with
+ *	RBTREE_ORDER_STATS, or they return -1. As with rbtree_range_apply(),
+ *	they are not suitable for trees with duplex keys.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+rbtree_rank(nft_rbtree * tree, void * key)
+{
+    if (!tree || !(tree->flags & RBTREE_ORDER_STATS)) return -1;
+    if (!tree->nodes) return 0;
+
+    if (tree->locking) rbtree_rdlock(tree);
+    int rank = node_rank(tree, key);
+    if (tree->locking) rbtree_unlock(tree);
+    return rank;
+}
+
+int
+rbtree_count_range(nft_rbtree * tree, void * lo, void * hi)
+{
+    if (!tree || !(tree->flags & RBTREE_ORDER_STATS)) return -1;
+    if (!tree->nodes) return 0;
+
+    if (tree->locking) rbtree_rdlock(tree);
+    int count = node_rank(tree, hi) - node_rank(tree, lo);
+    if (tree->locking) rbtree_unlock(tree);
+    return count > 0 ? count : 0;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ *	rbtree_select		Find the key with the given rank.
+ *
+ *	Returns the index'th key and data in ascending order, counting
+ *	from zero, via *key and *data. Returns true if index is less than
+ *	the number of keys, else false. This takes O(log n) time, and the
+ *	tree must have been created with RBTREE_ORDER_STATS.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+rbtree_select(nft_rbtree * tree, unsigned index, void ** key, void ** data)
+{
+    if (!tree || !(tree->flags & RBTREE_ORDER_STATS)) return 0;
+
+    if (tree->locking) rbtree_rdlock(tree);
+
+    nft_rbnode * nodes  = tree->nodes;
+    unsigned   * sizes  = tree->sizes;
+    int          result = 0;
+
+    if (index < rbtree_count(tree))
+    {
+        unsigned node = ROOT;
+        while (index != sizes[LEFT(node)])
+        {
+            if (index < sizes[LEFT(node)])
+                node   = LEFT(node);
+            else {
+                index -= sizes[LEFT(node)] + 1;
+                node   = RIGHT(node);
+            }
+        }
+        if (key)  *key  = KEY(node);
+        if (data) *data = DATA(node);
+        result = 1;
+    }
+    if (tree->locking) rbtree_unlock(tree);
+    return result;
+}
+
 /*-----------------------------------------------------------------------------
  *	rbtree_apply() - Call a function on every entry in the rb tree.
  *	Return the number of entries in the tree.
@@ -1001,6 +2721,15 @@ check_pointers(nft_rbtree *tree, unsigned node)
             return 0;
         }
 
+        /* If subtree sizes are kept, they must add up.
+         */
+        if (tree->sizes &&
+            tree->sizes[node] != tree->sizes[LEFT(node)] + tree->sizes[RIGHT(node)] + 1)
+        {
+            assert(!"rbtree_validate:Bad subtree size!\n");
+            return 0;
+        }
+
         /* If this node is red, both children must be black.
          */
         if (RED(node) && (RED(LEFT(node)) || RED(RIGHT(node))))
@@ -1028,6 +2757,9 @@ rbtree_validate( nft_rbtree * tree)
 
     nft_rbnode * nodes = tree->nodes;
 
+    // A tree that has never held a key has no nodes at all.
+    if (!nodes) return (tree->next_free == 1);
+
     // The Nil node should never be colored red.
     assert(!RED((NIL)));
 
@@ -1063,7 +2795,292 @@ rbtree_validate( nft_rbtree * tree)
 
 /* These two comparators should cover most needs.
  */
+/* The layout of a file written by rbtree_save. The header is followed
+ * by the nodes array, then the sizes array, if the tree has order stats,
+ * then the blob region, which holds the serialized keys and data. Each
+ * region begins on a MAP_ALIGN boundary. Serialized keys and data are
+ * stored in the nodes as pointers into the file, as it would be mapped
+ * at the base address, so that they need no relocation if the file can
+ * be mapped there.
+ */
+#define MAP_MAGIC   "nftrbtr"
+#define MAP_VERSION 1
+#define MAP_ALIGN   64
+
+typedef struct map_header
+{
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    byte_order;     // MAP_VERSION, as seen by the writer
+    uint32_t    pointer_size;   // sizeof(void *)
+    uint32_t    node_size;      // sizeof(nft_rbnode)
+    uint32_t    flags;          // The tree's flags
+    uint32_t    serialized;     // 1 if keys are in the blob, 2 if data are
+    uint64_t    base;           // The address at which the file should be mapped
+    uint64_t    next_free;      // The number of nodes, including NIL
+    uint64_t    nodes_offset;
+    uint64_t    sizes_offset;
+    uint64_t    blob_offset;
+    uint64_t    file_size;
+} map_header;
+
+// The preferred base address of a mapped tree, well clear of the heap and stack.
+#if UINTPTR_MAX > 0xffffffff
+#define MAP_BASE    ((uintptr_t) 0x100000000000)
+#else
+#define MAP_BASE    ((uintptr_t) 0x40000000)
+#endif
+
+#define MAP_ROUND(n, a) (((n) + (a) - 1) & ~(uint64_t) ((a) - 1))
+
+/*-----------------------------------------------------------------------------
+ *
+ * rbtree_save_string	A serializer for NUL-terminated strings.
+ *
+ *-----------------------------------------------------------------------------
+ */
+size_t
+rbtree_save_string(void * item, const void ** bytes)
+{
+    *bytes = item;
+    return strlen(item) + 1;
+}
+
+/* Write len bytes to file at the given offset, padding with zeros from
+ * the current position *pos, which must not be beyond offset.
+ */
+static int
+write_at(FILE * file, uint64_t * pos, uint64_t offset, const void * bytes, size_t len)
+{
+    for (; *pos < offset; (*pos)++)
+        if (putc(0, file) == EOF) return 0;
+
+    *pos += len;
+    return len == 0 || fwrite(bytes, 1, len, file) == len;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ * rbtree_save		Write a tree to a file that rbtree_map can map.
+ *
+ * We serialize each key and data once, recording where its bytes will be
+ * stored in the blob region, then write the nodes with their key and data
+ * pointing into the blob. The file is written under a temporary name and
+ * renamed, so that a process never maps a partially-written file.
+ *
+ *-----------------------------------------------------------------------------
+ */
+int
+rbtree_save(nft_rbtree * tree, const char * path, RBTREE_SAVE save_key, RBTREE_SAVE save_data)
+{
+    if (!tree || !path) return EINVAL;
+    if (tree->locking) rbtree_rdlock(tree);
+
+    nft_rbnode  * nodes  = tree->nodes;
+    uint64_t      count  = nodes ? tree->next_free : 1;
+    const void ** bytes  = malloc(2 * count * sizeof(void *));
+    uint64_t    * offset = malloc(2 * count * sizeof(uint64_t));
+    size_t      * length = malloc(2 * count * sizeof(size_t));
+    char        * temp   = malloc(strlen(path) + 5);
+    FILE        * file   = NULL;
+    int           result = ENOMEM;
+
+    if (bytes && offset && length && temp)
+    {
+        map_header header = { MAP_MAGIC, MAP_VERSION, MAP_VERSION, sizeof(void *), sizeof(nft_rbnode),
+                              tree->flags, (save_key ? 1 : 0) | (save_data ? 2 : 0), MAP_BASE, count };
+        header.nodes_offset = MAP_ROUND(sizeof(map_header), MAP_ALIGN);
+        header.sizes_offset = MAP_ROUND(header.nodes_offset + count * sizeof(nft_rbnode), MAP_ALIGN);
+        header.blob_offset  = header.sizes_offset;
+        if (tree->sizes)
+            header.blob_offset = MAP_ROUND(header.sizes_offset + count * sizeof(unsigned), MAP_ALIGN);
+
+        // Serialize the keys and data, and lay out the blob.
+        uint64_t end = header.blob_offset;
+        for (uint64_t n = 2; n < 2 * count; n++) {
+            RBTREE_SAVE save = (n & 1) ? save_data : save_key;
+            void      * item = (n & 1) ? DATA(n / 2) : KEY(n / 2);
+            length[n] = 0;
+            if (save && item) {
+                length[n] = save(item, &bytes[n]);
+                offset[n] = end;
+                end       = MAP_ROUND(end + length[n], sizeof(void *));
+            }
+        }
+        header.file_size = end;
+
+        sprintf(temp, "%s.tmp", path);
+        if (!(file = fopen(temp, "wb")))
+            result = errno;
+        else {
+            uint64_t pos = 0;
+            int      ok  = write_at(file, &pos, 0, &header, sizeof(header));
+
+            // Write the nodes, with serialized keys and data pointing into the blob.
+            nft_rbnode node = { 0 };
+            if (nodes) node.child[0] = ROOT;
+            ok = ok && write_at(file, &pos, header.nodes_offset, &node, sizeof(node));
+            for (uint64_t n = 1; ok && n < count; n++) {
+                node = nodes[n];
+                if (save_key  && node.key)  node.key  = (void *) (MAP_BASE + (uintptr_t) offset[2 * n]);
+                if (save_data && node.data) node.data = (void *) (MAP_BASE + (uintptr_t) offset[2 * n + 1]);
+                ok = write_at(file, &pos, pos, &node, sizeof(node));
+            }
+            if (tree->sizes) {
+                unsigned zero = 0;
+                ok = ok && write_at(file, &pos, header.sizes_offset, &zero, sizeof(zero));
+                ok = ok && write_at(file, &pos, pos, tree->sizes + 1, (count - 1) * sizeof(unsigned));
+            }
+
+            // Write the blob.
+            for (uint64_t n = 2; ok && n < 2 * count; n++)
+                if (length[n])
+                    ok = write_at(file, &pos, offset[n], bytes[n], length[n]);
+            ok = ok && write_at(file, &pos, header.file_size, NULL, 0);
+
+            if (fclose(file) != 0) ok = 0;
+            result = ok ? (rename(temp, path) ? errno : 0) : EIO;
+            if (result) remove(temp);
+        }
+    }
+    free(bytes);
+    free(offset);
+    free(length);
+    free(temp);
+
+    if (tree->locking) rbtree_unlock(tree);
+    return result;
+}
+
+/* Check that the regions described by a header lie within the file,
+ * in order, without overlapping. Returns 1 if they do, else zero.
+ */
+static int
+map_check_header(map_header * header, uint64_t file_size)
+{
+    uint64_t count = header->next_free;
+    uint64_t sizes = (header->flags & RBTREE_ORDER_STATS) ? count * sizeof(unsigned) : 0;
+
+    return !memcmp(header->magic, MAP_MAGIC, sizeof(header->magic)) &&
+           header->version == MAP_VERSION && header->byte_order == MAP_VERSION &&
+           header->pointer_size == sizeof(void *) && header->node_size == sizeof(nft_rbnode) &&
+           !(header->flags & ~RBTREE_ORDER_STATS) && header->serialized <= 3 &&
+           header->file_size == file_size && header->base <= UINTPTR_MAX - file_size &&
+           count >= 1 && count <= UINT_MAX &&
+           header->nodes_offset >= sizeof(map_header) && header->nodes_offset % MAP_ALIGN == 0 &&
+           header->sizes_offset % MAP_ALIGN == 0 &&
+           header->nodes_offset <= file_size && header->sizes_offset <= file_size &&
+           header->blob_offset  <= file_size &&
+           header->nodes_offset + count * sizeof(nft_rbnode) <= header->sizes_offset &&
+           header->sizes_offset + sizes <= header->blob_offset;
+}
+
+/* Check that the links of the mapped nodes are within the tree, and that
+ * serialized keys and data point into the blob, and relocate them by delta,
+ * which must be zero if the map is read-only. Returns 1 if they are valid.
+ */
+static int
+map_check_nodes(map_header * header, char * map, uintptr_t delta)
+{
+    nft_rbnode * nodes = (nft_rbnode *) (map + header->nodes_offset);
+    uint64_t     count = header->next_free;
+    uintptr_t    lo    = (uintptr_t) header->base + header->blob_offset;
+    uintptr_t    hi    = (uintptr_t) header->base + header->file_size;
+
+    if (ROOT >= count) return 0;
+
+    for (uint64_t node = 1; node < count; node++) {
+        if (LEFT(node) >= count || RIGHT(node) >= count || PARENT(node) >= count)
+            return 0;
+        for (int i = 0; i < 2; i++) {
+            void ** item = i ? &DATA(node) : &KEY(node);
+            if (!(header->serialized & (1 << i)) || !*item) continue;
+            if ((uintptr_t) *item < lo || (uintptr_t) *item > hi)
+                return 0;
+            if (delta) *item = (char *) *item + delta;
+        }
+    }
+    return 1;
+}
+
+/*-----------------------------------------------------------------------------
+ *
+ * rbtree_map		Map a file written by rbtree_save, as a read-only tree.
+ *
+ * If the file can be mapped at its base address, its pages are mapped
+ * read-only and shared, with no relocation. Otherwise, we map a private
+ * copy wherever we can, and relocate the serialized keys and data, which
+ * touches the pages of the nodes region, but not the blob region.
+ *
+ *-----------------------------------------------------------------------------
+ */
+nft_rbtree *
+rbtree_map(const char * path, RBTREE_COMPARE compare)
+{
+#ifdef _WIN32
+    errno = ENOSYS;
+    return NULL;
+#else
+    if (!path || !compare) { errno = EINVAL; return NULL; }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    map_header  header;
+    struct stat st;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || fstat(fd, &st) != 0 ||
+        !map_check_header(&header, st.st_size))
+    {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t size = header.file_size;
+    char * map  = mmap((void *) (uintptr_t) header.base, size, PROT_READ, MAP_SHARED, fd, 0);
+
+    int    valid = 1;
+
+    // If the map isn't at the base address, relocate a private copy.
+    // Either way, the nodes are checked, so a corrupt file can't lead
+    // searches outside the map.
+    if (map != MAP_FAILED && map != (char *) (uintptr_t) header.base && header.serialized)
+    {
+        munmap(map, size);
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            valid = map_check_nodes(&header, map, (uintptr_t) map - (uintptr_t) header.base);
+            mprotect(map, size, PROT_READ);
+        }
+    }
+    else if (map != MAP_FAILED)
+        valid = map_check_nodes(&header, map, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    if (!valid) {
+        munmap(map, size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    nft_rbtree * tree = rbtree_create(nft_rbtree_class, sizeof(nft_rbtree), 0, compare);
+    if (!tree) {
+        munmap(map, size);
+        errno = ENOMEM;
+        return NULL;
+    }
+    tree->map       = map;
+    tree->map_size  = size;
+    tree->flags     = header.flags;
+    tree->nodes     = (nft_rbnode *) (map + header.nodes_offset);
+    tree->sizes     = (header.flags & RBTREE_ORDER_STATS) ? (unsigned *) (map + header.sizes_offset) : NULL;
+    tree->next_free = header.next_free;
+    tree->num_nodes = header.next_free;
+    return tree;
+#endif
+}
+
 long rbtree_compare_pointers(void * h1, void * h2) { return h2 > h1 ? 1 : h2 < h1 ? -1 : 0; }
+long rbtree_compare_integers(void * i1, void * i2) { return COMPARE_INTEGERS(i1, i2, 0, 0); }
 long rbtree_compare_strings (char * s1, char * s2) { return (long) strcmp(s1, s2); }
 
 
@@ -1088,6 +3105,28 @@ nft_rbtree_new(int min_nodes, RBTREE_COMPARE compare )
     }
     return NULL;
 }
+nft_rbtree_h
+nft_rbtree_new_ex(int min_nodes, RBTREE_COMPARE compare, unsigned flags)
+{
+    nft_rbtree * rbtree = rbtree_new_ex(min_nodes, compare, flags);
+    if (rbtree) {
+        rbtree_locking(rbtree, 1);
+        return nft_rbtree_handle(rbtree);
+    }
+    return NULL;
+}
+nft_rbtree_h
+nft_rbtree_snapshot(nft_rbtree_h h)
+{
+    nft_rbtree_h result = NULL;
+    nft_rbtree * rbtree = nft_rbtree_lookup(h);
+    if (rbtree) {
+        nft_rbtree * snap = rbtree_snapshot(rbtree);
+        if (snap) result = nft_rbtree_handle(snap);
+        nft_rbtree_discard(rbtree);
+    }
+    return result;
+}
 int
 nft_rbtree_free(nft_rbtree_h h)
 {
@@ -1124,6 +3163,15 @@ nft_rbtree_locking(nft_rbtree_h h, unsigned enabled)
         nft_rbtree_discard(rbtree);
     }
 }
+void
+nft_rbtree_synchronize(nft_rbtree_h h)
+{
+    nft_rbtree * rbtree = nft_rbtree_lookup(h);
+    if (rbtree) {
+        rbtree_synchronize(rbtree);
+        nft_rbtree_discard(rbtree);
+    }
+}
 int
 nft_rbtree_insert(nft_rbtree_h h, void  *key, void  *data)
 {
@@ -1147,6 +3195,28 @@ nft_rbtree_replace(nft_rbtree_h h, void  *key, void  **data)
     return result;
 }
 int
+nft_rbtree_build_sorted(nft_rbtree_h h, void **keys, void **data, int n)
+{
+    int          result = 0;
+    nft_rbtree * rbtree = nft_rbtree_lookup(h);
+    if (rbtree) {
+        result = rbtree_build_sorted(rbtree, keys, data, n);
+        nft_rbtree_discard(rbtree);
+    }
+    return result;
+}
+int
+nft_rbtree_insert_many(nft_rbtree_h h, void **keys, void **data, int n)
+{
+    int          result = 0;
+    nft_rbtree * rbtree = nft_rbtree_lookup(h);
+    if (rbtree) {
+        result = rbtree_insert_many(rbtree, keys, data, n);
+        nft_rbtree_discard(rbtree);
+    }
+    return result;
+}
+int
 nft_rbtree_delete(nft_rbtree_h h, void  *key, void **data)
 {
     int          result = 0;
@@ -1163,66 +3233,258 @@ nft_rbtree_search(nft_rbtree_h h, void  *key, void **data)
     int          result = 0;
     nft_rbtree * rbtree = nft_rbtree_lookup(h);
     if (rbtree) {
-        result = rbtree_search(rbtree, key, data);
+        result = rbtree_search(rbtree, key, data);
+        nft_rbtree_discard(rbtree);
+    }
+    return result;
+}
+int
+nft_rbtree_walk_first(nft_rbtree_h h, void **key, void **data)
+{
+    int          result = 0;
+    nft_rbtree * rbtree = nft_rbtree_lookup(h);
+    if (rbtree) {
+        result = rbtree_walk_first(rbtree, key, data);
+        nft_rbtree_discard(rbtree);
+    }
+    return result;
+}
+int
+nft_rbtree_walk_next(nft_rbtree_h h, void **key, void **data)
+{
+    int          result = 0;
+    nft_rbtree * rbtree = nft_rbtree_lookup(h);
+    if (rbtree) {
+        result = rbtree_walk_next(rbtree, key, data);
+        nft_rbtree_discard(rbtree);
+    }
+    return result;
+}
+int
+nft_rbtree_walk_first_r(nft_rbtree_h h, void **key, void **data, void **walk)
+{
+    int          result = 0;
+    nft_rbtree * rbtree = nft_rbtree_lookup(h);
+    if (rbtree) {
+        result = rbtree_walk_first_r(rbtree, key, data, walk);
+        nft_rbtree_discard(rbtree);
+    }
+    return result;
+}
+int
+nft_rbtree_walk_next_r(nft_rbtree_h h, void **key, void **data, void **walk)
+{
+    int          result = 0;
+    nft_rbtree * rbtree = nft_rbtree_lookup(h);
+    if (rbtree) {
+        result = rbtree_walk_next_r(rbtree, key, data, walk);
+        nft_rbtree_discard(rbtree);
+    }
+    return result;
+}
+int
+nft_rbtree_apply(nft_rbtree_h h, RBTREE_APPLY apply, void * arg)
+{
+    int          result = 0;
+    nft_rbtree * rbtree = nft_rbtree_lookup(h);
+    if (rbtree) {
+        result = rbtree_apply(rbtree, apply, arg);
+        nft_rbtree_discard(rbtree);
+    }
+    return result;
+}
+int
+nft_rbtree_walk_last_r(nft_rbtree_h h, void **key, void **data, void **walk)
+{
+    int          result = 0;
+    nft_rbtree * rbtree = nft_rbtree_lookup(h);
+    if (rbtree) {
+        result = rbtree_walk_last_r(rbtree, key, data, walk);
+        nft_rbtree_discard(rbtree);
+    }
+    return result;
+}
+int
+nft_rbtree_walk_prev_r(nft_rbtree_h h, void **key, void **data, void **walk)
+{
+    int          result = 0;
+    nft_rbtree * rbtree = nft_rbtree_lookup(h);
+    if (rbtree) {
+        result = rbtree_walk_prev_r(rbtree, key, data, walk);
+        nft_rbtree_discard(rbtree);
+    }
+    return result;
+}
+int
+nft_rbtree_seek_ge(nft_rbtree_h h, void **key, void **data, void **walk)
+{
+    int          result = 0;
+    nft_rbtree * rbtree = nft_rbtree_lookup(h);
+    if (rbtree) {
+        result = rbtree_seek_ge(rbtree, key, data, walk);
+        nft_rbtree_discard(rbtree);
+    }
+    return result;
+}
+int
+nft_rbtree_seek_gt(nft_rbtree_h h, void **key, void **data, void **walk)
+{
+    int          result = 0;
+    nft_rbtree * rbtree = nft_rbtree_lookup(h);
+    if (rbtree) {
+        result = rbtree_seek_gt(rbtree, key, data, walk);
+        nft_rbtree_discard(rbtree);
+    }
+    return result;
+}
+int
+nft_rbtree_seek_le(nft_rbtree_h h, void **key, void **data, void **walk)
+{
+    int          result = 0;
+    nft_rbtree * rbtree = nft_rbtree_lookup(h);
+    if (rbtree) {
+        result = rbtree_seek_le(rbtree, key, data, walk);
+        nft_rbtree_discard(rbtree);
+    }
+    return result;
+}
+int
+nft_rbtree_range_apply(nft_rbtree_h h, void * lo, void * hi, RBTREE_APPLY apply, void * arg)
+{
+    int          result = 0;
+    nft_rbtree * rbtree = nft_rbtree_lookup(h);
+    if (rbtree) {
+        result = rbtree_range_apply(rbtree, lo, hi, apply, arg);
+        nft_rbtree_discard(rbtree);
+    }
+    return result;
+}
+int
+nft_rbtree_rank(nft_rbtree_h h, void * key)
+{
+    int          result = -1;
+    nft_rbtree * rbtree = nft_rbtree_lookup(h);
+    if (rbtree) {
+        result = rbtree_rank(rbtree, key);
+        nft_rbtree_discard(rbtree);
+    }
+    return result;
+}
+int
+nft_rbtree_count_range(nft_rbtree_h h, void * lo, void * hi)
+{
+    int          result = -1;
+    nft_rbtree * rbtree = nft_rbtree_lookup(h);
+    if (rbtree) {
+        result = rbtree_count_range(rbtree, lo, hi);
         nft_rbtree_discard(rbtree);
     }
     return result;
 }
 int
-nft_rbtree_walk_first(nft_rbtree_h h, void **key, void **data)
+nft_rbtree_select(nft_rbtree_h h, unsigned index, void **key, void **data)
 {
     int          result = 0;
     nft_rbtree * rbtree = nft_rbtree_lookup(h);
     if (rbtree) {
-        result = rbtree_walk_first(rbtree, key, data);
+        result = rbtree_select(rbtree, index, key, data);
         nft_rbtree_discard(rbtree);
     }
     return result;
 }
 int
-nft_rbtree_walk_next(nft_rbtree_h h, void **key, void **data)
+nft_rbtree_compact(nft_rbtree_h h, unsigned layout)
 {
     int          result = 0;
     nft_rbtree * rbtree = nft_rbtree_lookup(h);
     if (rbtree) {
-        result = rbtree_walk_next(rbtree, key, data);
+        result = rbtree_compact(rbtree, layout);
         nft_rbtree_discard(rbtree);
     }
     return result;
 }
 int
-nft_rbtree_walk_first_r(nft_rbtree_h h, void **key, void **data, void **walk)
+nft_rbtree_save(nft_rbtree_h h, const char * path, RBTREE_SAVE save_key, RBTREE_SAVE save_data)
 {
-    int          result = 0;
+    int          result = EINVAL;
     nft_rbtree * rbtree = nft_rbtree_lookup(h);
     if (rbtree) {
-        result = rbtree_walk_first_r(rbtree, key, data, walk);
+        result = rbtree_save(rbtree, path, save_key, save_data);
         nft_rbtree_discard(rbtree);
     }
     return result;
 }
-int
-nft_rbtree_walk_next_r(nft_rbtree_h h, void **key, void **data, void **walk)
+nft_rbtree_h
+nft_rbtree_map(const char * path, RBTREE_COMPARE compare)
 {
-    int          result = 0;
-    nft_rbtree * rbtree = nft_rbtree_lookup(h);
+    nft_rbtree * rbtree = rbtree_map(path, compare);
     if (rbtree) {
-        result = rbtree_walk_next_r(rbtree, key, data, walk);
-        nft_rbtree_discard(rbtree);
+        rbtree_locking(rbtree, 1);
+        return nft_rbtree_handle(rbtree);
     }
+    return NULL;
+}
+int
+nft_rbtree_join(nft_rbtree_h h1, nft_rbtree_h h2)
+{
+    int          result = 0;
+    nft_rbtree * t1     = nft_rbtree_lookup(h1);
+    nft_rbtree * t2     = nft_rbtree_lookup(h2);
+    if (t1 && t2)
+        result = rbtree_join(t1, t2);
+    if (t1) nft_rbtree_discard(t1);
+    if (t2) nft_rbtree_discard(t2);
     return result;
 }
 int
-nft_rbtree_apply(nft_rbtree_h h, RBTREE_APPLY apply, void * arg)
+nft_rbtree_split(nft_rbtree_h h, void * key, nft_rbtree_h * lo, nft_rbtree_h * hi)
 {
     int          result = 0;
     nft_rbtree * rbtree = nft_rbtree_lookup(h);
+    nft_rbtree * t1, * t2;
     if (rbtree) {
-        result = rbtree_apply(rbtree, apply, arg);
+        if (lo && hi && (result = rbtree_split(rbtree, key, &t1, &t2))) {
+            rbtree_locking(t1, 1);
+            rbtree_locking(t2, 1);
+            *lo = nft_rbtree_handle(t1);
+            *hi = nft_rbtree_handle(t2);
+        }
         nft_rbtree_discard(rbtree);
     }
     return result;
 }
+static nft_rbtree_h
+set_operation_handle(nft_rbtree_h h1, nft_rbtree_h h2, int op, nft_pool_h pool)
+{
+    nft_rbtree_h result = NULL;
+    nft_rbtree * t1     = nft_rbtree_lookup(h1);
+    nft_rbtree * t2     = nft_rbtree_lookup(h2);
+    if (t1 && t2) {
+        nft_rbtree * t = set_operation(t1, t2, op, pool);
+        if (t) {
+            rbtree_locking(t, 1);
+            result = nft_rbtree_handle(t);
+        }
+    }
+    if (t1) nft_rbtree_discard(t1);
+    if (t2) nft_rbtree_discard(t2);
+    return result;
+}
+nft_rbtree_h
+nft_rbtree_union(nft_rbtree_h h1, nft_rbtree_h h2, nft_pool_h pool)
+{
+    return set_operation_handle(h1, h2, SET_UNION, pool);
+}
+nft_rbtree_h
+nft_rbtree_intersection(nft_rbtree_h h1, nft_rbtree_h h2, nft_pool_h pool)
+{
+    return set_operation_handle(h1, h2, SET_INTERSECTION, pool);
+}
+nft_rbtree_h
+nft_rbtree_difference(nft_rbtree_h h1, nft_rbtree_h h2, nft_pool_h pool)
+{
+    return set_operation_handle(h1, h2, SET_DIFFERENCE, pool);
+}
 int
 nft_rbtree_validate(nft_rbtree_h h)
 {
@@ -1420,6 +3682,206 @@ test_duplex_keys(void)
     printf("Passed!\n");
 }
 
+static long
+compare_ints(void * a, void * b)
+{
+    return (intptr_t) a - (intptr_t) b;
+}
+
+static void
+sum_ints(void * key, void * data, void * arg)
+{
+    *(intptr_t *) arg += (intptr_t) key;
+}
+
+/* test_seek
+ *
+ * Insert the even numbers 0 to 198, and test seeks, reverse walks
+ * and range_apply, and deletion during a reverse walk.
+ */
+static void
+test_seek(void)
+{
+    printf("rbtree: testing seek, reverse walk and range: ");
+
+    nft_rbtree * t = rbtree_new(0, compare_ints);
+    for (intptr_t i = 0; i < 200; i += 2)
+        assert(rbtree_insert(t, (void *) i, (void *) -i));
+
+    void * key, * data, * walk;
+
+    key = (void *) 51;
+    assert(rbtree_seek_ge(t, &key, &data, &walk) && key == (void *) 52 && data == (void *) -52);
+    assert(rbtree_walk_next_r(t, &key, NULL, &walk) && key == (void *) 54);
+    key = (void *) 52;
+    assert(rbtree_seek_ge(t, &key, NULL, &walk) && key == (void *) 52);
+    key = (void *) 52;
+    assert(rbtree_seek_gt(t, &key, NULL, &walk) && key == (void *) 54);
+    key = (void *) 51;
+    assert(rbtree_seek_le(t, &key, NULL, &walk) && key == (void *) 50);
+    assert(rbtree_walk_prev_r(t, &key, NULL, &walk) && key == (void *) 48);
+    key = (void *) 199;
+    assert(!rbtree_seek_ge(t, &key, NULL, &walk));
+    key = (void *) 198;
+    assert(!rbtree_seek_gt(t, &key, NULL, &walk));
+    key = (void *) -1;
+    assert(!rbtree_seek_le(t, &key, NULL, &walk));
+
+    // Walk the whole tree backwards.
+    intptr_t i = 198;
+    for (int r = rbtree_walk_last_r(t, &key, &data, &walk); r; r = rbtree_walk_prev_r(t, &key, &data, &walk), i -= 2)
+        assert(key == (void *) i && data == (void *) -i);
+    assert(i == -2);
+
+    // The range [10, 20) holds 10, 12, 14, 16 and 18.
+    intptr_t sum = 0;
+    assert(5 == rbtree_range_apply(t, (void *) 10, (void *) 20, sum_ints, &sum) && sum == 70);
+    assert(0 == rbtree_range_apply(t, (void *) 11, (void *) 12, sum_ints, &sum) && sum == 70);
+    assert(100 == rbtree_range_apply(t, (void *) -1, (void *) 1000, sum_ints, &sum));
+
+    // Delete each key during a non-reentrant reverse walk,
+    // along with every third key beneath it.
+    i = 198;
+    for (int r = rbtree_walk_last(t, &key, NULL); r; r = rbtree_walk_prev(t, &key, NULL)) {
+        while (i % 6 == 4) i -= 2;
+        assert(key == (void *) i);
+        assert(rbtree_delete(t, key, NULL));
+        if (i % 6 == 0 && i > 0) assert(rbtree_delete(t, (void *)(i - 2), NULL));
+        assert(rbtree_validate(t));
+        i -= 2;
+    }
+    assert(rbtree_count(t) == 0);
+    assert(0 == rbtree_free(t));
+
+    printf("Passed!\n");
+}
+
+/* test_order_stats
+ *
+ * Randomly insert and delete integer keys, with duplicates, and check
+ * rank, select and count_range against a sorted array of the same keys.
+ */
+static void
+test_order_stats(void)
+{
+    printf("rbtree: testing order statistics: ");
+
+    assert(!rbtree_new_ex(0, compare_ints, 0x80));
+    nft_rbtree * plain = rbtree_new(0, compare_ints);
+    assert(rbtree_rank(plain, NULL) == -1 && !rbtree_select(plain, 0, NULL, NULL));
+    rbtree_free(plain);
+
+    nft_rbtree * t = rbtree_new_ex(4, compare_ints, RBTREE_ORDER_STATS);
+    assert(rbtree_rank(t, (void *) 1) == 0);
+    assert(!rbtree_select(t, 0, NULL, NULL));
+
+    enum { RANGE = 500, OPS = 20000 };
+    int counts[RANGE] = { 0 };
+    int total = 0;
+
+    for (int op = 0; op < OPS; op++)
+    {
+        intptr_t k = lrand48() % RANGE;
+        if (lrand48() % 3 && counts[k]) {
+            assert(rbtree_delete(t, (void *) k, NULL));
+            counts[k]--, total--;
+        }
+        else {
+            assert(rbtree_insert(t, (void *) k, (void *) k));
+            counts[k]++, total++;
+        }
+        if (op % 1000) continue;
+
+        assert(rbtree_validate(t));
+        int rank = 0;
+        for (intptr_t i = 0; i < RANGE; i++) {
+            void * key;
+            assert(rbtree_rank(t, (void *) i) == rank);
+            if (counts[i]) {
+                assert(rbtree_select(t, rank, &key, NULL) && key == (void *) i);
+                assert(rbtree_select(t, rank + counts[i] - 1, &key, NULL) && key == (void *) i);
+            }
+            assert(rbtree_count_range(t, (void *) i, (void *)(i + 1)) == counts[i]);
+            rank += counts[i];
+        }
+        assert(rank == total && !rbtree_select(t, total, NULL, NULL));
+        assert(rbtree_count_range(t, (void *) 0, (void *) RANGE) == total);
+        assert(rbtree_count_range(t, (void *) 10, (void *) 5) == 0);
+    }
+    assert(0 == rbtree_free(t));
+
+    nft_rbtree_h h = nft_rbtree_new_ex(0, compare_ints, RBTREE_ORDER_STATS);
+    for (intptr_t i = 0; i < 100; i++)
+        assert(nft_rbtree_insert(h, (void *) i, NULL));
+    void * key;
+    assert(nft_rbtree_rank(h, (void *) 42) == 42);
+    assert(nft_rbtree_select(h, 42, &key, NULL) && key == (void *) 42);
+    assert(nft_rbtree_count_range(h, (void *) 10, (void *) 20) == 10);
+    assert(0 == nft_rbtree_free(h));
+
+    printf("Passed!\n");
+}
+
+/* test_bulk_load
+ *
+ * Build trees of sorted keys of every size up to 100, with and without
+ * order statistics, then merge batches into an existing tree.
+ */
+static void
+test_bulk_load(void)
+{
+    printf("rbtree: testing bulk load: ");
+
+    enum { N = 100 };
+    void * keys[2 * N], * data[2 * N], * key, * value;
+    for (intptr_t i = 0; i < N; i++)
+        keys[i] = (void *) i, data[i] = (void *) -i;
+
+    for (int n = 0; n <= N; n++)
+        for (unsigned flags = 0; flags <= RBTREE_ORDER_STATS; flags++) {
+            nft_rbtree * t = rbtree_new_ex(0, compare_ints, flags);
+            assert(rbtree_build_sorted(t, keys, data, n));
+            assert(rbtree_validate(t) && rbtree_count(t) == n);
+            for (intptr_t i = 0; i < n; i++)
+                assert(rbtree_search(t, keys[i], &value) && value == data[i]);
+            if (flags && n > 0)
+                assert(rbtree_select(t, n / 2, &key, NULL) && key == keys[n / 2]);
+
+            // The tree remains usable after building.
+            assert(rbtree_insert(t, (void *) 50, NULL) && rbtree_validate(t));
+            assert(!rbtree_build_sorted(t, keys, data, n));
+            rbtree_free(t);
+        }
+
+    // Unsorted keys are refused.
+    nft_rbtree * t = rbtree_new(0, compare_ints);
+    void * unsorted[3] = { (void *) 1, (void *) 3, (void *) 2 };
+    assert(!rbtree_build_sorted(t, unsorted, NULL, 3));
+
+    // A large batch into an empty tree, then a small batch, then another large one.
+    for (int i = 0; i < 2 * N; i++)
+        keys[i] = (void *)(intptr_t)(lrand48() % N), data[i] = (void *)(intptr_t) i;
+    assert(rbtree_insert_many(t, keys, data, N));
+    assert(rbtree_validate(t) && rbtree_count(t) == N);
+    assert(rbtree_insert_many(t, keys + N, data + N, 5));
+    assert(rbtree_validate(t) && rbtree_count(t) == N + 5);
+    assert(rbtree_insert_many(t, keys + N + 5, NULL, N - 5));
+    assert(rbtree_validate(t) && rbtree_count(t) == 2 * N);
+
+    // Equal keys are walked in the order they were inserted.
+    void * walk, * lastkey = NULL, * lastdata = NULL;
+    for (int r = rbtree_walk_first_r(t, &key, &value, &walk); r; r = rbtree_walk_next_r(t, &key, &value, &walk)) {
+        assert((intptr_t) key >= (intptr_t) lastkey);
+        if (key == lastkey && value && lastdata)
+            assert((intptr_t) value > (intptr_t) lastdata);
+        lastkey  = key;
+        lastdata = value;
+    }
+    rbtree_free(t);
+
+    printf("Passed!\n");
+}
+
 /*
  * Store a set of strings that we will use to test this package.
  */
@@ -1450,6 +3912,231 @@ int read_words(sack_t sack, int limit) {
     return i;
 }
 
+/* Check that the tree holds exactly the keys lo..hi-1, with data -key.
+ */
+static void
+check_range(nft_rbtree * tree, intptr_t lo, intptr_t hi)
+{
+    void * key, * data, * walk;
+    intptr_t i = lo;
+
+    assert(rbtree_validate(tree));
+    assert(rbtree_count(tree) == hi - lo);
+    for (int more = rbtree_walk_first_r(tree, &key, &data, &walk); more;
+             more = rbtree_walk_next_r (tree, &key, &data, &walk), i++)
+        assert((intptr_t) key == i && (intptr_t) data == -i);
+    assert(i == hi);
+}
+
+static void
+test_snapshot(void)
+{
+    printf("rbtree: testing snapshots: ");
+
+    enum { N = 1000 };
+    for (unsigned locking = 0; locking <= RBTREE_LOCK_OPTIMISTIC; locking++)
+        for (unsigned flags = 0; flags <= RBTREE_ORDER_STATS; flags++) {
+            nft_rbtree * t = rbtree_new_ex(0, compare_ints, flags);
+            rbtree_locking(t, locking);
+
+            // A snapshot of an empty tree is empty.
+            nft_rbtree * s = rbtree_snapshot(t);
+            assert(s && rbtree_count(s) == 0 && rbtree_validate(s));
+            assert(rbtree_insert(s, (void *) 1, (void *) -1));
+            assert(rbtree_count(t) == 0);
+            rbtree_free(s);
+
+            for (intptr_t i = 0; i < N; i++)
+                assert(rbtree_insert(t, (void *) i, (void *) -i));
+
+            // Changes to the tree are not seen by the snapshots, nor vice versa.
+            nft_rbtree * s1 = rbtree_snapshot(t);
+            nft_rbtree * s2 = rbtree_snapshot(t);
+            assert(s1->nodes == t->nodes && s2->nodes == t->nodes);
+            for (intptr_t i = N; i < 2 * N; i++)
+                assert(rbtree_insert(t, (void *) i, (void *) -i));
+            for (intptr_t i = 0; i < N; i++)
+                assert(rbtree_delete(t, (void *) i, NULL));
+            assert(s1->nodes != t->nodes && s1->nodes == s2->nodes);
+
+            // Once the writes are done, the tree drops its reference to the shared nodes.
+            assert(!t->retired && s1->shared == s2->shared && s1->shared->refs == 2);
+            check_range(t,  N, 2 * N);
+            check_range(s1, 0, N);
+            check_range(s2, 0, N);
+
+            if (flags & RBTREE_ORDER_STATS) {
+                void * key;
+                assert(rbtree_select(s1, 10, &key, NULL) && key == (void *) 10);
+                assert(rbtree_rank(s1, (void *) 10) == 10);
+            }
+
+            // A snapshot can be changed, and it can outlive its tree.
+            void * data = (void *) 1;
+            assert(rbtree_replace(s1, (void *) 0, &data) == 2 && data == 0);
+            assert(rbtree_delete(s1, (void *) 0, NULL));
+            check_range(s1, 1, N);
+            check_range(s2, 0, N);
+            rbtree_free(t);
+            rbtree_free(s1);
+
+            // The last tree to share the nodes takes them back, rather than copy them.
+            nft_rbnode * nodes = s2->nodes;
+            assert(rbtree_build_sorted(s2, NULL, NULL, 0) == 0);
+            assert(rbtree_delete(s2, (void *) 0, NULL));
+            assert(s2->nodes == nodes && !s2->shared);
+            check_range(s2, 1, N);
+
+            // A snapshot of a snapshot, and a bulk insert that rebuilds the tree.
+            s = rbtree_snapshot(s2);
+            void * keys[N];
+            for (intptr_t i = 0; i < N; i++)
+                keys[i] = (void *) (N + i);
+            assert(rbtree_insert_many(s, keys, NULL, N));
+            assert(rbtree_count(s) == 2 * N - 1);
+            check_range(s2, 1, N);
+            rbtree_free(s2);
+            rbtree_free(s);
+        }
+
+    // The handle API.
+    nft_rbtree_h h = nft_rbtree_new(0, compare_ints);
+    for (intptr_t i = 0; i < N; i++)
+        assert(nft_rbtree_insert(h, (void *) i, (void *) -i));
+    nft_rbtree_h hs = nft_rbtree_snapshot(h);
+    assert(hs && hs != h);
+    assert(nft_rbtree_delete(h, (void *) 0, NULL));
+    assert(nft_rbtree_count(h) == N - 1 && nft_rbtree_count(hs) == N);
+    assert(nft_rbtree_free(h) == 0);
+    assert(nft_rbtree_free(hs) == 0);
+    assert(nft_rbtree_snapshot(h) == NULL);
+
+    printf("Passed!\n");
+}
+
+/* Readers search for the even keys, which are always present,
+ * while the writer inserts and deletes odd keys.
+ */
+enum { OPT_KEYS = 1000, OPT_READERS = 4, OPT_ROUNDS = 50 };
+
+static int opt_done;
+
+static void *
+optimistic_reader(void * arg)
+{
+    nft_rbtree * tree = arg;
+    long searches = 0;
+
+    while (!__atomic_load_n(&opt_done, __ATOMIC_ACQUIRE))
+        for (intptr_t i = 0; i < 2 * OPT_KEYS; i += 2, searches++) {
+            void * data = NULL;
+            int found = rbtree_search(tree, (void *) i, &data);
+            assert(found && data == (void *) -i);
+        }
+    return (void *) searches;
+}
+
+/* Keys that are freed after deletion are boxed, and the box is poisoned
+ * before it is freed, so that a search that still compares it goes astray.
+ */
+static long
+compare_boxes(void * a, void * b)
+{
+    return *(intptr_t *) a - *(intptr_t *) b;
+}
+
+static void *
+synchronize_reader(void * arg)
+{
+    nft_rbtree * tree = arg;
+
+    while (!__atomic_load_n(&opt_done, __ATOMIC_ACQUIRE))
+        for (intptr_t i = 0; i < 2 * OPT_KEYS; i += 2) {
+            void * data = NULL;
+            assert(rbtree_search(tree, &i, &data) && data == (void *) -i);
+        }
+    return NULL;
+}
+
+static void
+test_optimistic(void)
+{
+    printf("rbtree: testing optimistic readers: ");
+
+    nft_rbtree * tree = rbtree_new(16, compare_ints);
+    rbtree_locking(tree, RBTREE_LOCK_OPTIMISTIC);
+    for (intptr_t i = 0; i < 2 * OPT_KEYS; i += 2)
+        assert(rbtree_insert(tree, (void *) i, (void *) -i));
+
+    pthread_t readers[OPT_READERS];
+    for (int i = 0; i < OPT_READERS; i++)
+        assert(0 == pthread_create(&readers[i], NULL, optimistic_reader, tree));
+
+    for (int round = 0; round < OPT_ROUNDS; round++) {
+        for (intptr_t i = 1; i < 2 * OPT_KEYS; i += 2)
+            assert(rbtree_insert(tree, (void *) i, (void *) -i));
+        for (intptr_t i = 1; i < 2 * OPT_KEYS; i += 2)
+            assert(rbtree_delete(tree, (void *) i, NULL));
+    }
+    __atomic_store_n(&opt_done, 1, __ATOMIC_RELEASE);
+
+    long searches = 0;
+    for (int i = 0; i < OPT_READERS; i++) {
+        void * result;
+        assert(0 == pthread_join(readers[i], &result));
+        searches += (long) result;
+    }
+    assert(rbtree_count(tree) == OPT_KEYS);
+    assert(rbtree_validate(tree));
+
+    // With no search in progress, the next write frees the outgrown arrays.
+    assert(rbtree_insert(tree, (void *) 1, NULL) && rbtree_delete(tree, (void *) 1, NULL));
+    assert(tree->retired == NULL);
+    rbtree_free(tree);
+    assert(searches > 0);
+
+    // Deleted keys are freed once rbtree_synchronize returns.
+    tree = rbtree_new(16, compare_boxes);
+    rbtree_locking(tree, RBTREE_LOCK_OPTIMISTIC);
+    intptr_t * evens = malloc(OPT_KEYS * sizeof(intptr_t));
+    for (intptr_t i = 0; i < OPT_KEYS; i++) {
+        evens[i] = 2 * i;
+        assert(rbtree_insert(tree, &evens[i], (void *) -evens[i]));
+    }
+    opt_done = 0;
+    for (int i = 0; i < OPT_READERS; i++)
+        assert(0 == pthread_create(&readers[i], NULL, synchronize_reader, tree));
+
+    for (int round = 0; round < OPT_ROUNDS; round++) {
+        intptr_t * odds = malloc(OPT_KEYS * sizeof(intptr_t));
+        for (intptr_t i = 0; i < OPT_KEYS; i++) {
+            odds[i] = 2 * i + 1;
+            assert(rbtree_insert(tree, &odds[i], NULL));
+        }
+        for (intptr_t i = 0; i < OPT_KEYS; i++)
+            assert(rbtree_delete(tree, &odds[i], NULL));
+        rbtree_synchronize(tree);
+        for (intptr_t i = 0; i < OPT_KEYS; i++)
+            odds[i] = INTPTR_MIN / 2;
+        free(odds);
+    }
+    __atomic_store_n(&opt_done, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < OPT_READERS; i++)
+        assert(0 == pthread_join(readers[i], NULL));
+    assert(rbtree_count(tree) == OPT_KEYS && rbtree_validate(tree));
+    rbtree_free(tree);
+    free(evens);
+
+    // The handle API, and a tree that is not optimistic, return at once.
+    nft_rbtree_h h = nft_rbtree_new(0, compare_ints);
+    nft_rbtree_synchronize(h);
+    nft_rbtree_locking(h, RBTREE_LOCK_OPTIMISTIC);
+    nft_rbtree_synchronize(h);
+    assert(nft_rbtree_free(h) == 0);
+
+    printf("Passed!\n");
+}
+
 /* Timing stuff.
  */
 struct timespec mark, done;
@@ -1457,6 +4144,544 @@ struct timespec mark, done;
 #define TIME    done = nft_gettime()
 #define ELAPSED 0.000000001 * nft_timespec_comp(done, mark)
 
+/* Measure the total search throughput of 1, 2 and 4 threads, in optimistic
+ * mode and with the read lock. Optimistic searches share no cache line that
+ * is written, so their throughput should grow with the number of cores.
+ */
+enum { SCALE_KEYS = 100000, SCALE_SEARCHES = 200000, SCALE_THREADS = 4 };
+
+static void *
+scale_reader(void * arg)
+{
+    nft_rbtree * tree = arg;
+    intptr_t     key  = (intptr_t) pthread_self() % SCALE_KEYS;
+
+    for (int i = 0; i < SCALE_SEARCHES; i++) {
+        void * data = NULL;
+        key = (key + 7919) % SCALE_KEYS;
+        assert(rbtree_search(tree, (void *) key, &data) && data == (void *) -key);
+    }
+    return NULL;
+}
+
+static void
+test_read_scaling(void)
+{
+    printf("rbtree: testing search throughput\n");
+
+    long ncpus = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    nft_rbtree * tree = rbtree_new(SCALE_KEYS + 1, compare_ints);
+    for (intptr_t i = 0; i < SCALE_KEYS; i++)
+        assert(rbtree_insert(tree, (void *) i, (void *) -i));
+
+    for (unsigned locking = 1; locking <= RBTREE_LOCK_OPTIMISTIC; locking++) {
+        rbtree_locking(tree, locking);
+        double one = 0;
+        for (int threads = 1; threads <= SCALE_THREADS; threads *= 2) {
+            pthread_t readers[SCALE_THREADS];
+            MARK;
+            for (int i = 0; i < threads; i++)
+                assert(0 == pthread_create(&readers[i], NULL, scale_reader, tree));
+            for (int i = 0; i < threads; i++)
+                assert(0 == pthread_join(readers[i], NULL));
+            TIME;
+            double rate = threads * SCALE_SEARCHES / (ELAPSED);
+            if (threads == 1) one = rate;
+            printf("%s %d thread%s: %5.1f M searches/sec (%.2fx)\n",
+                   locking == RBTREE_LOCK_OPTIMISTIC ? "optimistic" : "read lock ",
+                   threads, threads > 1 ? "s" : " ", rate / 1e6, rate / one);
+
+            // Allow for noise, but optimistic searches must not contend.
+            // With fewer cores than threads, the threads take turns.
+            if (locking == RBTREE_LOCK_OPTIMISTIC && threads <= ncpus)
+                assert(rate >= 0.5 * threads * one);
+        }
+    }
+    rbtree_free(tree);
+}
+
+static void
+test_compact(void)
+{
+    printf("rbtree: testing compaction\n");
+
+    enum { N = 1000 };
+    for (unsigned layout = RBTREE_LAYOUT_NONE; layout <= RBTREE_LAYOUT_VEB; layout++)
+      for (unsigned locking = 0; locking <= RBTREE_LOCK_OPTIMISTIC; locking += RBTREE_LOCK_OPTIMISTIC)
+        for (unsigned flags = 0; flags <= RBTREE_ORDER_STATS; flags++) {
+            nft_rbtree * t = rbtree_new_ex(0, compare_ints, flags);
+            rbtree_locking(t, locking);
+
+            // An empty tree is already compact.
+            assert(rbtree_compact(t, layout));
+            for (intptr_t i = 0; i < N; i++) {
+                intptr_t k = (i * 7919) % N;
+                assert(rbtree_insert(t, (void *) k, (void *) -k));
+            }
+            for (intptr_t i = 0; i < N; i++)
+                if (i % 10) assert(rbtree_delete(t, (void *) i, NULL));
+
+            // A snapshot must be unaffected by compaction of its tree.
+            nft_rbtree * s    = rbtree_snapshot(t);
+            void       * key, * data;
+            assert(rbtree_walk_first(t, &key, &data) && key == (void *) 0);
+            assert(rbtree_walk_next (t, &key, &data) && key == (void *) 10);
+
+            assert(rbtree_compact(t, layout));
+            assert(rbtree_validate(t) && rbtree_count(t) == N / 10);
+            assert(locking ? t->num_nodes >= N : t->num_nodes == N / 10 + 1);
+            assert(rbtree_validate(s) && rbtree_count(s) == N / 10);
+            rbtree_free(s);
+
+            // The walk continues where it left off.
+            intptr_t i = 20;
+            while (rbtree_walk_next(t, &key, &data)) {
+                assert(key == (void *) i && data == (void *) -i);
+                i += 10;
+            }
+            assert(i == N);
+
+            // In key order, node i holds the i'th key.
+            if (layout == RBTREE_LAYOUT_INORDER)
+                for (unsigned node = 1; node < t->next_free; node++)
+                    assert(t->nodes[node].key == (void *) (intptr_t) (10 * (node - 1)));
+
+            if (flags & RBTREE_ORDER_STATS)
+                assert(rbtree_rank(t, (void *) 500) == 50);
+
+            // The compacted tree is fully functional.
+            for (intptr_t i = 0; i < N; i++)
+                assert(rbtree_search(t, (void *) i, NULL) == !(i % 10));
+            for (intptr_t i = 0; i < N; i++)
+                if (i % 10) assert(rbtree_insert(t, (void *) i, (void *) -i));
+            check_range(t, 0, N);
+            rbtree_free(t);
+        }
+    assert(!rbtree_compact(NULL, RBTREE_LAYOUT_NONE));
+
+    nft_rbtree_h h = nft_rbtree_new(0, compare_ints);
+    assert(!nft_rbtree_compact(h, RBTREE_LAYOUT_VEB + 1));
+    assert( nft_rbtree_compact(h, RBTREE_LAYOUT_VEB));
+    nft_rbtree_free(h);
+
+    /* Compare search times in a large tree, before and after compaction.
+     * The nodes take 32MB, which exceeds most caches, and the keys are
+     * searched in a pseudo-random order, so that most node visits miss.
+     * Each time is the best of several runs.
+     */
+    enum { M = 1000000, RUNS = 5 };
+    const char * names[] = { "insertion", "key", "vEB" };
+    double       base    = 0;
+    intptr_t   * keys    = malloc(M * sizeof(intptr_t));
+    nft_rbtree * t       = rbtree_new(0, rbtree_compare_integers);
+    for (int i = 0; i < M; i++) {
+        keys[i] = ((intptr_t) i * 7919) % M;
+        assert(rbtree_insert(t, (void *) keys[i], NULL));
+    }
+    for (unsigned layout = RBTREE_LAYOUT_NONE; layout <= RBTREE_LAYOUT_VEB; layout++) {
+        MARK;
+        assert(rbtree_compact(t, layout));
+        TIME;
+        double compact_time = ELAPSED;
+        double search_time  = 0;
+        for (int run = 0; run < RUNS; run++) {
+            MARK;
+            for (intptr_t i = 0; i < M; i++)
+                assert(rbtree_search(t, (void *) ((i * 48271 + run * 7) % M), NULL));
+            TIME;
+            if (run == 0 || ELAPSED < search_time) search_time = ELAPSED;
+        }
+        if (layout == RBTREE_LAYOUT_NONE) base = search_time;
+        printf("Time to search %d keys in %s order: %.3f (%.2fx, compacted in %.3f)\n",
+               M, names[layout], search_time, base / search_time, compact_time);
+    }
+    rbtree_free(t);
+    free(keys);
+}
+
+static void
+test_save_map(void)
+{
+    printf("rbtree: testing save and map\n");
+
+    enum { N = 1000 };
+    const char * path = "nft_rbtree.map";
+    static char  strings[N][16];
+    void       * key, * data;
+
+    // Save a tree of strings, and map it twice. The second map is relocated.
+    nft_rbtree * t = rbtree_new(0, rbtree_compare_strings);
+    for (int i = 0; i < N; i++) {
+        sprintf(strings[i], "key%04d", (i * 7) % N);
+        assert(rbtree_insert(t, strings[i], strings[i] + 3));
+    }
+    assert(0 == rbtree_save(t, path, rbtree_save_string, rbtree_save_string));
+
+    nft_rbtree * m1 = rbtree_map(path, rbtree_compare_strings);
+    nft_rbtree * m2 = rbtree_map(path, rbtree_compare_strings);
+    assert(m1 && m2 && m1->map != m2->map);
+    rbtree_free(t);
+    for (nft_rbtree * m = m1; m; m = (m == m1) ? m2 : NULL) {
+        assert(rbtree_validate(m) && rbtree_count(m) == N);
+        int i = 0;
+        for (int more = rbtree_walk_first(m, &key, &data); more; more = rbtree_walk_next(m, &key, &data), i++) {
+            char expect[16];
+            sprintf(expect, "key%04d", i);
+            assert(!strcmp(key, expect) && !strcmp(data, expect + 3));
+            assert((char *) key >= (char *) m->map && (char *) key < (char *) m->map + m->map_size);
+        }
+        assert(i == N);
+        assert(rbtree_search(m, "key0500", &data) && !strcmp(data, "0500"));
+        assert(!rbtree_search(m, "key5000", NULL));
+
+        // The mapped tree is read-only.
+        assert(!rbtree_insert(m, "key5000", NULL));
+        assert(!rbtree_delete(m, "key0500", NULL));
+        data = NULL;
+        assert(!rbtree_replace(m, "key0500", &data));
+        assert(!rbtree_snapshot(m) && !rbtree_compact(m, RBTREE_LAYOUT_NONE));
+        assert(rbtree_count(m) == N && rbtree_validate(m));
+    }
+    rbtree_free(m1);
+    rbtree_free(m2);
+
+    // Save integer keys, with order statistics, without serializers.
+    t = rbtree_new_ex(0, rbtree_compare_integers, RBTREE_ORDER_STATS);
+    for (intptr_t i = 0; i < N; i++)
+        assert(rbtree_insert(t, (void *) i, (void *) -i));
+    assert(0 == rbtree_save(t, path, NULL, NULL));
+    rbtree_free(t);
+    t = rbtree_map(path, rbtree_compare_integers);
+    check_range(t, 0, N);
+    assert(rbtree_rank(t, (void *) 10) == 10);
+    assert(rbtree_select(t, 20, &key, &data) && key == (void *) 20);
+    rbtree_free(t);
+
+    // Save an empty tree.
+    t = rbtree_new(0, rbtree_compare_integers);
+    assert(0 == rbtree_save(t, path, NULL, NULL));
+    rbtree_free(t);
+    t = rbtree_map(path, rbtree_compare_integers);
+    assert(t && rbtree_count(t) == 0 && rbtree_validate(t));
+    assert(!rbtree_walk_first(t, &key, &data) && !rbtree_search(t, (void *) 1, NULL));
+    rbtree_free(t);
+
+    // Invalid files can't be mapped.
+    FILE * file = fopen(path, "w");
+    for (int i = 0; i < 100; i++) fputs("not a tree ", file);
+    fclose(file);
+    assert(!rbtree_map(path, rbtree_compare_integers) && errno == EINVAL);
+    assert(!rbtree_map("no such file", rbtree_compare_integers) && errno == ENOENT);
+
+    // Neither can files whose header or nodes are corrupt.
+    for (int corrupt = 0; corrupt < 5; corrupt++) {
+        t = rbtree_new_ex(0, rbtree_compare_strings, RBTREE_ORDER_STATS);
+        for (int i = 0; i < N; i++)
+            assert(rbtree_insert(t, strings[i], strings[i] + 3));
+        assert(0 == rbtree_save(t, path, rbtree_save_string, rbtree_save_string));
+        rbtree_free(t);
+
+        map_header header;
+        file = fopen(path, "r+b");
+        assert(file && fread(&header, sizeof(header), 1, file) == 1);
+        uint64_t   offset = header.nodes_offset + 3 * sizeof(nft_rbnode);
+        nft_rbnode node;
+        assert(0 == fseek(file, offset, SEEK_SET) && fread(&node, sizeof(node), 1, file) == 1);
+        switch (corrupt) {
+        case 0: header.nodes_offset = 0;                  break;
+        case 1: header.blob_offset  = header.sizes_offset; break;
+        case 2: node.child[1]       = header.next_free;   break;
+        case 3: node.parent         = UINT_MAX;           break;
+        case 4: node.key            = (void *) (uintptr_t) (header.base + header.file_size + 8); break;
+        }
+        assert(0 == fseek(file, 0, SEEK_SET) && fwrite(&header, sizeof(header), 1, file) == 1);
+        assert(0 == fseek(file, offset, SEEK_SET) && fwrite(&node, sizeof(node), 1, file) == 1);
+        fclose(file);
+        errno = 0;
+        assert(!rbtree_map(path, rbtree_compare_strings) && errno == EINVAL);
+    }
+    assert(rbtree_save(NULL, path, NULL, NULL) == EINVAL);
+
+    // The handle API, and a comparison of load times for a large tree.
+    enum { M = 1000000 };
+    nft_rbtree_h h = nft_rbtree_new(0, rbtree_compare_integers);
+    MARK;
+    for (intptr_t i = 0; i < M; i++)
+        assert(nft_rbtree_insert(h, (void *) ((i * 7919) % M), NULL));
+    TIME;
+    printf("Time to insert %d keys: %.3f\n", M, ELAPSED);
+    MARK;
+    assert(0 == nft_rbtree_save(h, path, NULL, NULL));
+    TIME;
+    printf("Time to save   %d keys: %.3f\n", M, ELAPSED);
+    nft_rbtree_free(h);
+    MARK;
+    h = nft_rbtree_map(path, rbtree_compare_integers);
+    TIME;
+    printf("Time to map    %d keys: %.3f\n", M, ELAPSED);
+    assert(h && nft_rbtree_count(h) == M && nft_rbtree_validate(h));
+    assert(!nft_rbtree_insert(h, (void *) (intptr_t) M, NULL));
+    nft_rbtree_free(h);
+
+    unlink(path);
+}
+
+/* Check that tree holds count[k] pairs with key k, with data of the given parity,
+ * for each k in 0..range-1.
+ */
+static void
+check_counts(nft_rbtree * tree, int * count, int * parity, int range)
+{
+    int  * seen = calloc(range, sizeof(int));
+    void * key, * data, * walk;
+    long   last = -1, total = 0;
+
+    assert(rbtree_validate(tree));
+    for (int more = rbtree_walk_first_r(tree, &key, &data, &walk); more;
+             more = rbtree_walk_next_r (tree, &key, &data, &walk)) {
+        intptr_t k = (intptr_t) key;
+        assert(k >= last && k < range);
+        assert(((intptr_t) data & 1) == parity[k]);
+        seen[k]++, last = k;
+    }
+    for (int k = 0; k < range; k++) {
+        assert(seen[k] == count[k]);
+        total += count[k];
+    }
+    assert(rbtree_count(tree) == total);
+    free(seen);
+}
+
+static void
+test_set_ops(void)
+{
+    printf("rbtree: testing set operations\n");
+
+    nft_pool_h pool = nft_pool_new(0, 4, 0);
+    int sizes[] = { 0, 1, 100, 50000 };
+
+    for (int si = 0; si < 4; si++)
+      for (int sj = 0; sj < 4; sj++)
+        for (int p = 0; p < 2; p++) {
+            int   n1 = sizes[si], n2 = sizes[sj], range = n1 + n2 + 1;
+            int * c1 = calloc(range, sizeof(int)), * c2 = calloc(range, sizeof(int));
+            int * expect = calloc(range, sizeof(int)), * parity = calloc(range, sizeof(int));
+            nft_rbtree * t1 = rbtree_new(0, rbtree_compare_integers);
+            nft_rbtree * t2 = rbtree_new(0, rbtree_compare_integers);
+
+            // Odd data in t2, and keys that include duplicates.
+            for (intptr_t i = 0; i < n1; i++) {
+                intptr_t k = (i * 7919) % range / 2;
+                assert(rbtree_insert(t1, (void *) k, (void *) (2 * i)));
+                c1[k]++;
+            }
+            for (intptr_t i = 0; i < n2; i++) {
+                intptr_t k = (i * 104729) % range / 3 * 2;
+                assert(rbtree_insert(t2, (void *) k, (void *) (2 * i + 1)));
+                c2[k]++;
+            }
+            nft_pool_h   use = p ? pool : NULL;
+            nft_rbtree * t;
+
+            t = rbtree_union(t1, t2, use);
+            for (int k = 0; k < range; k++)
+                expect[k] = c1[k] ? c1[k] : c2[k], parity[k] = !c1[k];
+            check_counts(t, expect, parity, range);
+            rbtree_free(t);
+
+            t = rbtree_intersection(t1, t2, use);
+            for (int k = 0; k < range; k++)
+                expect[k] = c2[k] ? c1[k] : 0, parity[k] = 0;
+            check_counts(t, expect, parity, range);
+            rbtree_free(t);
+
+            t = rbtree_difference(t1, t2, use);
+            for (int k = 0; k < range; k++)
+                expect[k] = c2[k] ? 0 : c1[k];
+            check_counts(t, expect, parity, range);
+            rbtree_free(t);
+
+            // Split t1 at its median key.
+            nft_rbtree * lo, * hi;
+            intptr_t     key = n1 / 4;
+            assert(rbtree_split(t1, (void *) key, &lo, &hi));
+            for (int k = 0; k < range; k++)
+                expect[k] = (k < key) ? c1[k] : 0;
+            check_counts(lo, expect, parity, range);
+            for (int k = 0; k < range; k++)
+                expect[k] = (k < key) ? 0 : c1[k];
+            check_counts(hi, expect, parity, range);
+            rbtree_free(lo);
+            rbtree_free(hi);
+
+            // Join t2 into t1. Equal keys from t2 follow those of t1.
+            assert(rbtree_join(t1, t2));
+            for (int k = 0; k < range; k++)
+                expect[k] = c1[k] + c2[k];
+            int  * seen = calloc(range, sizeof(int));
+            void * wkey = NULL, * wdata = NULL, * walk = NULL;
+            for (int more = rbtree_walk_first_r(t1, &wkey, &wdata, &walk); more;
+                     more = rbtree_walk_next_r (t1, &wkey, &wdata, &walk)) {
+                intptr_t ki = (intptr_t) wkey;
+                assert(((intptr_t) wdata & 1) == (seen[ki]++ >= c1[ki]));
+            }
+            for (int k = 0; k < range; k++)
+                assert(seen[k] == expect[k]);
+            assert(rbtree_validate(t1) && rbtree_count(t2) == n2);
+
+            free(seen);
+            free(c1), free(c2), free(expect), free(parity);
+            rbtree_free(t1);
+            rbtree_free(t2);
+        }
+
+    // The handle API, and a comparison of sequential and parallel unions.
+    enum { M = 1000000 };
+    nft_rbtree_h h1 = nft_rbtree_new(0, rbtree_compare_integers);
+    nft_rbtree_h h2 = nft_rbtree_new(0, rbtree_compare_integers);
+    for (intptr_t i = 0; i < M; i++) {
+        assert(nft_rbtree_insert(h1, (void *) (2 * i), NULL));
+        assert(nft_rbtree_insert(h2, (void *) (3 * i), NULL));
+    }
+    for (int p = 0; p < 2; p++) {
+        MARK;
+        nft_rbtree_h u = nft_rbtree_union(h1, h2, p ? pool : NULL);
+        TIME;
+        printf("Time to unite %d and %d keys%s: %.3f\n", M, M, p ? " in parallel" : "", ELAPSED);
+        // The multiples of 6 that are less than 2M are in both trees.
+        assert(u && nft_rbtree_count(u) == M + M - ((2 * M - 1) / 6 + 1) && nft_rbtree_validate(u));
+        nft_rbtree_free(u);
+    }
+    nft_rbtree_h inter = nft_rbtree_intersection(h1, h2, pool);
+    nft_rbtree_h diff  = nft_rbtree_difference(h1, h2, pool);
+    assert(nft_rbtree_count(inter) + nft_rbtree_count(diff) == M);
+    nft_rbtree_h lo, hi;
+    assert(nft_rbtree_split(inter, (void *) (intptr_t) M, &lo, &hi));
+    assert(nft_rbtree_count(lo) + nft_rbtree_count(hi) == nft_rbtree_count(inter));
+    assert(nft_rbtree_join(lo, hi) && nft_rbtree_count(lo) == nft_rbtree_count(inter));
+    assert(!nft_rbtree_union(h1, NULL, NULL) && !nft_rbtree_join(h1, NULL));
+    nft_rbtree_free(lo), nft_rbtree_free(hi), nft_rbtree_free(inter), nft_rbtree_free(diff);
+
+    // A small tree is searched for in a large one, which is not flattened.
+    nft_rbtree_h small = nft_rbtree_new(0, rbtree_compare_integers);
+    for (intptr_t i = 0; i < 10; i++)
+        assert(nft_rbtree_insert(small, (void *) (3 * i), NULL));
+    MARK;
+    inter = nft_rbtree_intersection(small, h1, NULL);
+    diff  = nft_rbtree_difference(small, h1, NULL);
+    nft_rbtree_h big = nft_rbtree_intersection(h1, small, NULL);
+    TIME;
+    printf("Time to intersect and subtract 10 and %d keys: %.6f\n", M, ELAPSED);
+    assert(nft_rbtree_count(inter) == 5 && nft_rbtree_count(diff) == 5 && nft_rbtree_count(big) == 5);
+    nft_rbtree_free(small), nft_rbtree_free(inter), nft_rbtree_free(diff), nft_rbtree_free(big);
+
+    // Trees with different comparators can't be merged.
+    nft_rbtree_h h3 = nft_rbtree_new(0, compare_ints);
+    assert(nft_rbtree_insert(h3, (void *) 1, NULL));
+    assert(!nft_rbtree_union(h1, h3, NULL) && !nft_rbtree_intersection(h1, h3, pool));
+    assert(!nft_rbtree_difference(h3, h1, NULL));
+    nft_rbtree_free(h1), nft_rbtree_free(h2), nft_rbtree_free(h3);
+
+    assert(0 == nft_pool_shutdown(pool, -1));
+}
+
+/* Calls the comparator, so that the tree can't compare keys inline.
+ */
+static long
+compare_pointers(void * a, void * b)
+{
+    return rbtree_compare_pointers(a, b);
+}
+
+/* Return the best time of several runs to search for the first n keys.
+ */
+static double
+time_searches(nft_rbtree * tree, intptr_t * keys, int n)
+{
+    enum { SEARCHES = 1000000, RUNS = 5 };
+    double best = 0;
+
+    for (int run = 0; run < RUNS; run++) {
+        MARK;
+        for (int i = 0; i < SEARCHES; i++)
+            assert(rbtree_search(tree, (void *) keys[i % n], NULL));
+        TIME;
+        if (run == 0 || ELAPSED < best) best = ELAPSED;
+    }
+    return best;
+}
+
+/* Compare trees with inline comparisons to trees that call the equivalent
+ * comparator, with pseudo-random keys that include duplicates.
+ */
+static void
+test_key_modes(void)
+{
+    printf("rbtree: testing inline key comparison\n");
+
+    enum { N = 1000000 };
+    RBTREE_COMPARE inline_compare[] = { (RBTREE_COMPARE) rbtree_compare_integers, (RBTREE_COMPARE) rbtree_compare_pointers };
+    RBTREE_COMPARE called_compare[] = { (RBTREE_COMPARE) compare_ints, (RBTREE_COMPARE) compare_pointers };
+    const char   * names[]          = { "integer", "pointer" };
+
+    intptr_t * keys = malloc(N * sizeof(intptr_t));
+    for (int i = 0; i < N; i++)
+        keys[i] = (intptr_t) ((i * 2654435761u) % (N / 2)) - N / 4;
+
+    for (int m = 0; m < 2; m++) {
+        nft_rbtree * a = rbtree_new(0, inline_compare[m]);
+        nft_rbtree * b = rbtree_new(0, called_compare[m]);
+        assert(a->keys != KEYS_GENERIC && b->keys == KEYS_GENERIC);
+
+        for (int i = 0; i < N; i++) {
+            assert(rbtree_insert(a, (void *) keys[i], (void *) (intptr_t) i));
+            assert(rbtree_insert(b, (void *) keys[i], (void *) (intptr_t) i));
+        }
+        assert(rbtree_validate(a) && rbtree_validate(b));
+
+        // The trees must hold the same pairs, in the same order.
+        void * ka, * da, * kb, * db, * wa, * wb;
+        int    more = rbtree_walk_first_r(a, &ka, &da, &wa);
+        assert(more == rbtree_walk_first_r(b, &kb, &db, &wb));
+        while (more) {
+            assert(ka == kb && da == db);
+            more = rbtree_walk_next_r(a, &ka, &da, &wa);
+            assert(more == rbtree_walk_next_r(b, &kb, &db, &wb));
+        }
+
+        assert(!rbtree_search(a, (void *) (intptr_t) N, NULL));
+        for (int i = 0; i < N; i++) {
+            void * data = NULL;
+            assert(rbtree_delete(a, (void *) keys[i], &data));
+            assert(rbtree_delete(b, (void *) keys[i], NULL));
+            assert(keys[(intptr_t) data] == keys[i]);
+        }
+        assert(rbtree_count(a) == 0 && rbtree_validate(a));
+        rbtree_free(a);
+        rbtree_free(b);
+
+        // Time a million searches of trees that do and don't fit in cache.
+        for (int n = 1000; n <= N; n *= 100) {
+            a = rbtree_new(n, inline_compare[m]);
+            b = rbtree_new(n, called_compare[m]);
+            for (int i = 0; i < n; i++) {
+                assert(rbtree_insert(a, (void *) keys[i], NULL));
+                assert(rbtree_insert(b, (void *) keys[i], NULL));
+            }
+            double inline_time = time_searches(a, keys, n);
+            double called_time = time_searches(b, keys, n);
+            printf("Time to search %7d %s keys: %.3f inline, %.3f with comparator (%.2fx)\n",
+                   n, names[m], inline_time, called_time, called_time / inline_time);
+            rbtree_free(a);
+            rbtree_free(b);
+        }
+    }
+    free(keys);
+}
+
 static void
 test_private_api(void)
 {
@@ -1480,6 +4705,32 @@ test_private_api(void)
 
     assert(rbtree_validate(t));
 
+    /* Rebuild the tree from its sorted keys */
+    {
+        void ** sorted = malloc(nkeys * sizeof(void *));
+        for (i = 0, result = rbtree_walk_first(t, &key, NULL);
+             result;
+             i++,   result = rbtree_walk_next (t, &key, NULL))
+            sorted[i] = key;
+
+        nft_rbtree * u = rbtree_new(0, rbtree_compare_strings);
+        MARK;
+        assert(rbtree_build_sorted(u, sorted, NULL, nkeys));
+        TIME;
+        printf("Time to build  %d keys: %.3f\n", nkeys, ELAPSED);
+        assert(rbtree_count(u) == nkeys);
+        rbtree_free(u);
+
+        u = rbtree_new(0, rbtree_compare_strings);
+        MARK;
+        assert(rbtree_insert_many(u, (void **) keys, NULL, nkeys));
+        TIME;
+        printf("Time to bulk-insert %d keys: %.3f\n", nkeys, ELAPSED);
+        assert(rbtree_count(u) == nkeys);
+        rbtree_free(u);
+        free(sorted);
+    }
+
     /* Walk the tree */
     MARK;
     for (i = 0, result = rbtree_walk_first(t, &key, &data);
@@ -1593,6 +4844,46 @@ main(int argc, char * argv[])
      */
     test_duplex_keys();
 
+    /* Test seeks, reverse walks and range queries.
+     */
+    test_seek();
+
+    /* Test rank, select and count_range.
+     */
+    test_order_stats();
+
+    /* Test bulk loading.
+     */
+    test_bulk_load();
+
+    /* Test snapshots.
+     */
+    test_snapshot();
+
+    /* Test compaction and node layouts.
+     */
+    test_compact();
+
+    /* Test saving and mapping.
+     */
+    test_save_map();
+
+    /* Test join, split, and the set operations.
+     */
+    test_set_ops();
+
+    /* Test inline comparison of integer and pointer keys.
+     */
+    test_key_modes();
+
+    /* Test lock-free searches against a concurrent writer.
+     */
+    test_optimistic();
+
+    /* Measure how searches scale with threads.
+     */
+    test_read_scaling();
+
     /* Insert strings into key table
      */
     sack_t sack = sack_create(16344);
@@ -26,7 +26,7 @@
  *
  * REALTIME SCHEDULING
  * ~~~~~~~~~~~~~~~~~~~
- * There are reasons you may wish to run the TaskThread at an elevated
+ * There are reasons you may wish to run the scheduler threads at an elevated
  * realtime priority. You may want tasks to execute as nearly as possible
  * to their scheduled time, to minimize "jitter". When tasks are used
  * to implement time-outs, they may need an elevated priority in order
@@ -36,7 +36,7 @@
  * but in this case, since scheduled tasks should be brief and nonblocking,
  * there is no reason to expect problems. Note that if you use realtime
  * scheduling, and your task spawns a thread, the spawned thread will by
- * default inherit the scheduling priority of the TaskThread. You should
+ * default inherit the scheduling priority of the scheduler. You should
  * explicitly override this, or use nft_pool instead of spawning a thread.
  *
  * With these caveats in mind, if you wish to use realtime scheduling,
@@ -51,7 +51,7 @@
 
 #include <nft_task.h>
 
-// Uncomment this definition to run the TaskThread at elevated priority.
+// Uncomment this definition to run the scheduler threads at elevated priority.
 // #define USE_REALTIME_SCHEDULING
 
 #if    defined(USE_REALTIME_SCHEDULING) && !defined(_WIN32)
@@ -61,89 +61,548 @@
 #endif
 #endif
 
+// The monotonic clock mode needs pthread_condattr_setclock, which is absent on macOS.
+#if !defined(_WIN32) && !defined(__APPLE__) && defined(CLOCK_MONOTONIC)
+#define HAVE_CONDATTR_SETCLOCK 1
+#endif
+
 // Define the minimum size of the queue's task array.
 #define MIN_SIZE   32
 
-/* All of the pending tasks are stored in a queue that is structured as a heap.
+/* All of the pending tasks are stored in a queue that is structured as a 4-ary heap.
+ * Each entry holds its task's abstime in nanoseconds, beside the task pointer,
+ * so that comparisons need not touch the tasks themselves. The four children
+ * of an entry fill 64 bytes, and the array is offset by HEAP_PAD entries from
+ * a cache line boundary, so that each set of siblings shares one cache line.
  */
+#define HEAP_ARITY  4
+#define HEAP_LINE   64
+#define HEAP_PAD    (HEAP_ARITY - 1)
+
+typedef struct heap_entry {
+    int64_t	deadline;	 // task->abstime in nanoseconds
+    nft_task  * task;
+} heap_entry;
+
 typedef struct heap {
-    long        size;		 // size of tasks array
-    long        count;		 // number of tasks in use
-    nft_task ** tasks;		 // array of task pointers
-    nft_task  * min[MIN_SIZE];	 // initial minimal array
+    long         size;		 // size of entries array
+    long         count;		 // number of tasks in use
+    heap_entry * entries;	 // array of entries, aligned in memory or min
+    void       * memory;	 // allocation holding entries, or NULL
+    char	 min[(MIN_SIZE + HEAP_PAD) * sizeof(heap_entry) + HEAP_LINE]; // initial minimal array
 } heap_t;
 
 
+/* Alternatively, the pending tasks are stored in a hierarchical timing wheel.
+ * Each level has WHEEL_SLOTS slots, and each slot of a level spans all the
+ * slots of the level below. A task is placed in the lowest level whose span
+ * reaches its tick, and when the wheel turns to a slot in a higher level,
+ * that slot's tasks cascade down into the lower levels.
+ */
+#define WHEEL_BITS	8
+#define WHEEL_SLOTS	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS	4
+#define WHEEL_DUE	(WHEEL_LEVELS * WHEEL_SLOTS) // task->index of due tasks
+
+typedef struct wheel {
+    long	count;				// number of tasks in the wheel
+    long	counts[WHEEL_LEVELS];		// number of tasks in each level
+    uint64_t	current;			// next tick to be processed
+    uint64_t	wake;				// tick when the scheduler will wake
+    nft_task  * due;				// tasks whose tick has passed
+    nft_task  * slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} wheel_t;
+
+
 // Forward prototypes for the heap functions.
 static void		heap_init  (heap_t *heap);
 static int		heap_insert(heap_t *heap, nft_task *  item);
 static long		heap_top   (heap_t *heap, nft_task ** item);
+static void		heap_window(heap_t *heap, long        index, struct timespec * latest);
 static int		heap_pop   (heap_t *heap, nft_task ** item);
 static void		heap_delete(heap_t *heap, long        index);
+static int		heap_insert_many(heap_t *heap, nft_task ** items, long count);
+static void		heap_compact(heap_t *heap);
+static void		heap_update(heap_t *heap, long        index);
 
+// Forward prototypes for the timing wheel functions.
+static void		wheel_init  (wheel_t *wheel, uint64_t current);
+static void		wheel_insert(wheel_t *wheel, nft_task *  item);
+static int		wheel_next  (wheel_t *wheel, uint64_t  * tick);
+static int		wheel_pop   (wheel_t *wheel, uint64_t    now, nft_task ** item);
+static void		wheel_delete(wheel_t *wheel, nft_task *  item);
 
-// Local static data.
-static heap_t		Queue;		// This heap holds the task queue.
-static nft_task_h	CurrentTask;	// Handle to executing task.
 
+/* Each shard has its own scheduler thread, and its own task queue, which is
+ * protected from concurrent access by the shard's mutex. The scheduler thread
+ * uses the shard's cond to control its behavior.
+ */
+typedef struct shard {
+    pthread_mutex_t	mutex;
+    pthread_cond_t	cond;
+    pthread_t		thread;		// The shard's scheduler thread id.
+    heap_t		queue;		// This heap holds the task queue.
+    wheel_t		wheel;		// Or this wheel holds the task queue.
+    struct timespec	wake;		// When the scheduler will wake, for the heap.
+    nft_task_stats_t	stats;		// Instrumentation, see nft_task_stats.
+
+    // Due tasks for nft_pools are collected, and dispatched in batches.
+    long		batch_count;
+    long		batch_size;
+    nft_task	     ** batch;		// The due tasks.
+    nft_task	     ** group;		// The tasks for one pool.
+    nft_task	     ** retry;		// The tasks to retry.
+    void	   (** functions)(void *);
+    void	     ** arguments;
+} shard_t;
+
+
+/* Each scheduler thread describes the task that it is running in thread-local
+ * storage, so that nft_task_this and nft_task_this_info need not lock.
+ */
+#if defined(_WIN32) && !defined(__GNUC__)
+#define thread_local __declspec(thread)
+#else
+#define thread_local _Thread_local
+#endif
+
+static thread_local nft_task_this_info_t Current;
+
+
+// Local static data.
+static shard_t	      * Shards;		// The array of NumShards shards.
+
+// The backend and shards are chosen before the scheduler starts.
+static int		Backend   = NFT_TASK_HEAP;
+static int		NumShards = 1;
+static int		Clock     = NFT_TASK_REALTIME;
+static int		Started   = 0;
+static int64_t		TickNsec  = 1000000;	// Wheel tick in nanoseconds.
+static int64_t		Budget    = 0;		// Action run-time budget in nanoseconds.
+static void	     (* Overrun)(nft_task_h, double);	// Called when an action exceeds Budget.
+static struct timespec	TickBase;		// Time of wheel tick zero.
+
+// nft_task_budget may change Budget and Overrun while the scheduler threads read them.
+#ifdef __GNUC__
+#define BUDGET_SET(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define BUDGET_GET(x)		__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#else
+#define BUDGET_SET(x, v)	((x) = (v))
+#define BUDGET_GET(x)		(x)
+#endif
 
-/* The Queue and other local static vars are protected from concurrent access
- * by QueueMutex. The scheduler thread uses QueueCond to control its behavior.
- * All of them are initialized under QueueOnce.
+/* The settings above are protected by QueueMutex until the scheduler starts.
+ * The Shards are initialized under QueueOnce.
  */
 static pthread_once_t   QueueOnce  = PTHREAD_ONCE_INIT;
 static pthread_mutex_t	QueueMutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t	QueueCond  = PTHREAD_COND_INITIALIZER;
-static pthread_t	TaskThread;  // The task scheduler thread id.
 
 // Define the helper functions nft_task_cast, _handle, _lookup, and _discard.
 NFT_DEFINE_WRAPPERS(nft_task,)
 
 
+/*-----------------------------------------------------------------------------
+ * Backend dispatch - These functions operate on whichever of the shard's
+ * queue or wheel is in use. The caller must hold the shard's mutex.
+ *-----------------------------------------------------------------------------
+ */
+
+// Return the current time on the scheduler's clock.
+static inline struct timespec
+sched_now(void)
+{
+    return (Clock == NFT_TASK_MONOTONIC) ? nft_gettime_mono() : nft_gettime();
+}
+
+// Convert a time on the scheduler's clock to the clock of nft_gettime.
+static inline struct timespec
+user_time(struct timespec time)
+{
+    if (Clock != NFT_TASK_MONOTONIC) return time;
+
+    int64_t nsec = nft_timespec_comp(time, nft_gettime_mono());
+    return nft_timespec_add(nft_gettime(), (struct timespec){ nsec / NANOSEC, nsec % NANOSEC });
+}
+
+// Convert a time from nft_gettime to the scheduler's clock.
+static inline struct timespec
+sched_time(struct timespec time)
+{
+    if (Clock != NFT_TASK_MONOTONIC) return time;
+
+    int64_t         nsec  = nft_timespec_comp(time, nft_gettime());
+    struct timespec now   = nft_gettime_mono();
+    if (nsec < 0) {
+	// The time is past, so the task is due now.
+	return now;
+    }
+    return nft_timespec_add(now, (struct timespec){ nsec / NANOSEC, nsec % NANOSEC });
+}
+
+// Convert a time to a wheel tick, rounding up so tasks never run early.
+static uint64_t
+time_tick(struct timespec time, int round_up)
+{
+    int64_t nsec = nft_timespec_comp(time, TickBase);
+    if (nsec <= 0) return 0;
+    return (nsec + (round_up ? TickNsec - 1 : 0)) / TickNsec;
+}
+
+// Convert a wheel tick to the time that it begins.
+static struct timespec
+tick_time(uint64_t tick)
+{
+    int64_t         nsec  = tick * TickNsec;
+    struct timespec delta = { nsec / NANOSEC, nsec % NANOSEC };
+    return nft_timespec_add(TickBase, delta);
+}
+
+// Return the latest time that the task may run, which is abstime plus slack.
+static inline struct timespec
+task_latest(nft_task * task)
+{
+    return nft_timespec_add(task->abstime, task->slack);
+}
+
+/* Choose the wheel tick for a task. Without slack, this is the first tick at
+ * or after abstime. With slack, it is the roundest tick within the task's
+ * window, that is, the one with the most trailing zero bits, so that tasks
+ * whose windows overlap tend to share a tick, and so share a wakeup.
+ */
+static uint64_t
+task_tick(nft_task * task)
+{
+    uint64_t lo = time_tick(task->abstime, 1);
+    if (!(task->slack.tv_sec || task->slack.tv_nsec)) return lo;
+
+    uint64_t hi = time_tick(task_latest(task), 0);
+    if (hi <= lo) return lo;
+
+    for (int bit = 63; bit > 0; bit--) {
+	uint64_t tick = hi & ~(((uint64_t) 1 << bit) - 1);
+	if (tick >= lo) return tick;
+    }
+    return hi;
+}
+
+// Return the histogram bucket of a value, which is its number of significant bits.
+static int
+task_bucket(uint64_t value)
+{
+    int bucket = 0;
+    while (value > 0 && bucket < NFT_TASK_BUCKETS - 1) {
+	value >>= 1;
+	bucket++;
+    }
+    return bucket;
+}
+
+// Return the number of tasks in the shard's queue.
+static inline long
+queue_size(shard_t * shard)
+{
+    return (Backend == NFT_TASK_WHEEL) ? shard->wheel.count : shard->queue.count;
+}
+
+// Insert the task. Returns true on success, and sets *wake if the
+// scheduler must be signalled, because the task is due before it wakes.
+static int
+queue_insert(shard_t * shard, nft_task * task, int * wake)
+{
+    if (Backend == NFT_TASK_WHEEL) {
+	task->tick = task_tick(task);
+	wheel_insert(&shard->wheel, task);
+	if (wake) *wake = (task->tick < shard->wheel.wake);
+	if (shard->stats.queue_high < shard->wheel.count) shard->stats.queue_high = shard->wheel.count;
+	return 1;
+    }
+    if (!heap_insert(&shard->queue, task)) return 0;
+    if (shard->stats.queue_high < shard->queue.count) shard->stats.queue_high = shard->queue.count;
+    if (wake) *wake = (shard->queue.entries[0].task == task) ||
+		      (nft_timespec_comp(task_latest(task), shard->wake) < 0);
+    return 1;
+}
+
+// Remove the task, if it is queued. Returns true if it was removed.
+static int
+queue_delete(shard_t * shard, nft_task * task)
+{
+    if (Backend == NFT_TASK_WHEEL) {
+	if (task->index < 0) return 0;
+	wheel_delete(&shard->wheel, task);
+	return 1;
+    }
+    heap_t * queue = &shard->queue;
+    if (task->index >= 0 && task->index < queue->count) {
+        assert(queue->entries[task->index].task == task);
+
+        if (queue->entries[task->index].task == task) {
+            heap_delete(queue, task->index);
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+// Move a queued task to its new abstime, and set *wake as queue_insert.
+static void
+queue_move(shard_t * shard, nft_task * task, int * wake)
+{
+    if (Backend == NFT_TASK_WHEEL) {
+	wheel_delete(&shard->wheel, task);
+	queue_insert(shard, task, wake);
+	return;
+    }
+    heap_update(&shard->queue, task->index);
+    *wake = (shard->queue.entries[0].task == task) ||
+	    (nft_timespec_comp(task_latest(task), shard->wake) < 0);
+}
+
+// Insert count tasks. Returns true on success, and sets *wake as queue_insert.
+// On failure, none of the tasks is inserted.
+static int
+queue_insert_many(shard_t * shard, nft_task ** tasks, long count, int * wake)
+{
+    *wake = 0;
+    if (Backend == NFT_TASK_WHEEL) {
+	for (long i = 0; i < count; i++) {
+	    tasks[i]->tick = task_tick(tasks[i]);
+	    wheel_insert(&shard->wheel, tasks[i]);
+	    if (tasks[i]->tick < shard->wheel.wake) *wake = 1;
+	}
+	if (shard->stats.queue_high < shard->wheel.count) shard->stats.queue_high = shard->wheel.count;
+	return 1;
+    }
+    heap_t   * queue = &shard->queue;
+    nft_task * top   = queue->count ? queue->entries[0].task : NULL;
+    for (long i = 0; i < count; i++)
+	if (nft_timespec_comp(task_latest(tasks[i]), shard->wake) < 0) *wake = 1;
+
+    if (!heap_insert_many(queue, tasks, count)) return 0;
+    if (queue->entries[0].task != top) *wake = 1;
+    if (shard->stats.queue_high < queue->count) shard->stats.queue_high = queue->count;
+    return 1;
+}
+
+// Remove those of count tasks that are queued. The tasks that were removed
+// are left in tasks, and the others are set to NULL. Returns the number removed.
+static long
+queue_delete_many(shard_t * shard, nft_task ** tasks, long count)
+{
+    heap_t * queue   = &shard->queue;
+    long     removed = 0;
+
+    // As in heap_insert_many, few tasks are deleted one by one, and only
+    // when there are many is the heap compacted and rebuilt.
+    int      compact = count >= (queue->count >> 3);
+
+    for (long i = 0; i < count; i++)
+    {
+	nft_task * task = tasks[i];
+	if (Backend == NFT_TASK_WHEEL) {
+	    if (task->index < 0) { tasks[i] = NULL; continue; }
+	    wheel_delete(&shard->wheel, task);
+	}
+	else {
+	    if (task->index < 0 || task->index >= queue->count || queue->entries[task->index].task != task) {
+		tasks[i] = NULL;
+		continue;
+	    }
+	    if (!compact) heap_delete(queue, task->index);
+	    else {
+		// Clear the task's place in the heap, which is compacted below.
+		queue->entries[task->index].task = NULL;
+		task->index = -1;
+	    }
+	}
+	removed++;
+    }
+    if (Backend == NFT_TASK_HEAP && compact && removed)
+	heap_compact(queue);
+    return removed;
+}
+
+// Get the time when the next task may be due. Returns false if none is queued.
+static int
+queue_wake(shard_t * shard, struct timespec * wake)
+{
+    if (Backend == NFT_TASK_WHEEL) {
+	wheel_t * wheel = &shard->wheel;
+	if (!wheel_next(wheel, &wheel->wake)) {
+	    wheel->wake = UINT64_MAX;
+	    return 0;
+	}
+	*wake = tick_time(wheel->wake);
+	return 1;
+    }
+    // Wake at the latest time of the top task, or sooner, if another task
+    // whose window opens before then must run sooner.
+    nft_task * task;
+    if (!heap_top(&shard->queue, &task)) return 0;
+    *wake = task_latest(task);
+    heap_window(&shard->queue, 0, wake);
+    shard->wake = *wake;
+    return 1;
+}
+
+// Pop a task that is due at time now. Returns false if no task is due.
+static int
+queue_pop(shard_t * shard, struct timespec now, nft_task ** task)
+{
+    if (Backend == NFT_TASK_WHEEL)
+	return wheel_pop(&shard->wheel, time_tick(now, 0), task);
+
+    // Return false if the top task is not yet due to execute.
+    if (!heap_top(&shard->queue, task) || nft_timespec_comp((*task)->abstime, now) > 0)
+	return 0;
+    return heap_pop(&shard->queue, task);
+}
+
+// Ensure there is room in the shard's batch for one more task.
+// Returns false on malloc failure.
+static int
+batch_reserve(shard_t * shard)
+{
+    if (shard->batch_count < shard->batch_size) return 1;
+
+    long size = shard->batch_size ? shard->batch_size * 2 : 64;
+    void * batch     = realloc(shard->batch,     size * sizeof(nft_task *));
+    if (batch)     shard->batch     = batch;
+    void * group     = realloc(shard->group,     size * sizeof(nft_task *));
+    if (group)     shard->group     = group;
+    void * retry     = realloc(shard->retry,     size * sizeof(nft_task *));
+    if (retry)     shard->retry     = retry;
+    void * functions = realloc(shard->functions, size * sizeof(void (*)(void *)));
+    if (functions) shard->functions = functions;
+    void * arguments = realloc(shard->arguments, size * sizeof(void *));
+    if (arguments) shard->arguments = arguments;
+
+    if (!(batch && group && retry && functions && arguments)) return 0;
+    shard->batch_size = size;
+    return 1;
+}
+
+/* batch_dispatch
+ *
+ * Submit the shard's batch of due tasks to their pools, with one call to
+ * nft_pool_add_many for each pool. This is called without the shard's mutex.
+ * The tasks that a pool could not accept are left in the batch, to be retried,
+ * unless the pool is gone, in which case their runs are dropped.
+ */
+static void
+batch_dispatch(shard_t * shard)
+{
+    long count = shard->batch_count;
+    long retry = 0;
+
+    for (long i = 0; i < count; i++)
+    {
+	if (!shard->batch[i]) continue;
+
+	// Gather the remaining tasks that are for the same pool.
+	nft_pool_h pool = shard->batch[i]->pool;
+	int	   n    = 0;
+	for (long j = i; j < count; j++) {
+	    nft_task * task = shard->batch[j];
+	    if (task && task->pool == pool) {
+		shard->group[n]     = task;
+		shard->functions[n] = task->function;
+		shard->arguments[n] = task->argument;
+		shard->batch[j]     = NULL;
+		n++;
+	    }
+	}
+	int added;
+	int error = nft_pool_add_many(pool, n, shard->functions, shard->arguments, &added);
+
+	// Discard the batch's references to the tasks that were submitted,
+	// and to those whose pool is gone. Keep the others, to retry them.
+	for (int k = 0; k < n; k++) {
+	    if (k < added || error == EINVAL || error == ESHUTDOWN)
+		nft_task_discard(shard->group[k]);
+	    else
+		shard->retry[retry++] = shard->group[k];
+	}
+    }
+    memcpy(shard->batch, shard->retry, retry * sizeof(nft_task *));
+    shard->batch_count = retry;
+}
+
+// Return the shard that a task is assigned to.
+static shard_t *
+task_shard(nft_task * task)
+{
+    if (task->shard < 0) {
+	// Assign the task by a hash of its handle.
+	uint64_t hash = (uintptr_t) nft_task_handle(task) * 0x9E3779B97F4A7C15ULL;
+	task->shard   = (hash >> 32) % NumShards;
+    }
+    return &Shards[task->shard];
+}
+
+
 /*-----------------------------------------------------------------------------
  * task_thread - The scheduler thread.
  *-----------------------------------------------------------------------------
  */
 static void *
-task_thread(void * ignore)
+task_thread(void * arg)
 {
-    int rc = pthread_mutex_lock(&QueueMutex); assert(rc == 0);
+    shard_t * shard = arg;
+    int rc = pthread_mutex_lock(&shard->mutex); assert(rc == 0);
 
     while (1) // This loop never exits.
     {
-	nft_task * task = NULL;
+	nft_task      * task = NULL;
+	struct timespec wake;
 
 	// If there is a task in the queue...
-	if (heap_top(&Queue, &task))
+	if (queue_wake(shard, &wake))
 	{
 	    // Wait for the topmost task to come due, or for a new task to be scheduled.
-	    rc = pthread_cond_timedwait(&QueueCond, &QueueMutex, &task->abstime); assert((rc == 0) || (rc == ETIMEDOUT));
+	    rc = pthread_cond_timedwait(&shard->cond, &shard->mutex, &wake); assert((rc == 0) || (rc == ETIMEDOUT));
 	}
 	else {
 	    // There is no pending task - wait for condition to be signaled by nft_task_schedule().
-	    rc = pthread_cond_wait(&QueueCond, &QueueMutex); assert(rc == 0);
+	    rc = pthread_cond_wait(&shard->cond, &shard->mutex); assert(rc == 0);
 	}
 
 	// Get the time that we woke up.
-	struct timespec curr = nft_gettime();
+	struct timespec curr = sched_now();
+	int		fired = 0;
 
-	/* While there are tasks on the queue, check the topmost task
-	 * to see if its abstime has been reached. If so, pop the queue
+	/* Pop each task from the queue whose abstime has been reached,
 	 * and execute the task.
 	 *
 	 * If it's a repeated task, compute the new abstime and insert
 	 * back into the queue. Otherwise, free the task.
 	 *
-	 * Repeat until the queue is empty, or the top task is not yet due.
+	 * Repeat until the queue is empty, or no task is yet due.
 	 */
-	while (heap_top(&Queue, &task))
+	while (queue_pop(shard, curr, &task))
 	{
-            // Break if the top task is not yet due to execute.
-	    if (nft_timespec_comp(task->abstime, curr) > 0)
-		break;
-
-	    // Pop the top task from the queue.
-	    rc = heap_pop(&Queue, &task); assert(rc == 1);
+	    // If the task was extended, requeue it at its new abstime.
+	    if (task->extend.tv_sec) {
+		struct timespec extend = task->extend;
+		task->extend = (struct timespec){ 0, 0 };
+		if (nft_timespec_comp(extend, task->abstime) > 0) {
+		    task->abstime = extend;
+		    queue_insert(shard, task, NULL);
+		    continue;
+		}
+	    }
+	    // Record how late the task is running.
+	    struct timespec deadline = task->abstime;
+	    int64_t late = nft_timespec_comp(curr, task->abstime);
+	    fired++;
+	    shard->stats.fired++;
+	    shard->stats.late_ns += late;
+	    shard->stats.late_hist[task_bucket(late / 1000)]++;
+	    task->runs++;
+	    task->late_last   = late;
+	    task->late_total += late;
+	    if (task->late_max < late) task->late_max = late;
 
 	    /* If the task is a repeated task, reinsert it now, otherwise free it.
 	     * This is important to allow a task to cancel itself - the task must
@@ -154,26 +613,109 @@ task_thread(void * ignore)
 	    {
 		// Periodic task. Increment abstime by the task interval,
 		// and re-insert task into queue, remembering not to discard it.
+		// Since abstime advances from its previous value, and not from
+		// the current time, the period does not drift.
 		task->abstime = nft_timespec_add(task->abstime, task->interval);
-		heap_insert(&Queue, task);
+
+		// To skip the runs that are already missed, advance abstime by
+		// whole intervals, to the first time after now.
+		int64_t behind = nft_timespec_comp(curr, task->abstime);
+		if (task->catchup == NFT_TASK_SKIP && behind >= 0)
+		{
+		    int64_t period = (int64_t) task->interval.tv_sec * NANOSEC + task->interval.tv_nsec;
+		    int64_t missed = behind / period + 1;
+		    int64_t nsec   = missed * period;
+		    task->skipped += missed;
+		    task->abstime  = nft_timespec_add(task->abstime, (struct timespec){ nsec / NANOSEC, nsec % NANOSEC });
+		}
+		queue_insert(shard, task, NULL);
 		discard = 0;
 	    }
+	    /* A task for a pool is collected into the batch, and submitted below.
+	     * A periodic task remains queued, so the batch takes a reference.
+	     * If the batch cannot grow, the task is handled as though its pool
+	     * refused it: a one-shot task is retried one tick later, and the run
+	     * of a periodic task is skipped. It never runs on this thread.
+	     */
+	    if (task->pool)
+	    {
+		if (!batch_reserve(shard)) {
+		    if (discard) {
+			task->abstime = nft_timespec_add(curr, (struct timespec){ TickNsec / NANOSEC, TickNsec % NANOSEC });
+			queue_insert(shard, task, NULL);
+		    }
+		    else task->skipped++;
+		    continue;
+		}
+		if (!discard) {
+		    nft_task * ref = nft_task_lookup(nft_task_handle(task)); assert(ref == task);
+		}
+		shard->batch[shard->batch_count++] = task;
+		continue;
+	    }
+
 	    /* Yield the queue mutex while the task action executes,
 	     * in case the action needs to add or cancel a task.
 	     */
-	    rc = pthread_mutex_unlock(&QueueMutex); assert(rc == 0);
+	    nft_task_h handle = nft_task_handle(task);
+	    Current = (nft_task_this_info_t){ handle, user_time(deadline), task->interval, task->runs };
+	    rc = pthread_mutex_unlock(&shard->mutex); assert(rc == 0);
 
-	    CurrentTask = nft_task_handle(task);
+	    // The task must not be used after the action, unless it is discarded
+	    // here, since the action may cancel it, freeing a periodic task.
+	    struct timespec begin = nft_gettime_mono();
 	    task->action(task);
-	    CurrentTask = NULL;
 	    if (discard) nft_task_discard(task);
+	    int64_t run = nft_timespec_comp(nft_gettime_mono(), begin);
+
+	    // Report an action that overran the budget. Read Budget and Overrun
+	    // once, since nft_task_budget may change them at any time.
+	    int64_t budget = BUDGET_GET(Budget);
+	    void (* overrun)(nft_task_h, double) = BUDGET_GET(Overrun);
+	    if (budget > 0 && run > budget && overrun) overrun(handle, run * 1e-9);
+
+	    Current.task = NULL;
+	    rc = pthread_mutex_lock(&shard->mutex); assert(rc == 0);
+	    shard->stats.run_ns += run;
+	    shard->stats.run_hist[task_bucket(run / 1000)]++;
+	    if (budget > 0 && run > budget) shard->stats.overruns++;
+	}
+
+	// Record how many tasks this wakeup fired.
+	if (fired) {
+	    shard->stats.wakeups++;
+	    shard->stats.fired_hist[task_bucket(fired)]++;
+	}
 
-	    rc = pthread_mutex_lock(&QueueMutex); assert(rc == 0);
+	// Submit the due tasks for pools, without holding the queue mutex.
+	if (shard->batch_count)
+	{
+	    rc = pthread_mutex_unlock(&shard->mutex); assert(rc == 0);
+	    batch_dispatch(shard);
+	    rc = pthread_mutex_lock(&shard->mutex); assert(rc == 0);
+
+	    /* A one-shot task that its pool could not accept is retried one tick
+	     * later. The run of a periodic task is skipped, since its next run is
+	     * already queued.
+	     */
+	    struct timespec retry = nft_timespec_add(sched_now(), (struct timespec){ TickNsec / NANOSEC, TickNsec % NANOSEC });
+	    for (long i = 0; i < shard->batch_count; i++) {
+		task = shard->batch[i];
+		if (task->interval.tv_sec || task->interval.tv_nsec) {
+		    task->skipped++;
+		    nft_task_discard(task);
+		}
+		else {
+		    task->abstime = retry;
+		    queue_insert(shard, task, NULL);
+		}
+	    }
+	    shard->batch_count = 0;
 	}
     }
     // Unlock the scheduler queue.
     // Currently, the loop above will never exit, so this code is somewhat superfluous. -SEan
-    rc = pthread_mutex_unlock(&QueueMutex); assert(rc == 0);
+    rc = pthread_mutex_unlock(&shard->mutex); assert(rc == 0);
     return NULL;
 }
 
@@ -188,12 +730,13 @@ task_init(void)
     pthread_attr_t	attr;
     int		   	rc;
 
-    // Initialize the task queue.
-    heap_init(&Queue);
+    // Freeze the settings. The wheel's tick zero is the current time.
+    rc = pthread_mutex_lock(&QueueMutex); assert(rc == 0);
+    Started  = 1;
+    TickBase = sched_now();
+    rc = pthread_mutex_unlock(&QueueMutex); assert(rc == 0);
 
-    // Initialize the condition and mutex that guard the task queue.
-    rc = pthread_cond_init (&QueueCond,  NULL); assert(rc == 0);
-    rc = pthread_mutex_init(&QueueMutex, NULL); assert(rc == 0);
+    Shards = calloc(NumShards, sizeof(shard_t)); assert(Shards);
 
     // Initialize thread attributes to defaults.
     rc = pthread_attr_init(&attr); assert(rc == 0);
@@ -217,11 +760,30 @@ task_init(void)
     }
 #endif
 
-    // Create the task thread.
-    rc = pthread_create(&TaskThread, &attr, task_thread, NULL); assert(rc == 0);
+    // The condition's timed waits use the scheduler's clock.
+    pthread_condattr_t	cattr;
+    rc = pthread_condattr_init(&cattr); assert(rc == 0);
+#ifdef HAVE_CONDATTR_SETCLOCK
+    if (Clock == NFT_TASK_MONOTONIC) {
+	rc = pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC); assert(rc == 0);
+    }
+#endif
+
+    // Initialize each shard's task queue, with the condition and mutex that
+    // guard it, and create its scheduler thread.
+    for (int i = 0; i < NumShards; i++)
+    {
+	shard_t * shard = &Shards[i];
+	heap_init(&shard->queue);
+	wheel_init(&shard->wheel, 0);
+	rc = pthread_cond_init (&shard->cond, &cattr); assert(rc == 0);
+	rc = pthread_mutex_init(&shard->mutex, NULL); assert(rc == 0);
+	rc = pthread_create(&shard->thread, &attr, task_thread, shard); assert(rc == 0);
+    }
 
-    // Free the thread attribute structure.
+    // Free the thread and condition attribute structures.
     pthread_attr_destroy(&attr);
+    pthread_condattr_destroy(&cattr);
 
     return;
 }
@@ -264,6 +826,19 @@ nft_task_create(const char    * class,
     // Override the nft_core destructor with our own.
     task->core.destroy = nft_task_destroy;
     task->index        = -1;
+    task->next         = NULL;
+    task->prev         = NULL;
+    task->tick         = 0;
+    task->shard        = -1;
+    task->pool         = NULL;
+    task->slack        = (struct timespec){ 0, 0 };
+    task->extend       = (struct timespec){ 0, 0 };
+    task->catchup      = NFT_TASK_RUN_ALL;
+    task->runs         = 0;
+    task->skipped      = 0;
+    task->late_last    = 0;
+    task->late_max     = 0;
+    task->late_total   = 0;
     task->action       = nft_task_action;
     task->interval     = interval;
     task->function     = function;
@@ -301,35 +876,36 @@ nft_task_schedule_task(nft_task * task)
     // Ensure task package is initialized.
     int rc = pthread_once(&QueueOnce, task_init); assert(rc == 0);
 
-    // Lock the queue.
-    rc = pthread_mutex_lock(&QueueMutex); assert(rc == 0);
+    // The task's abstime is kept on the scheduler's clock.
+    task->abstime = sched_time(task->abstime);
+
+    // Lock the queue of the shard that owns this task.
+    shard_t * shard = task_shard(task);
+    rc = pthread_mutex_lock(&shard->mutex); assert(rc == 0);
 
     // Attempt to insert the task pointer into queue.
-    if (heap_insert(&Queue, task))
+    int wake;
+    if (queue_insert(shard, task, &wake))
     {
-	// After inserting the task, obtain the current top pending task.
-	nft_task * top_task;
-	rc = heap_top(&Queue, &top_task); assert(rc > 0);
-
 	/* If the new task that we just inserted is now at the top of the heap,
-	 * signal the scheduler thread since the new entry must be due to execute
-	 * sooner than the previous topmost task.
+	 * or is due before the wheel's next wakeup, signal the scheduler thread
+	 * since the new entry must be due to execute sooner than it would wake.
 	 * Signal under the mutex to avoid a race condition in the WIN32 emulation of pthread_cond_wait().
 	 */
-	if (top_task == task) {
-	    rc = pthread_cond_signal(&QueueCond); assert(rc == 0);
+	if (wake) {
+	    rc = pthread_cond_signal(&shard->cond); assert(rc == 0);
 	}
     }
     else {
-	// heap_insert failed, presumably due to memory exhaustion.
-	assert(!"heap_insert failed");
+	// queue_insert failed, presumably due to memory exhaustion.
+	assert(!"queue_insert failed");
 	error = ENOMEM;
 
 	// Normally, this call stores the task reference in the Queue.
 	// Since that did not happen, we need to discard this reference.
 	nft_task_discard(task);
     }
-    rc = pthread_mutex_unlock(&QueueMutex); assert(rc == 0);
+    rc = pthread_mutex_unlock(&shard->mutex); assert(rc == 0);
 
     return error;
 }
@@ -348,25 +924,20 @@ nft_task_cancel_task(nft_task * task)
     // Ensure task package is initialized.
     int rc = pthread_once(&QueueOnce, task_init); assert(rc == 0);
 
-    // Lock the queue.
-    rc = pthread_mutex_lock(&QueueMutex);     assert(rc == 0);
+    // Lock the queue of the shard that owns this task.
+    shard_t * shard = task_shard(task);
+    rc = pthread_mutex_lock(&shard->mutex);   assert(rc == 0);
 
-    if (task->index >= 0 && task->index < Queue.count) {
-        assert(Queue.tasks[task->index] == task);
-
-        if (Queue.tasks[task->index] == task)
-        {
-            // Remove the task from the queue.
-            heap_delete(&Queue, task->index);
-
-            // Discard the reference that was stored in the queue.
-            // This reference was created in nft_task_schedule by nft_task_create().
-            nft_task_discard(task);
+    // Remove the task from the queue.
+    if (queue_delete(shard, task))
+    {
+	// Discard the reference that was stored in the queue.
+	// This reference was created in nft_task_schedule by nft_task_create().
+	nft_task_discard(task);
 
-            result = 1;
-        }
+	result = 1;
     }
-    rc = pthread_mutex_unlock(&QueueMutex); assert(rc == 0);
+    rc = pthread_mutex_unlock(&shard->mutex); assert(rc == 0);
     return result;
 }
 
@@ -410,6 +981,92 @@ nft_task_schedule(struct timespec abstime,
     return error ? NULL : handle;
 }
 
+/*-----------------------------------------------------------------------------
+ * nft_task_schedule_slack - Schedule a task that may run late by up to slack.
+ *
+ * As nft_task_schedule, but the scheduler may defer the task by as much as
+ * slack, so that it can run together with other tasks in a single wakeup.
+ * A periodic task's later runs are still computed from abstime, so the
+ * slack does not accumulate.
+ *-----------------------------------------------------------------------------
+ */
+nft_task_h
+nft_task_schedule_slack(struct timespec abstime,
+			struct timespec interval,
+			struct timespec slack,
+			void         (* function)(void *),
+			void	      * argument)
+{
+    if (slack.tv_sec < 0 || slack.tv_nsec < 0 || slack.tv_nsec >= NANOSEC) return NULL;
+
+    nft_task * task = nft_task_create(nft_task_class, sizeof(nft_task), abstime, interval, function, argument);
+    if (!task) return NULL;
+    task->slack = slack;
+
+    nft_task_h handle = nft_task_handle(task);
+    int        error  = nft_task_schedule_task(task); assert(!error);
+
+    return error ? NULL : handle;
+}
+
+/*-----------------------------------------------------------------------------
+ * nft_task_schedule_on - Schedule a task to be run by a thread pool.
+ *
+ * As nft_task_schedule, but when the task comes due, the scheduler thread
+ * submits function(argument) to the pool, rather than calling it. The tasks
+ * that come due together are submitted in one batch, so that the scheduler
+ * thread stays responsive, however long the functions take.
+ *-----------------------------------------------------------------------------
+ */
+nft_task_h
+nft_task_schedule_on(nft_pool_h      pool,
+		     struct timespec abstime,
+		     struct timespec interval,
+		     void         (* function)(void *),
+		     void	   * argument)
+{
+    if (!pool) return NULL;
+
+    nft_task * task = nft_task_create(nft_task_class, sizeof(nft_task), abstime, interval, function, argument);
+    if (!task) return NULL;
+    task->pool = pool;
+
+    nft_task_h handle = nft_task_handle(task);
+    int        error  = nft_task_schedule_task(task); assert(!error);
+
+    return error ? NULL : handle;
+}
+
+/*-----------------------------------------------------------------------------
+ * nft_task_schedule_shard - Schedule a task on a particular shard.
+ *
+ * As nft_task_schedule, but the task runs on the given shard's scheduler
+ * thread, so that related tasks can be kept together. If shard is negative,
+ * the task is assigned by hash, as with nft_task_schedule.
+ * Returns NULL if the shard is out of range.
+ *-----------------------------------------------------------------------------
+ */
+nft_task_h
+nft_task_schedule_shard(int             shard,
+			struct timespec abstime,
+			struct timespec interval,
+			void         (* function)(void *),
+			void	      * argument)
+{
+    // Ensure task package is initialized, so that NumShards is fixed.
+    int rc = pthread_once(&QueueOnce, task_init); assert(rc == 0);
+    if (shard >= NumShards) return NULL;
+
+    nft_task * task = nft_task_create(nft_task_class, sizeof(nft_task), abstime, interval, function, argument);
+    if (!task) return NULL;
+    task->shard = (shard < 0) ? -1 : shard;
+
+    nft_task_h handle = nft_task_handle(task);
+    int        error  = nft_task_schedule_task(task); assert(!error);
+
+    return error ? NULL : handle;
+}
+
 /*-----------------------------------------------------------------------------
  * nft_task_cancel - Cancel a scheduler task.
  *
@@ -437,81 +1094,447 @@ nft_task_cancel(nft_task_h handle)
 }
 
 /*-----------------------------------------------------------------------------
- * nft_task_this - Return the handle to the current task.
+ * nft_task_schedule_many - Schedule a batch of tasks.
  *
- * This convenience function allows your task function to get its own
- * task handle, making it easy for repeating tasks to cancel themselves.
- * It should only be called within the task code.
+ * The tasks are inserted into each shard's queue under one lock acquisition,
+ * and each shard's scheduler thread is signalled at most once.
  *-----------------------------------------------------------------------------
  */
-nft_task_h
-nft_task_this(void)
+int
+nft_task_schedule_many(const nft_task_spec_t * specs, int count, nft_task_h * handles)
 {
-    int rc = pthread_mutex_lock(&QueueMutex); assert(rc == 0);
-    nft_task_h task = CurrentTask;
-    rc = pthread_mutex_unlock(&QueueMutex); assert(rc == 0);
-    return task;
-}
+    if (count <= 0) return 0;
 
+    // Ensure task package is initialized.
+    int rc = pthread_once(&QueueOnce, task_init); assert(rc == 0);
 
-/******************************************************************************/
-/*******								*******/
-/*******		HEAP IMPLEMENTATION				*******/
-/*******								*******/
-/******************************************************************************/
+    nft_task ** tasks = malloc(2 * count * sizeof(nft_task *));
+    if (!tasks) {
+	for (int i = 0; i < count; i++) handles[i] = NULL;
+	return 0;
+    }
+    nft_task ** batch = tasks + count;
 
-/* comp_tasks
- *
- * Determine earlier of two tasks, used to order the Queue.
- */
-static inline int64_t
-comp_tasks(heap_t * heap, int x, int y)
-{
-    nft_task * t1 = heap->tasks[x];
-    nft_task * t2 = heap->tasks[y];
+    // Create the tasks, and assign them to shards.
+    for (int i = 0; i < count; i++)
+    {
+	const nft_task_spec_t * spec = &specs[i];
+	nft_task * task = NULL;
+	if (spec->slack.tv_sec >= 0 && spec->slack.tv_nsec >= 0 && spec->slack.tv_nsec < NANOSEC)
+	    task = nft_task_create(nft_task_class, sizeof(nft_task), spec->abstime, spec->interval, spec->function, spec->argument);
+	if (task) {
+	    task->slack   = spec->slack;
+	    task->abstime = sched_time(task->abstime);
+	    task_shard(task);
+	}
+	tasks[i]   = task;
+	handles[i] = task ? nft_task_handle(task) : NULL;
+    }
 
-    /* Note that we invert the order of comparison, so that
-     * smaller (earlier) times are at the top of the queue.
-     */
-    return nft_timespec_comp(t2->abstime, t1->abstime);
-}
+    // Insert each shard's tasks as one batch.
+    int scheduled = 0;
+    for (int s = 0; s < NumShards; s++)
+    {
+	shard_t * shard = &Shards[s];
+	long      n     = 0;
+	for (int i = 0; i < count; i++)
+	    if (tasks[i] && tasks[i]->shard == s) batch[n++] = tasks[i];
+	if (n == 0) continue;
+
+	rc = pthread_mutex_lock(&shard->mutex); assert(rc == 0);
+	int wake;
+	int ok = queue_insert_many(shard, batch, n, &wake);
+	if (ok && wake) {
+	    rc = pthread_cond_signal(&shard->cond); assert(rc == 0);
+	}
+	rc = pthread_mutex_unlock(&shard->mutex); assert(rc == 0);
 
-static inline void
-swap_tasks(heap_t * heap, int x, int y)
-{
-    void * temp    = heap->tasks[x];
-    heap->tasks[x] = heap->tasks[y];
-    heap->tasks[y] = temp;
-    heap->tasks[x]->index = x;
-    heap->tasks[y]->index = y;
+	if (ok) {
+	    scheduled += n;
+	    continue;
+	}
+	// queue_insert_many failed, presumably due to memory exhaustion,
+	// so discard the references that would have been stored in the queue.
+	for (int i = 0; i < count; i++)
+	    if (tasks[i] && tasks[i]->shard == s) {
+		handles[i] = NULL;
+		nft_task_discard(tasks[i]);
+	    }
+    }
+    free(tasks);
+    return scheduled;
 }
 
-/* upheap()
+/*-----------------------------------------------------------------------------
+ * nft_task_cancel_many - Cancel a batch of tasks.
  *
- * Starts from the bottom of the heap up, restoring the heap condition.
- * heap_insert() adds a new member to the end of the heap, then calls
+ * The tasks are removed from each shard's queue under one lock acquisition.
+ *-----------------------------------------------------------------------------
+ */
+int
+nft_task_cancel_many(const nft_task_h * handles, int count, void ** arguments)
+{
+    if (count <= 0) return 0;
+
+    // Ensure task package is initialized.
+    int rc = pthread_once(&QueueOnce, task_init); assert(rc == 0);
+
+    nft_task ** tasks = malloc(2 * count * sizeof(nft_task *));
+    if (!tasks) return 0;
+    nft_task ** batch = tasks + count;
+
+    for (int i = 0; i < count; i++) {
+	tasks[i] = nft_task_lookup(handles[i]);
+	if (arguments) arguments[i] = NULL;
+    }
+
+    int canceled = 0;
+    for (int s = 0; s < NumShards; s++)
+    {
+	shard_t * shard = &Shards[s];
+	long      n     = 0;
+	for (int i = 0; i < count; i++)
+	    if (tasks[i] && tasks[i]->shard == s) batch[n++] = tasks[i];
+	if (n == 0) continue;
+
+	rc = pthread_mutex_lock(&shard->mutex); assert(rc == 0);
+	queue_delete_many(shard, batch, n);
+	rc = pthread_mutex_unlock(&shard->mutex); assert(rc == 0);
+
+	// Discard the references that were stored in the queue.
+	// The batch entries of tasks that were not queued are now NULL.
+	n = 0;
+	for (int i = 0; i < count; i++)
+	    if (tasks[i] && tasks[i]->shard == s && batch[n++]) {
+		if (arguments) arguments[i] = tasks[i]->argument;
+		nft_task_discard(tasks[i]);
+		canceled++;
+	    }
+    }
+
+    // Discard the references that we obtained from nft_task_lookup.
+    for (int i = 0; i < count; i++)
+	if (tasks[i]) nft_task_discard(tasks[i]);
+    free(tasks);
+    return canceled;
+}
+
+/*-----------------------------------------------------------------------------
+ * task_adjust - Reschedule or extend a queued task.
+ *-----------------------------------------------------------------------------
+ */
+static int
+task_adjust(nft_task_h handle, struct timespec abstime, int lazy)
+{
+    nft_task * task = nft_task_lookup(handle);
+    if (!task) return EINVAL;
+
+    // If abstime isn't given, compute it as now plus one interval.
+    if (!abstime.tv_sec) {
+	if (!(task->interval.tv_sec || task->interval.tv_nsec)) {
+	    nft_task_discard(task);
+	    return EINVAL;
+	}
+	abstime = nft_timespec_add(nft_gettime(), task->interval);
+    }
+    abstime = sched_time(nft_timespec_norm(abstime));
+
+    int	      result = 0;
+    shard_t * shard  = task_shard(task);
+    int rc = pthread_mutex_lock(&shard->mutex); assert(rc == 0);
+
+    if (task->index < 0)
+	result = ENOENT;
+    else if (lazy && nft_timespec_comp(abstime, task->abstime) >= 0) {
+	// Leave the task in place, and requeue it when it comes due.
+	task->extend = abstime;
+    }
+    else {
+	int wake;
+	task->extend  = (struct timespec){ 0, 0 };
+	task->abstime = abstime;
+	queue_move(shard, task, &wake);
+	if (wake) {
+	    rc = pthread_cond_signal(&shard->cond); assert(rc == 0);
+	}
+    }
+    rc = pthread_mutex_unlock(&shard->mutex); assert(rc == 0);
+
+    nft_task_discard(task);
+    return result;
+}
+
+/*-----------------------------------------------------------------------------
+ * nft_task_reschedule - Move a pending task to a new abstime.
+ *-----------------------------------------------------------------------------
+ */
+int
+nft_task_reschedule(nft_task_h handle, struct timespec abstime)
+{
+    return task_adjust(handle, abstime, 0);
+}
+
+/*-----------------------------------------------------------------------------
+ * nft_task_extend - Defer a pending task to a later abstime, lazily.
+ *-----------------------------------------------------------------------------
+ */
+int
+nft_task_extend(nft_task_h handle, struct timespec abstime)
+{
+    return task_adjust(handle, abstime, 1);
+}
+
+/*-----------------------------------------------------------------------------
+ * nft_task_catchup - Set the catch-up policy of a periodic task.
+ *-----------------------------------------------------------------------------
+ */
+int
+nft_task_catchup(nft_task_h handle, int policy)
+{
+    if (policy != NFT_TASK_RUN_ALL && policy != NFT_TASK_SKIP) return EINVAL;
+
+    nft_task * task = nft_task_lookup(handle);
+    if (!task) return EINVAL;
+
+    // The scheduler thread reads the policy under the shard's mutex.
+    shard_t * shard = task_shard(task);
+    int rc = pthread_mutex_lock(&shard->mutex); assert(rc == 0);
+    task->catchup = policy;
+    rc = pthread_mutex_unlock(&shard->mutex); assert(rc == 0);
+
+    nft_task_discard(task);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * nft_task_info - Get a task's run count and lateness.
+ *-----------------------------------------------------------------------------
+ */
+int
+nft_task_info(nft_task_h handle, nft_task_info_t * info)
+{
+    if (!info) return EINVAL;
+
+    nft_task * task = nft_task_lookup(handle);
+    if (!task) return EINVAL;
+
+    shard_t * shard = task_shard(task);
+    int rc = pthread_mutex_lock(&shard->mutex); assert(rc == 0);
+    info->runs      = task->runs;
+    info->skipped   = task->skipped;
+    info->late_last = task->late_last * 1e-9;
+    info->late_max  = task->late_max  * 1e-9;
+    info->late_mean = task->runs ? task->late_total * 1e-9 / task->runs : 0;
+    rc = pthread_mutex_unlock(&shard->mutex); assert(rc == 0);
+
+    nft_task_discard(task);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * nft_task_this - Return the handle to the current task.
+ *
+ * This convenience function allows your task function to get its own
+ * task handle, making it easy for repeating tasks to cancel themselves.
+ * It should only be called within the task code.
+ *-----------------------------------------------------------------------------
+ */
+nft_task_h
+nft_task_this(void)
+{
+    // Only a scheduler thread that is running a task sets Current.
+    return Current.task;
+}
+
+/*-----------------------------------------------------------------------------
+ * nft_task_this_info - Describe the current task, and the run in progress.
+ *-----------------------------------------------------------------------------
+ */
+int
+nft_task_this_info(nft_task_this_info_t * info)
+{
+    if (!info) return EINVAL;
+    if (!Current.task) return ENOENT;
+
+    *info = Current;
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * nft_task_backend - Select how the scheduler queues pending tasks.
+ *-----------------------------------------------------------------------------
+ */
+int
+nft_task_backend(int backend, struct timespec tick)
+{
+    if (backend != NFT_TASK_HEAP && backend != NFT_TASK_WHEEL) return EINVAL;
+
+    int64_t nsec = (int64_t) tick.tv_sec * NANOSEC + tick.tv_nsec;
+    if (nsec < 0 || tick.tv_nsec < 0 || tick.tv_nsec >= NANOSEC) return EINVAL;
+
+    int result = 0;
+    int rc = pthread_mutex_lock(&QueueMutex); assert(rc == 0);
+    if (Started)
+	result = EBUSY;
+    else {
+	Backend  = backend;
+	TickNsec = nsec ? nsec : 1000000;
+    }
+    rc = pthread_mutex_unlock(&QueueMutex); assert(rc == 0);
+    return result;
+}
+
+/*-----------------------------------------------------------------------------
+ * nft_task_stats - Take a snapshot of the scheduler's instrumentation.
+ *-----------------------------------------------------------------------------
+ */
+int
+nft_task_stats(nft_task_stats_t * stats)
+{
+    if (!stats) return EINVAL;
+    memset(stats, 0, sizeof(*stats));
+
+    // Ensure task package is initialized.
+    int rc = pthread_once(&QueueOnce, task_init); assert(rc == 0);
+
+    // Sum the statistics of the shards.
+    for (int s = 0; s < NumShards; s++)
+    {
+	shard_t * shard = &Shards[s];
+	rc = pthread_mutex_lock(&shard->mutex); assert(rc == 0);
+	nft_task_stats_t * ss = &shard->stats;
+	stats->wakeups    += ss->wakeups;
+	stats->fired      += ss->fired;
+	stats->overruns   += ss->overruns;
+	stats->late_ns    += ss->late_ns;
+	stats->run_ns     += ss->run_ns;
+	stats->queue_size += queue_size(shard);
+	stats->queue_high += ss->queue_high;
+	for (int i = 0; i < NFT_TASK_BUCKETS; i++) {
+	    stats->late_hist [i] += ss->late_hist [i];
+	    stats->run_hist  [i] += ss->run_hist  [i];
+	    stats->fired_hist[i] += ss->fired_hist[i];
+	}
+	rc = pthread_mutex_unlock(&shard->mutex); assert(rc == 0);
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * nft_task_budget - Set the run-time budget for task actions.
+ *-----------------------------------------------------------------------------
+ */
+int
+nft_task_budget(struct timespec budget, void (* overrun)(nft_task_h task, double seconds))
+{
+    if (budget.tv_sec < 0 || budget.tv_nsec < 0 || budget.tv_nsec >= NANOSEC) return EINVAL;
+
+    BUDGET_SET(Overrun, overrun);
+    BUDGET_SET(Budget, (int64_t) budget.tv_sec * NANOSEC + budget.tv_nsec);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * nft_task_clock - Select the clock that the scheduler waits on.
+ *-----------------------------------------------------------------------------
+ */
+int
+nft_task_clock(int clock)
+{
+    if (clock != NFT_TASK_REALTIME && clock != NFT_TASK_MONOTONIC) return EINVAL;
+#ifndef HAVE_CONDATTR_SETCLOCK
+    if (clock == NFT_TASK_MONOTONIC) return ENOTSUP;
+#endif
+
+    int result = 0;
+    int rc = pthread_mutex_lock(&QueueMutex); assert(rc == 0);
+    if (Started)
+	result = EBUSY;
+    else
+	Clock = clock;
+    rc = pthread_mutex_unlock(&QueueMutex); assert(rc == 0);
+    return result;
+}
+
+/*-----------------------------------------------------------------------------
+ * nft_task_shards - Set the number of scheduler threads.
+ *-----------------------------------------------------------------------------
+ */
+int
+nft_task_shards(int count)
+{
+    if (count < 1) return EINVAL;
+
+    int result = 0;
+    int rc = pthread_mutex_lock(&QueueMutex); assert(rc == 0);
+    if (Started)
+	result = EBUSY;
+    else
+	NumShards = count;
+    rc = pthread_mutex_unlock(&QueueMutex); assert(rc == 0);
+    return result;
+}
+
+
+/******************************************************************************/
+/*******								*******/
+/*******		HEAP IMPLEMENTATION				*******/
+/*******								*******/
+/******************************************************************************/
+
+/* heap_align
+ *
+ * Return the entries array within a block of memory, so that each set
+ * of siblings (the children of one entry) shares one cache line.
+ */
+static inline heap_entry *
+heap_align(void * memory)
+{
+    uintptr_t line = ((uintptr_t) memory + HEAP_LINE - 1) & ~(uintptr_t) (HEAP_LINE - 1);
+    return (heap_entry *) line + HEAP_PAD;
+}
+
+// Return the bytes needed for a block of memory to hold size entries.
+static inline size_t
+heap_bytes(long size)
+{
+    return (size + HEAP_PAD) * sizeof(heap_entry) + HEAP_LINE;
+}
+
+// Return a task's abstime in nanoseconds, as stored in its heap entry.
+static inline int64_t
+heap_deadline(nft_task * task)
+{
+    return (int64_t) task->abstime.tv_sec * NANOSEC + task->abstime.tv_nsec;
+}
+
+/* upheap()
+ *
+ * Starts from the bottom of the heap up, restoring the heap condition.
+ * heap_insert() adds a new member to the end of the heap, then calls
  * this function so that the new element will percolate up until the
- * heap condition is satisfied.
+ * heap condition is satisfied. Each parent that is later than the new
+ * element moves down into the hole, and the element is stored once.
  */
 static void
 upheap(heap_t *heap, long child)
 {
-    long parent;
+    heap_entry * entries = heap->entries;
+    heap_entry   item    = entries[child];
 
     while (child > 0)
     {
-	parent = (child - 1) >> 1;
+	long parent = (child - 1) / HEAP_ARITY;
 
-	/* If the parent is less than the child,
-	 * exchange parent and child nodes in the heap.
-	 */
-	if (comp_tasks(heap, parent, child) < 0)
-	    swap_tasks(heap, parent, child);
-	else
-	    break;
+	// Stop when the parent is not later than the new element.
+	if (entries[parent].deadline <= item.deadline) break;
 
+	entries[child] = entries[parent];
+	entries[child].task->index = child;
 	child = parent;
     }
+    entries[child] = item;
+    item.task->index = child;
 }
 
 /* downheap()
@@ -519,34 +1542,40 @@ upheap(heap_t *heap, long child)
  * Starts from the top of the heap down, restoring the heap condition.
  * heap_pop() removes the top element from the heap, puts the last
  * element in its place, then calls this function to restore the heap.
+ * The children of an entry share a cache line, so finding the earliest
+ * of the four costs one cache miss at most.
  */
 static void
 downheap(heap_t *heap, long i)
 {
-    long child1, child2, largest;
+    heap_entry * entries = heap->entries;
+    heap_entry   item    = entries[i];
 
-    while ( i < (heap->count >> 1)) // i has at least one child
+    while (1)
     {
-	child1 = (i << 1) + 1;
-	child2 = child1   + 1;
+	long first = i * HEAP_ARITY + 1;
+	if (first >= heap->count) break; // i has no children
 
-	/* Find the largest of the two children of i.
-	 * If child2 is not within the heap, then child1 is by default.
-	 */
-	largest = child1;
-	if ((child2 < heap->count) &&
-	    (comp_tasks(heap, child1, child2) < 0))
-	    largest = child2;
+	// Find the earliest of the children of i.
+	long last = first + HEAP_ARITY;
+	if (last > heap->count) last = heap->count;
 
-	/* If i is less than its largest child, then exchange contents
-	 * of i and largest, and repeat the process at largest.
+	long earliest = first;
+	for (long child = first + 1; child < last; child++)
+	    if (entries[child].deadline < entries[earliest].deadline)
+		earliest = child;
+
+	/* If the element is later than the earliest child, move that child
+	 * up into the hole, and repeat the process at the child.
 	 */
-	if (comp_tasks(heap, i, largest) < 0)
-	    swap_tasks(heap, i, largest);
-	else
-	    break;
-	i = largest;
+	if (item.deadline <= entries[earliest].deadline) break;
+
+	entries[i] = entries[earliest];
+	entries[i].task->index = i;
+	i = earliest;
     }
+    entries[i] = item;
+    item.task->index = i;
 }
 
 /* heap_init - Initialize a heap.
@@ -554,149 +1583,450 @@ downheap(heap_t *heap, long i)
 static void
 heap_init(heap_t * heap)
 {
-    heap->size  = MIN_SIZE;
-    heap->count = 0;
-    heap->tasks = heap->min;
+    heap->size    = MIN_SIZE;
+    heap->count   = 0;
+    heap->memory  = NULL;
+    heap->entries = heap_align(heap->min);
 }
 
 /* heap_resize
  *
- * Reallocate the heap->tasks array to the new size.
+ * Reallocate the heap->entries array to the new size.
  * Returns true on success, else failure.
  */
 static int
 heap_resize(heap_t *heap, long nsize)
 {
-    nft_task ** tasks;
-
     assert((nsize >  heap->count));
     assert((nsize >= MIN_SIZE));
     assert((nsize != heap->size));
 
-    if (heap->size == MIN_SIZE)
+    void       * memory;
+    heap_entry * entries;
+
+    if (heap->memory == NULL)
     {
-	// Growing from minimal size, need to malloc tasks.
-	assert(heap->tasks == heap->min);
-	if (!(tasks = malloc(nsize * sizeof(nft_task *))))
+	// Growing from minimal size, need to malloc entries.
+	if (!(memory = malloc(heap_bytes(nsize))))
 	    return 0;
-	memcpy(tasks, heap->tasks, MIN_SIZE * sizeof(nft_task *));
-	heap->tasks = tasks;
+	entries = heap_align(memory);
+	memcpy(entries, heap->entries, heap->count * sizeof(heap_entry));
     }
     else if (nsize == MIN_SIZE)
     {
-	// Shrinking to minimal size, we can free tasks.
-	assert(heap->tasks != heap->min);
-	memcpy(heap->min, heap->tasks, MIN_SIZE * sizeof(nft_task *));
-	free(heap->tasks);
-	heap->tasks = heap->min;
+	// Shrinking to minimal size, we can free entries.
+	memory  = NULL;
+	entries = heap_align(heap->min);
+	memcpy(entries, heap->entries, heap->count * sizeof(heap_entry));
+	free(heap->memory);
     }
     else
     {
-	// Reallocate the tasks array.
-	assert(heap->tasks != heap->min);
-	if (!(tasks = realloc(heap->tasks, nsize * sizeof(nft_task *))))
+	// Reallocate the entries array. If realloc moved it to a block with
+	// a different alignment, slide the entries back into alignment.
+	size_t offset = (char *) heap->entries - (char *) heap->memory;
+	if (!(memory = realloc(heap->memory, heap_bytes(nsize))))
 	    return 0;
-	heap->tasks = tasks;
+	entries = heap_align(memory);
+	if ((char *) entries - (char *) memory != offset)
+	    memmove(entries, (char *) memory + offset, heap->count * sizeof(heap_entry));
     }
-    heap->size = nsize;
+
+    heap->memory  = memory;
+    heap->entries = entries;
+    heap->size    = nsize;
     return 1;
 }
 
-/* heap_insert
- *
- * Inserts a new item into the heap. The method is to  place the new node
- * at the end of the queue, and then call upheap() to restore the heap
- * condition, which will ensure that the largest item is at the head of
- * the queue.
+// Realloc heap->entries while it is less than one quarter full.
+static void
+heap_shrink(heap_t *heap)
+{
+    while ((heap->count  <  (heap->size >> 2)) &&
+	   (MIN_SIZE     <= (heap->size >> 1)))
+	if (!heap_resize(heap, heap->size >> 1)) break;
+}
+
+/* heap_insert
+ *
+ * Inserts a new item into the heap. The method is to  place the new node
+ * at the end of the queue, and then call upheap() to restore the heap
+ * condition, which will ensure that the earliest item is at the head of
+ * the queue.
+ *
+ * Returns true on success, false on malloc failure.
+ */
+static int
+heap_insert(heap_t *heap, nft_task * item)
+{
+    // Do we need to realloc heap->entries?
+    if (heap->count == heap->size)
+	if (!heap_resize(heap, heap->size << 1))
+	    return 0;
+
+    assert(heap->count < heap->size);
+
+    long index = heap->count++;
+    heap->entries[index] = (heap_entry){ heap_deadline(item), item };
+    upheap(heap, index);
+    return 1;
+}
+
+/* heap_top
+ *
+ * Returns the top item on the heap (or NULL), without removing it.
+ * Returns the heap count.
+ */
+static long
+heap_top(heap_t *heap, nft_task ** itemp)
+{
+    if (itemp) *itemp = heap->count ? heap->entries[0].task : NULL ;
+    return heap->count;
+}
+
+/* heap_window
+ *
+ * Lower *latest to the earliest latest time, among the tasks in the subtree
+ * at index whose abstime is not after *latest. These are the tasks that may
+ * not wait until *latest. Subtrees whose top is later than *latest are
+ * skipped, so without slack, only the top task is visited.
+ */
+static void
+heap_window(heap_t *heap, long index, struct timespec * latest)
+{
+    if (index >= heap->count) return;
+
+    int64_t deadline = (int64_t) latest->tv_sec * NANOSEC + latest->tv_nsec;
+    if (heap->entries[index].deadline > deadline) return;
+
+    nft_task      * task = heap->entries[index].task;
+    struct timespec time = task_latest(task);
+    if (nft_timespec_comp(time, *latest) < 0) *latest = time;
+
+    for (long child = index * HEAP_ARITY + 1; child <= index * HEAP_ARITY + HEAP_ARITY; child++)
+	heap_window(heap, child, latest);
+}
+
+/* heap_pop
+ *
+ * Removes the topmost item from the heap and returns it to the caller.
+ * Returns 1 if a node was popped, or it returns zero if the heap was empty.
+ */
+static int
+heap_pop(heap_t *heap, nft_task ** itemp)
+{
+    nft_task * task = heap->count ? heap->entries[0].task : NULL ;
+
+    if (itemp) *itemp = task;
+
+    if (task) {
+	task->index = -1;
+        if (--heap->count) {
+            // Replace the task at 0 with the last task
+            heap->entries[0] = heap->entries[heap->count];
+            downheap(heap, 0);
+        }
+    }
+    heap_shrink(heap);
+
+    return task ? 1 : 0;
+}
+
+/* heap_delete
+ *
+ * Deletes the node at index i in the heap.
+ */
+static void
+heap_delete(heap_t *heap, long index)
+{
+    assert(heap->count > 0);
+    assert(index >= 0 && index < heap->count);
+
+    heap_entry removed = heap->entries[index];
+    removed.task->index = -1;
+
+    // Removing the last node requires no further work.
+    if (index < --heap->count)
+    {
+	// Replace the task at index with the last task
+	heap->entries[index] = heap->entries[heap->count];
+
+	if (heap->entries[index].deadline < removed.deadline)
+	    upheap(heap, index);
+	else
+	    downheap(heap, index);
+    }
+    heap_shrink(heap);
+}
+
+/* heap_update
+ *
+ * Restores the heap condition after the abstime of the task at index changed.
+ */
+static void
+heap_update(heap_t *heap, long index)
+{
+    nft_task * task = heap->entries[index].task;
+    heap->entries[index].deadline = heap_deadline(task);
+    upheap(heap, index);
+    downheap(heap, task->index);
+}
+
+/* heap_build
+ *
+ * Restore the heap condition over the whole array, bottom up, in linear time.
+ */
+static void
+heap_build(heap_t *heap)
+{
+    for (long i = (heap->count - 2) / HEAP_ARITY; i >= 0 && heap->count > 1; i--)
+	downheap(heap, i);
+}
+
+/* heap_insert_many
+ *
+ * Inserts count items into the heap. When there are few, they are inserted
+ * one by one, but when there are many, they are appended, and the heap is
+ * rebuilt, which is cheaper than percolating each one up.
+ *
+ * Returns true on success, false on malloc failure, when none is inserted.
+ */
+static int
+heap_insert_many(heap_t *heap, nft_task ** items, long count)
+{
+    // Grow heap->entries once to hold all of the new items.
+    long size = heap->size;
+    while (size < heap->count + count) size <<= 1;
+    if (size != heap->size && !heap_resize(heap, size))
+	return 0;
+
+    if (count < (heap->count >> 3)) {
+	for (long i = 0; i < count; i++) {
+	    int rc = heap_insert(heap, items[i]); assert(rc);
+	}
+	return 1;
+    }
+    for (long i = 0; i < count; i++) {
+	items[i]->index = heap->count;
+	heap->entries[heap->count++] = (heap_entry){ heap_deadline(items[i]), items[i] };
+    }
+    heap_build(heap);
+    return 1;
+}
+
+/* heap_compact
+ *
+ * Removes the entries that queue_delete_many leaves with a NULL task,
+ * by compacting the array and rebuilding the heap.
+ */
+static void
+heap_compact(heap_t *heap)
+{
+    long j = 0;
+    for (long i = 0; i < heap->count; i++) {
+	if (heap->entries[i].task) {
+	    heap->entries[j] = heap->entries[i];
+	    heap->entries[j].task->index = j;
+	    j++;
+	}
+    }
+    heap->count = j;
+    heap_build(heap);
+    heap_shrink(heap);
+}
+
+
+/******************************************************************************/
+/*******								*******/
+/*******		TIMING WHEEL IMPLEMENTATION			*******/
+/*******								*******/
+/******************************************************************************/
+
+/* wheel_init - Initialize an empty wheel, whose next tick is current.
+ */
+static void
+wheel_init(wheel_t * wheel, uint64_t current)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->current = current;
+    wheel->wake    = UINT64_MAX;
+}
+
+/* list_push, list_unlink - Maintain the doubly-linked lists of slot tasks.
+ */
+static inline void
+list_push(nft_task ** head, nft_task * task)
+{
+    task->prev = NULL;
+    task->next = *head;
+    if (*head) (*head)->prev = task;
+    *head = task;
+}
+
+static inline void
+list_unlink(nft_task ** head, nft_task * task)
+{
+    if (task->prev) task->prev->next = task->next;
+    else	    *head            = task->next;
+    if (task->next) task->next->prev = task->prev;
+    task->next = task->prev = NULL;
+}
+
+/* wheel_place
  *
- * Returns true on success, false on malloc failure.
+ * Place the task in the lowest level whose span reaches its tick.
+ * A task that is already due goes in the current slot, and a task
+ * beyond the wheel's span goes in the farthest slot, from which
+ * it will cascade and be placed again.
  */
-static int
-heap_insert(heap_t *heap, nft_task * item)
+static void
+wheel_place(wheel_t * wheel, nft_task * task)
 {
-    // Do we need to realloc heap->tasks?
-    if (heap->count == heap->size)
-	if (!heap_resize(heap, heap->size << 1))
-	    return 0;
+    uint64_t tick  = (task->tick < wheel->current) ? wheel->current : task->tick;
+    uint64_t delta = tick - wheel->current;
+    int      level = 0;
+
+    while (level < WHEEL_LEVELS - 1 && (delta >> (WHEEL_BITS * (level + 1))) != 0)
+	level++;
+    if ((delta >> (WHEEL_BITS * (level + 1))) != 0)
+	tick = wheel->current + ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+    int slot = (tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    list_push(&wheel->slots[level][slot], task);
+    task->index = level * WHEEL_SLOTS + slot;
+    wheel->counts[level]++;
+}
 
-    assert(heap->count < heap->size);
+/* wheel_insert - Insert a task whose tick has been set.
+ */
+static void
+wheel_insert(wheel_t * wheel, nft_task * task)
+{
+    wheel_place(wheel, task);
+    wheel->count++;
+}
 
-    item->index = heap->count++;
-    heap->tasks[item->index] = item;
-    upheap(heap, item->index);
-    return 1;
+/* wheel_delete - Remove a task from its slot, or from the due list.
+ */
+static void
+wheel_delete(wheel_t * wheel, nft_task * task)
+{
+    assert(task->index >= 0 && task->index <= WHEEL_DUE);
+
+    if (task->index == WHEEL_DUE)
+	list_unlink(&wheel->due, task);
+    else {
+	int level = task->index / WHEEL_SLOTS;
+	list_unlink(&wheel->slots[level][task->index % WHEEL_SLOTS], task);
+	wheel->counts[level]--;
+    }
+    task->index = -1;
+    wheel->count--;
 }
 
-/* heap_top
+/* wheel_horizon
  *
- * Returns the top item on the heap (or NULL), without removing it.
- * Returns the heap count.
+ * Return the next tick at which the wheel has work to do, which is either
+ * a tick whose level-0 slot holds tasks, or a tick where a higher level
+ * cascades. When the lower levels are empty, the ticks before the next
+ * cascade of the lowest occupied level can be skipped entirely.
+ * The wheel must not be empty.
  */
-static long
-heap_top(heap_t *heap, nft_task ** itemp)
+static uint64_t
+wheel_horizon(wheel_t * wheel)
 {
-    if (itemp) *itemp = heap->count ? heap->tasks[0] : NULL ;
-    return heap->count;
+    uint64_t tick  = wheel->current;
+    int      level = 0;
+
+    while (level < WHEEL_LEVELS && wheel->counts[level] == 0) level++;
+    assert(level < WHEEL_LEVELS);
+
+    if (level == 0) {
+	// Scan the level-0 slots, up to the next cascade.
+	if ((tick & WHEEL_MASK) == 0) return tick;
+	while (!wheel->slots[0][tick & WHEEL_MASK])
+	    if ((++tick & WHEEL_MASK) == 0) break;
+	return tick;
+    }
+    uint64_t span = (uint64_t) 1 << (WHEEL_BITS * level);
+    if ((tick & (span - 1)) == 0) return tick;
+    return (tick + span) & ~(span - 1);
 }
 
-/* heap_pop
+/* wheel_next
  *
- * Removes the topmost item from the heap and returns it to the caller.
- * Returns 1 if a node was popped, or it returns zero if the heap was empty.
+ * Get the next tick at which the scheduler should wake.
+ * Returns false if the wheel is empty.
  */
 static int
-heap_pop(heap_t *heap, nft_task ** itemp)
+wheel_next(wheel_t * wheel, uint64_t * tick)
 {
-    nft_task * task = heap->count ? heap->tasks[0] : NULL ;
-
-    if (itemp) *itemp = task;
+    if (wheel->count == 0) return 0;
+    *tick = wheel->due ? wheel->current : wheel_horizon(wheel);
+    return 1;
+}
 
-    if (task) {
-	task->index = -1;
-        if (--heap->count) {
-            // Replace the task at 0 with the last task
-            heap->tasks[0] = heap->tasks[heap->count];
-            heap->tasks[0]->index = 0;
-            downheap(heap, 0);
-        }
+/* wheel_cascade - Move the tasks of the higher-level slots that turn at tick.
+ */
+static void
+wheel_cascade(wheel_t * wheel, uint64_t tick)
+{
+    for (int level = WHEEL_LEVELS - 1; level > 0; level--)
+    {
+	if (tick & (((uint64_t) 1 << (WHEEL_BITS * level)) - 1)) continue;
+
+	nft_task ** slot = &wheel->slots[level][(tick >> (WHEEL_BITS * level)) & WHEEL_MASK];
+	nft_task  * task = *slot;
+	*slot = NULL;
+	while (task) {
+	    nft_task * next = task->next;
+	    wheel->counts[level]--;
+	    wheel_place(wheel, task);
+	    task = next;
+	}
     }
-    // Realloc heap->tasks if less than one quarter full.
-    if ((heap->count  <  (heap->size >> 2)) &&
-	(MIN_SIZE     <= (heap->size >> 1)))
-	heap_resize(heap, heap->size >> 1);
-
-    return task ? 1 : 0;
 }
 
-/* heap_delete
+/* wheel_pop
  *
- * Deletes the node at index i in the heap.
+ * Turn the wheel up to tick now, and pop a task that is due.
+ * Returns 1 if a task was popped, or zero if none is due.
  */
-static void
-heap_delete(heap_t *heap, long index)
+static int
+wheel_pop(wheel_t * wheel, uint64_t now, nft_task ** itemp)
 {
-    assert(heap->count > 0);
-    assert(index >= 0 && index < heap->count);
-
-    heap->tasks[index]->index = -1;
-
-    // Removing the last node requires no further work.
-    if (index < --heap->count)
+    while (!wheel->due)
     {
-	int comp = comp_tasks(heap, index, heap->count);
-
-	// Replace the task at index with the last task
-	heap->tasks[index] = heap->tasks[heap->count];
-	heap->tasks[index]->index = index;
-
-	if	(comp > 0) downheap(heap, index);
-	else if (comp < 0)   upheap(heap, index);
+	// With no tasks, there is nothing to process until now.
+	if (wheel->count == 0) {
+	    if (wheel->current <= now) wheel->current = now + 1;
+	    return 0;
+	}
+	uint64_t tick = wheel_horizon(wheel);
+	if (tick > now) {
+	    wheel->current = now + 1;
+	    return 0;
+	}
+	wheel->current = tick;
+	if ((tick & WHEEL_MASK) == 0) wheel_cascade(wheel, tick);
+
+	// Move the tasks of this tick to the due list.
+	nft_task ** slot = &wheel->slots[0][tick & WHEEL_MASK];
+	for (nft_task * task = *slot; task; task = task->next) {
+	    task->index = WHEEL_DUE;
+	    wheel->counts[0]--;
+	}
+	wheel->due = *slot;
+	*slot = NULL;
+	wheel->current = tick + 1;
     }
+    nft_task * task = wheel->due;
+    list_unlink(&wheel->due, task);
+    task->index = -1;
+    wheel->count--;
 
-    // Realloc heap->tasks if less than one quarter full.
-    if ((heap->count  <  (heap->size >> 2)) &&
-	(MIN_SIZE     <= (heap->size >> 1)))
-	heap_resize(heap, heap->size >> 1);
+    if (itemp) *itemp = task;
+    return 1;
 }
 
 
@@ -722,6 +2052,25 @@ heap_delete(heap_t *heap, long index)
 
 int Waiting = 0;
 
+// Return the number of queued tasks, over all shards.
+static long
+queue_count(void)
+{
+    long count = 0;
+    for (int i = 0; i < NumShards; i++)
+	count += (Backend == NFT_TASK_WHEEL) ? Shards[i].wheel.count : Shards[i].queue.count ;
+    return count;
+}
+
+// Return true if every shard's heap has shrunk to its minimum size.
+static int
+queue_shrunk(void)
+{
+    for (int i = 0; i < NumShards; i++)
+	if (Backend == NFT_TASK_HEAP && Shards[i].queue.size != MIN_SIZE) return 0;
+    return 1;
+}
+
 void
 null_task(void * arg)
 {
@@ -764,12 +2113,13 @@ volatile int test_nsec_count = 0;
 void
 test_nsec(void * arg)
 {
-    static long save = 0;
+    // Tasks execute in order within each shard's scheduler thread.
+    static _Thread_local long save = 0;
     long        msec = (long) arg;
     /* printf("%d\n", msec); */
     assert(save <= msec);
     save = msec;
-    test_nsec_count--;
+    __atomic_sub_fetch(&test_nsec_count, 1, __ATOMIC_SEQ_CST);
 }
 
 /* test_basic
@@ -933,8 +2283,8 @@ test_basic() {
 	    putc('.', stdout);
 	    fflush(stdout);
 	}
-	assert(Queue.count == 0);
-	assert(Queue.size  == MIN_SIZE);
+	assert(queue_count() == 0);
+	assert(queue_shrunk());
 
         // Verify that no Nifty handles remain.
         assert(0 == nft_handle_apply(NULL, NULL, NULL));
@@ -965,13 +2315,13 @@ test_basic() {
 	}
 
 	// Wait for all of the tasks to finish.
-	while (Queue.count > 0) {
+	while (queue_count() > 0) {
 	    sleep(1);
 	    putc('.', stdout);
 	    fflush(stdout);
 	}
-	assert(Queue.count == 0);
-	assert(Queue.size  == MIN_SIZE);
+	assert(queue_count() == 0);
+	assert(queue_shrunk());
 
         // Verify that no Nifty handles remain.
         assert(0 == nft_handle_apply(NULL, NULL, NULL));
@@ -1162,6 +2512,9 @@ test_timespec()
     test = nft_timespec_add(test, half);
     assert(2 == test.tv_sec && 0 == test.tv_nsec);
 
+    test = nft_gettime_mono();
+    assert(nft_timespec_comp(nft_gettime_mono(), test) >= 0);
+
     printf(" Passed!\n");
 }
 
@@ -1207,31 +2560,669 @@ test_heap()
 	tasks[i]->abstime.tv_nsec = 0;
 	heap_insert(&heap, tasks[i]);
     }
-    for (int i = 0; i < 100; i++) assert(heap.tasks[i]->index == i);
+    for (int i = 0; i < 100; i++) assert(heap.entries[i].task->index == i);
     for (int i = 0; i < 100; i++)
     {
-	assert(heap.tasks[tasks[i]->index] == tasks[i]);
+	assert(heap.entries[tasks[i]->index].task == tasks[i]);
 	heap_delete(&heap, tasks[i]->index);
 	assert(tasks[i]->index == -1);
 	free(tasks[i]);
     }
     printf(" Passed!\n");
+
+    printf("Testing heap_insert_many and heap_compact...");
+    nft_task many[1000];
+    nft_task * items[1000];
+    for (int i = 0; i < 1000; i++)
+    {
+	many[i].abstime = (struct timespec){ lrand48() % 1000, 0 };
+	items[i] = &many[i];
+    }
+    // Insert a few, then many at once, which rebuilds the heap.
+    assert(heap_insert_many(&heap, items, 10));
+    assert(heap_insert_many(&heap, items + 10, 990));
+    for (int i = 0; i < 1000; i += 2) {
+	heap.entries[many[i].index].task = NULL;
+	many[i].index = -1;
+    }
+    heap_compact(&heap);
+    assert(heap.count == 500);
+
+    nft_task * task;
+    long       last = 0;
+    while (heap_pop(&heap, &task)) {
+	assert(task->abstime.tv_sec >= last);
+	assert((task - many) % 2 == 1);
+	last = task->abstime.tv_sec;
+    }
+    assert(heap.size == MIN_SIZE);
+    printf(" Passed!\n");
+}
+
+void
+test_wheel()
+{
+    /* Verify that the wheel pops tasks in tick order, and never early or late.
+     */
+    wheel_t wheel;
+    wheel_init(&wheel, 0);
+
+    printf("Testing wheel_insert, wheel_delete and wheel_pop...");
+    MARK;
+    int        count = 100000;
+    nft_task * tasks = malloc(count * sizeof(nft_task));
+    assert(tasks);
+    for (int i = 0; i < count; i++)
+    {
+	// Most ticks are within 2^24, but a few lie beyond the wheel's span.
+	tasks[i].tick = (i % 1000) ? lrand48() % (1 << 24) : ((uint64_t) 1 << 33) + i;
+	wheel_insert(&wheel, &tasks[i]);
+	assert(tasks[i].index >= 0 && tasks[i].index < WHEEL_DUE);
+    }
+    for (int i = 0; i < count; i += 3)
+    {
+	wheel_delete(&wheel, &tasks[i]);
+	assert(tasks[i].index == -1);
+    }
+    assert(wheel.count == count - (count + 2) / 3);
+
+    uint64_t now = 0, last = 0, tick;
+    long     popped = 0;
+    while (wheel_next(&wheel, &tick))
+    {
+	uint64_t prev = now;
+	now = (now < (1 << 24)) ? now + 1 + lrand48() % 5000 : (uint64_t) 1 << 34;
+
+	nft_task * task;
+	while (wheel_pop(&wheel, now, &task)) {
+	    assert(task->index == -1);
+	    assert(task->tick <= now && task->tick > prev);
+	    assert(task->tick >= last);
+	    last = task->tick;
+	    popped++;
+	}
+    }
+    assert(popped == count - (count + 2) / 3);
+    free(tasks);
+    TIME; // compute elapsed time
+    printf(" Passed!\n");
+    fprintf(stderr, "wheel processed %d tasks in %.3f seconds\n", count, ELAPSED);
+}
+
+/* bench_tasks
+ *
+ * Measure the throughput of the task API with 10k to 1M pending tasks,
+ * which are scheduled an hour or more in the future. With n tasks pending,
+ * we time a batch of nft_task_schedule calls, the nft_task_cancel calls
+ * for those tasks, and the firing of a batch of tasks that all come due
+ * at once, from their due time until the scheduler has run the last one.
+ * The batches are small enough that 1M pending tasks and a batch fit within
+ * the limit on handles (see NFT_HMAPSZMAX). Run this with ./nft_task -b.
+ */
+volatile int bench_fired = 0;
+
+void
+bench_task(void * arg)
+{
+    __atomic_add_fetch(&bench_fired, 1, __ATOMIC_RELAXED);
+}
+
+void
+bench_tasks(void)
+{
+    const long batch = 10000;
+    printf("%10s %14s %14s %14s\n", "pending", "schedule/sec", "cancel/sec", "fire/sec");
+
+    for (long n = 10000; n <= 1000000; n *= 10)
+    {
+	nft_task_h    * tasks = malloc((n + batch) * sizeof(nft_task_h));
+	struct timespec later = nft_timespec_add(nft_gettime(), (struct timespec){ 3600, 0 });
+	assert(tasks);
+	for (long i = 0; i < n; i++) {
+	    struct timespec when = nft_timespec_add(later, (struct timespec){ lrand48() % 3600, lrand48() % NANOSEC });
+	    tasks[i] = nft_task_schedule(when, (struct timespec){ 0, 0 }, bench_task, NULL);
+	    assert(tasks[i]);
+	}
+
+	MARK;
+	for (long i = n; i < n + batch; i++) {
+	    struct timespec when = nft_timespec_add(later, (struct timespec){ lrand48() % 3600, lrand48() % NANOSEC });
+	    tasks[i] = nft_task_schedule(when, (struct timespec){ 0, 0 }, bench_task, NULL);
+	}
+	TIME;
+	double schedule = batch / (ELAPSED);
+
+	MARK;
+	for (long i = n; i < n + batch; i++) nft_task_cancel(tasks[i]);
+	TIME;
+	double cancel = batch / (ELAPSED);
+
+	// Schedule a batch to come due at once, after the schedule calls are done.
+	bench_fired = 0;
+	struct timespec due = nft_timespec_add(nft_gettime(), (struct timespec){ 0, 200000000 });
+	for (long i = n; i < n + batch; i++)
+	    assert(nft_task_schedule(due, (struct timespec){ 0, 0 }, bench_task, NULL));
+	while (__atomic_load_n(&bench_fired, __ATOMIC_RELAXED) < batch)
+	    nanosleep(&(struct timespec){ 0, 100000 }, NULL);
+	done = nft_gettime();
+	mark = due;
+	double fire = batch / (ELAPSED);
+	assert(queue_count() == n);
+
+	printf("%10ld %14.0f %14.0f %14.0f\n", n, schedule, cancel, fire);
+
+	for (long i = 0; i < n; i++) nft_task_cancel(tasks[i]);
+	free(tasks);
+	assert(queue_count() == 0);
+    }
+}
+
+#define SLACK_COUNT 100
+static struct timespec Slack_time[SLACK_COUNT];
+
+void
+slack_task(void * arg)
+{
+    Slack_time[(intptr_t) arg] = nft_gettime();
+}
+
+/* test_slack
+ *
+ * Schedule tasks one millisecond apart, with a slack of 200 milliseconds,
+ * and verify that they run within their windows, in only a few wakeups.
+ */
+void
+test_slack(void)
+{
+    printf("Testing %d tasks with slack:", SLACK_COUNT);
+    fflush(stdout);
+
+    struct timespec slack = { 0, 200000000 };
+    struct timespec start = nft_timespec_add(nft_gettime(), (struct timespec){ 1, 0 });
+    struct timespec when[SLACK_COUNT];
+    assert(NULL == nft_task_schedule_slack(start, (struct timespec){0,0}, (struct timespec){0,-1}, null_task, NULL));
+
+    long wakeups = 0;
+    for (int i = 0; i < NumShards; i++) wakeups += Shards[i].stats.wakeups;
+
+    for (intptr_t i = 0; i < SLACK_COUNT; i++) {
+	when[i] = nft_timespec_add(start, (struct timespec){ 0, i * 1000000 });
+	assert(nft_task_schedule_slack(when[i], (struct timespec){0,0}, slack, slack_task, (void *) i));
+    }
+    sleep(2);
+    assert(queue_count() == 0);
+
+    for (int i = 0; i < NumShards; i++) wakeups -= Shards[i].stats.wakeups;
+    for (int i = 0; i < SLACK_COUNT; i++) {
+	// Allow 50 milliseconds for the scheduler thread to respond.
+	assert(nft_timespec_comp(Slack_time[i], when[i]) >= 0);
+	assert(nft_timespec_comp(Slack_time[i], when[i]) < 250000000);
+    }
+    assert(-wakeups <= 2 * NumShards);
+    assert(0 == nft_handle_apply(NULL, NULL, NULL));
+    printf(" Passed!\n");
+}
+
+volatile int test_many_count = 0;
+
+void
+many_task(void * arg)
+{
+    __atomic_add_fetch(&test_many_count, 1, __ATOMIC_SEQ_CST);
+}
+
+/* test_many
+ *
+ * Schedule a batch of tasks, cancel every other one as a batch, then
+ * a few more, and verify that exactly the remaining tasks execute.
+ */
+void
+test_many(void)
+{
+    const int n = 10000;
+    printf("Testing schedule and cancel of %d tasks in batches:", n);
+    fflush(stdout);
+
+    nft_task_spec_t * specs     = malloc(n * sizeof(nft_task_spec_t));
+    nft_task_h      * handles   = malloc(n * sizeof(nft_task_h));
+    nft_task_h      * cancels   = malloc(n / 2 * sizeof(nft_task_h));
+    void           ** arguments = malloc(n / 2 * sizeof(void *));
+    assert(specs && handles && cancels && arguments);
+
+    struct timespec now = nft_gettime();
+    for (intptr_t i = 0; i < n; i++) {
+	long nsec = random() % NANOSEC;
+	specs[i]  = (nft_task_spec_t){ .abstime  = nft_timespec_add(now, (struct timespec){ 1, nsec }),
+				       .function = many_task,
+				       .argument = (void *) (i + 1) };
+    }
+    // An invalid spec yields a NULL handle.
+    specs[n - 1].function = NULL;
+    assert(n - 1 == nft_task_schedule_many(specs, n, handles));
+    assert(handles[n - 1] == NULL);
+
+    for (int i = 0; i < n / 2; i++) cancels[i] = handles[2 * i];
+    assert(n / 2 == nft_task_cancel_many(cancels, n / 2, arguments));
+    for (int i = 0; i < n / 2; i++) assert(arguments[i] == (void *) (intptr_t) (2 * i + 1));
+
+    // A second cancel finds nothing.
+    assert(0 == nft_task_cancel_many(cancels, n / 2, arguments));
+    assert(arguments[0] == NULL);
+
+    // A small batch is deleted from the heap one by one, without compaction.
+    const int few = 16;
+    for (int i = 0; i < few; i++) cancels[i] = handles[2 * i + 1];
+    assert(few == nft_task_cancel_many(cancels, few, arguments));
+    for (int i = 0; i < few; i++) assert(arguments[i] == (void *) (intptr_t) (2 * i + 2));
+
+    sleep(3);
+    assert(test_many_count == n / 2 - 1 - few);
+    assert(queue_count() == 0);
+    assert(queue_shrunk());
+    assert(0 == nft_handle_apply(NULL, NULL, NULL));
+
+    free(specs);
+    free(handles);
+    free(cancels);
+    free(arguments);
+    printf(" Passed!\n");
+}
+
+static struct timespec Resched_time[3];
+
+void
+resched_task(void * arg)
+{
+    // A one-shot is no longer pending once it executes.
+    assert(ENOENT == nft_task_reschedule(nft_task_this(), nft_gettime()));
+    Resched_time[(intptr_t) arg - 1] = nft_gettime();
+}
+
+/* test_reschedule
+ *
+ * Move one task later, one task earlier, and extend a third repeatedly,
+ * as an idle timer would be, and verify that each runs once, on time.
+ */
+void
+test_reschedule(void)
+{
+    printf("Testing reschedule and extend:");
+    fflush(stdout);
+
+    struct timespec once  = { 0, 0 };
+    struct timespec start = nft_gettime();
+    nft_task_h later   = nft_task_schedule(nft_timespec_add(start, (struct timespec){  1, 0 }), once, resched_task, (void *) 1);
+    nft_task_h earlier = nft_task_schedule(nft_timespec_add(start, (struct timespec){ 10, 0 }), once, resched_task, (void *) 2);
+    nft_task_h idle    = nft_task_schedule(nft_timespec_add(start, (struct timespec){  1, 0 }), once, resched_task, (void *) 3);
+    assert(later && earlier && idle);
+
+    assert(0 == nft_task_reschedule(later,   nft_timespec_add(start, (struct timespec){ 2, 0 })));
+    assert(0 == nft_task_reschedule(earlier, nft_timespec_add(start, (struct timespec){ 0, 500000000 })));
+    assert(EINVAL == nft_task_reschedule(idle, once));
+
+    // Push the idle timer out by one second, every quarter second.
+    struct timespec last;
+    for (int i = 0; i < 8; i++) {
+	last = nft_gettime();
+	assert(0 == nft_task_extend(idle, nft_timespec_add(last, (struct timespec){ 1, 0 })));
+	usleep(250000);
+    }
+    sleep(2);
+
+    int64_t nsec;
+    nsec = nft_timespec_comp(Resched_time[0], start);
+    assert(nsec >= 2 * NANOSEC && nsec < 2 * NANOSEC + 100000000);
+    nsec = nft_timespec_comp(Resched_time[1], start);
+    assert(nsec >= NANOSEC / 2 && nsec < NANOSEC / 2 + 100000000);
+    nsec = nft_timespec_comp(Resched_time[2], last);
+    assert(nsec >= NANOSEC && nsec < NANOSEC + 100000000);
+
+    // The one-shots have executed, so they are no longer pending.
+    assert(EINVAL == nft_task_reschedule(later, start));
+    assert(EINVAL == nft_task_extend(idle, start));
+    assert(0 == nft_handle_apply(NULL, NULL, NULL));
+
+    // A periodic task that is executing is still pending.
+    nft_task_h periodic = nft_task_schedule(once, (struct timespec){ 0, 100000000 }, null_task, (void *) 1);
+    assert(periodic);
+    assert(0 == nft_task_reschedule(periodic, once));
+    assert(0 == nft_task_extend(periodic, nft_timespec_add(nft_gettime(), (struct timespec){ 1, 0 })));
+    assert(NULL != nft_task_cancel(periodic));
+    assert(0 == nft_handle_apply(NULL, NULL, NULL));
+    printf(" Passed!\n");
+}
+
+void
+sleep_task(void * arg)
+{
+    sleep((intptr_t) arg);
+}
+
+static nft_task_h Overrun_task;
+static double     Overrun_time;
+
+void
+overrun_handler(nft_task_h task, double seconds)
+{
+    Overrun_task = task;
+    Overrun_time = seconds;
+}
+
+void
+usleep_task(void * arg)
+{
+    usleep((intptr_t) arg);
+}
+
+/* test_stats
+ *
+ * Fire ten tasks at once, and one that overruns the budget,
+ * and verify that the statistics and the overrun report them.
+ */
+void
+test_stats(void)
+{
+    printf("Testing scheduler statistics:");
+    fflush(stdout);
+
+    nft_task_stats_t before, after;
+    assert(EINVAL == nft_task_stats(NULL));
+    assert(0 == nft_task_stats(&before));
+    assert(EINVAL == nft_task_budget((struct timespec){ 0, NANOSEC }, NULL));
+    assert(0 == nft_task_budget((struct timespec){ 0, 100000000 }, overrun_handler));
+
+    struct timespec once = { 0, 0 };
+    struct timespec when = nft_timespec_add(nft_gettime(), (struct timespec){ 0, 200000000 });
+    for (int i = 0; i < 10; i++)
+	assert(nft_task_schedule_shard(0, when, once, null_task, NULL));
+    when = nft_timespec_add(when, (struct timespec){ 0, 200000000 });
+    nft_task_h slow = nft_task_schedule(when, once, usleep_task, (void *) 200000);
+    assert(slow);
+    sleep(1);
+    assert(0 == nft_task_stats(&after));
+    assert(0 == nft_task_budget(once, NULL));
+
+    assert(after.fired    - before.fired    == 11);
+    assert(after.overruns - before.overruns == 1);
+    assert(after.wakeups  - before.wakeups  == 2);
+    assert(after.run_ns   - before.run_ns   >= 200000000);
+    assert(after.queue_size == 0 && after.queue_high >= 10);
+    assert(Overrun_task == slow && Overrun_time >= 0.2);
+
+    // Ten tasks fired in one wakeup, and the slow task ran for 2^17 to 2^18 usec.
+    assert(after.fired_hist[4] - before.fired_hist[4] == 1);
+    assert(after.run_hist[18]  - before.run_hist[18]  == 1);
+    uint64_t late = 0;
+    for (int i = 0; i < NFT_TASK_BUCKETS; i++) late += after.late_hist[i] - before.late_hist[i];
+    assert(late == 11);
+    assert(0 == nft_handle_apply(NULL, NULL, NULL));
+    printf(" Passed!\n");
+}
+
+static nft_task_this_info_t This_info[3];
+
+void
+this_info_task(void * arg)
+{
+    nft_task_this_info_t info;
+    assert(EINVAL == nft_task_this_info(NULL));
+    assert(0 == nft_task_this_info(&info));
+    assert(info.task == nft_task_this());
+    assert(info.runs >= 1 && info.runs <= 3);
+    This_info[info.runs - 1] = info;
+    if (info.runs == 3) nft_task_cancel(info.task);
+}
+
+/* test_this_info
+ *
+ * Run a periodic task three times, and verify that nft_task_this_info
+ * reports its deadline, interval and run count on each run.
+ */
+void
+test_this_info(void)
+{
+    printf("Testing nft_task_this_info:");
+    fflush(stdout);
+
+    nft_task_this_info_t info;
+    assert(nft_task_this() == NULL);
+    assert(ENOENT == nft_task_this_info(&info));
+
+    struct timespec interval = { 0, 100000000 };
+    struct timespec when     = nft_timespec_add(nft_gettime(), interval);
+    nft_task_h task = nft_task_schedule(when, interval, this_info_task, NULL);
+    assert(task);
+    usleep(500000);
+
+    for (int i = 0; i < 3; i++)
+    {
+	assert(This_info[i].task == task);
+	assert(This_info[i].runs == i + 1);
+	assert(This_info[i].interval.tv_sec == 0 && This_info[i].interval.tv_nsec == 100000000);
+	if (i == 0) continue;
+
+	// The deadlines advance by the interval, give or take a clock conversion.
+	int64_t step = nft_timespec_comp(This_info[i].deadline, This_info[i - 1].deadline);
+	assert(step > 90000000 && step < 110000000);
+    }
+    assert(nft_timespec_comp(This_info[0].deadline, when) < 10000000);
+    assert(nft_timespec_comp(when, This_info[0].deadline) < 10000000);
+    assert(0 == nft_handle_apply(NULL, NULL, NULL));
+    printf(" Passed!\n");
+}
+
+volatile int test_pool_count = 0;
+
+void
+pool_task(void * arg)
+{
+    // Pool threads are not scheduler threads.
+    assert(nft_task_this() == NULL);
+    usleep((intptr_t) arg);
+    __atomic_add_fetch(&test_pool_count, 1, __ATOMIC_SEQ_CST);
+}
+
+/* test_schedule_on
+ *
+ * Verify that tasks scheduled on a pool do not delay the scheduler thread,
+ * and that tasks the pool cannot accept at once are retried.
+ */
+void
+test_schedule_on(void)
+{
+    printf("Testing tasks scheduled on a pool:");
+    fflush(stdout);
+
+    struct timespec once  = { 0, 0 };
+    struct timespec start = nft_gettime();
+    struct timespec due   = nft_timespec_add(start, (struct timespec){ 0, 500000000 });
+    struct timespec after = nft_timespec_add(start, (struct timespec){ 0, 600000000 });
+
+    // Fifty tasks that each take a second come due together, ahead of a plain task.
+    nft_pool_h pool = nft_pool_new(0, 50, 0); assert(pool);
+    assert(NULL == nft_task_schedule_on(NULL, due, once, pool_task, NULL));
+    for (int i = 0; i < 50; i++)
+	assert(nft_task_schedule_on(pool, due, once, pool_task, (void *) 1000000));
+    assert(nft_task_schedule_shard(0, after, once, resched_task, (void *) 1));
+    sleep(2);
+    assert(test_pool_count == 50);
+    assert(nft_timespec_comp(Resched_time[0], after) < 100000000);
+    assert(0 == nft_pool_shutdown(pool, -1));
+
+    // A pool with one thread and a queue limit of two must reject most of a
+    // batch of five, and those tasks are retried until they have all run.
+    pool = nft_pool_new(2, 1, 0); assert(pool);
+    due  = nft_timespec_add(nft_gettime(), (struct timespec){ 0, 100000000 });
+    for (int i = 0; i < 5; i++)
+	assert(nft_task_schedule_on(pool, due, once, pool_task, (void *) 100000));
+    sleep(2);
+    assert(test_pool_count == 55);
+    assert(queue_count() == 0);
+    assert(0 == nft_pool_shutdown(pool, -1));
+    assert(0 == nft_handle_apply(NULL, NULL, NULL));
+    printf(" Passed!\n");
+}
+
+/* test_catchup
+ *
+ * Block the scheduler for a second, ahead of two periodic tasks, and verify
+ * that the task that skips missed runs runs fewer times than the one that
+ * runs them all, and that the lateness of both is reported.
+ */
+void
+test_catchup(void)
+{
+    printf("Testing catch-up policies:");
+    fflush(stdout);
+
+    struct timespec start    = nft_gettime();
+    struct timespec interval = { 0, 100000000 };
+    struct timespec once     = { 0, 0 };
+    struct timespec blocker  = nft_timespec_add(start, (struct timespec){ 0, 100000000 });
+    struct timespec first    = nft_timespec_add(start, (struct timespec){ 0, 200000000 });
+
+    // Schedule the tasks on one shard, so that the blocker delays them.
+    nft_task_h block = nft_task_schedule_shard(0, blocker, once,     sleep_task, (void *) 1);
+    nft_task_h skip  = nft_task_schedule_shard(0, first,   interval, null_task,  (void *) 1);
+    nft_task_h all   = nft_task_schedule_shard(0, first,   interval, null_task,  (void *) 1);
+    assert(block && skip && all);
+    assert(0      == nft_task_catchup(skip, NFT_TASK_SKIP));
+    assert(EINVAL == nft_task_catchup(skip, 2));
+
+    sleep(2);
+    nft_task_info_t sinfo, ainfo;
+    assert(0 == nft_task_info(skip, &sinfo));
+    assert(0 == nft_task_info(all,  &ainfo));
+    assert(EINVAL == nft_task_info(block, &sinfo));
+    assert(NULL != nft_task_cancel(skip));
+    assert(NULL != nft_task_cancel(all));
+
+    assert(sinfo.skipped >= 5 && ainfo.skipped == 0);
+    assert(sinfo.runs + sinfo.skipped >= ainfo.runs - 2);
+    assert(sinfo.runs < ainfo.runs);
+    assert(sinfo.late_max >= 0.5 && ainfo.late_max >= 0.5);
+    assert(sinfo.late_mean <= sinfo.late_max && ainfo.late_mean <= ainfo.late_max);
+    assert(0 == nft_handle_apply(NULL, NULL, NULL));
+    printf(" Passed!\n");
+}
+
+static pthread_t      Shard_thread[4];
+static struct timespec Shard_time[4];
+
+void
+shard_task(void * arg)
+{
+    intptr_t i = (intptr_t) arg;
+    Shard_thread[i] = pthread_self();
+    Shard_time[i]   = nft_gettime();
+}
+
+void
+block_task(void * arg)
+{
+    sleep(2);
+    shard_task(arg);
+}
+
+void
+test_shards(void)
+{
+    printf("Testing %d scheduler shards:", NumShards);
+    fflush(stdout);
+    assert(NumShards >= 2 && NumShards <= 4);
+    assert(NULL == nft_task_schedule_shard(NumShards, nft_gettime(), (struct timespec){0,0}, null_task, NULL));
+
+    // Run one task on each shard, and verify that each has its own thread.
+    struct timespec when = nft_timespec_add(nft_gettime(), (struct timespec){ 0, 100000000 });
+    for (intptr_t i = 0; i < NumShards; i++)
+	assert(nft_task_schedule_shard(i, when, (struct timespec){0,0}, shard_task, (void *) i));
+    sleep(1);
+    for (int i = 0; i < NumShards; i++)
+	for (int j = 0; j < i; j++)
+	    assert(!pthread_equal(Shard_thread[i], Shard_thread[j]));
+
+    // Block shard zero, and verify that shard one still runs on time.
+    struct timespec start = nft_gettime();
+    when = nft_timespec_add(start, (struct timespec){ 0, 100000000 });
+    assert(nft_task_schedule_shard(0, start, (struct timespec){0,0}, block_task, (void *) 0));
+    assert(nft_task_schedule_shard(1, when,  (struct timespec){0,0}, shard_task, (void *) 1));
+    sleep(3);
+    assert(nft_timespec_comp(Shard_time[1], start) < NANOSEC);
+    assert(nft_timespec_comp(Shard_time[0], start) >= 2 * NANOSEC);
+    assert(queue_count() == 0);
+    assert(0 == nft_handle_apply(NULL, NULL, NULL));
+    printf(" Passed!\n");
 }
 
 /*
  * main - Unit test for nft_task
+ *
+ * With the -w option, the nft_task user APIs are tested on the timing wheel.
+ * With the -s option, they are tested with the given number of shards.
+ * With the -m option, they are tested on the monotonic clock.
+ * The -b option runs a benchmark of the task API.
  */
 int
 main(int argc, char *argv[])
 {
+    if (argc > 1 && !strcmp(argv[1], "-b")) {
+	bench_tasks();
+	exit(0);
+    }
+
+    int options = 0;
+    for (int i = 1; i < argc; i++) {
+	if (!strcmp(argv[i], "-w")) {
+	    int rc = nft_task_backend(NFT_TASK_WHEEL, (struct timespec){ 0, 1000000 }); assert(rc == 0);
+	    options++;
+	}
+	else if (!strcmp(argv[i], "-m")) {
+	    int rc = nft_task_clock(NFT_TASK_MONOTONIC); assert(rc == 0 || rc == ENOTSUP);
+	    options++;
+	}
+	else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+	    int rc = nft_task_shards(atoi(argv[++i])); assert(rc == 0);
+	    options++;
+	}
+    }
+    if (options) {
+	test_basic();
+	test_slack();
+	test_catchup();
+	test_many();
+	test_reschedule();
+	test_schedule_on();
+	test_stats();
+	test_this_info();
+	if (NumShards > 1) test_shards();
+	assert(EBUSY == nft_task_shards(1));
+	assert(EBUSY == nft_task_clock(NFT_TASK_REALTIME));
+	printf("nft_task: All option tests passed.\n");
+	exit(0);
+    }
+
     // Test the inline functions in nft_gettime.h.
     test_timespec();
 
     // Test the heap-sort implementation.
     test_heap();
 
+    // Test the timing wheel implementation.
+    test_wheel();
+
     // Test the nft_task user APIs
     test_basic();
+    test_slack();
+    test_catchup();
+    test_many();
+    test_reschedule();
+    test_schedule_on();
+    test_stats();
+    test_this_info();
+    assert(EBUSY == nft_task_backend(NFT_TASK_WHEEL, (struct timespec){ 0, 0 }));
+    assert(EINVAL == nft_task_backend(2, (struct timespec){ 0, 0 }));
+    assert(EINVAL == nft_task_shards(0));
+    assert(EINVAL == nft_task_clock(2));
 
     // Test the subclass implementation
     test_nft_task_pool();